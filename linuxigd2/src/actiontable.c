@@ -0,0 +1,345 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Table of UPnP actions handled by the daemon.
+ *
+ * Every action of the SCPD files in configs/ has one entry, keyed by
+ * serviceId and action name. Entries are found through a hash index built
+ * by ActionTableInit, so dispatching an action costs one hash and the string
+ * comparisons verifying the hit, however many actions the service has.
+ * When an SCPD file gets a new action, add it here too.
+ *
+ * Shared state of the device is protected by one reader/writer lock per lock
+ * class. Actions which don't change anything take their lock for reading, so
+ * they run concurrently in the threads of libupnp.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <upnp/ithread.h>
+#include "globals.h"
+#include "util.h"
+#include "gatedevice.h"
+#include "lanhostconfig.h"
+#include "wanipv6fw.h"
+#include "actiontable.h"
+
+// size of hash index, power of two and at least twice the number of actions
+#define ACTION_INDEX_SIZE 128
+
+static const struct actionService wanCommonIFCService =
+    { "urn:upnp-org:serviceId:WANCommonIFC1", &wanUDN };
+static const struct actionService wanIPConnService =
+    { "urn:upnp-org:serviceId:WANIPConn1", &wanConnectionUDN };
+static const struct actionService wanEthLinkCService =
+    { "urn:upnp-org:serviceId:WANEthLinkC1", &wanConnectionUDN };
+static const struct actionService wanIPv6FwCtrlService =
+    { "urn:upnp-org:serviceId:WANIPv6FwCtrl1", &wanConnectionUDN };
+static const struct actionService lanHostConfigService =
+    { "urn:upnp-org:serviceId:LANHostConfig1", &lanUDN };
+
+static const struct actionService *services[] =
+{
+    &wanCommonIFCService, &wanIPConnService, &wanEthLinkCService, &wanIPv6FwCtrlService, &lanHostConfigService
+};
+
+#define ACTION(service, name, handler, args, flags, lock) \
+    { &service, name, handler, args, flags, lock, 0, 0, 0, 0 }
+
+static struct actionEntry actions[] =
+{
+    // WANCommonInterfaceConfig:1, gateicfgSCPD.xml
+    ACTION(wanCommonIFCService, "GetCommonLinkProperties", GetCommonLinkProperties, 0, 0, ACTION_LOCK_WAN),
+    ACTION(wanCommonIFCService, "GetTotalBytesSent", GetTotalBytesSent, 0, 0, ACTION_LOCK_WAN),
+    ACTION(wanCommonIFCService, "GetTotalBytesReceived", GetTotalBytesReceived, 0, 0, ACTION_LOCK_WAN),
+    ACTION(wanCommonIFCService, "GetTotalPacketsSent", GetTotalPacketsSent, 0, 0, ACTION_LOCK_WAN),
+    ACTION(wanCommonIFCService, "GetTotalPacketsReceived", GetTotalPacketsReceived, 0, 0, ACTION_LOCK_WAN),
+
+    // WANIPConnection:2, gateconnSCPD.xml
+    ACTION(wanIPConnService, "SetConnectionType", SetConnectionType, 1, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetConnectionTypeInfo", GetConnectionTypeInfo, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "RequestConnection", RequestConnection, 0, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "RequestTermination", RequestTermination, 0, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "ForceTermination", ForceTermination, 0, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "SetAutoDisconnectTime", SetAutoDisconnectTime, 1, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "SetIdleDisconnectTime", SetIdleDisconnectTime, 1, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "SetWarnDisconnectDelay", SetWarnDisconnectDelay, 1, ACTION_MUTATES, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetStatusInfo", GetStatusInfo, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetAutoDisconnectTime", GetAutoDisconnectTime, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetIdleDisconnectTime", GetIdleDisconnectTime, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetWarnDisconnectDelay", GetWarnDisconnectDelay, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetNATRSIPStatus", GetNATRSIPStatus, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "GetGenericPortMappingEntry", GetGenericPortMappingEntry, 1, 0, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "GetSpecificPortMappingEntry", GetSpecificPortMappingEntry, 3, 0, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "AddPortMapping", AddPortMapping, 8, ACTION_MUTATES, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "DeletePortMapping", DeletePortMapping, 3, ACTION_MUTATES, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "GetExternalIPAddress", GetExternalIPAddress, 0, 0, ACTION_LOCK_CONNECTION),
+    ACTION(wanIPConnService, "DeletePortMappingRange", DeletePortMappingRange, 4, ACTION_MUTATES, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "GetListOfPortMappings", GetListOfPortmappings, 5, 0, ACTION_LOCK_PORTMAP),
+    ACTION(wanIPConnService, "AddAnyPortMapping", AddAnyPortMapping, 8, ACTION_MUTATES, ACTION_LOCK_PORTMAP),
+
+    // WANEthernetLinkConfig:1, gateEthlcfgSCPD.xml
+    ACTION(wanEthLinkCService, "GetEthernetLinkStatus", GetEthernetLinkStatus, 0, 0, ACTION_LOCK_WAN),
+
+    // WANIPv6FirewallControl:1, wanipv6fwctrlSCPD.xml
+    ACTION(wanIPv6FwCtrlService, "GetFirewallStatus", upnp_wanipv6_getFirewallStatus, 0, 0, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "GetOutboundPinholeTimeout", upnp_wanipv6_getOutboundPinholeTimeOut, 5, 0, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "AddPinhole", upnp_wanipv6_addPinhole, 6, ACTION_MUTATES, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "UpdatePinhole", upnp_wanipv6_updatePinhole, 2, ACTION_MUTATES, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "DeletePinhole", upnp_wanipv6_deletePinhole, 1, ACTION_MUTATES, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "GetPinholePackets", upnp_wanipv6_getPinholePackets, 1, 0, ACTION_LOCK_PINHOLE),
+    ACTION(wanIPv6FwCtrlService, "CheckPinholeWorking", upnp_wanipv6_checkPinholeWorking, 1, 0, ACTION_LOCK_PINHOLE),
+
+    // LANHostConfigManagement:1, lanhostconfigSCPD.xml
+    ACTION(lanHostConfigService, "SetDHCPServerConfigurable", SetDHCPServerConfigurable, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetDHCPServerConfigurable", GetDHCPServerConfigurable, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetDHCPRelay", SetDHCPRelay, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetDHCPRelay", GetDHCPRelay, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetSubnetMask", SetSubnetMask, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetSubnetMask", GetSubnetMask, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetIPRouter", SetIPRouter, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "DeleteIPRouter", DeleteIPRouter, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetIPRoutersList", GetIPRoutersList, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetDomainName", SetDomainName, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetDomainName", GetDomainName, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetAddressRange", SetAddressRange, 2, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetAddressRange", GetAddressRange, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetReservedAddress", SetReservedAddress, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "DeleteReservedAddress", DeleteReservedAddress, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetReservedAddresses", GetReservedAddresses, 0, 0, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "SetDNSServer", SetDNSServer, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "DeleteDNSServer", DeleteDNSServer, 1, ACTION_MUTATES, ACTION_LOCK_LANHOST),
+    ACTION(lanHostConfigService, "GetDNSServers", GetDNSServers, 0, 0, ACTION_LOCK_LANHOST),
+};
+
+#define ACTION_COUNT (sizeof(actions) / sizeof(actions[0]))
+
+// slot contains index of action + 1, 0 means empty slot
+static uint8_t actionIndex[ACTION_INDEX_SIZE];
+
+static ithread_rwlock_t actionLocks[ACTION_LOCK_COUNT];
+
+/**
+ * Compute FNV-1a hash of serviceId and action name.
+ *
+ * @param serviceId ServiceId of service.
+ * @param name Name of action.
+ * @return Hash value.
+ */
+static uint32_t ActionTableHash(const char *serviceId, const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*serviceId)
+        hash = (hash ^ (uint8_t)*serviceId++) * 16777619u;
+    // separator, so that moving characters between the strings changes hash
+    hash = (hash ^ '/') * 16777619u;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Build hash index of action table and initialize locks. Must be called once
+ * before any action is dispatched or any lock is taken.
+ */
+void ActionTableInit(void)
+{
+    uint32_t slot;
+    unsigned int i;
+
+#if UPNP_USE_RWLOCK && defined(__GLIBC__)
+    // default rwlock of glibc lets steady stream of read actions starve
+    // writers, such as expiration of portmappings
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (i = 0; i < ACTION_LOCK_COUNT; i++)
+        pthread_rwlock_init(&actionLocks[i], &attr);
+    pthread_rwlockattr_destroy(&attr);
+#else
+    for (i = 0; i < ACTION_LOCK_COUNT; i++)
+        ithread_rwlock_init(&actionLocks[i], NULL);
+#endif
+
+    memset(actionIndex, 0, sizeof(actionIndex));
+    for (i = 0; i < ACTION_COUNT; i++)
+    {
+        slot = ActionTableHash(actions[i].service->serviceId, actions[i].name);
+        while (actionIndex[slot & (ACTION_INDEX_SIZE - 1)])
+            slot++;
+        actionIndex[slot & (ACTION_INDEX_SIZE - 1)] = i + 1;
+    }
+}
+
+/**
+ * Find action of service of device.
+ *
+ * @param devUDN UDN of device.
+ * @param serviceId ServiceId of service.
+ * @param name Name of action.
+ * @return Action, or NULL if device has no such service or service has no such action.
+ */
+struct actionEntry *ActionTableFind(const char *devUDN, const char *serviceId, const char *name)
+{
+    struct actionEntry *action;
+    uint32_t slot;
+
+    slot = ActionTableHash(serviceId, name);
+    while (actionIndex[slot & (ACTION_INDEX_SIZE - 1)])
+    {
+        action = &actions[actionIndex[slot & (ACTION_INDEX_SIZE - 1)] - 1];
+        if (strcmp(action->name, name) == 0 &&
+            strcmp(action->service->serviceId, serviceId) == 0)
+        {
+            if (*action->service->devUDN == NULL ||
+                strcmp(*action->service->devUDN, devUDN) != 0)
+                return NULL;
+            return action;
+        }
+        slot++;
+    }
+
+    return NULL;
+}
+
+/**
+ * Check if device has service with given serviceId.
+ *
+ * @param devUDN UDN of device.
+ * @param serviceId ServiceId of service.
+ * @return 1 if device has the service, 0 if not.
+ */
+int ActionTableHasService(const char *devUDN, const char *serviceId)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(services) / sizeof(services[0]); i++)
+    {
+        if (strcmp(services[i]->serviceId, serviceId) == 0)
+            return *services[i]->devUDN != NULL &&
+                   strcmp(*services[i]->devUDN, devUDN) == 0;
+    }
+
+    return 0;
+}
+
+/**
+ * Call handler of action and update statistics of action. Lock of action is
+ * held while handler runs. Request with other number of arguments than
+ * action has in SCPD is rejected with 402 without calling handler.
+ *
+ * @param action Action.
+ * @param ca_event Upnp event struct.
+ * @return Upnp error code returned by handler.
+ */
+int ActionTableCall(struct actionEntry *action, struct Upnp_Action_Request *ca_event)
+{
+    struct timespec start, end;
+    unsigned long usecs, max;
+    int result;
+
+    if (GetNbSoapParameters(ca_event->ActionRequest) != action->args)
+    {
+        trace(1, "%s: Invalid number of arguments, expected %d", action->name, action->args);
+        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
+        __sync_fetch_and_add(&action->calls, 1);
+        __sync_fetch_and_add(&action->errors, 1);
+        return ca_event->ErrCode;
+    }
+
+    if (action->flags & ACTION_MUTATES)
+        ActionLockWrite(action->lock);
+    else
+        ActionLockRead(action->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    result = action->handler(ca_event);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ActionUnlock(action->lock);
+
+    usecs = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    // readers of same lock class run concurrently
+    __sync_fetch_and_add(&action->calls, 1);
+    if (ca_event->ErrCode != UPNP_E_SUCCESS)
+        __sync_fetch_and_add(&action->errors, 1);
+    __sync_fetch_and_add(&action->usecs, usecs);
+    max = action->maxUsecs;
+    while (usecs > max && !__sync_bool_compare_and_swap(&action->maxUsecs, max, usecs))
+        max = action->maxUsecs;
+
+    return result;
+}
+
+/**
+ * Log statistics of every action which has been called.
+ */
+void ActionTableLogStatistics(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < ACTION_COUNT; i++)
+    {
+        if (actions[i].calls == 0)
+            continue;
+
+        trace(2, "%s: %lu calls, %lu errors, average %llu us, max %lu us",
+              actions[i].name, actions[i].calls, actions[i].errors,
+              actions[i].usecs / actions[i].calls, actions[i].maxUsecs);
+    }
+}
+
+/**
+ * Lock shared state of lock class for reading.
+ *
+ * @param lock Lock class.
+ */
+void ActionLockRead(action_lock_t lock)
+{
+    ithread_rwlock_rdlock(&actionLocks[lock]);
+}
+
+/**
+ * Lock shared state of lock class for writing.
+ *
+ * @param lock Lock class.
+ */
+void ActionLockWrite(action_lock_t lock)
+{
+    ithread_rwlock_wrlock(&actionLocks[lock]);
+}
+
+/**
+ * Unlock shared state of lock class.
+ *
+ * @param lock Lock class.
+ */
+void ActionUnlock(action_lock_t lock)
+{
+    ithread_rwlock_unlock(&actionLocks[lock]);
+}
@@ -0,0 +1,75 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _ACTIONTABLE_H_
+#define _ACTIONTABLE_H_
+
+#include <upnp/upnp.h>
+
+// Which shared state an action uses. Every class has its own lock, when more
+// than one is needed they are taken in this order.
+typedef enum
+{
+    ACTION_LOCK_PORTMAP,    // portmapping list, PortMappingNumberOfEntries and SystemUpdateID
+    ACTION_LOCK_PINHOLE,    // IPv6 pinholes
+    ACTION_LOCK_LANHOST,    // LANHostConfigManagement
+    ACTION_LOCK_CONNECTION, // connection state of WANIPConnection
+    ACTION_LOCK_WAN,        // WANCommonInterfaceConfig and WANEthernetLinkConfig
+    ACTION_LOCK_COUNT
+} action_lock_t;
+
+// Action flags
+#define ACTION_MUTATES 0x01 // action changes state of device, lock is taken for writing
+
+struct actionService
+{
+    const char *serviceId;
+    char **devUDN;          // UDN of device containing service
+};
+
+struct actionEntry
+{
+    const struct actionService *service;
+    const char *name;
+    int (*handler)(struct Upnp_Action_Request *ca_event);
+    int args;               // number of in arguments in SCPD
+    int flags;
+    action_lock_t lock;
+
+    // statistics
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long long usecs;
+    unsigned long maxUsecs;
+};
+
+void ActionTableInit(void);
+struct actionEntry *ActionTableFind(const char *devUDN, const char *serviceId, const char *name);
+int ActionTableHasService(const char *devUDN, const char *serviceId);
+int ActionTableCall(struct actionEntry *action, struct Upnp_Action_Request *ca_event);
+void ActionTableLogStatistics(void);
+
+void ActionLockRead(action_lock_t lock);
+void ActionLockWrite(action_lock_t lock);
+void ActionUnlock(action_lock_t lock);
+
+#endif // _ACTIONTABLE_H_
@@ -107,6 +107,8 @@ int parseConfigFile(globals_p vars)
     regex_t re_comment;
     regex_t re_empty_row;
     regex_t re_iptables_location;
+    regex_t re_iptables_restore_location;
+    regex_t re_ip6tables_restore_location;
     regex_t re_debug_mode;
     regex_t re_create_forward_rules;
     regex_t re_forward_rules_append;
@@ -128,11 +130,16 @@ int parseConfigFile(globals_p vars)
     regex_t re_dhcpc;
     regex_t re_network;
     regex_t re_advertisement_interval;
+    regex_t re_port_allocation;
+    regex_t re_firewall_commit_wait;
+    regex_t re_portmap_list_max_size;
+    regex_t re_event_min_interval;
 
     regex_t re_ipv6firewall_enabled;
     regex_t re_ipv6inbound_pinhole_allowed;
     regex_t re_control_point_authorized;
     regex_t re_ipv6forward_chain_name;
+    regex_t re_ipv6_nflog_group;
     regex_t re_ipv4enabled;
     regex_t re_ipv6ula_gua_enabled;
     regex_t re_ipv6link_local_enabled;
@@ -142,6 +149,8 @@ int parseConfigFile(globals_p vars)
     vars->createForwardRules = 0;
     vars->forwardRulesAppend = 0;
     strcpy(vars->iptables,"");
+    strcpy(vars->iptablesRestore,"");
+    strcpy(vars->ip6tablesRestore,"");
     strcpy(vars->forwardChainName,"");
     strcpy(vars->preroutingChainName,"");
     strcpy(vars->upstreamBitrate,"");
@@ -160,11 +169,16 @@ int parseConfigFile(globals_p vars)
     strcpy(vars->dhcpc, "");
     strcpy(vars->networkCmd, "");
     vars->advertisementInterval = ADVERTISEMENT_INTERVAL;
+    vars->portAllocation = PORT_ALLOCATION_SEQUENTIAL;
+    vars->firewallCommitWait = 0;
+    vars->portmapListMaxSize = DEFAULT_PORTMAP_LIST_MAX_SIZE;
+    vars->eventMinInterval = DEFAULT_EVENT_MIN_INTERVAL;
 
     vars->ipv6firewallEnabled = TRUE;
     vars->ipv6inboundPinholeAllowed = TRUE;
     vars->controlPointAuthorized = TRUE;
     strcpy(vars->ipv6forwardChain, "");
+    vars->ipv6nflogGroup = DEFAULT_IPV6_NFLOG_GROUP;
     vars->ipv4Enabled = TRUE;
     vars->ipv6UlaGuaEnabled = TRUE;
     vars->ipv6LinkLocalEnabled = TRUE;
@@ -175,6 +189,8 @@ int parseConfigFile(globals_p vars)
 
     // Regexps to match configuration file settings
     regcomp(&re_iptables_location,"iptables_location[[:blank:]]*=[[:blank:]]*\"([^\"]+)\"",REG_EXTENDED);
+    regcomp(&re_iptables_restore_location,"iptables_restore_location[[:blank:]]*=[[:blank:]]*\"([^\"]+)\"",REG_EXTENDED);
+    regcomp(&re_ip6tables_restore_location,"ip6tables_restore_location[[:blank:]]*=[[:blank:]]*\"([^\"]+)\"",REG_EXTENDED);
     regcomp(&re_debug_mode,"debug_mode[[:blank:]]*=[[:blank:]]*([[:digit:]])",REG_EXTENDED);
     regcomp(&re_forward_chain_name,"forward_chain_name[[:blank:]]*=[[:blank:]]*([[:alpha:]_-]+)",REG_EXTENDED);
     regcomp(&re_prerouting_chain_name,"prerouting_chain_name[[:blank:]]*=[[:blank:]]([[:alpha:]_-]+)",REG_EXTENDED);
@@ -196,11 +212,16 @@ int parseConfigFile(globals_p vars)
     regcomp(&re_dhcpc,"dhcpc_cmd[[:blank:]]*=[[:blank:]]*([[:alpha:]_/.]{1,50})",REG_EXTENDED);
     regcomp(&re_network,"network_script[[:blank:]]*=[[:blank:]]*([[:alpha:]_/.]{1,50})",REG_EXTENDED);
     regcomp(&re_advertisement_interval,"advertisement_interval[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
+    regcomp(&re_port_allocation,"port_allocation[[:blank:]]*=[[:blank:]]*(sequential|random|near)",REG_EXTENDED);
+    regcomp(&re_firewall_commit_wait,"firewall_commit_wait[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
+    regcomp(&re_portmap_list_max_size,"portmap_list_max_size[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
+    regcomp(&re_event_min_interval,"event_min_interval[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
 
     regcomp(&re_ipv6firewall_enabled,"ipv6firewall_enabled[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
     regcomp(&re_ipv6inbound_pinhole_allowed,"ipv6inbound_pinhole_allowed[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
     regcomp(&re_control_point_authorized,"control_point_authorized[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
     regcomp(&re_ipv6forward_chain_name,"ipv6forward_chain_name[[:blank:]]*=[[:blank:]]*([[:alpha:]_-]+)",REG_EXTENDED);
+    regcomp(&re_ipv6_nflog_group,"ipv6_nflog_group[[:blank:]]*=[[:blank:]]*([[:digit:]]{1,5})",REG_EXTENDED);
     regcomp(&re_ipv4enabled,"ipv4_enabled[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
     regcomp(&re_ipv6ula_gua_enabled,"ipv6_ula_gua_enabled[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
     regcomp(&re_ipv6link_local_enabled,"ipv6_linklocal_enabled[[:blank:]]*=[[:blank:]]*([[:digit:]]+)",REG_EXTENDED);
@@ -220,6 +241,16 @@ int parseConfigFile(globals_p vars)
                 {
                     getConfigOptionArgument(vars->iptables, OPTION_LEN, line, submatch);
                 }
+                // Check if iptables_restore_location
+                else if (regexec(&re_iptables_restore_location,line,NMATCH,submatch,0) == 0)
+                {
+                    getConfigOptionArgument(vars->iptablesRestore, OPTION_LEN, line, submatch);
+                }
+                // Check if ip6tables_restore_location
+                else if (regexec(&re_ip6tables_restore_location,line,NMATCH,submatch,0) == 0)
+                {
+                    getConfigOptionArgument(vars->ip6tablesRestore, OPTION_LEN, line, submatch);
+                }
                 // Check if create_forward_rules
                 else if (regexec(&re_create_forward_rules,line,NMATCH,submatch,0) == 0)
                 {
@@ -314,6 +345,37 @@ int parseConfigFile(globals_p vars)
                     getConfigOptionArgument(tmp, OPTION_LEN, line, submatch);
                     vars->advertisementInterval = atoi(tmp);
                 }
+                else if (regexec(&re_port_allocation,line,NMATCH,submatch,0) == 0)
+                {
+                    char tmp[11];
+                    getConfigOptionArgument(tmp,sizeof(tmp),line,submatch);
+                    if (strcmp(tmp,"random") == 0)
+                        vars->portAllocation = PORT_ALLOCATION_RANDOM;
+                    else if (strcmp(tmp,"near") == 0)
+                        vars->portAllocation = PORT_ALLOCATION_NEAR;
+                    else
+                        vars->portAllocation = PORT_ALLOCATION_SEQUENTIAL;
+                }
+                else if (regexec(&re_firewall_commit_wait,line,NMATCH,submatch,0) == 0)
+                {
+                    char tmp[11];
+                    getConfigOptionArgument(tmp,sizeof(tmp),line,submatch);
+                    vars->firewallCommitWait = atoi(tmp);
+                }
+                else if (regexec(&re_portmap_list_max_size,line,NMATCH,submatch,0) == 0)
+                {
+                    char tmp[11];
+                    getConfigOptionArgument(tmp,sizeof(tmp),line,submatch);
+                    vars->portmapListMaxSize = atoi(tmp);
+                    if (vars->portmapListMaxSize != 0 && vars->portmapListMaxSize < MINIMUM_PORTMAP_LIST_MAX_SIZE)
+                        vars->portmapListMaxSize = MINIMUM_PORTMAP_LIST_MAX_SIZE;
+                }
+                else if (regexec(&re_event_min_interval,line,NMATCH,submatch,0) == 0)
+                {
+                    char tmp[11];
+                    getConfigOptionArgument(tmp,sizeof(tmp),line,submatch);
+                    vars->eventMinInterval = atoi(tmp);
+                }
                 else if (regexec(&re_ipv6firewall_enabled,line,NMATCH,submatch,0) == 0)
                 {
                     char tmp[2];
@@ -354,6 +416,14 @@ int parseConfigFile(globals_p vars)
                 {
                     getConfigOptionArgument(vars->ipv6forwardChain, OPTION_LEN, line, submatch);
                 }
+                else if (regexec(&re_ipv6_nflog_group,line,NMATCH,submatch,0) == 0)
+                {
+                    char tmp[6];
+                    getConfigOptionArgument(tmp,sizeof(tmp),line,submatch);
+                    vars->ipv6nflogGroup = atoi(tmp);
+                    if (vars->ipv6nflogGroup > 65535)
+                        vars->ipv6nflogGroup = DEFAULT_IPV6_NFLOG_GROUP;
+                }
                 // Check forward_chain_name
                 else if (regexec(&re_forward_chain_name,line,NMATCH,submatch,0) == 0)
                 {
@@ -371,6 +441,8 @@ int parseConfigFile(globals_p vars)
     regfree(&re_comment);
     regfree(&re_empty_row);
     regfree(&re_iptables_location);
+    regfree(&re_iptables_restore_location);
+    regfree(&re_ip6tables_restore_location);
     regfree(&re_debug_mode);
     regfree(&re_create_forward_rules);
     regfree(&re_forward_rules_append);
@@ -392,11 +464,16 @@ int parseConfigFile(globals_p vars)
     regfree(&re_dhcpc);
     regfree(&re_network);
     regfree(&re_advertisement_interval);
+    regfree(&re_port_allocation);
+    regfree(&re_firewall_commit_wait);
+    regfree(&re_portmap_list_max_size);
+    regfree(&re_event_min_interval);
 
     regfree(&re_ipv6firewall_enabled);
     regfree(&re_ipv6inbound_pinhole_allowed);
     regfree(&re_control_point_authorized);
     regfree(&re_ipv6forward_chain_name);
+    regfree(&re_ipv6_nflog_group);
     regfree(&re_ipv4enabled);
     regfree(&re_ipv6ula_gua_enabled);
     regfree(&re_ipv6link_local_enabled);
@@ -491,6 +568,19 @@ int parseConfigFile(globals_p vars)
         // No forward chain name was set in conf file, set it to default
         snprintf(vars->ipv6forwardChain, OPTION_LEN, IP6TABLES_DEFAULT_FORWARD_CHAIN);
     }
+    if (strnlen(vars->iptablesRestore, OPTION_LEN) == 0 && strnlen(vars->iptables, OPTION_LEN) > 0)
+    {
+        // iptables-restore is expected to be next to iptables
+        snprintf(vars->iptablesRestore, OPTION_LEN, "%s-restore", vars->iptables);
+    }
+    if (strnlen(vars->ip6tablesRestore, OPTION_LEN) == 0 && strnlen(vars->iptables, OPTION_LEN) > 0)
+    {
+        // ip6tables-restore is expected to be in the directory of iptables
+        const char *name = strrchr(vars->iptables, '/');
+        int dir_length = name ? (int)(name - vars->iptables) + 1 : 0;
+
+        snprintf(vars->ip6tablesRestore, OPTION_LEN, "%.*sip6tables-restore", dir_length, vars->iptables);
+    }
     if (strnlen(vars->iptables, OPTION_LEN) == 0)
     {
         // Can't find the iptables executable, return -1 to
@@ -31,6 +31,7 @@
 #include <upnp/ixml.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 #include <upnp/upnp.h>
 #include <upnp/upnptools.h>
 #include <arpa/inet.h>
@@ -39,7 +40,10 @@
 #include "pmlist.h"
 #include "lanhostconfig.h"
 #include "wanipv6fw.h"
+#include "pinholev6.h"
 #include "config.h"
+#include "actiontable.h"
+#include "ifmonitor.h"
 
 //Definitions for mapping expiration timer thread
 static ThreadPool gExpirationThreadPool;
@@ -47,10 +51,46 @@ static ThreadPoolJob gEventUpdateJob;
 
 static int gAutoDisconnectJobId = -1;
 
-// MUTEX for locking shared state variables whenver they are changed
-ithread_mutex_t DevMutex = PTHREAD_MUTEX_INITIALIZER;
+// Expiration of portmappings. Wheel is protected by portmapping lock, tick
+// thread expires portmappings and pinholes once a second.
+static struct timerWheel gMappingWheel;
+static ithread_t gExpirationTickThread;
+static ithread_mutex_t gExpirationTickMutex;
+static ithread_cond_t gExpirationTickCond;
+static int gExpirationTickStop;
+static int gExpirationTickRunning;
+
+static void *ExpirationTick(void *arg);
+static void ExpireMappings(time_t now);
+
+// Pending state variable changes of one evented service
+#define EVENT_MAX_SERVICES 8
+#define EVENT_MAX_VARIABLES 16
+
+struct pendingEvent
+{
+    char *devUDN;
+    char *serviceId;
+    int count;                          // number of pending variables
+    char *names[EVENT_MAX_VARIABLES];
+    char *values[EVENT_MAX_VARIABLES];
+    long long due;                      // when pending variables are sent, monotonic ms
+    long long lastSent;                 // when previous event was sent, monotonic ms
+};
+
+// Event merging, see NotifyExtForIPv4AndIPv6
+static struct pendingEvent gPendingEvents[EVENT_MAX_SERVICES];
+static int gPendingEventCount;
+static ithread_t gEventThread;
+static ithread_mutex_t gEventMutex = PTHREAD_MUTEX_INITIALIZER;
+static ithread_cond_t gEventCond = PTHREAD_COND_INITIALIZER;
+// held while taken pending changes are sent, so events of service stay in order
+static ithread_mutex_t gEventSendMutex = PTHREAD_MUTEX_INITIALIZER;
+static int gEventThreadStop;
+static int gEventThreadRunning;
 
 // XML string definitions
+// description is written escaped between xml_portmapEntry and xml_portmapEntryEnd
 static const char xml_portmapEntry[] =
         "<p:PortMappingEntry>"
         "<p:NewRemoteHost>%s</p:NewRemoteHost>"
@@ -59,7 +99,9 @@ static const char xml_portmapEntry[] =
         "<p:NewInternalPort>%s</p:NewInternalPort>"
         "<p:NewInternalClient>%s</p:NewInternalClient>"
         "<p:NewEnabled>%d</p:NewEnabled>"
-        "<p:NewDescription>%s</p:NewDescription>"
+        "<p:NewDescription>";
+static const char xml_portmapEntryEnd[] =
+        "</p:NewDescription>"
         "<p:NewLeaseTime>%li</p:NewLeaseTime>"
         "</p:PortMappingEntry>\n";
 static const char xml_portmapListingHeader[] =
@@ -68,6 +110,34 @@ static const char xml_portmapListingHeader[] =
         "xsi:schemaLocation=\"urn:schemas-upnp-org:gw:WANIPConnection http://www.upnp.org/schemas/gw/WANIPConnection-v2.xsd\">\n";
 static const char xml_portmapListingFooter[] = "</p:PortMappingList>";
 
+/**
+ * Check if internal client of portmapping is same as IP address of control point.
+ *
+ * @param pm Portmapping.
+ * @param ss Address of control point.
+ * @return 1 if addresses are same, 0 if not.
+ */
+static int ControlPointIP_equals_PortMapClient(struct portMap *pm, struct sockaddr_storage *ss)
+{
+    char address[INET6_ADDRSTRLEN];
+
+    // compare binary addresses when possible, string comparison is needed only for logging a mismatch
+    if (pm->m_InternalClientFamily == AF_INET && ss->ss_family == AF_INET &&
+        pm->m_InternalClient.v4.s_addr == ((struct sockaddr_in *)ss)->sin_addr.s_addr)
+        return 1;
+
+    if (pm->m_InternalClientFamily == AF_INET)
+        inet_ntop(AF_INET, &pm->m_InternalClient.v4, address, sizeof(address));
+    else if (pm->m_InternalClientFamily == AF_INET6)
+        inet_ntop(AF_INET6, &pm->m_InternalClient.v6, address, sizeof(address));
+    else if (pm->m_InternalClientFamily == PM_AF_NAME)
+        snprintf(address, sizeof(address), "%s", pm->m_InternalClient.name);
+    else
+        address[0] = '\0';
+
+    return ControlPointIP_equals_InternalClientIP(address, ss);
+}
+
 
 /**
  * Main event handler for callbacks from the SDK.  Determine type of event
@@ -179,8 +249,15 @@ void AcceptSubscriptionExtForIPv4AndIPv6(const char *DevID, const char *ServID,
                 PropSet, SubsId); 
 }
 
-void NotifyExtForIPv4AndIPv6(const char *DevID, const char *ServID,
-                            IXML_Document *PropSet)
+/**
+ * Send property set to subscribers of service on every device handle.
+ *
+ * @param DevID UDN of device.
+ * @param ServID ID of service.
+ * @param PropSet Property set.
+ */
+static void sendEvent(const char *DevID, const char *ServID,
+                      IXML_Document *PropSet)
 {
     if(deviceHandle)
         UpnpNotifyExt(deviceHandle, DevID, ServID, PropSet);
@@ -190,6 +267,324 @@ void NotifyExtForIPv4AndIPv6(const char *DevID, const char *ServID,
         UpnpNotifyExt(deviceHandleIPv6UlaGua, DevID, ServID, PropSet);
 }
 
+/**
+ * Get time of monotonic clock.
+ *
+ * @return Milliseconds.
+ */
+static long long monotonicMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * Find pending changes of service, add new entry if service has none yet.
+ * gEventMutex must be held.
+ *
+ * @param DevID UDN of device.
+ * @param ServID ID of service.
+ * @return Pending changes or NULL if table is full or out of memory.
+ */
+static struct pendingEvent *findPendingEvent(const char *DevID, const char *ServID)
+{
+    struct pendingEvent *ev;
+    int i;
+
+    for (i = 0; i < gPendingEventCount; i++)
+    {
+        ev = &gPendingEvents[i];
+        if (strcmp(ev->serviceId, ServID) == 0 && strcmp(ev->devUDN, DevID) == 0)
+            return ev;
+    }
+    if (gPendingEventCount == EVENT_MAX_SERVICES)
+        return NULL;
+
+    ev = &gPendingEvents[gPendingEventCount];
+    memset(ev, 0, sizeof(*ev));
+    ev->devUDN = strdup(DevID);
+    ev->serviceId = strdup(ServID);
+    if (ev->devUDN == NULL || ev->serviceId == NULL)
+    {
+        free(ev->devUDN);
+        free(ev->serviceId);
+        return NULL;
+    }
+    // first event of service may be sent at once
+    ev->lastSent = monotonicMs() - g_vars.eventMinInterval;
+    gPendingEventCount++;
+    return ev;
+}
+
+/**
+ * Build property set of pending changes and clear them.
+ * gEventMutex must be held.
+ *
+ * @param ev Pending changes of service.
+ * @param now Current time of monotonic clock in milliseconds.
+ * @return Property set or NULL.
+ */
+static IXML_Document *takePendingEvent(struct pendingEvent *ev, long long now)
+{
+    IXML_Document *propSet = NULL;
+    int i;
+
+    for (i = 0; i < ev->count; i++)
+    {
+        UpnpAddToPropertySet(&propSet, ev->names[i], ev->values[i]);
+        free(ev->names[i]);
+        free(ev->values[i]);
+    }
+    ev->count = 0;
+    ev->lastSent = now;
+
+    return propSet;
+}
+
+/**
+ * Merge state variables of property set into pending changes of service.
+ * Pending value of variable is replaced by the new one. If variables don't
+ * fit, pending changes are sent first and then property set, both at once.
+ *
+ * @param DevID UDN of device.
+ * @param ServID ID of service.
+ * @param PropSet Property set.
+ * @return 1 if merged or sent, 0 if property set must be sent by caller.
+ */
+static int queueEvent(const char *DevID, const char *ServID,
+                      IXML_Document *PropSet)
+{
+    struct pendingEvent *ev;
+    IXML_Document *pending;
+    IXML_Node *set, *prop, *var, *text;
+    const char *name, *value;
+    char *copy;
+    int i, added = 0, wasPending;
+    long long now;
+
+    ithread_mutex_lock(&gEventMutex);
+    if (!gEventThreadRunning || (ev = findPendingEvent(DevID, ServID)) == NULL)
+    {
+        ithread_mutex_unlock(&gEventMutex);
+        return 0;
+    }
+
+    // <e:propertyset><e:property><name>value</name></e:property>...
+    set = ixmlNode_getFirstChild((IXML_Node *)PropSet);
+    if (set == NULL)
+    {
+        ithread_mutex_unlock(&gEventMutex);
+        return 1;
+    }
+
+    // check that new variables fit before changing anything
+    for (prop = ixmlNode_getFirstChild(set); prop; prop = ixmlNode_getNextSibling(prop))
+    {
+        if ((var = ixmlNode_getFirstChild(prop)) == NULL)
+            continue;
+        name = ixmlNode_getNodeName(var);
+        for (i = 0; i < ev->count && strcmp(ev->names[i], name) != 0; i++)
+            ;
+        if (i == ev->count)
+            added++;
+    }
+    if (ev->count + added > EVENT_MAX_VARIABLES)
+    {
+        trace(1, "Too many pending state variables of %s, sending event at once", ServID);
+        pending = takePendingEvent(ev, monotonicMs());
+        ithread_mutex_lock(&gEventSendMutex);
+        ithread_mutex_unlock(&gEventMutex);
+        if (pending)
+        {
+            sendEvent(DevID, ServID, pending);
+            ixmlDocument_free(pending);
+        }
+        sendEvent(DevID, ServID, PropSet);
+        ithread_mutex_unlock(&gEventSendMutex);
+        return 1;
+    }
+
+    wasPending = ev->count > 0;
+    for (prop = ixmlNode_getFirstChild(set); prop; prop = ixmlNode_getNextSibling(prop))
+    {
+        if ((var = ixmlNode_getFirstChild(prop)) == NULL)
+            continue;
+        name = ixmlNode_getNodeName(var);
+        text = ixmlNode_getFirstChild(var);
+        value = text ? ixmlNode_getNodeValue(text) : NULL;
+        if ((copy = strdup(value ? value : "")) == NULL)
+            continue;
+
+        for (i = 0; i < ev->count && strcmp(ev->names[i], name) != 0; i++)
+            ;
+        if (i == ev->count)
+        {
+            if ((ev->names[i] = strdup(name)) == NULL)
+            {
+                free(copy);
+                continue;
+            }
+            ev->count++;
+        }
+        else
+            free(ev->values[i]);
+        ev->values[i] = copy;
+    }
+
+    if (!wasPending && ev->count > 0)
+    {
+        now = monotonicMs();
+        ev->due = ev->lastSent + g_vars.eventMinInterval;
+        if (ev->due < now)
+            ev->due = now;
+        ithread_cond_signal(&gEventCond);
+    }
+    ithread_mutex_unlock(&gEventMutex);
+
+    return 1;
+}
+
+/**
+ * Event thread. Sends pending changes of each service when minimum interval
+ * since its previous event has passed. When stopped, sends everything
+ * pending before exiting.
+ *
+ * @param arg Not used.
+ * @return NULL.
+ */
+static void *EventThread(void *arg)
+{
+    IXML_Document *propSets[EVENT_MAX_SERVICES];
+    struct timespec deadline;
+    sigset_t signals;
+    long long now, wait;
+    int i, count, ready;
+
+    // signals are handled by main thread
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    ithread_mutex_lock(&gEventMutex);
+    for (;;)
+    {
+        now = monotonicMs();
+        count = gPendingEventCount;
+        ready = 0;
+        wait = -1;
+        for (i = 0; i < count; i++)
+        {
+            propSets[i] = NULL;
+            if (gPendingEvents[i].count == 0)
+                continue;
+            if (gEventThreadStop || gPendingEvents[i].due <= now)
+            {
+                propSets[i] = takePendingEvent(&gPendingEvents[i], now);
+                ready = 1;
+            }
+            else if (wait < 0 || gPendingEvents[i].due - now < wait)
+                wait = gPendingEvents[i].due - now;
+        }
+
+        if (ready)
+        {
+            // entries of table are never removed, so UDN and ID stay valid
+            ithread_mutex_lock(&gEventSendMutex);
+            ithread_mutex_unlock(&gEventMutex);
+            for (i = 0; i < count; i++)
+            {
+                if (propSets[i])
+                {
+                    sendEvent(gPendingEvents[i].devUDN, gPendingEvents[i].serviceId, propSets[i]);
+                    ixmlDocument_free(propSets[i]);
+                }
+            }
+            ithread_mutex_unlock(&gEventSendMutex);
+            ithread_mutex_lock(&gEventMutex);
+            continue;
+        }
+        if (gEventThreadStop)
+            break;
+
+        if (wait < 0)
+            ithread_cond_wait(&gEventCond, &gEventMutex);
+        else
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += wait / 1000;
+            deadline.tv_nsec += (wait % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            ithread_cond_timedwait(&gEventCond, &gEventMutex, &deadline);
+        }
+    }
+    // from now on events are sent by the caller
+    gEventThreadRunning = 0;
+    ithread_mutex_unlock(&gEventMutex);
+
+    return NULL;
+}
+
+/**
+ * Start event thread which merges and rate limits events, see
+ * event_min_interval option. Without it events are sent at once.
+ *
+ * @return 1 if started or not needed, 0 if failed.
+ */
+int EventThreadInit(void)
+{
+    if (g_vars.eventMinInterval <= 0 || gEventThreadRunning)
+        return 1;
+
+    gEventThreadStop = 0;
+    gEventThreadRunning = 1;
+    if (ithread_create(&gEventThread, NULL, EventThread, NULL) != 0)
+    {
+        gEventThreadRunning = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Send pending events and stop event thread.
+ */
+void EventThreadShutdown(void)
+{
+    ithread_mutex_lock(&gEventMutex);
+    if (!gEventThreadRunning)
+    {
+        ithread_mutex_unlock(&gEventMutex);
+        return;
+    }
+    gEventThreadStop = 1;
+    ithread_cond_signal(&gEventCond);
+    ithread_mutex_unlock(&gEventMutex);
+
+    ithread_join(gEventThread, NULL);
+}
+
+/**
+ * Send event of state variable changes to subscribers of service.
+ * With event thread running, changes are merged into pending changes of
+ * service and sent after event_min_interval from previous event of service.
+ * Caller keeps ownership of PropSet.
+ *
+ * @param DevID UDN of device.
+ * @param ServID ID of service.
+ * @param PropSet Property set.
+ */
+void NotifyExtForIPv4AndIPv6(const char *DevID, const char *ServID,
+                            IXML_Document *PropSet)
+{
+    if (!queueEvent(DevID, ServID, PropSet))
+        sendEvent(DevID, ServID, PropSet);
+}
+
 /**
  * Handles subscription request for state variable notifications.
  *  
@@ -200,8 +595,6 @@ int HandleSubscriptionRequest(struct Upnp_Subscription_Request *sr_event)
 {
     IXML_Document *propSet = NULL;
 
-    ithread_mutex_lock(&DevMutex);
-
     if (wanUDN != NULL && strcmp(sr_event->UDN, wanUDN) == 0)
     {
         // WAN Common Interface Config Device Notifications
@@ -219,6 +612,8 @@ int HandleSubscriptionRequest(struct Upnp_Subscription_Request *sr_event)
         // WAN IP Connection Device Notifications
         if (strcmp(sr_event->ServiceId, "urn:upnp-org:serviceId:WANIPConn1") == 0)
         {
+            ActionLockRead(ACTION_LOCK_PORTMAP);
+            ActionLockWrite(ACTION_LOCK_CONNECTION);
             GetIpAddressStr(ExternalIPAddress, g_vars.extInterfaceName);
             GetConnectionStatus(ConnectionStatus, g_vars.extInterfaceName);
             trace(3, "Received request to subscribe to WANIPConn1");
@@ -234,30 +629,35 @@ int HandleSubscriptionRequest(struct Upnp_Subscription_Request *sr_event)
 
             AcceptSubscriptionExtForIPv4AndIPv6(sr_event->UDN, sr_event->ServiceId,
                                                 propSet, sr_event->Sid);
+            ActionUnlock(ACTION_LOCK_CONNECTION);
+            ActionUnlock(ACTION_LOCK_PORTMAP);
             ixmlDocument_free(propSet);
         }
         else if (strcmp(sr_event->ServiceId, "urn:upnp-org:serviceId:WANEthLinkC1") == 0)
         {
             trace(3, "Received request to subscribe to WANEthLinkC1");
+            ActionLockWrite(ACTION_LOCK_WAN);
             setEthernetLinkStatus(EthernetLinkStatus, g_vars.extInterfaceName);
             UpnpAddToPropertySet(&propSet, "EthernetLinkStatus", EthernetLinkStatus);
             AcceptSubscriptionExtForIPv4AndIPv6(sr_event->UDN, sr_event->ServiceId,
                                                 propSet, sr_event->Sid);
+            ActionUnlock(ACTION_LOCK_WAN);
             ixmlDocument_free(propSet);
         }
         else if (strcmp(sr_event->ServiceId, "urn:upnp-org:serviceId:WANIPv6FwCtrl1") == 0)
         {
             trace(3, "Received request to subscribe to WANIPv6FwCtrl1 UDN : %s, SID : %s", sr_event->UDN, sr_event->Sid);
+            ActionLockRead(ACTION_LOCK_PINHOLE);
             snprintf(FirewallEnabled,2,"%i",g_vars.ipv6firewallEnabled);
             snprintf(InboundPinholeAllowed,2,"%i",g_vars.ipv6inboundPinholeAllowed);
             UpnpAddToPropertySet(&propSet, "FirewallEnabled", FirewallEnabled);
             UpnpAddToPropertySet(&propSet, "InboundPinholeAllowed", InboundPinholeAllowed);
             AcceptSubscriptionExtForIPv4AndIPv6(sr_event->UDN, sr_event->ServiceId,
                                                 propSet, sr_event->Sid);
+            ActionUnlock(ACTION_LOCK_PINHOLE);
             ixmlDocument_free(propSet);
         }
     }
-    ithread_mutex_unlock(&DevMutex);
     return(1);
 }
 
@@ -277,204 +677,34 @@ int HandleGetVarRequest(struct Upnp_State_Var_Request *gv_request)
 }
 
 /**
- * Handles action requests for WANCommonIFC1, WANIPConn1, LANHostConfig1 and
- * WANEthLinkC1 services.
+ * Handles action requests for WANCommonIFC1, WANIPConn1, LANHostConfig1,
+ * WANEthLinkC1 and WANIPv6FwCtrl1 services. Handler of action is looked up
+ * from action table, which also takes the lock of action.
  *  
  * @param sr_event Upnp Action Request struct
  * @return Upnp error code.
  */
 int HandleActionRequest(struct Upnp_Action_Request *ca_event)
 {
+    struct actionEntry *action;
     int result = 0;
 
-    ithread_mutex_lock(&DevMutex);
     trace(3, "ActionName = %s", ca_event->ActionName);
 
     // check if CP is authorized to use this action.
     // checking managed flag is left to action itself
     if ( AuthorizeControlPoint(ca_event, 0, 1) == CONTROL_POINT_NOT_AUTHORIZED )
-    {
-        ithread_mutex_unlock(&DevMutex);
         return ca_event->ErrCode;
-    }
 
-    if (wanUDN != NULL && strcmp(ca_event->DevUDN, wanUDN) == 0)
+    action = ActionTableFind(ca_event->DevUDN, ca_event->ServiceID, ca_event->ActionName);
+    if (action)
+        result = ActionTableCall(action, ca_event);
+    else if (ActionTableHasService(ca_event->DevUDN, ca_event->ServiceID))
     {
-        if (strcmp(ca_event->ServiceID,"urn:upnp-org:serviceId:WANCommonIFC1") == 0)
-        {
-            if (strcmp(ca_event->ActionName,"GetTotalBytesSent") == 0)
-            {
-                if(GetNbSoapParameters(ca_event->ActionRequest) == 0) 
-		    result = GetTotal(ca_event, STATS_TX_BYTES);
-                else
-                    addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-            }
-            else if (strcmp(ca_event->ActionName,"GetTotalBytesReceived") == 0)
-            {
-                if(GetNbSoapParameters(ca_event->ActionRequest) == 0)
-                    result = GetTotal(ca_event, STATS_RX_BYTES);
-                else
-                    addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-            }
-            else if (strcmp(ca_event->ActionName,"GetTotalPacketsSent") == 0)
-            {
-                if(GetNbSoapParameters(ca_event->ActionRequest) == 0)
-                    result = GetTotal(ca_event, STATS_TX_PACKETS);
-                else
-                    addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args"); 
-            }
-            else if (strcmp(ca_event->ActionName,"GetTotalPacketsReceived") == 0)
-            {
-                if(GetNbSoapParameters(ca_event->ActionRequest) == 0)
-                    result = GetTotal(ca_event, STATS_RX_PACKETS);
-                else
-                    addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-            }
-            else if (strcmp(ca_event->ActionName,"GetCommonLinkProperties") == 0)
-                result = GetCommonLinkProperties(ca_event);
-            else
-            {
-                trace(1, "Invalid Action Request : %s",ca_event->ActionName);
-                result = InvalidAction(ca_event);
-            }
-        }
-    }
-    else if (wanConnectionUDN !=NULL && strcmp(ca_event->DevUDN, wanConnectionUDN) == 0)
-    {
-        if (strcmp(ca_event->ServiceID, "urn:upnp-org:serviceId:WANIPConn1") == 0)
-        {
-            if (strcmp(ca_event->ActionName,"GetConnectionTypeInfo") == 0)
-                result = GetConnectionTypeInfo(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetNATRSIPStatus") == 0)
-                result = GetNATRSIPStatus(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetConnectionType") == 0)
-                result = SetConnectionType(ca_event);
-            else if (strcmp(ca_event->ActionName,"RequestConnection") == 0)
-                result = RequestConnection(ca_event);
-            else if (strcmp(ca_event->ActionName,"AddPortMapping") == 0)
-                result = AddPortMapping(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetGenericPortMappingEntry") == 0)
-                result = GetGenericPortMappingEntry(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetSpecificPortMappingEntry") == 0)
-                result = GetSpecificPortMappingEntry(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetExternalIPAddress") == 0)
-                result = GetExternalIPAddress(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeletePortMapping") == 0)
-                result = DeletePortMapping(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetStatusInfo") == 0)
-                result = GetStatusInfo(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeletePortMappingRange") == 0)
-                result = DeletePortMappingRange(ca_event);
-            else if (strcmp(ca_event->ActionName,"AddAnyPortMapping") == 0)
-                result = AddAnyPortMapping(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetListOfPortMappings") == 0)
-                result = GetListOfPortmappings(ca_event);
-            else if (strcmp(ca_event->ActionName,"ForceTermination") == 0)
-                result = ForceTermination(ca_event);
-            else if (strcmp(ca_event->ActionName,"RequestTermination") == 0)
-                result = RequestTermination(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetAutoDisconnectTime") == 0)
-                result = SetAutoDisconnectTime(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetIdleDisconnectTime") == 0)
-                result = SetIdleDisconnectTime(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetWarnDisconnectDelay") == 0)
-                result = SetWarnDisconnectDelay(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetAutoDisconnectTime") == 0)
-                result = GetAutoDisconnectTime(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetIdleDisconnectTime") == 0)
-                result = GetIdleDisconnectTime(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetWarnDisconnectDelay") == 0)
-                result = GetWarnDisconnectDelay(ca_event);
-            else result = InvalidAction(ca_event);
-        }
-        else if (strcmp(ca_event->ServiceID,"urn:upnp-org:serviceId:WANEthLinkC1") == 0)
-        {
-            if (strcmp(ca_event->ActionName,"GetEthernetLinkStatus") == 0)
-                result = GetEthernetLinkStatus(ca_event);
-            else
-            {
-                trace(1, "Invalid Action Request : %s",ca_event->ActionName);
-                result = InvalidAction(ca_event);
-            }
-        }
-        /**
-         * Added for WANIPv6FirewallControl
-         */
-        else if (strcmp(ca_event->ServiceID,"urn:upnp-org:serviceId:WANIPv6FwCtrl1") == 0)
-        {
-            if (strcmp(ca_event->ActionName,"GetFirewallStatus") == 0)
-                result = upnp_wanipv6_getFirewallStatus(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetOutboundPinholeTimeout") == 0)
-                result = upnp_wanipv6_getOutboundPinholeTimeOut(ca_event);
-            else if (strcmp(ca_event->ActionName,"AddPinhole") == 0)
-                result = upnp_wanipv6_addPinhole(ca_event);
-            else if (strcmp(ca_event->ActionName,"UpdatePinhole") == 0)
-                result = upnp_wanipv6_updatePinhole(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeletePinhole") == 0)
-                result = upnp_wanipv6_deletePinhole(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetPinholePackets") == 0)
-                result = upnp_wanipv6_getPinholePackets(ca_event);
-            else if (strcmp(ca_event->ActionName,"CheckPinholeWorking") == 0)
-                result = upnp_wanipv6_checkPinholeWorking(ca_event);
-            else
-            {
-                trace(1, "Invalid Action Request : %s",ca_event->ActionName);
-                result = InvalidAction(ca_event);
-            }
-        }
-    }
-    else if (lanUDN !=NULL && strcmp(ca_event->DevUDN, lanUDN) == 0)
-    {
-        if (strcmp(ca_event->ServiceID,"urn:upnp-org:serviceId:LANHostConfig1") == 0)
-        {
-            if (strcmp(ca_event->ActionName,"SetDHCPServerConfigurable") == 0)
-                result = SetDHCPServerConfigurable(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetDHCPServerConfigurable") == 0)
-                result = GetDHCPServerConfigurable(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetDHCPRelay") == 0)
-                result = SetDHCPRelay(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetDHCPRelay") == 0)
-                result = GetDHCPRelay(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetSubnetMask") == 0)
-                result = SetSubnetMask(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetSubnetMask") == 0)
-                result = GetSubnetMask(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetIPRouter") == 0)
-                result = SetIPRouter(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeleteIPRouter") == 0)
-                result = DeleteIPRouter(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetIPRoutersList") == 0)
-                result = GetIPRoutersList(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetDomainName") == 0)
-                result = SetDomainName(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetDomainName") == 0)
-                result = GetDomainName(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetAddressRange") == 0)
-                result = SetAddressRange(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetAddressRange") == 0)
-                result = GetAddressRange(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetReservedAddress") == 0)
-                result = SetReservedAddress(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeleteReservedAddress") == 0)
-                result = DeleteReservedAddress(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetReservedAddresses") == 0)
-                result = GetReservedAddresses(ca_event);
-            else if (strcmp(ca_event->ActionName,"SetDNSServer") == 0)
-                result = SetDNSServer(ca_event);
-            else if (strcmp(ca_event->ActionName,"DeleteDNSServer") == 0)
-                result = DeleteDNSServer(ca_event);
-            else if (strcmp(ca_event->ActionName,"GetDNSServers") == 0)
-                result = GetDNSServers(ca_event);
-            else
-            {
-                trace(1, "Action not supported: %s",ca_event->ActionName);
-                result = InvalidAction(ca_event);
-            }
-        }
+        trace(1, "Invalid Action Request : %s",ca_event->ActionName);
+        result = InvalidAction(ca_event);
     }
 
-    ithread_mutex_unlock(&DevMutex);
-
     return (result);
 }
 
@@ -505,18 +735,10 @@ int InvalidAction(struct Upnp_Action_Request *ca_event)
  */
 int GetCommonLinkProperties(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetCommonLinkProperties invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult (ca_event, "<NewWANAccessType>Cable</NewWANAccessType>\n"
-        "<NewLayer1UpstreamMaxBitRate>%s</NewLayer1UpstreamMaxBitRate>\n"
-        "<NewLayer1DownstreamMaxBitRate>%s</NewLayer1DownstreamMaxBitRate>\n"
-        "<NewPhysicalLinkStatus>Up</NewPhysicalLinkStatus>\n",
-        g_vars.upstreamBitrate, g_vars.downstreamBitrate);
+    AddActionResponse(ca_event, "NewWANAccessType", "Cable");
+    AddActionResponse(ca_event, "NewLayer1UpstreamMaxBitRate", g_vars.upstreamBitrate);
+    AddActionResponse(ca_event, "NewLayer1DownstreamMaxBitRate", g_vars.downstreamBitrate);
+    AddActionResponse(ca_event, "NewPhysicalLinkStatus", "Up");
 
     return(ca_event->ErrCode);
 }
@@ -527,17 +749,17 @@ int GetCommonLinkProperties(struct Upnp_Action_Request *ca_event)
  *                                     GetTotalPacketsSent
  *                                     GetTotalPacketsReceived
  * 
- * Get specified statistic from /proc/net/dev.
+ * Get specified statistic of external interface, see readStats.
  * 
  * @param ca_event Upnp event struct.
- * @param stat Which value is read from /proc
+ * @param stat Which value is read
  * @return Upnp error code.
  */
 int GetTotal(struct Upnp_Action_Request *ca_event, stats_t stat)
 {
-    const char *methods[STATS_LIMIT] =
-        { "BytesSent", "BytesReceived", "PacketsSent", "PacketsReceived" };
-    unsigned long stats[STATS_LIMIT];
+    const char *names[STATS_LIMIT] =
+        { "NewTotalBytesSent", "NewTotalBytesReceived", "NewTotalPacketsSent", "NewTotalPacketsReceived" };
+    uint64_t stats[STATS_LIMIT];
 
     if (!readStats(stats))
     {
@@ -547,12 +769,56 @@ int GetTotal(struct Upnp_Action_Request *ca_event, stats_t stat)
         return (ca_event->ErrCode);
     }
 
-    ParseResult(ca_event, "<NewTotal%s>%lu</NewTotal%s>\n",
-        methods[stat], stats[stat], methods[stat]);
+    // counters are ui4, they wrap around at 2^32
+    AddActionResponseUInt(ca_event, names[stat], (uint32_t)stats[stat]);
 
     return (ca_event->ErrCode);
 }
 
+/**
+ * WANCommonInterfaceConfig:1 Action: GetTotalBytesSent
+ * 
+ * @param ca_event Upnp event struct.
+ * @return Upnp error code.
+ */
+int GetTotalBytesSent(struct Upnp_Action_Request *ca_event)
+{
+    return GetTotal(ca_event, STATS_TX_BYTES);
+}
+
+/**
+ * WANCommonInterfaceConfig:1 Action: GetTotalBytesReceived
+ * 
+ * @param ca_event Upnp event struct.
+ * @return Upnp error code.
+ */
+int GetTotalBytesReceived(struct Upnp_Action_Request *ca_event)
+{
+    return GetTotal(ca_event, STATS_RX_BYTES);
+}
+
+/**
+ * WANCommonInterfaceConfig:1 Action: GetTotalPacketsSent
+ * 
+ * @param ca_event Upnp event struct.
+ * @return Upnp error code.
+ */
+int GetTotalPacketsSent(struct Upnp_Action_Request *ca_event)
+{
+    return GetTotal(ca_event, STATS_TX_PACKETS);
+}
+
+/**
+ * WANCommonInterfaceConfig:1 Action: GetTotalPacketsReceived
+ * 
+ * @param ca_event Upnp event struct.
+ * @return Upnp error code.
+ */
+int GetTotalPacketsReceived(struct Upnp_Action_Request *ca_event)
+{
+    return GetTotal(ca_event, STATS_RX_PACKETS);
+}
+
 
 //-----------------------------------------------------------------------------
 //
@@ -572,23 +838,15 @@ int GetStatusInfo(struct Upnp_Action_Request *ca_event)
 {
     long int uptime;
 
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetStatusInfo invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
     // If connection is not connected, uptime value is 0
     if (strcmp(ConnectionStatus, "Connected") == 0)
         uptime = (time(NULL) - startup_time);
     else
         uptime = 0;
 
-    ParseResult(ca_event, "<NewConnectionStatus>%s</NewConnectionStatus>\n"
-        "<NewLastConnectionError>ERROR_NONE</NewLastConnectionError>\n"
-        "<NewUptime>%ld</NewUptime>\n",
-        ConnectionStatus, uptime);
+    AddActionResponse(ca_event, "NewConnectionStatus", ConnectionStatus);
+    AddActionResponse(ca_event, "NewLastConnectionError", "ERROR_NONE");
+    AddActionResponseInt(ca_event, "NewUptime", uptime);
 
     return(ca_event->ErrCode);
 }
@@ -604,14 +862,8 @@ int GetStatusInfo(struct Upnp_Action_Request *ca_event)
  */
 int GetConnectionTypeInfo (struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0) {
-        trace(1, "GetConnectionTypeInfo invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult(ca_event, "<NewConnectionType>IP_Routed</NewConnectionType>\n"
-         "<NewPossibleConnectionTypes>IP_Routed</NewPossibleConnectionTypes>");
+    AddActionResponse(ca_event, "NewConnectionType", "IP_Routed");
+    AddActionResponse(ca_event, "NewPossibleConnectionTypes", "IP_Routed");
 
     return(ca_event->ErrCode);
 }
@@ -626,14 +878,8 @@ int GetConnectionTypeInfo (struct Upnp_Action_Request *ca_event)
  */
 int GetNATRSIPStatus(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0) {
-        trace(1, "GetNATRSIPStatus invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult(ca_event, "<NewRSIPAvailable>0</NewRSIPAvailable>\n"
-         "<NewNATEnabled>1</NewNATEnabled>\n");
+    AddActionResponse(ca_event, "NewRSIPAvailable", "0");
+    AddActionResponse(ca_event, "NewNATEnabled", "1");
 
     return(ca_event->ErrCode);
 }
@@ -650,13 +896,6 @@ int GetNATRSIPStatus(struct Upnp_Action_Request *ca_event)
  */
 int SetConnectionType(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 1)
-    {
-        trace(1, "SetConnectionType invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
     ca_event->ErrCode = 731;
     strcpy(ca_event->ErrStr, "ReadOnly");
     ca_event->ActionResult = NULL;
@@ -675,11 +914,13 @@ int SetConnectionType(struct Upnp_Action_Request *ca_event)
 int SetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
 {
     char *delay_str = NULL;
+    struct soapArg args[] = {
+        { "NewAutoDisconnectTime", &delay_str, 0 }
+    };
     long int delay;
     int result = 0;
 
-    if ((delay_str = GetFirstDocumentItem(ca_event->ActionRequest, "NewAutoDisconnectTime")) &&
-            (GetNbSoapParameters(ca_event->ActionRequest)==1))
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         delay = atol(delay_str);
         if (delay < 0)
@@ -699,7 +940,7 @@ int SetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
             if (createAutoDisconnectTimer() == 0)
             {
                 // create response SOAP message
-                ParseResult(ca_event, ""); 
+                CreateActionResponse(ca_event);
             }
             else
             {
@@ -713,7 +954,6 @@ int SetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
         trace(1, "%s: Invalid Args",ca_event->ActionName);
         addErrorData(ca_event, 402, "Invalid Args");
     }
-    free (delay_str);
     return (ca_event->ErrCode);
 }
 
@@ -728,11 +968,13 @@ int SetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
 int SetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
 {
     char *delay_str = NULL;
+    struct soapArg args[] = {
+        { "NewIdleDisconnectTime", &delay_str, 0 }
+    };
     long int delay;
     int result = 0;
 
-    if ((delay_str = GetFirstDocumentItem(ca_event->ActionRequest, "NewIdleDisconnectTime")) &&
-            (GetNbSoapParameters(ca_event->ActionRequest)==1))
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         delay = atol(delay_str);
         if (delay < 0)
@@ -750,7 +992,7 @@ int SetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
         if (result == 0)
         {
             // create response SOAP message
-            ParseResult(ca_event, "");            
+            CreateActionResponse(ca_event);
         }
     }
     else
@@ -758,7 +1000,6 @@ int SetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
         trace(1, "%s: Invalid Args",ca_event->ActionName);
         addErrorData(ca_event, 402, "Invalid Args");
     }
-    free (delay_str);
     return (ca_event->ErrCode);
 }
 
@@ -773,11 +1014,13 @@ int SetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
 int SetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event)
 {
     char *delay_str = NULL;
+    struct soapArg args[] = {
+        { "NewWarnDisconnectDelay", &delay_str, 0 }
+    };
     long int delay;
     int result = 0;
 
-    if ((delay_str = GetFirstDocumentItem(ca_event->ActionRequest, "NewWarnDisconnectDelay")) &&
-           (GetNbSoapParameters(ca_event->ActionRequest)==1))
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         delay = atol(delay_str);
         if (delay < 0)
@@ -795,7 +1038,7 @@ int SetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event)
         if (result == 0)
         {
             // create response SOAP message
-            ParseResult(ca_event, "");
+            CreateActionResponse(ca_event);
         }
 
     }
@@ -804,7 +1047,6 @@ int SetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event)
         trace(1, "%s: Invalid Args",ca_event->ActionName);
         addErrorData(ca_event, 402, "Invalid Args");
     }
-    free (delay_str);
     return (ca_event->ErrCode);
 }
 
@@ -816,16 +1058,7 @@ int SetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event)
  */
 int GetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetAutoDisconnectTime invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult(ca_event,
-        "<NewAutoDisconnectTime>%ld</NewAutoDisconnectTime>\n",
-        AutoDisconnectTime);
+    AddActionResponseInt(ca_event, "NewAutoDisconnectTime", AutoDisconnectTime);
 
     return ca_event->ErrCode;
 }
@@ -838,16 +1071,7 @@ int GetAutoDisconnectTime(struct Upnp_Action_Request *ca_event)
  */
 int GetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetIdleDisconnectTime invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult(ca_event, 
-        "<NewIdleDisconnectTime>%ld</NewIdleDisconnectTime>\n", 
-        IdleDisconnectTime);
+    AddActionResponseInt(ca_event, "NewIdleDisconnectTime", IdleDisconnectTime);
 
     return ca_event->ErrCode;
 }
@@ -860,16 +1084,7 @@ int GetIdleDisconnectTime(struct Upnp_Action_Request *ca_event)
  */
 int GetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetWarnDisconnectDelay invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
-    ParseResult(ca_event,
-        "<NewWarnDisconnectDelay>%ld</NewWarnDisconnectDelay>\n",    
-        WarnDisconnectDelay);
+    AddActionResponseInt(ca_event, "NewWarnDisconnectDelay", WarnDisconnectDelay);
 
     return ca_event->ErrCode;
 }
@@ -888,15 +1103,8 @@ int RequestConnection(struct Upnp_Action_Request *ca_event)
     IXML_Document *propSet = NULL;
     int result = 0;
 
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "RequestConnection invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
     // create result document for succesfull cases. addErrorData overwrites this if no success
-    ParseResult(ca_event, "");
+    CreateActionResponse(ca_event);
 
     trace(2, "RequestConnection received ... Checking status...");
 
@@ -989,13 +1197,6 @@ int ForceTermination(struct Upnp_Action_Request *ca_event)
 {
     int result = 0;
 
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "ForceTermination invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
     if (strcmp(ConnectionStatus,"Disconnecting") == 0)
     {
         trace(1, "%s: Connection of %s already disconnecting", ca_event->ActionName, g_vars.extInterfaceName);
@@ -1025,13 +1226,6 @@ int RequestTermination(struct Upnp_Action_Request *ca_event)
     int result = 0;
     long int delay = WarnDisconnectDelay;
 
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "RequestTermination invalid number of parameters");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
-
     if (strcmp(ConnectionStatus,"Disconnecting") == 0 || strcmp(ConnectionStatus,"PendingDisconnect") == 0) 
     {
         trace(1, "%s: Connection of %s already disconnecting", ca_event->ActionName, g_vars.extInterfaceName);
@@ -1074,19 +1268,18 @@ int AddPortMapping(struct Upnp_Action_Request *ca_event)
     struct portMap *ret;
     int result = 0;
     int update_portmap = 0;
-
-    if ( (remote_host = GetFirstDocumentItem(ca_event->ActionRequest, "NewRemoteHost") )
-            && (ext_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewExternalPort") )
-            && (proto = GetFirstDocumentItem(ca_event->ActionRequest, "NewProtocol") )
-            && (int_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewInternalPort") )
-            && (int_client = GetFirstDocumentItem(ca_event->ActionRequest, "NewInternalClient") )
-            && (long_duration = GetFirstDocumentItem(ca_event->ActionRequest, "NewLeaseDuration") )
-            && (bool_enabled = GetFirstDocumentItem(ca_event->ActionRequest, "NewEnabled") )
-            && (isStringInteger(ext_port) )
-            && (isStringInteger(int_port) )
-            && (isStringInteger(long_duration) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 8 )
-            && (desc = GetFirstDocumentItem(ca_event->ActionRequest, "NewPortMappingDescription") ) )
+    struct soapArg args[] = {
+        { "NewRemoteHost", &remote_host, 0 },
+        { "NewExternalPort", &ext_port, 1 },
+        { "NewProtocol", &proto, 0 },
+        { "NewInternalPort", &int_port, 1 },
+        { "NewInternalClient", &int_client, 0 },
+        { "NewLeaseDuration", &long_duration, 1 },
+        { "NewEnabled", &bool_enabled, 0 },
+        { "NewPortMappingDescription", &desc, 0 }
+    };
+
+    if (GetSoapArguments(ca_event->ActionRequest, args, 8))
     {
         if (((strcmp(proto, "TCP") != 0) && (strcmp(proto, "UDP") != 0))
             || (atoi(ext_port) < 0)
@@ -1151,9 +1344,10 @@ unless control port is authorized. external_port:%s, internal_port:%s internal_c
             }
 
             // If the ExternalPort and PortMappingProtocol pair is already mapped to another 
-            // internal client, an error is returned.
+            // internal client, an error is returned. (Both finds walk the same index run, so
+            // they return the same mapping if its internal client is int_client.)
             else if ((ret = pmlist_FindBy_extPort_proto(ext_port, proto)) != NULL && 
-                    strcmp(ret->m_InternalClient, int_client) != 0)
+                    pmlist_FindBy_extPort_proto_intClient(ext_port, proto, int_client) != ret)
             {
                 trace(1, "Portmapping with same external port '%s' and protocol '%s' are mapped to another client already.\n",ext_port,proto);
                 result = 718;
@@ -1168,7 +1362,7 @@ unless control port is authorized. external_port:%s, internal_port:%s internal_c
             if (result == 1)
             {
                 // create response SOAP message
-                ParseResult(ca_event, "");
+                CreateActionResponse(ca_event);
             }
         }
     }
@@ -1178,15 +1372,6 @@ unless control port is authorized. external_port:%s, internal_port:%s internal_c
         addErrorData(ca_event, 402, "Invalid Args");
     }
 
-    free(ext_port);
-    free(int_port);
-    free(proto);
-    free(int_client);
-    free(bool_enabled);
-    free(desc);
-    free(remote_host);
-    free(long_duration);
-
     return(ca_event->ErrCode);
 }
 
@@ -1214,20 +1399,19 @@ int AddAnyPortMapping(struct Upnp_Action_Request *ca_event)
     int next_free_port = 0;
     struct portMap *ret;
     int result = 0;
-    char freePort[5];
-
-    if ( (remote_host = GetFirstDocumentItem(ca_event->ActionRequest, "NewRemoteHost") )
-            && (ext_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewExternalPort") )
-            && (proto = GetFirstDocumentItem(ca_event->ActionRequest, "NewProtocol") )
-            && (int_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewInternalPort") )
-            && (int_client = GetFirstDocumentItem(ca_event->ActionRequest, "NewInternalClient") )
-            && (bool_enabled = GetFirstDocumentItem(ca_event->ActionRequest, "NewEnabled") )
-            && (desc = GetFirstDocumentItem(ca_event->ActionRequest, "NewPortMappingDescription") )
-            && (long_duration = GetFirstDocumentItem(ca_event->ActionRequest, "NewLeaseDuration") )
-            && (isStringInteger(ext_port) )
-            && (isStringInteger(int_port) )
-            && (isStringInteger(long_duration) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 8) )
+    char freePort[6];
+    struct soapArg args[] = {
+        { "NewRemoteHost", &remote_host, 0 },
+        { "NewExternalPort", &ext_port, 1 },
+        { "NewProtocol", &proto, 0 },
+        { "NewInternalPort", &int_port, 1 },
+        { "NewInternalClient", &int_client, 0 },
+        { "NewEnabled", &bool_enabled, 0 },
+        { "NewPortMappingDescription", &desc, 0 },
+        { "NewLeaseDuration", &long_duration, 1 }
+    };
+
+    if (GetSoapArguments(ca_event->ActionRequest, args, 8))
     {
         if (((strcmp(proto, "TCP") != 0) && (strcmp(proto, "UDP") != 0))
             || (atoi(ext_port) < 0)
@@ -1300,11 +1484,11 @@ unless control port is authorized. external_port:%s, internal_port:%s internal_c
                 {
                     // Find searches free external port...
                     trace(3, "Port map with same ExternalPort and protocol exists. Finding next free ExternalPort...");
-                    next_free_port = pmlist_FindNextFreePort(proto);
+                    next_free_port = pmlist_FindNextFreePort(proto, atoi(ext_port));
                     if (next_free_port > 0)
                     {
                         trace(3, "Found free port:%d", next_free_port);
-                        sprintf(freePort, "%d", next_free_port);
+                        snprintf(freePort, sizeof(freePort), "%u", (unsigned int)next_free_port);
                         result = AddNewPortMapping(ca_event, bool_enabled, atol(long_duration), remote_host,
                                                     freePort, int_port, proto,
                                                     int_client, desc, 0);
@@ -1345,19 +1529,9 @@ unless control port is authorized. external_port:%s, internal_port:%s internal_c
         // Port mapping has been done for external port that control point wanted
         if (next_free_port == 0) next_free_port = atoi(ext_port);
 
-        ParseResult(ca_event, "<NewReservedPort>%d</NewReservedPort>\n",
-            next_free_port);
+        AddActionResponseInt(ca_event, "NewReservedPort", next_free_port);
     }
 
-    free(remote_host);
-    free(ext_port);
-    free(proto);
-    free(int_port);
-    free(int_client);
-    free(bool_enabled);
-    free(desc);
-    free(long_duration);
-
     return(ca_event->ErrCode);
 }
 
@@ -1373,40 +1547,33 @@ int GetGenericPortMappingEntry(struct Upnp_Action_Request *ca_event)
 {
     char *mapindex = NULL;
     struct portMap *temp;
-    char result_param[RESULT_LEN];
-    int action_succeeded = 0;
+    struct portMapText text;
+    struct soapArg args[] = {
+        { "NewPortMappingIndex", &mapindex, 1 }
+    };
 
-    if ((mapindex = GetFirstDocumentItem(ca_event->ActionRequest, "NewPortMappingIndex"))
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 1)
-            && (isStringInteger(mapindex)) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         temp = pmlist_FindByIndex(atoi(mapindex));
         // if portmapping is found, we must check if CP is authorized OR if internalclient value of portmapping matches IP of CP
         // Also if CP is not authorized NewInternalPort and NewExternalPort values of the port mapping entry must be greater than or equal to 1024,
         // else empty values are returned 
         if (temp && (AuthorizeControlPoint(ca_event, 1, 0) == CONTROL_POINT_AUTHORIZED || 
-                        (ControlPointIP_equals_InternalClientIP(temp->m_InternalClient, &ca_event->CtrlPtIPAddr) && 
-                         atoi(temp->m_ExternalPort) > 1023 && atoi(temp->m_InternalPort) > 1023)
+                        (ControlPointIP_equals_PortMapClient(temp, &ca_event->CtrlPtIPAddr) && 
+                         temp->m_ExternalPort > 1023 && temp->m_InternalPort > 1023)
                      )
             )
         {
-            snprintf(result_param, RESULT_LEN, "<NewRemoteHost>%s</NewRemoteHost>\n"
-                "<NewExternalPort>%s</NewExternalPort>\n"
-                "<NewProtocol>%s</NewProtocol>\n"
-                "<NewInternalPort>%s</NewInternalPort>\n"
-                "<NewInternalClient>%s</NewInternalClient>\n"
-                "<NewEnabled>%d</NewEnabled>\n"
-                "<NewPortMappingDescription>%s</NewPortMappingDescription>\n"
-                "<NewLeaseDuration>%li</NewLeaseDuration>\n",
-                temp->m_RemoteHost,
-                temp->m_ExternalPort,
-                temp->m_PortMappingProtocol,
-                temp->m_InternalPort,
-                temp->m_InternalClient,
-                temp->m_PortMappingEnabled,
-                temp->m_PortMappingDescription,
+            pmlist_ToText(temp, &text);
+            AddActionResponse(ca_event, "NewRemoteHost", text.remoteHost);
+            AddActionResponse(ca_event, "NewExternalPort", text.externalPort);
+            AddActionResponse(ca_event, "NewProtocol", text.protocol);
+            AddActionResponse(ca_event, "NewInternalPort", text.internalPort);
+            AddActionResponse(ca_event, "NewInternalClient", text.internalClient);
+            AddActionResponseInt(ca_event, "NewEnabled", temp->m_PortMappingEnabled);
+            AddActionResponse(ca_event, "NewPortMappingDescription", text.description);
+            AddActionResponseInt(ca_event, "NewLeaseDuration",
                 (temp->m_IsStatic == 1)?0:(temp->expirationTime-time(NULL)));
-            action_succeeded = 1;
         }
         else if (!temp) // nothing in that index
         {
@@ -1418,19 +1585,12 @@ int GetGenericPortMappingEntry(struct Upnp_Action_Request *ca_event)
             trace(1, "GetGenericPortMappingEntry: Not authorized user and Control point IP and portmapping internal client doesn't mach or portnumbers of portmapping are under 1024");
             addErrorData(ca_event, 606, "Action not authorized");
         }
-
-        if (action_succeeded)
-        {
-            ParseResult(ca_event, result_param);
-        }
-
     }
     else
     {
         trace(1, "Failure in GetGenericPortMappingEntry: Invalid Args");
         addErrorData(ca_event, 402, "Invalid Args");
     }
-    free (mapindex);
     return (ca_event->ErrCode);
 }
 
@@ -1448,16 +1608,16 @@ int GetSpecificPortMappingEntry(struct Upnp_Action_Request *ca_event)
     char *remote_host=NULL;
     char *ext_port=NULL;
     char *proto=NULL;
-    char result_param[RESULT_LEN];
-    int action_succeeded = 0;
     struct portMap *temp;
+    struct portMapText text;
     int authorized = 0;
+    struct soapArg args[] = {
+        { "NewRemoteHost", &remote_host, 0 },
+        { "NewExternalPort", &ext_port, 1 },
+        { "NewProtocol", &proto, 0 }
+    };
 
-    if ((remote_host = GetFirstDocumentItem(ca_event->ActionRequest, "NewRemoteHost")) &&
-            (ext_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewExternalPort")) &&
-            (GetNbSoapParameters(ca_event->ActionRequest)==3) &&
-            (isStringInteger(ext_port)) &&
-            (proto = GetFirstDocumentItem(ca_event->ActionRequest,"NewProtocol")) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 3))
     {
         //check if authorized
         if (AuthorizeControlPoint(ca_event, 1, 0) == CONTROL_POINT_AUTHORIZED)
@@ -1485,22 +1645,18 @@ int GetSpecificPortMappingEntry(struct Upnp_Action_Request *ca_event)
         // Also if CP is not authorized NewInternalPort and NewExternalPort values of the port mapping entry must be greater than or equal to 1024,
         // else error is returned 
         else if ((temp = pmlist_FindSpecific (remote_host, ext_port, proto)) && (authorized || 
-                        (ControlPointIP_equals_InternalClientIP(temp->m_InternalClient, &ca_event->CtrlPtIPAddr) && 
-                         atoi(temp->m_ExternalPort) > 1023 && atoi(temp->m_InternalPort) > 1023)
+                        (ControlPointIP_equals_PortMapClient(temp, &ca_event->CtrlPtIPAddr) && 
+                         temp->m_ExternalPort > 1023 && temp->m_InternalPort > 1023)
                      )
             )
         {
-            snprintf(result_param, RESULT_LEN, "<NewInternalPort>%s</NewInternalPort>\n"
-                "<NewInternalClient>%s</NewInternalClient>\n"
-                "<NewEnabled>%d</NewEnabled>\n"
-                "<NewPortMappingDescription>%s</NewPortMappingDescription>\n"
-                "<NewLeaseDuration>%li</NewLeaseDuration>\n",
-                temp->m_InternalPort,
-                temp->m_InternalClient,
-                temp->m_PortMappingEnabled,
-                temp->m_PortMappingDescription,
+            pmlist_ToText(temp, &text);
+            AddActionResponse(ca_event, "NewInternalPort", text.internalPort);
+            AddActionResponse(ca_event, "NewInternalClient", text.internalClient);
+            AddActionResponseInt(ca_event, "NewEnabled", temp->m_PortMappingEnabled);
+            AddActionResponse(ca_event, "NewPortMappingDescription", text.description);
+            AddActionResponseInt(ca_event, "NewLeaseDuration",
                 (temp->m_IsStatic == 1)?0:(temp->expirationTime-time(NULL)));
-            action_succeeded = 1;
         }
         else if (!temp)
         {
@@ -1512,11 +1668,6 @@ int GetSpecificPortMappingEntry(struct Upnp_Action_Request *ca_event)
             trace(1, "Failure in GetSpecificPortMappingEntry: Action not authorized\n");
             addErrorData(ca_event, 606, "Action not authorized");
         }
-
-        if (action_succeeded)
-        {
-            ParseResult(ca_event, result_param);
-        }
     }
     else
     {
@@ -1524,10 +1675,6 @@ int GetSpecificPortMappingEntry(struct Upnp_Action_Request *ca_event)
         addErrorData(ca_event, 402, "Invalid Args");
     }
 
-    free(remote_host);
-    free(ext_port);
-    free(proto);
-
     return (ca_event->ErrCode);
 }
 
@@ -1541,16 +1688,11 @@ int GetSpecificPortMappingEntry(struct Upnp_Action_Request *ca_event)
  */
 int GetExternalIPAddress(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "Failure in GetExternalIPAddress: Invalid Args");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode;
-    }
+    char address[INET6_ADDRSTRLEN];
 
-    GetIpAddressStr(ExternalIPAddress, g_vars.extInterfaceName);
-    ParseResult(ca_event, "<NewExternalIPAddress>%s</NewExternalIPAddress>\n",
-        ExternalIPAddress);
+    // state variable is updated by eventing, action holds only read lock
+    GetIpAddressStr(address, g_vars.extInterfaceName);
+    AddActionResponse(ca_event, "NewExternalIPAddress", address);
 
     return(ca_event->ErrCode);
 }
@@ -1569,18 +1711,19 @@ int DeletePortMapping(struct Upnp_Action_Request *ca_event)
     char *ext_port=NULL;
     char *proto=NULL;
     int result=0;
-    char num[5];
+    char num[11];
     IXML_Document *propSet= NULL;
     int action_succeeded = 0;
     struct portMap *temp;
     char tmp[11];
     int authorized = 0;
+    struct soapArg args[] = {
+        { "NewRemoteHost", &remote_host, 0 },
+        { "NewExternalPort", &ext_port, 1 },
+        { "NewProtocol", &proto, 0 }
+    };
 
-    if ((remote_host = GetFirstDocumentItem(ca_event->ActionRequest, "NewRemoteHost")) &&
-            (ext_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewExternalPort")) &&
-            (GetNbSoapParameters(ca_event->ActionRequest)==3) &&
-            (isStringInteger(ext_port)) &&
-            (proto = GetFirstDocumentItem(ca_event->ActionRequest, "NewProtocol")) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 3))
     {
         if (((strcmp(proto, "TCP") != 0) && (strcmp(proto, "UDP") != 0)) || 
             (atoi(ext_port) < 0) )
@@ -1612,8 +1755,8 @@ int DeletePortMapping(struct Upnp_Action_Request *ca_event)
         // else error is returned 
         else if ((temp = pmlist_FindSpecific(remote_host, ext_port, proto)) != NULL && 
                      (authorized || 
-                        (ControlPointIP_equals_InternalClientIP(temp->m_InternalClient, &ca_event->CtrlPtIPAddr) && 
-                         atoi(temp->m_ExternalPort) > 1023 && atoi(temp->m_InternalPort) > 1023))
+                        (ControlPointIP_equals_PortMapClient(temp, &ca_event->CtrlPtIPAddr) && 
+                         temp->m_ExternalPort > 1023 && temp->m_InternalPort > 1023))
             )
         {
             result = pmlist_Delete(temp);
@@ -1622,7 +1765,7 @@ int DeletePortMapping(struct Upnp_Action_Request *ca_event)
             {
                 trace(2, "DeletePortMap: Remote Host: %s Proto:%s Port:%s\n", remote_host, proto, ext_port);
                 PortMappingNumberOfEntries = pmlist_Size();
-                sprintf(num,"%d",PortMappingNumberOfEntries);
+                snprintf(num,11,"%d",PortMappingNumberOfEntries);
                 UpnpAddToPropertySet(&propSet,"PortMappingNumberOfEntries", num);
                 snprintf(tmp,11,"%ld",++SystemUpdateID);
                 UpnpAddToPropertySet(&propSet,"SystemUpdateID", tmp);
@@ -1656,13 +1799,9 @@ int DeletePortMapping(struct Upnp_Action_Request *ca_event)
 
     if (action_succeeded)
     {
-        ParseResult(ca_event, "");
+        CreateActionResponse(ca_event);
     }
 
-    free(remote_host);
-    free(ext_port);
-    free(proto);
-
     return(ca_event->ErrCode);
 }
 
@@ -1682,28 +1821,26 @@ int DeletePortMappingRange(struct Upnp_Action_Request *ca_event)
     char *bool_manage=NULL;
     int start=0;
     int end=0;
-    int ext_port=0;
     int result=0;
     int str_len = 6;
     char del_port[str_len];
     char tmp[11];
     IXML_Document *propSet= NULL;
     int action_succeeded = 0;
-    struct portMap *temp;
+    struct portMap *temp, *kept = NULL;
     int authorized = 0;
     int managed = 0;
-    int index = 0;
     int foundPortmapCount = 0;
+    struct soapArg args[] = {
+        { "NewStartPort", &start_port, 1 },
+        { "NewEndPort", &end_port, 1 },
+        { "NewProtocol", &proto, 0 },
+        { "NewManage", &bool_manage, 0 }
+    };
 
     ca_event->ErrCode = UPNP_E_SUCCESS;
 
-    if ((start_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewStartPort")) &&
-            (end_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewEndPort")) &&
-            (proto = GetFirstDocumentItem(ca_event->ActionRequest, "NewProtocol")) &&
-            (GetNbSoapParameters(ca_event->ActionRequest) == 4) &&
-            (isStringInteger(start_port)) &&
-            (isStringInteger(end_port)) &&
-            (bool_manage = GetFirstDocumentItem(ca_event->ActionRequest, "NewManage")) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 4))
     {
         //check if authorized
         if (AuthorizeControlPoint(ca_event, 1, 0) == CONTROL_POINT_AUTHORIZED)
@@ -1736,39 +1873,37 @@ int DeletePortMappingRange(struct Upnp_Action_Request *ca_event)
         {
             managed = resolveBoolean(bool_manage);
 
-            //loop ports from start to end
-            for (ext_port = start; ext_port <= end; ext_port++)
+            // loop portmappings of the range in port order, iptables is committed once at the end
+            pmlist_BeginBatch();
+            while ( (temp = pmlist_FindRangeAfter(start, end, proto, "", kept)) != NULL )
             {
-                snprintf(del_port,str_len,"%d",ext_port);
-                index = 0;
-                // remove all instances with externalPort, actually there can ony be one, byt let's be sure
-                while ( (temp = pmlist_FindBy_extPort_proto_afterIndex(del_port, proto, index)) != NULL )
+                foundPortmapCount++;
+                // portmapping can be deleted if control point IP is same as internal client of portmapping,
+                // or if user is authorized and managed flag is up
+                if ((authorized && managed) || ControlPointIP_equals_PortMapClient(temp, &ca_event->CtrlPtIPAddr))
                 {
-                    foundPortmapCount++;
-                    // portmapping can be deleted if control point IP is same as internal client of portmapping,
-                    // or if user is authorized and managed flag is up
-                    if ((authorized && managed) || ControlPointIP_equals_InternalClientIP(temp->m_InternalClient, &ca_event->CtrlPtIPAddr))
+                    // delete portmapping
+                    snprintf(del_port,str_len,"%u",temp->m_ExternalPort);
+                    result = pmlist_Delete(temp);
+
+                    if (result==1)
                     {
-                        // delete portmapping
-                        result = pmlist_Delete(temp);
-
-                        if (result==1)
-                        {
-                            trace(2, "DeletePortMappingRange: DeletedPort:%s StartPort:%s EndPort:%s  Proto:%s Manage:%s\n", del_port, start_port, end_port, proto, bool_manage);
-                            action_succeeded = 1;
-                        }
+                        trace(2, "DeletePortMappingRange: DeletedPort:%s StartPort:%s EndPort:%s  Proto:%s Manage:%s\n", del_port, start_port, end_port, proto, bool_manage);
+                        action_succeeded = 1;
                     }
-                    else // if portmap is deleted, index of following port mappings decreases, that is why we increase our index only when nothing is removed
-                        index++;
                 }
+                else // search continues after portmappings which are not deleted
+                    kept = temp;
             }
+            if (!pmlist_EndBatch())
+                trace(1, "DeletePortMappingRange: Failed to commit iptables changes");
 
             // if action has succeeded and something has been deleted, send event and update SystemUpdateId 
             if (action_succeeded)
             {
                 SystemUpdateID++;
                 PortMappingNumberOfEntries = pmlist_Size();
-                sprintf(tmp,"%d",PortMappingNumberOfEntries);
+                snprintf(tmp,11,"%d",PortMappingNumberOfEntries);
                 UpnpAddToPropertySet(&propSet,"PortMappingNumberOfEntries", tmp);
                 snprintf(tmp,11,"%ld",SystemUpdateID);
                 UpnpAddToPropertySet(&propSet,"SystemUpdateID", tmp);
@@ -1796,14 +1931,10 @@ int DeletePortMappingRange(struct Upnp_Action_Request *ca_event)
 
     if (action_succeeded)
     {
-        ParseResult(ca_event, "");
+        CreateActionResponse(ca_event);
     }
 
     ixmlDocument_free(propSet);
-    free(start_port);
-    free(end_port);
-    free(proto);
-    free(bool_manage);
 
     return(ca_event->ErrCode);
 }
@@ -1824,24 +1955,24 @@ int GetListOfPortmappings(struct Upnp_Action_Request *ca_event)
     char *proto = NULL;
     char *number_of_ports = NULL;
     char cp_ip[INET_ADDRSTRLEN] = "";
-    char result_str[RESULT_LEN_LONG]; // TODO: dynamically allocated result_str
+    struct xmlBuffer result;
+    size_t entry_start;
 
     int start, end;
-    int max_entries, chars_wrote;
-    int action_succeeded = 0, action_fail_exit = 0;
-    int result_place = 0;
+    int max_entries;
+    int entries = 0, truncated = 0;
     int authorized = 0;
     struct portMap *pm = NULL;
+    struct portMapText text;
+    struct soapArg args[] = {
+        { "NewStartPort", &start_port, 1 },
+        { "NewEndPort", &end_port, 1 },
+        { "NewManage", &manage, 0 },
+        { "NewNumberOfPorts", &number_of_ports, 1 },
+        { "NewProtocol", &proto, 0 }
+    };
 
-    if ( (start_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewStartPort") )
-            && (end_port = GetFirstDocumentItem(ca_event->ActionRequest, "NewEndPort") )
-            && (manage = GetFirstDocumentItem(ca_event->ActionRequest, "NewManage") )
-            && (number_of_ports = GetFirstDocumentItem(ca_event->ActionRequest, "NewNumberOfPorts") )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 5 )
-            && (isStringInteger(start_port) )
-            && (isStringInteger(end_port) )
-            && (isStringInteger(number_of_ports) )
-            && (proto = GetFirstDocumentItem(ca_event->ActionRequest, "NewProtocol") ) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 5))
     {
         //check if authorized
         if (AuthorizeControlPoint(ca_event, 1, 0) == CONTROL_POINT_AUTHORIZED)
@@ -1876,52 +2007,53 @@ int GetListOfPortmappings(struct Upnp_Action_Request *ca_event)
             if ( !resolveBoolean(manage) || !authorized )
                 inet_ntop(AF_INET, &ca_event->CtrlPtIPAddr, cp_ip, INET_ADDRSTRLEN);
 
-            // Write XML header
-            result_place += snprintf(result_str, RESULT_LEN_LONG, xml_portmapListingHeader);
-            if (result_place > RESULT_LEN_LONG)
-            {
-                // if buffer runs out of space, return error
-                action_fail_exit = 1;
-            }
+            // footer is always written, entries may only use the rest of the buffer
+            XmlBufferInit(&result, g_vars.portmapListMaxSize ?
+                g_vars.portmapListMaxSize - sizeof(xml_portmapListingFooter) + 1 : 0);
 
-            // Loop through port mappings until we run out or max_entries reaches 0
-            while (!action_fail_exit && (pm = pmlist_FindRangeAfter(start, end, proto, cp_ip, pm)) != NULL && max_entries--)
-            {
-                chars_wrote = snprintf(&result_str[result_place], RESULT_LEN_LONG-result_place, xml_portmapEntry,
-                                       pm->m_RemoteHost, pm->m_ExternalPort, pm->m_PortMappingProtocol,
-                                       pm->m_InternalPort, pm->m_InternalClient, pm->m_PortMappingEnabled,
-                                       pm->m_PortMappingDescription, (pm->m_IsStatic == 1)?0:(pm->expirationTime-time(NULL)));
+            if (!XmlBufferAppend(&result, xml_portmapListingHeader))
+                truncated = 1;
 
-                // if buffer runs out of space, return error
-                if (chars_wrote > RESULT_LEN_LONG-result_place)
+            // Loop through port mappings until we run out, max_entries reaches 0 or buffer is full.
+            // When list is cut short, control point gets next ones by starting after last returned port.
+            while (!truncated && (pm = pmlist_FindRangeAfter(start, end, proto, cp_ip, pm)) != NULL && max_entries--)
+            {
+                pmlist_ToText(pm, &text);
+                entry_start = result.len;
+                if (!XmlBufferPrintf(&result, xml_portmapEntry,
+                                     text.remoteHost, text.externalPort, text.protocol,
+                                     text.internalPort, text.internalClient, pm->m_PortMappingEnabled)
+                    || !XmlBufferAppendEscaped(&result, text.description)
+                    || !XmlBufferPrintf(&result, xml_portmapEntryEnd,
+                                        (pm->m_IsStatic == 1)?0:(pm->expirationTime-time(NULL))))
                 {
-                    action_succeeded = 0;
-                    action_fail_exit = 1;
+                    XmlBufferTruncate(&result, entry_start);
+                    truncated = 1;
                     break;
                 }
-
-                result_place += chars_wrote;
-                action_succeeded = 1;
+                entries++;
             }
 
-            if (action_succeeded)
+            if (entries > 0)
             {
-                chars_wrote = snprintf(&result_str[result_place], RESULT_LEN_LONG-result_place, xml_portmapListingFooter);
-                if (chars_wrote > RESULT_LEN_LONG-result_place)
+                if (result.max)
+                    result.max += sizeof(xml_portmapListingFooter) - 1;
+                if (!XmlBufferAppend(&result, xml_portmapListingFooter))
                 {
-                    // if buffer runs out of space, return error
                     trace(2, "GetListOfPortmappings: Failure while creating result string");
                     addErrorData(ca_event, 501, "Action Failed");
                 }
                 else
                 {
-                    // this will automatically escape value of NewPortListing
-                    ParseResult(ca_event, "<NewPortListing>%s</NewPortListing>\n",
-                        escapeXMLString(result_str));
-                    trace(3, "[This is un-escaped value of response]\n%s",result_str);
+                    if (truncated)
+                        trace(2, "GetListOfPortmappings: List doesn't fit in %d bytes, returning first %d portmappings",
+                              g_vars.portmapListMaxSize, entries);
+                    // text node is escaped when response is serialized
+                    AddActionResponse(ca_event, "NewPortListing", result.data);
+                    trace(3, "[This is un-escaped value of response]\n%s", result.data);
                 }
             }
-            else if (action_fail_exit)
+            else if (truncated)
             {
                 trace(2, "GetListOfPortmappings: Failure while creating result string");
                 addErrorData(ca_event, 501, "Action Failed");
@@ -1931,6 +2063,7 @@ int GetListOfPortmappings(struct Upnp_Action_Request *ca_event)
                 trace(2, "GetListOfPortmappings: Portmapping does not exist");
                 addErrorData(ca_event, 730, "PortMappingNotFound");
             }
+            XmlBufferFree(&result);
         }
     }
     else
@@ -1940,12 +2073,6 @@ int GetListOfPortmappings(struct Upnp_Action_Request *ca_event)
         addErrorData(ca_event, 402, "Invalid Args");
     }
 
-    free(start_port);
-    free(end_port);
-    free(proto);
-    free(manage);
-    free(number_of_ports);
-
     return ca_event->ErrCode;
 }
 
@@ -1966,18 +2093,12 @@ int GetListOfPortmappings(struct Upnp_Action_Request *ca_event)
  */
 int GetEthernetLinkStatus (struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) != 0)
-    {
-        trace(1, "GetEthernetLinkStatus invalid args");
-        addErrorData(ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args");
-        return ca_event->ErrCode; 
-    } 
+    char status[sizeof(EthernetLinkStatus)];
 
-    setEthernetLinkStatus(EthernetLinkStatus, g_vars.extInterfaceName);
+    // state variable is updated by eventing, action holds only read lock
+    setEthernetLinkStatus(status, g_vars.extInterfaceName);
 
-    ParseResult(ca_event,
-        "<NewEthernetLinkStatus>%s</NewEthernetLinkStatus>\n",
-        EthernetLinkStatus);
+    AddActionResponse(ca_event, "NewEthernetLinkStatus", status);
 
     return(ca_event->ErrCode);
 }
@@ -2017,6 +2138,20 @@ int ExpirationTimerThreadInit(void)
         return retVal;
     }
 
+    if (!gExpirationTickRunning)
+    {
+        gExpirationTickStop = 0;
+        ithread_mutex_init(&gExpirationTickMutex, NULL);
+        ithread_cond_init(&gExpirationTickCond, NULL);
+        if (ithread_create(&gExpirationTickThread, NULL, ExpirationTick, NULL) != 0)
+        {
+            ithread_cond_destroy(&gExpirationTickCond);
+            ithread_mutex_destroy(&gExpirationTickMutex);
+            return UPNP_E_INIT_FAILED;
+        }
+        gExpirationTickRunning = 1;
+    }
+
     createEventUpdateTimer();
 
     return 0;
@@ -2029,20 +2164,59 @@ int ExpirationTimerThreadInit(void)
  */
 int ExpirationTimerThreadShutdown(void)
 {
+    if (gExpirationTickRunning)
+    {
+        ithread_mutex_lock(&gExpirationTickMutex);
+        gExpirationTickStop = 1;
+        ithread_cond_signal(&gExpirationTickCond);
+        ithread_mutex_unlock(&gExpirationTickMutex);
+        ithread_join(gExpirationTickThread, NULL);
+        ithread_cond_destroy(&gExpirationTickCond);
+        ithread_mutex_destroy(&gExpirationTickMutex);
+        gExpirationTickRunning = 0;
+    }
+
     TimerThreadShutdown(&gExpirationTimerThread);
     return ThreadPoolShutdown(&gExpirationThreadPool);
 }
 
 /**
- * Set expiration event free.
+ * Expiration tick thread. Once a second expires all portmappings and pinholes
+ * whose lease has ended.
  * 
- * @param event Expiration event.
+ * @param arg Not used.
+ * @return NULL.
  */
-void free_expiration_event(expiration_event *event)
+static void *ExpirationTick(void *arg)
 {
-    if (event!=NULL && event->mapping!=NULL)
-        event->mapping->expirationEventId = -1;
-    free(event);
+    struct timespec deadline;
+    sigset_t signals;
+    time_t now;
+
+    // signals are handled by main thread
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    ithread_mutex_lock(&gExpirationTickMutex);
+    while (!gExpirationTickStop)
+    {
+        // wake up on next second
+        deadline.tv_sec = time(NULL) + 1;
+        deadline.tv_nsec = 0;
+        ithread_cond_timedwait(&gExpirationTickCond, &gExpirationTickMutex, &deadline);
+        if (gExpirationTickStop)
+            break;
+        ithread_mutex_unlock(&gExpirationTickMutex);
+
+        now = time(NULL);
+        ExpireMappings(now);
+        phv6_expire(now);
+
+        ithread_mutex_lock(&gExpirationTickMutex);
+    }
+    ithread_mutex_unlock(&gExpirationTickMutex);
+
+    return NULL;
 }
 
 /**
@@ -2167,22 +2341,15 @@ void DisconnectWAN(void *input)
  */
 int createEventUpdateTimer(void)
 {
-    expiration_event *event;
-    event = ( expiration_event * ) malloc( sizeof( expiration_event ) );
-    if ( event == NULL )
-    {
-        return 0;
-    }
-    event->mapping=NULL;
+    int eventId = -1;
 
     // Add event update job
-    TPJobInit( &gEventUpdateJob, ( start_routine ) UpdateEvents, event );
-    TPJobSetFreeFunction( &gEventUpdateJob, ( free_routine ) free_expiration_event );
+    TPJobInit( &gEventUpdateJob, ( start_routine ) UpdateEvents, NULL );
     TimerThreadSchedule( &gExpirationTimerThread,
                          g_vars.eventUpdateInterval,
                          REL_SEC, &gEventUpdateJob, SHORT_TERM,
-                         &( event->eventId ) );
-    return  event->eventId;
+                         &eventId );
+    return eventId;
 }
 
 /**
@@ -2194,7 +2361,7 @@ static void updateIdleTime()
     if (IdleDisconnectTime <= 0 || strcmp(ConnectionStatus, "Connected") != 0)
         return;
 
-    unsigned long stats[STATS_LIMIT];
+    uint64_t stats[STATS_LIMIT];
     if (!readStats(stats))
     {
         return;
@@ -2226,48 +2393,74 @@ static void updateIdleTime()
 
 /**
  * UpdateEventTimer calls this to check if state variables, which may change on they own,
- * have changed. These variables are EthernetLinkStatus, ExternalIPAddress and ConnectionStatus.
+ * have changed. These variables are EthernetLinkStatus, ExternalIPAddress and ConnectionStatus
+ * when WAN interface is not monitored, and the firewall state variables of WANIPv6FirewallControl.
  * 
  * @param input This parameter not used.
  */
 void UpdateEvents(void *input)
 {
     IXML_Document *propSet = NULL;
-    expiration_event *event = ( expiration_event * ) input;
 
-    ithread_mutex_lock(&DevMutex);
-
-    EthernetLinkStatusEventing(propSet);
-    ExternalIPAddressEventing(propSet);
-    ConnectionStatusEventing(propSet);
-    WANIPv6FirewallStatusEventing(propSet);
+    // interface monitor checks these when WAN interface changes
+    if (!IfMonitorRunning())
+        WANInterfaceEventing(-1);
 
+    ActionLockWrite(ACTION_LOCK_CONNECTION);
     // this is not anything to do with eventing, but because this function is regularly executed this is here also.
     updateIdleTime();
+    ActionUnlock(ACTION_LOCK_CONNECTION);
 
-    ithread_mutex_unlock(&DevMutex);
+    // takes pinhole lock itself, config file is read without holding it
+    WANIPv6FirewallStatusEventing(propSet);
 
     ixmlDocument_free(propSet);
 
-    free_expiration_event(event);
-
     // create update event again
     createEventUpdateTimer();
 }
 
+/**
+ * Check if state variables depending on link and addresses of WAN interface
+ * have changed. These are EthernetLinkStatus, ExternalIPAddress and ConnectionStatus.
+ * Called by interface monitor when WAN interface changes, or by UpdateEvents
+ * if interface is not monitored.
+ *
+ * @param linkUp Link state reported by interface monitor, 1 if running, 0 if not,
+ *               -1 if it must be resolved here.
+ */
+void WANInterfaceEventing(int linkUp)
+{
+    IXML_Document *propSet = NULL;
+
+    ActionLockWrite(ACTION_LOCK_WAN);
+    EthernetLinkStatusEventing(propSet, linkUp);
+    ActionUnlock(ACTION_LOCK_WAN);
+
+    ActionLockWrite(ACTION_LOCK_CONNECTION);
+    ExternalIPAddressEventing(propSet);
+    ConnectionStatusEventing(propSet);
+    ActionUnlock(ACTION_LOCK_CONNECTION);
+}
+
 /**
  * Check if EthernetLinkStatus state variable has changed since last check.
  * Update value and send notification for control points if it has changed.
  * 
  * @param propSet IXML_Document used for notification.
+ * @param linkUp Link state of WAN interface, 1 if running, 0 if not, -1 if
+ *               it must be resolved with setEthernetLinkStatus.
  * @return 1 if EthernetLinkStatus has changed, 0 if not.
  */
-int EthernetLinkStatusEventing(IXML_Document *propSet)
+int EthernetLinkStatusEventing(IXML_Document *propSet, int linkUp)
 {
     char prevStatus[12];
 
     strcpy(prevStatus,EthernetLinkStatus);
-    setEthernetLinkStatus(EthernetLinkStatus, g_vars.extInterfaceName);
+    if (linkUp < 0)
+        setEthernetLinkStatus(EthernetLinkStatus, g_vars.extInterfaceName);
+    else
+        strcpy(EthernetLinkStatus, linkUp ? "Up" : "Down");
 
     // has status changed?
     if (strcmp(prevStatus,EthernetLinkStatus) != 0)
@@ -2360,24 +2553,34 @@ int ConnectionStatusEventing(IXML_Document *propSet)
  * Those variables are only changed in the /etc/upnpd.conf file
  * A web service should be developped for that
  * The only purpose of thisfunction is to test the GENA events
+ *
+ * Config file is read into a copy of g_vars, only the two firewall values
+ * are published, under pinhole lock. Other threads read g_vars without
+ * locking and it must not be rewritten under them.
  */
 int WANIPv6FirewallStatusEventing(IXML_Document *propSet)
 {
     int ipv6firewall_enabled = g_vars.ipv6firewallEnabled;
     int ipv6inbound_pinhole_allowed = g_vars.ipv6inboundPinholeAllowed;
+    globals vars = g_vars;
 
     char FirewallEnabled[2] = {'\0'};
     char InboundPinholeAllowed[2] = {'\0'};
 
-    if(parseConfigFile(&g_vars))
+    if(parseConfigFile(&vars))
     {
         perror("Error parsing config file");
         return 0;
     }
     // has status changed?
-    if (g_vars.ipv6firewallEnabled != ipv6firewall_enabled
-            || g_vars.ipv6inboundPinholeAllowed != ipv6inbound_pinhole_allowed)
+    if (vars.ipv6firewallEnabled != ipv6firewall_enabled
+            || vars.ipv6inboundPinholeAllowed != ipv6inbound_pinhole_allowed)
     {
+        ActionLockWrite(ACTION_LOCK_PINHOLE);
+        g_vars.ipv6firewallEnabled = vars.ipv6firewallEnabled;
+        g_vars.ipv6inboundPinholeAllowed = vars.ipv6inboundPinholeAllowed;
+        ActionUnlock(ACTION_LOCK_PINHOLE);
+
         if(g_vars.ipv6firewallEnabled != ipv6firewall_enabled)
         {
             snprintf(FirewallEnabled,2,"%i", g_vars.ipv6firewallEnabled);
@@ -2401,58 +2604,67 @@ int WANIPv6FirewallStatusEventing(IXML_Document *propSet)
 }
 
 /**
- * Expire portmapping when expiration time of portmapping has expired.
- * Delete portmapping and send notifications.
+ * Expire portmappings whose lease has ended. All portmappings due are deleted
+ * as one batch under one acquisition of the portmapping lock, their firewall
+ * rules are committed together and one event is sent for the whole batch.
  * 
- * @param input Expiration event struct.
+ * @param now Current time.
  */
-void ExpireMapping(void *input)
+static void ExpireMappings(time_t now)
 {
-    char num[5]; // Maximum number of port mapping entries 9999
+    char num[11];
     IXML_Document *propSet = NULL;
-    expiration_event *event = ( expiration_event * ) input;
+    struct timerNode *due, *node;
+    struct portMap *mapping;
     char tmp[11];
+    int expired = 0;
 
-    ithread_mutex_lock(&DevMutex);
+    ActionLockWrite(ACTION_LOCK_PORTMAP);
 
-    trace(2, "ExpireMapping: Proto:%s Port:%s\n",
-          event->mapping->m_PortMappingProtocol, event->mapping->m_ExternalPort);
+    if (TimerWheelCollect(&gMappingWheel, now, &due) == 0)
+    {
+        ActionUnlock(ACTION_LOCK_PORTMAP);
+        return;
+    }
 
-    //reset the event id before deleting the mapping so that pmlist_Delete
-    //will not call CancelMappingExpiration
-    if(event != NULL && event->mapping != NULL) {
-        event->mapping->expirationEventId = -1;
-        pmlist_Delete(event->mapping);
+    pmlist_BeginBatch();
+    while ((node = TimerWheelPop(&due)) != NULL)
+    {
+        mapping = TIMER_NODE_ENTRY(node, struct portMap, expirationTimer);
+        trace(2, "ExpireMapping: Proto:%s Port:%u",
+              pmlist_ProtocolToStr(mapping->m_PortMappingProtocol), mapping->m_ExternalPort);
+
+        pmlist_Delete(mapping);
+        expired++;
     }
+    if (!pmlist_EndBatch())
+        trace(1, "ExpireMappings: Failed to commit iptables changes");
 
+    // one event with final values for the whole batch
+    SystemUpdateID++;
     PortMappingNumberOfEntries = pmlist_Size();
-    sprintf(num,"%d",PortMappingNumberOfEntries);
+    snprintf(num,11,"%d",PortMappingNumberOfEntries);
     UpnpAddToPropertySet(&propSet, "PortMappingNumberOfEntries", num);
-    snprintf(tmp,11,"%ld",++SystemUpdateID);
+    snprintf(tmp,11,"%ld",SystemUpdateID);
     UpnpAddToPropertySet(&propSet,"SystemUpdateID", tmp);
-    NotifyExtForIPv4AndIPv6(event->DevUDN, event->ServiceID, propSet);
+    NotifyExtForIPv4AndIPv6(wanConnectionUDN, "urn:upnp-org:serviceId:WANIPConn1", propSet);
     ixmlDocument_free(propSet);
-    trace(3, "ExpireMapping: UpnpNotifyExt(deviceHandle,%s,%s,propSet)\n  PortMappingNumberOfEntries: %s",
-          event->DevUDN, event->ServiceID, num);
-
-    free_expiration_event(event);
+    trace(3, "ExpireMappings: %d portmappings expired. UpnpNotifyExt(deviceHandle,%s,%s,propSet)\n  PortMappingNumberOfEntries: %s",
+          expired, wanConnectionUDN, "urn:upnp-org:serviceId:WANIPConn1", num);
 
-    ithread_mutex_unlock(&DevMutex);
+    ActionUnlock(ACTION_LOCK_PORTMAP);
 }
 
 /**
- * Schedule expiration event for new portmapping into ExpirationTimer
+ * Schedule expiration of new portmapping. Earlier expiration of portmapping
+ * is replaced. Portmapping lock must be held for writing.
  * 
  * @param mapping portMap struct of new portmapping.
- * @param DevUDN Device UDN.
- * @param ServiceID ID of service.
- * @return eventID if success, 0 else.
+ * @return 1
  */
-int ScheduleMappingExpiration(struct portMap *mapping, char *DevUDN, char *ServiceID)
+int ScheduleMappingExpiration(struct portMap *mapping)
 {
-    int retVal = 0;
-    ThreadPoolJob job;
-    expiration_event *event;
+    struct portMapText text;
     time_t curtime = time(NULL);
 
     // set expiration time for portmapping
@@ -2491,60 +2703,27 @@ int ScheduleMappingExpiration(struct portMap *mapping, char *DevUDN, char *Servi
             mapping->expirationTime = curtime+diff;
         }
     }
-    event = ( expiration_event * ) malloc( sizeof( expiration_event ) );
-    if ( event == NULL )
-    {
-        return 0;
-    }
-
-    event->mapping = mapping;
-
-    if (strlen(DevUDN) < sizeof(event->DevUDN)) strcpy(event->DevUDN, DevUDN);
-    else strcpy(event->DevUDN, "");
-    if (strlen(ServiceID) < sizeof(event->ServiceID)) strcpy(event->ServiceID, ServiceID);
-    else strcpy(event->ServiceID, "");
-
-    TPJobInit( &job, ( start_routine ) ExpireMapping, event );
-    TPJobSetFreeFunction( &job, ( free_routine ) free_expiration_event );
-
-    if ( ( retVal = TimerThreadSchedule( &gExpirationTimerThread,
-                                         mapping->expirationTime,
-                                         ABS_SEC, &job, SHORT_TERM,
-                                         &( event->eventId ) ) )
-            != UPNP_E_SUCCESS )
-    {
-        free( event );
-        mapping->expirationEventId = -1;
-        return 0;
-    }
+    TimerWheelSchedule(&gMappingWheel, &mapping->expirationTimer, mapping->expirationTime);
 
-    mapping->expirationEventId = event->eventId;
+    pmlist_ToText(mapping, &text);
+    trace(3,"ScheduleMappingExpiration: Proto: %s ExtPort: %s Int: %s.%s at: %s",text.protocol, text.externalPort, text.internalClient, text.internalPort, ctime(&(mapping->expirationTime)));
 
-    trace(3,"ScheduleMappingExpiration: DevUDN: %s ServiceID: %s Proto: %s ExtPort: %s Int: %s.%s at: %s eventId: %d",event->DevUDN,event->ServiceID,mapping->m_PortMappingProtocol, mapping->m_ExternalPort, mapping->m_InternalClient, mapping->m_InternalPort, ctime(&(mapping->expirationTime)), event->eventId);
-
-    return event->eventId;
+    return 1;
 }
 
 /**
- * Cancel given expiration event.
+ * Cancel expiration of portmapping. Portmapping lock must be held for writing.
  * 
- * @param expirationEventId ID of mappingExpiration.
+ * @param mapping Portmapping whose expiration is cancelled.
  * @return 1
  */
-int CancelMappingExpiration(int expirationEventId)
+int CancelMappingExpiration(struct portMap *mapping)
 {
-    ThreadPoolJob job;
-    if (expirationEventId<0)
+    if (!TimerNodePending(&mapping->expirationTimer))
         return 1;
-    trace(3,"CancelMappingExpiration: eventId: %d",expirationEventId);
-    if (TimerThreadRemove(&gExpirationTimerThread,expirationEventId,&job)==0)
-    {
-        free_expiration_event((expiration_event *)job.arg);
-    }
-    else
-    {
-        trace(1,"  TimerThreadRemove failed!");
-    }
+    trace(3,"CancelMappingExpiration: Proto: %s ExtPort: %u",
+          pmlist_ProtocolToStr(mapping->m_PortMappingProtocol), mapping->m_ExternalPort);
+    TimerWheelCancel(&mapping->expirationTimer);
     return 1;
 }
 
@@ -2556,12 +2735,12 @@ void DeleteAllPortMappings(void)
     IXML_Document *propSet = NULL;
     char tmp[11];
 
-    ithread_mutex_lock(&DevMutex);
+    ActionLockWrite(ACTION_LOCK_PORTMAP);
 
     pmlist_FreeList();
 
     PortMappingNumberOfEntries = pmlist_Size();
-    sprintf(tmp,"%d",PortMappingNumberOfEntries);
+    snprintf(tmp,11,"%d",PortMappingNumberOfEntries);
     UpnpAddToPropertySet(&propSet, "PortMappingNumberOfEntries", tmp);
     snprintf(tmp,11,"%ld",++SystemUpdateID);
     UpnpAddToPropertySet(&propSet,"SystemUpdateID", tmp);
@@ -2570,7 +2749,27 @@ void DeleteAllPortMappings(void)
     trace(2, "DeleteAllPortMappings: UpnpNotifyExt(deviceHandle,%s,%s,propSet)\n  PortMappingNumberOfEntries: %s",
           wanConnectionUDN, "urn:upnp-org:serviceId:WANIPConn1", "0");
 
-    ithread_mutex_unlock(&DevMutex);
+    ActionUnlock(ACTION_LOCK_PORTMAP);
+}
+
+/**
+ * Event PortMappingNumberOfEntries and SystemUpdateID after portmappings were
+ * removed outside of actions, e.g. rolled back by firewall worker because
+ * their rules couldn't be added. Portmapping lock must be held for writing.
+ */
+void NotifyPortMappingsRemoved(void)
+{
+    IXML_Document *propSet = NULL;
+    char tmp[11];
+
+    PortMappingNumberOfEntries = pmlist_Size();
+    snprintf(tmp,11,"%d",PortMappingNumberOfEntries);
+    UpnpAddToPropertySet(&propSet, "PortMappingNumberOfEntries", tmp);
+    snprintf(tmp,11,"%ld",++SystemUpdateID);
+    UpnpAddToPropertySet(&propSet,"SystemUpdateID", tmp);
+    NotifyExtForIPv4AndIPv6(wanConnectionUDN, "urn:upnp-org:serviceId:WANIPConn1", propSet);
+    ixmlDocument_free(propSet);
+    trace(2, "NotifyPortMappingsRemoved: PortMappingNumberOfEntries: %d", PortMappingNumberOfEntries);
 }
 
 /**
@@ -2602,7 +2801,7 @@ int AddNewPortMapping(struct Upnp_Action_Request *ca_event, char* bool_enabled,
                       int is_update)
 {
     int result;
-    char num[5]; // Maximum number of port mapping entries 9999
+    char num[11];
     IXML_Document *propSet = NULL;
     struct portMap *new;
     char tmp[11];
@@ -2620,15 +2819,17 @@ int AddNewPortMapping(struct Upnp_Action_Request *ca_event, char* bool_enabled,
                   int_client, desc, isStatic);
 
     result = pmlist_PushBack(new);
+    if (result != 1)
+        pmlist_FreeNode(new);
 
     if (result==1)
     {
-        ScheduleMappingExpiration(new,ca_event->DevUDN,ca_event->ServiceID);
+        ScheduleMappingExpiration(new);
         PortMappingNumberOfEntries = pmlist_Size();
         // no enventing on PortMappingNumberOfEntries if updating
         if (!is_update)
         {
-            sprintf(num,"%d",PortMappingNumberOfEntries);
+            snprintf(num,11,"%d",PortMappingNumberOfEntries);
             trace(3, "PortMappingNumberOfEntries: %d", pmlist_Size());
             UpnpAddToPropertySet(&propSet, "PortMappingNumberOfEntries", num);
         }
@@ -2707,7 +2908,7 @@ int ConnectionTermination(struct Upnp_Action_Request *ca_event, long int disconn
         if (result == 0)
         {
             // create response SOAP message
-            ParseResult(ca_event, "");
+            CreateActionResponse(ca_event);
         }
         else
         {
@@ -44,7 +44,7 @@ char *wanUDN;
 char *wanConnectionUDN;
 char *lanUDN;
 long int startup_time;
-unsigned long connection_stats[STATS_LIMIT]; // this is used for defining if connection is in idling
+uint64_t connection_stats[STATS_LIMIT]; // this is used for defining if connection is in idling
 long int idle_time;
 
 // State Variables
@@ -77,6 +77,8 @@ void AcceptSubscriptionExtForIPv4andIPv6(const char *DevID, const char *ServID,
                                         IXML_Document *PropSet, Upnp_SID SubsId);
 void NotifyExtForIPv4AndIPv6(const char *DevID, const char *ServID,
                             IXML_Document *PropSet);
+int EventThreadInit(void);
+void EventThreadShutdown(void);
 int HandleSubscriptionRequest(struct Upnp_Subscription_Request *sr_event);
 int HandleGetVarRequest(struct Upnp_State_Var_Request *gv_event);
 int HandleActionRequest(struct Upnp_Action_Request *ca_event);
@@ -92,6 +94,10 @@ int GetIdleDisconnectTime(struct Upnp_Action_Request *ca_event);
 int GetWarnDisconnectDelay(struct Upnp_Action_Request *ca_event);
 int RequestConnection(struct Upnp_Action_Request *ca_event);
 int GetTotal(struct Upnp_Action_Request *ca_event, stats_t stat);
+int GetTotalBytesSent(struct Upnp_Action_Request *ca_event);
+int GetTotalBytesReceived(struct Upnp_Action_Request *ca_event);
+int GetTotalPacketsSent(struct Upnp_Action_Request *ca_event);
+int GetTotalPacketsReceived(struct Upnp_Action_Request *ca_event);
 int GetCommonLinkProperties(struct Upnp_Action_Request *ca_event);
 int InvalidAction(struct Upnp_Action_Request *ca_event);
 int GetStatusInfo(struct Upnp_Action_Request *ca_event);
@@ -117,9 +123,10 @@ int GetEthernetLinkStatus (struct Upnp_Action_Request *ca_event);
 
 int ExpirationTimerThreadInit(void);
 int ExpirationTimerThreadShutdown(void);
-int ScheduleMappingExpiration(struct portMap *mapping, char *DevUDN, char *ServiceID);
-int CancelMappingExpiration(int eventId);
+int ScheduleMappingExpiration(struct portMap *mapping);
+int CancelMappingExpiration(struct portMap *mapping);
 void DeleteAllPortMappings(void);
+void NotifyPortMappingsRemoved(void);
 int AddNewPortMapping(struct Upnp_Action_Request *ca_event, char* new_enabled, long int leaseDuration,
                      char* new_remote_host, char* new_external_port, char* new_internal_port,
                      char* new_protocol, char* new_internal_client, char* new_port_mapping_description,
@@ -128,7 +135,8 @@ int createAutoDisconnectTimer(void);
 void DisconnectWAN(void *input);
 int createEventUpdateTimer(void);
 void UpdateEvents(void *input);
-int EthernetLinkStatusEventing(IXML_Document *propSet);
+void WANInterfaceEventing(int linkUp);
+int EthernetLinkStatusEventing(IXML_Document *propSet, int linkUp);
 int ExternalIPAddressEventing(IXML_Document *propSet);
 int ConnectionStatusEventing(IXML_Document *propSet);
 int ConnectionTermination(struct Upnp_Action_Request *ca_event, long int disconnectDelay);
@@ -37,7 +37,6 @@
 #define BITRATE_LEN 32
 #define OPTION_LEN 64
 #define RESULT_LEN 4096
-#define RESULT_LEN_LONG 65536
 #define NUM_LEN 32
 
 #define SUB_MATCH 2
@@ -58,6 +57,8 @@ struct GLOBALS
     int debug;  // 1 - print debug messages to syslog
     // 0 - no debug messages
     char iptables[OPTION_LEN];  // The full name and path of the iptables executable, used in pmlist.c
+    char iptablesRestore[OPTION_LEN];  // The full name and path of the iptables-restore executable, used in iptrestore.c
+    char ip6tablesRestore[OPTION_LEN];  // The full name and path of the ip6tables-restore executable, used in iptrestore.c
     char upstreamBitrate[OPTION_LEN];  // The upstream bitrate reported by the daemon
     char downstreamBitrate[OPTION_LEN]; // The downstream bitrate reported by the daemon
     char forwardChainName[OPTION_LEN];  // The name of the iptables chain to put FORWARD rules in
@@ -90,6 +91,21 @@ struct GLOBALS
     // Event update thread checking interval
     int eventUpdateInterval;
 
+    // How AddAnyPortMapping picks external port when requested one is taken
+    int portAllocation;
+
+    // How many milliseconds actions wait for firewall rules of new portmapping
+    // to be committed, 0 - respond without waiting
+    int firewallCommitWait;
+
+    // Maximum size of NewPortListing of GetListOfPortmappings in bytes,
+    // longer list is cut short. 0 - unlimited
+    int portmapListMaxSize;
+
+    // Minimum interval in milliseconds between events of one service,
+    // changes in between are merged. 0 - events are sent at once
+    int eventMinInterval;
+
     // dhcp-client command
     char dhcpc[OPTION_LEN];
 
@@ -116,6 +132,10 @@ struct GLOBALS
     //define the ipv6 forward chain
     char ipv6forwardChain[OPTION_LEN];
 
+    //netfilter log group where pinhole rules send packets
+    //seen by CheckPinholeWorking
+    int ipv6nflogGroup;
+
     //enables IPv4
     //TODO: should be removed, only for testing purpose
     int ipv4Enabled;
@@ -153,6 +173,17 @@ extern globals g_vars;
 #define RESOLV_CONF_TMP "/tmp/resolv.conf.IGDv2"
 // How often check if update events should be sent
 #define DEFAULT_EVENT_UPDATE_INTERVAL 60
+// Values of port_allocation option
+#define PORT_ALLOCATION_SEQUENTIAL 0
+#define PORT_ALLOCATION_RANDOM 1
+#define PORT_ALLOCATION_NEAR 2
+// Size limits of GetListOfPortmappings result
+#define DEFAULT_PORTMAP_LIST_MAX_SIZE 1048576
+#define MINIMUM_PORTMAP_LIST_MAX_SIZE 4096
+// Minimum interval between events of one service in milliseconds
+#define DEFAULT_EVENT_MIN_INTERVAL 200
+// NFLOG group of pinhole rules, 0-65535
+#define DEFAULT_IPV6_NFLOG_GROUP 6464
 #define DHCPC_DEFAULT "udhcpc"
 #define NETWORK_CMD_DEFAULT "/etc/init.d/network"
 
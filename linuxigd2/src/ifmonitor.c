@@ -0,0 +1,277 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Monitor of link and addresses of WAN interface.
+ *
+ * Monitor subscribes link, IPv4 address and IPv6 address notifications of
+ * rtnetlink and its thread sleeps until kernel reports a change. When a change concerns
+ * the monitored interface, callback is called once for all notifications
+ * read together. While nothing changes, nothing is done.
+ *
+ * Link state is taken from the link notifications themselves, so it isn't
+ * read again from /proc for every change. It is asked from kernel only when
+ * monitoring starts and when notifications were lost.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include "globals.h"
+#include "util.h"
+#include "netlinkmonitor.h"
+#include "ifmonitor.h"
+
+static void ifmonitor_Received(char *buf, int len);
+static void ifmonitor_Lost(void);
+static void ifmonitor_Idle(void);
+
+static union
+{
+    struct nlmsghdr nh;
+    char buf[8192];
+} ifmonitor_Buf;
+
+static struct netlinkMonitor ifmonitor_Monitor =
+{
+    .name = "Interface monitor",
+    .buf = ifmonitor_Buf.buf,
+    .size = sizeof(ifmonitor_Buf),
+    .received = ifmonitor_Received,
+    .lost = ifmonitor_Lost,
+    .idle = ifmonitor_Idle,
+    .socket = -1,
+    .pipe = { -1, -1 }
+};
+
+static char ifmonitor_Name[IFNAMSIZ];
+static void (*ifmonitor_Changed)(int linkUp);
+static int ifmonitor_Pending;               // callback must be called, used by monitor thread
+static int ifmonitor_LinkUnknown;           // link state must be asked, used by monitor thread
+static int ifmonitor_Link = -1;             // 1 running, 0 not, -1 not known, read by other threads
+
+/**
+ * Check if link notification concerns monitored interface, and get link
+ * state it reports. Operational state is used when driver reports it,
+ * otherwise IFF_RUNNING flag. Deleted link is down.
+ *
+ * @param nh Netlink message of RTM_NEWLINK or RTM_DELLINK.
+ * @param link Link state is written here if notification matches, 1 if
+ *             link is running, 0 if not.
+ * @return 1 if it does, 0 if not.
+ */
+static int ifmonitor_LinkMatches(struct nlmsghdr *nh, int *link)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct rtattr *rta;
+    int len, matches = 0;
+    int running;
+
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifi)))
+        return 0;
+
+    running = (ifi->ifi_flags & IFF_RUNNING) != 0;
+
+    len = IFLA_PAYLOAD(nh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+    {
+        if (rta->rta_type == IFLA_IFNAME)
+            matches = strncmp(RTA_DATA(rta), ifmonitor_Name, IFNAMSIZ) == 0;
+        else if (rta->rta_type == IFLA_OPERSTATE && RTA_PAYLOAD(rta) >= 1 &&
+                 *(uint8_t *)RTA_DATA(rta) != IF_OPER_UNKNOWN)
+            running = *(uint8_t *)RTA_DATA(rta) == IF_OPER_UP;
+    }
+
+    if (matches)
+        *link = nh->nlmsg_type == RTM_NEWLINK && running;
+    return matches;
+}
+
+/**
+ * Check if address notification concerns monitored interface.
+ *
+ * @param nh Netlink message of RTM_NEWADDR or RTM_DELADDR.
+ * @return 1 if it does or if interface is already gone, 0 if not.
+ */
+static int ifmonitor_AddrMatches(struct nlmsghdr *nh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    char name[IFNAMSIZ];
+
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(*ifa)))
+        return 0;
+
+    // addresses are removed also when interface is deleted, check again to be sure
+    if (if_indextoname(ifa->ifa_index, name) == NULL)
+        return 1;
+    return strncmp(name, ifmonitor_Name, IFNAMSIZ) == 0;
+}
+
+/**
+ * Check notifications of one datagram. Link notifications are all parsed,
+ * so that link state of the last one is kept.
+ *
+ * @param buf Netlink messages.
+ * @param len Length of buf.
+ */
+static void ifmonitor_Received(char *buf, int len)
+{
+    struct nlmsghdr *nh;
+    int link;
+
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+    {
+        switch (nh->nlmsg_type)
+        {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            if (ifmonitor_LinkMatches(nh, &link))
+            {
+                __atomic_store_n(&ifmonitor_Link, link, __ATOMIC_RELAXED);
+                ifmonitor_LinkUnknown = 0;
+                ifmonitor_Pending = 1;
+            }
+            break;
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+            if (!ifmonitor_Pending && ifmonitor_AddrMatches(nh))
+                ifmonitor_Pending = 1;
+            break;
+        }
+    }
+}
+
+/**
+ * Notifications were lost, state must be checked.
+ */
+static void ifmonitor_Lost(void)
+{
+    ifmonitor_LinkUnknown = 1;
+    ifmonitor_Pending = 1;
+}
+
+/**
+ * Ask link state of monitored interface from kernel. Missing interface is
+ * down.
+ *
+ * @return 1 if link is running, 0 if not.
+ */
+static int ifmonitor_ReadLink(void)
+{
+    struct ifreq ifr;
+    int fd, running = 0;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return 0;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, ifmonitor_Name, IFNAMSIZ - 1);
+    if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0)
+        running = (ifr.ifr_flags & IFF_RUNNING) != 0;
+
+    close(fd);
+    return running;
+}
+
+/**
+ * Call callback once for all notifications read together.
+ */
+static void ifmonitor_Idle(void)
+{
+    if (ifmonitor_Pending)
+    {
+        if (ifmonitor_LinkUnknown)
+        {
+            ifmonitor_LinkUnknown = 0;
+            __atomic_store_n(&ifmonitor_Link, ifmonitor_ReadLink(), __ATOMIC_RELAXED);
+        }
+        ifmonitor_Pending = 0;
+        ifmonitor_Changed(__atomic_load_n(&ifmonitor_Link, __ATOMIC_RELAXED));
+    }
+}
+
+/**
+ * Start monitoring link and addresses of interface.
+ *
+ * @param ifname Name of interface.
+ * @param changed Called from monitor thread when link or addresses of
+ *                interface may have changed, and once when monitoring starts.
+ *                Gets 1 if link is running, 0 if not.
+ * @return 1 if started, 0 if failed.
+ */
+int IfMonitorStart(const char *ifname, void (*changed)(int linkUp))
+{
+    if (ifmonitor_Monitor.running)
+        return 1;
+
+    if (!NetlinkMonitorOpen(&ifmonitor_Monitor, NETLINK_ROUTE,
+                            RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR, 0))
+        return 0;
+
+    strncpy(ifmonitor_Name, ifname, IFNAMSIZ - 1);
+    ifmonitor_Name[IFNAMSIZ - 1] = '\0';
+    ifmonitor_Changed = changed;
+    // state may have changed before subscribing
+    ifmonitor_LinkUnknown = 1;
+    ifmonitor_Pending = 1;
+
+    return NetlinkMonitorStart(&ifmonitor_Monitor);
+}
+
+/**
+ * Stop monitoring. Waits until callback running in monitor thread returns,
+ * so this must not be called with locks which callback takes.
+ */
+void IfMonitorStop(void)
+{
+    NetlinkMonitorStop(&ifmonitor_Monitor);
+    __atomic_store_n(&ifmonitor_Link, -1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Check if interface is monitored. When it isn't, its state must be polled.
+ *
+ * @return 1 if monitor is running, 0 if not.
+ */
+int IfMonitorRunning(void)
+{
+    return NetlinkMonitorRunning(&ifmonitor_Monitor);
+}
+
+/**
+ * Get link state of monitored interface, as reported by last notification.
+ *
+ * @return 1 if link is running, 0 if not, -1 if interface isn't monitored
+ *         or its state isn't known yet.
+ */
+int IfMonitorLinkState(void)
+{
+    if (!IfMonitorRunning())
+        return -1;
+    return __atomic_load_n(&ifmonitor_Link, __ATOMIC_RELAXED);
+}
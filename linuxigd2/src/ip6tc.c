@@ -0,0 +1,705 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * IPv6 firewall rules of pinholes with libip6tc.
+ *
+ * Every pinhole has an ACCEPT rule in the IPv6 forward chain. For
+ * CheckPinholeWorking, NFLOG rules log packets of pinhole when they arrive,
+ * in raw PREROUTING, and when they are accepted, just before the ACCEPT
+ * rule; these are best effort. Rules are built and looked up in process,
+ * and changes of a transaction are committed with one call per table.
+ */
+
+#if HAVE_LIBIPTC
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <libiptc/libip6tc.h>
+#include <linux/netfilter_ipv6/ip6_tables.h>
+#include <linux/netfilter/xt_NFLOG.h>
+#include "globals.h"
+#include "util.h"
+#include "ip6tc.h"
+#include "xtctransaction.h"
+
+#define IP6TC_PINHOLE_TABLE "filter"
+#define IP6TC_LOG_TABLE "raw"
+#define IP6TC_LOG_CHAIN "PREROUTING"
+#define IP6TC_LOG_TARGET "NFLOG"
+#define IP6TC_INPUT_CHAIN "INPUT"
+
+// 5-tuple of pinhole as found in firewall rule
+struct ip6tc_tuple
+{
+    struct in6_addr internal_client;
+    struct in6_addr remote_host;
+    int remote_wildcard;
+    uint16_t internal_port;
+    uint16_t remote_port;
+    uint8_t protocol;
+};
+
+static const struct xtcOps ip6tc_ops =
+{
+    .name = "libip6tc",
+    .init = ip6tc_init,
+    .commit = ip6tc_commit,
+    .free = ip6tc_free,
+    .strerror = ip6tc_strerror,
+};
+
+// tables opened in current transaction, see xtctransaction.c
+static struct xtcTransaction ip6tc_transaction = { .ops = &ip6tc_ops };
+
+/**
+ * Start transaction. Until matching ip6tc_transaction_commit or
+ * ip6tc_transaction_abort is called, rules are changed only in local copies
+ * of tables. Transactions may be nested, only outermost one commits. If
+ * nested transaction is aborted, outermost one is aborted too.
+ */
+void ip6tc_transaction_begin(void)
+{
+    xtct_begin(&ip6tc_transaction);
+}
+
+/**
+ * End transaction. If this is outermost transaction, every changed table is
+ * committed into kernel with one call per table. If some nested transaction
+ * was aborted, nothing is committed.
+ *
+ * @return 1 if succesfull, 0 if some table failed to commit or nested
+ *         transaction was aborted.
+ */
+int ip6tc_transaction_commit(void)
+{
+    return xtct_commit(&ip6tc_transaction);
+}
+
+/**
+ * End transaction without committing anything. If transaction is nested,
+ * outermost transaction is marked failed and it aborts instead of commit.
+ */
+void ip6tc_transaction_abort(void)
+{
+    xtct_abort(&ip6tc_transaction);
+}
+
+/**
+ * Set interface name and mask of rule, as ip6tables does for name without '+'.
+ *
+ * @param name Interface name in rule.
+ * @param mask Interface mask in rule.
+ * @param ifname Interface name.
+ */
+static void ip6tc_set_iface(char *name, unsigned char *mask, const char *ifname)
+{
+    size_t len = strnlen(ifname, IFNAMSIZ - 1);
+
+    memcpy(name, ifname, len);
+    memset(mask, 0xff, len + 1);
+}
+
+/**
+ * Build firewall rule.
+ *
+ * @param iniface Interface packet was received from, NULL if any.
+ * @param outiface Interface packet is going to be sent to, NULL if any.
+ * @param tuple Addresses, protocol and ports of packet. Addresses which are
+ *              unspecified or wildcarded are not matched.
+ * @param match_sport Match remote port as source port. If 0, any source port
+ *                    is accepted, as in rules of INPUT chain.
+ * @param target Target of rule, ACCEPT or NFLOG.
+ * @param log_prefix Prefix of NFLOG rule, NULL for none.
+ * @return Rule allocated with malloc, NULL if protocol is not supported or
+ *         allocation failed.
+ */
+static struct ip6t_entry *ip6tc_build_entry(const char *iniface,
+                                            const char *outiface,
+                                            const struct ip6tc_tuple *tuple,
+                                            int match_sport,
+                                            const char *target,
+                                            const char *log_prefix)
+{
+    struct ip6t_entry *entry;
+    struct xt_entry_match *match;
+    struct xt_entry_target *entry_target;
+    size_t match_size, target_size;
+    uint16_t *spts, *dpts;
+
+    if (tuple->protocol == IPPROTO_TCP)
+        match_size = XT_ALIGN(sizeof(struct xt_entry_match)) + XT_ALIGN(sizeof(struct ip6t_tcp));
+    else if (tuple->protocol == IPPROTO_UDP)
+        match_size = XT_ALIGN(sizeof(struct xt_entry_match)) + XT_ALIGN(sizeof(struct ip6t_udp));
+    else
+    {
+        trace(1, "libip6tc error: Unsupported protocol: %d", tuple->protocol);
+        return NULL;
+    }
+
+    target_size = XT_ALIGN(sizeof(struct xt_entry_target));
+    if (strcmp(target, IP6TC_LABEL_ACCEPT) == 0)
+        target_size += XT_ALIGN(sizeof(int));
+    else if (strcmp(target, IP6TC_LOG_TARGET) == 0)
+        target_size += XT_ALIGN(sizeof(struct xt_nflog_info));
+
+    entry = calloc(1, sizeof(*entry) + match_size + target_size);
+    if (entry == NULL)
+        return NULL;
+
+    if (iniface)
+        ip6tc_set_iface(entry->ipv6.iniface, entry->ipv6.iniface_mask, iniface);
+    if (outiface)
+        ip6tc_set_iface(entry->ipv6.outiface, entry->ipv6.outiface_mask, outiface);
+
+    if (!tuple->remote_wildcard)
+    {
+        entry->ipv6.src = tuple->remote_host;
+        memset(&entry->ipv6.smsk, 0xff, sizeof(entry->ipv6.smsk));
+    }
+    if (!IN6_IS_ADDR_UNSPECIFIED(&tuple->internal_client))
+    {
+        entry->ipv6.dst = tuple->internal_client;
+        memset(&entry->ipv6.dmsk, 0xff, sizeof(entry->ipv6.dmsk));
+    }
+    entry->ipv6.proto = tuple->protocol;
+    entry->ipv6.flags |= IP6T_F_PROTO;
+
+    match = (struct xt_entry_match *)entry->elems;
+    match->u.match_size = match_size;
+    if (tuple->protocol == IPPROTO_TCP)
+    {
+        struct ip6t_tcp *tcpinfo = (struct ip6t_tcp *)match->data;
+
+        strncpy(match->u.user.name, "tcp", sizeof(match->u.user.name) - 1);
+        spts = tcpinfo->spts;
+        dpts = tcpinfo->dpts;
+    }
+    else
+    {
+        struct ip6t_udp *udpinfo = (struct ip6t_udp *)match->data;
+
+        strncpy(match->u.user.name, "udp", sizeof(match->u.user.name) - 1);
+        spts = udpinfo->spts;
+        dpts = udpinfo->dpts;
+    }
+    if (match_sport)
+        spts[0] = spts[1] = tuple->remote_port;
+    else
+        spts[1] = 0xffff;
+    dpts[0] = dpts[1] = tuple->internal_port;
+
+    entry_target = (struct xt_entry_target *)(entry->elems + match_size);
+    entry_target->u.target_size = target_size;
+    strncpy(entry_target->u.user.name, target, sizeof(entry_target->u.user.name) - 1);
+    if (strcmp(target, IP6TC_LOG_TARGET) == 0)
+    {
+        struct xt_nflog_info *info = (struct xt_nflog_info *)entry_target->data;
+
+        info->group = g_vars.ipv6nflogGroup;
+        if (log_prefix)
+            strncpy(info->prefix, log_prefix, sizeof(info->prefix) - 1);
+    }
+
+    entry->target_offset = sizeof(*entry) + match_size;
+    entry->next_offset = sizeof(*entry) + match_size + target_size;
+
+    return entry;
+}
+
+/**
+ * Check if rule read from kernel is same as rule built by ip6tc_build_entry.
+ * Addresses, interfaces, protocol and ports are compared.
+ *
+ * @param e Rule of chain.
+ * @param rule Rule to look for.
+ * @return 1 if rules match, 0 else.
+ */
+static int ip6tc_entry_matches(const struct ip6t_entry *e, const struct ip6t_entry *rule)
+{
+    const struct xt_entry_match *m, *rule_match;
+    const uint16_t *spts, *dpts, *rule_spts, *rule_dpts;
+
+    if (memcmp(&e->ipv6.src, &rule->ipv6.src, sizeof(struct in6_addr)) != 0 ||
+        memcmp(&e->ipv6.dst, &rule->ipv6.dst, sizeof(struct in6_addr)) != 0 ||
+        memcmp(&e->ipv6.smsk, &rule->ipv6.smsk, sizeof(struct in6_addr)) != 0 ||
+        memcmp(&e->ipv6.dmsk, &rule->ipv6.dmsk, sizeof(struct in6_addr)) != 0 ||
+        strncmp(e->ipv6.iniface, rule->ipv6.iniface, IFNAMSIZ) != 0 ||
+        strncmp(e->ipv6.outiface, rule->ipv6.outiface, IFNAMSIZ) != 0 ||
+        e->ipv6.proto != rule->ipv6.proto ||
+        e->ipv6.invflags != rule->ipv6.invflags)
+        return 0;
+
+    // the only match is the protocol match
+    if (e->target_offset != rule->target_offset)
+        return 0;
+    m = (const struct xt_entry_match *)e->elems;
+    rule_match = (const struct xt_entry_match *)rule->elems;
+    if (strcmp(m->u.user.name, rule_match->u.user.name) != 0)
+        return 0;
+
+    if (strcmp(m->u.user.name, "tcp") == 0)
+    {
+        const struct ip6t_tcp *tcpinfo = (const struct ip6t_tcp *)m->data;
+        const struct ip6t_tcp *rule_tcpinfo = (const struct ip6t_tcp *)rule_match->data;
+
+        if (tcpinfo->invflags != rule_tcpinfo->invflags || tcpinfo->flg_mask != rule_tcpinfo->flg_mask)
+            return 0;
+        spts = tcpinfo->spts;
+        dpts = tcpinfo->dpts;
+        rule_spts = rule_tcpinfo->spts;
+        rule_dpts = rule_tcpinfo->dpts;
+    }
+    else if (strcmp(m->u.user.name, "udp") == 0)
+    {
+        const struct ip6t_udp *udpinfo = (const struct ip6t_udp *)m->data;
+        const struct ip6t_udp *rule_udpinfo = (const struct ip6t_udp *)rule_match->data;
+
+        if (udpinfo->invflags != rule_udpinfo->invflags)
+            return 0;
+        spts = udpinfo->spts;
+        dpts = udpinfo->dpts;
+        rule_spts = rule_udpinfo->spts;
+        rule_dpts = rule_udpinfo->dpts;
+    }
+    else
+        return 0;
+
+    return spts[0] == rule_spts[0] && spts[1] == rule_spts[1] &&
+           dpts[0] == rule_dpts[0] && dpts[1] == rule_dpts[1];
+}
+
+/**
+ * Check if rule is ACCEPT rule of pinhole and get 5-tuple of it. Rule must
+ * be from external to internal interface and match exactly one destination
+ * address, one source address or any, and exactly one port of each.
+ *
+ * @param e Rule of IPv6 forward chain.
+ * @param tuple 5-tuple of pinhole.
+ * @return 1 if rule is pinhole rule, 0 else.
+ */
+static int ip6tc_entry_tuple(const struct ip6t_entry *e, struct ip6tc_tuple *tuple)
+{
+    static const struct in6_addr any = IN6ADDR_ANY_INIT;
+    struct in6_addr host_mask;
+    const struct xt_entry_match *m;
+    const uint16_t *spts, *dpts;
+
+    if (strncmp(e->ipv6.iniface, g_vars.extInterfaceName, IFNAMSIZ) != 0 ||
+        strncmp(e->ipv6.outiface, g_vars.intInterfaceName, IFNAMSIZ) != 0 ||
+        e->ipv6.invflags != 0 || e->target_offset <= sizeof(*e))
+        return 0;
+
+    memset(&host_mask, 0xff, sizeof(host_mask));
+    if (memcmp(&e->ipv6.dmsk, &host_mask, sizeof(host_mask)) != 0)
+        return 0;
+
+    memset(tuple, 0, sizeof(*tuple));
+    if (memcmp(&e->ipv6.smsk, &host_mask, sizeof(host_mask)) == 0)
+        tuple->remote_host = e->ipv6.src;
+    else if (memcmp(&e->ipv6.smsk, &any, sizeof(any)) == 0)
+        tuple->remote_wildcard = 1;
+    else
+        return 0;
+    tuple->internal_client = e->ipv6.dst;
+    tuple->protocol = e->ipv6.proto;
+
+    m = (const struct xt_entry_match *)e->elems;
+    if (tuple->protocol == IPPROTO_TCP && strcmp(m->u.user.name, "tcp") == 0)
+    {
+        const struct ip6t_tcp *tcpinfo = (const struct ip6t_tcp *)m->data;
+
+        if (tcpinfo->invflags != 0)
+            return 0;
+        spts = tcpinfo->spts;
+        dpts = tcpinfo->dpts;
+    }
+    else if (tuple->protocol == IPPROTO_UDP && strcmp(m->u.user.name, "udp") == 0)
+    {
+        const struct ip6t_udp *udpinfo = (const struct ip6t_udp *)m->data;
+
+        if (udpinfo->invflags != 0)
+            return 0;
+        spts = udpinfo->spts;
+        dpts = udpinfo->dpts;
+    }
+    else
+        return 0;
+
+    if (spts[0] != spts[1] || dpts[0] != dpts[1])
+        return 0;
+    tuple->remote_port = spts[0];
+    tuple->internal_port = dpts[0];
+
+    return 1;
+}
+
+/**
+ * Insert rule as first rule of chain.
+ *
+ * @param table Name of table.
+ * @param chain Name of chain.
+ * @param entry Rule to insert.
+ * @return 1 if succesfull, 0 else.
+ */
+static int ip6tc_insert_rule(const char *table, const char *chain, const struct ip6t_entry *entry)
+{
+    struct xtc_handle *handle;
+
+    handle = xtct_get_handle(&ip6tc_transaction, table);
+    if (!handle)
+        return 0;
+
+    if (!ip6tc_is_chain(chain, handle))
+    {
+        trace(1, "libip6tc error: Chain %s does not exist in table %s!", chain, table);
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+    if (!ip6tc_insert_entry(chain, entry, 0, handle))
+    {
+        trace(1, "libip6tc error: Can't add to %s, %s", chain, ip6tc_strerror(errno));
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+
+    return xtct_release_handle(&ip6tc_transaction, handle, 1);
+}
+
+/**
+ * Delete first rule of chain matching given rule and target.
+ *
+ * @param table Name of table.
+ * @param chain Name of chain.
+ * @param entry Rule to delete.
+ * @param target Target of rule.
+ * @return 1 if succesfull, 0 if rule was not found or deleting failed.
+ */
+static int ip6tc_delete_rule(const char *table, const char *chain, const struct ip6t_entry *entry, const char *target)
+{
+    struct xtc_handle *handle;
+    const struct ip6t_entry *e;
+    unsigned int i;
+
+    handle = xtct_get_handle(&ip6tc_transaction, table);
+    if (!handle)
+        return 0;
+
+    if (!ip6tc_is_chain(chain, handle))
+    {
+        trace(1, "libip6tc error: Chain %s does not exist in table %s!", chain, table);
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+
+    for (e = ip6tc_first_rule(chain, handle), i = 0; e; e = ip6tc_next_rule(e, handle), i++)
+    {
+        if (ip6tc_entry_matches(e, entry) && strcmp(ip6tc_get_target(e, handle), target) == 0)
+            break;
+    }
+    if (!e)
+    {
+        trace(2, "libip6tc: rule to delete not found in %s", chain);
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+    if (!ip6tc_delete_num_entry(chain, i, handle))
+    {
+        trace(1, "libip6tc error: Delete error in %s, %s", chain, ip6tc_strerror(errno));
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+
+    return xtct_release_handle(&ip6tc_transaction, handle, 1);
+}
+
+/**
+ * Fill 5-tuple of pinhole.
+ */
+static void ip6tc_set_tuple(struct ip6tc_tuple *tuple,
+                            const struct in6_addr *internal_client,
+                            const struct in6_addr *remote_host,
+                            uint16_t internal_port,
+                            uint16_t remote_port,
+                            uint8_t protocol)
+{
+    memset(tuple, 0, sizeof(*tuple));
+    tuple->internal_client = *internal_client;
+    if (remote_host)
+        tuple->remote_host = *remote_host;
+    else
+        tuple->remote_wildcard = 1;
+    tuple->internal_port = internal_port;
+    tuple->remote_port = remote_port;
+    tuple->protocol = protocol;
+}
+
+/*
+ * Rules of pinhole. ACCEPT rule is inserted first, and as each rule is
+ * inserted first in its chain, the log rule of accepted packets ends up
+ * before ACCEPT rule.
+ */
+#define IP6TC_PINHOLE_RULES 3
+#define IP6TC_RULE_ACCEPT 0
+#define IP6TC_RULE_ACCEPTED_LOG 1
+#define IP6TC_RULE_SEEN_LOG 2
+
+struct ip6tc_rule
+{
+    const char *table;
+    const char *chain;
+    const char *target;
+    struct ip6t_entry *entry;
+};
+
+/**
+ * Build firewall rules of pinhole.
+ *
+ * @param rules Rules of pinhole. Entries are allocated with malloc, entry
+ *              which could not be built is NULL.
+ * @param tuple 5-tuple of pinhole.
+ * @param seen_prefix Log prefix of packets arriving, NULL if not needed.
+ * @param accepted_prefix Log prefix of packets accepted, NULL if not needed.
+ * @return 1 if all rules were built, 0 else.
+ */
+static int ip6tc_pinhole_rules(struct ip6tc_rule rules[IP6TC_PINHOLE_RULES],
+                               const struct ip6tc_tuple *tuple,
+                               const char *seen_prefix,
+                               const char *accepted_prefix)
+{
+    int i, result = 1;
+
+    rules[IP6TC_RULE_ACCEPT].table = IP6TC_PINHOLE_TABLE;
+    rules[IP6TC_RULE_ACCEPT].chain = g_vars.ipv6forwardChain;
+    rules[IP6TC_RULE_ACCEPT].target = IP6TC_LABEL_ACCEPT;
+    rules[IP6TC_RULE_ACCEPT].entry = ip6tc_build_entry(g_vars.extInterfaceName, g_vars.intInterfaceName,
+                                                       tuple, 1, IP6TC_LABEL_ACCEPT, NULL);
+    rules[IP6TC_RULE_ACCEPTED_LOG].table = IP6TC_PINHOLE_TABLE;
+    rules[IP6TC_RULE_ACCEPTED_LOG].chain = g_vars.ipv6forwardChain;
+    rules[IP6TC_RULE_ACCEPTED_LOG].target = IP6TC_LOG_TARGET;
+    rules[IP6TC_RULE_ACCEPTED_LOG].entry = ip6tc_build_entry(g_vars.extInterfaceName, g_vars.intInterfaceName,
+                                                             tuple, 1, IP6TC_LOG_TARGET, accepted_prefix);
+    rules[IP6TC_RULE_SEEN_LOG].table = IP6TC_LOG_TABLE;
+    rules[IP6TC_RULE_SEEN_LOG].chain = IP6TC_LOG_CHAIN;
+    rules[IP6TC_RULE_SEEN_LOG].target = IP6TC_LOG_TARGET;
+    rules[IP6TC_RULE_SEEN_LOG].entry = ip6tc_build_entry(g_vars.extInterfaceName, NULL,
+                                                         tuple, 1, IP6TC_LOG_TARGET, seen_prefix);
+
+    for (i = 0; i < IP6TC_PINHOLE_RULES; i++)
+        result &= rules[i].entry != NULL;
+    return result;
+}
+
+/**
+ * Add log rules of pinhole: NFLOG rule logging arriving packets into raw
+ * PREROUTING, and NFLOG rule logging accepted packets just before ACCEPT
+ * rule. Tables are committed separately, so if the second one fails the
+ * first rule is deleted again.
+ *
+ * @param rules Rules of pinhole.
+ * @return 1 if both rules were added, 0 if none was.
+ */
+static int ip6tc_add_log_rules(const struct ip6tc_rule rules[IP6TC_PINHOLE_RULES])
+{
+    const struct ip6tc_rule *seen = &rules[IP6TC_RULE_SEEN_LOG];
+    const struct ip6tc_rule *accepted = &rules[IP6TC_RULE_ACCEPTED_LOG];
+
+    if (!seen->entry || !accepted->entry)
+        return 0;
+
+    if (!ip6tc_insert_rule(seen->table, seen->chain, seen->entry))
+        return 0;
+    if (!ip6tc_insert_rule(accepted->table, accepted->chain, accepted->entry))
+    {
+        ip6tc_delete_rule(seen->table, seen->chain, seen->entry, seen->target);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Add firewall rules of pinhole: ACCEPT rule into IPv6 forward chain, NFLOG
+ * rule logging accepted packets just before it, and NFLOG rule logging
+ * arriving packets into raw PREROUTING.
+ *
+ * ACCEPT rule is committed alone, so the pinhole is either open or not
+ * whatever happens to the other tables. Log rules are only needed by
+ * CheckPinholeWorking and are added afterwards on best effort, as kernel
+ * may lack NFLOG target or raw table. Must not be called inside transaction.
+ *
+ * @param internal_client The internal client address
+ * @param remote_host The remote host address, NULL if wildcarded
+ * @param internal_port The internal port
+ * @param remote_port The remote port
+ * @param protocol The protocol, IPPROTO_TCP or IPPROTO_UDP
+ * @param seen_prefix Log prefix of packets arriving to pinhole
+ * @param accepted_prefix Log prefix of packets accepted by pinhole
+ * @param logged Set to 1 if log rules were added too, 0 else.
+ * @return 1 if ACCEPT rule was added, 0 else.
+ */
+int ip6tc_add_pinhole(const struct in6_addr *internal_client,
+                      const struct in6_addr *remote_host,
+                      uint16_t internal_port,
+                      uint16_t remote_port,
+                      uint8_t protocol,
+                      const char *seen_prefix,
+                      const char *accepted_prefix,
+                      int *logged)
+{
+    struct ip6tc_tuple tuple;
+    struct ip6tc_rule rules[IP6TC_PINHOLE_RULES];
+    const struct ip6tc_rule *accept = &rules[IP6TC_RULE_ACCEPT];
+    int i, result = 0;
+
+    *logged = 0;
+    ip6tc_set_tuple(&tuple, internal_client, remote_host, internal_port, remote_port, protocol);
+    ip6tc_pinhole_rules(rules, &tuple, seen_prefix, accepted_prefix);
+
+    if (accept->entry)
+        result = ip6tc_insert_rule(accept->table, accept->chain, accept->entry);
+    if (result)
+    {
+        *logged = ip6tc_add_log_rules(rules);
+        if (!*logged)
+            trace(1, "libip6tc: Log rules of pinhole could not be added, its traffic is not checked");
+    }
+
+    for (i = 0; i < IP6TC_PINHOLE_RULES; i++)
+        free(rules[i].entry);
+
+    return result;
+}
+
+/**
+ * Delete firewall rules of pinhole added with ip6tc_add_pinhole.
+ *
+ * @param internal_client The internal client address
+ * @param remote_host The remote host address, NULL if wildcarded
+ * @param internal_port The internal port
+ * @param remote_port The remote port
+ * @param protocol The protocol, IPPROTO_TCP or IPPROTO_UDP
+ * @param logged Were log rules added with the pinhole.
+ * @return 1 if ACCEPT rule was deleted, 0 else.
+ */
+int ip6tc_delete_pinhole(const struct in6_addr *internal_client,
+                         const struct in6_addr *remote_host,
+                         uint16_t internal_port,
+                         uint16_t remote_port,
+                         uint8_t protocol,
+                         int logged)
+{
+    struct ip6tc_tuple tuple;
+    struct ip6tc_rule rules[IP6TC_PINHOLE_RULES];
+    int i, result = 0;
+
+    ip6tc_set_tuple(&tuple, internal_client, remote_host, internal_port, remote_port, protocol);
+    if (ip6tc_pinhole_rules(rules, &tuple, NULL, NULL))
+    {
+        // log rules may have been removed by someone else, only ACCEPT rule matters
+        ip6tc_transaction_begin();
+        result = ip6tc_delete_rule(rules[IP6TC_RULE_ACCEPT].table, rules[IP6TC_RULE_ACCEPT].chain,
+                                   rules[IP6TC_RULE_ACCEPT].entry, rules[IP6TC_RULE_ACCEPT].target);
+        for (i = 0; logged && i < IP6TC_PINHOLE_RULES; i++)
+        {
+            if (i != IP6TC_RULE_ACCEPT)
+                ip6tc_delete_rule(rules[i].table, rules[i].chain, rules[i].entry, rules[i].target);
+        }
+        if (!ip6tc_transaction_commit())
+            result = 0;
+    }
+
+    for (i = 0; i < IP6TC_PINHOLE_RULES; i++)
+        free(rules[i].entry);
+
+    return result;
+}
+
+/**
+ * Insert rule accepting packets to given port into INPUT chain.
+ *
+ * @param protocol The protocol, IPPROTO_TCP or IPPROTO_UDP
+ * @param port Destination port.
+ * @return 1 if succesfull, 0 else.
+ */
+int ip6tc_add_input_rule(uint8_t protocol, uint16_t port)
+{
+    struct ip6tc_tuple tuple;
+    struct ip6t_entry *accept;
+    int result = 0;
+
+    memset(&tuple, 0, sizeof(tuple));
+    tuple.remote_wildcard = 1;
+    tuple.internal_port = port;
+    tuple.protocol = protocol;
+
+    accept = ip6tc_build_entry(NULL, NULL, &tuple, 0, IP6TC_LABEL_ACCEPT, NULL);
+    if (accept)
+        result = ip6tc_insert_rule(IP6TC_PINHOLE_TABLE, IP6TC_INPUT_CHAIN, accept);
+    free(accept);
+
+    return result;
+}
+
+/**
+ * Read packet counters of all pinhole rules in IPv6 forward chain. Chain is
+ * read from kernel once, and counters come with the rules, so any number of
+ * pinholes costs one table read.
+ *
+ * @param callback Function called for every pinhole rule.
+ * @param arg Argument passed to callback.
+ * @return 1 if succesfull, 0 if chain could not be read.
+ */
+int ip6tc_read_pinhole_counters(ip6tc_counter_cb callback, void *arg)
+{
+    struct xtc_handle *handle;
+    const struct ip6t_entry *e;
+    struct ip6tc_tuple tuple;
+
+    handle = xtct_get_handle(&ip6tc_transaction, IP6TC_PINHOLE_TABLE);
+    if (!handle)
+        return 0;
+
+    if (!ip6tc_is_chain(g_vars.ipv6forwardChain, handle))
+    {
+        trace(1, "libip6tc error: Chain %s does not exist!", g_vars.ipv6forwardChain);
+        xtct_release_handle(&ip6tc_transaction, handle, 0);
+        return 0;
+    }
+
+    for (e = ip6tc_first_rule(g_vars.ipv6forwardChain, handle); e; e = ip6tc_next_rule(e, handle))
+    {
+        if (strcmp(ip6tc_get_target(e, handle), IP6TC_LABEL_ACCEPT) != 0 ||
+            !ip6tc_entry_tuple(e, &tuple))
+            continue;
+
+        callback(&tuple.internal_client, tuple.remote_wildcard ? NULL : &tuple.remote_host,
+                 tuple.internal_port, tuple.remote_port, tuple.protocol,
+                 e->counters.pcnt, arg);
+    }
+
+    xtct_release_handle(&ip6tc_transaction, handle, 0);
+
+    return 1;
+}
+#endif
@@ -0,0 +1,60 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _IP6TC_H_
+#define _IP6TC_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+int ip6tc_add_pinhole(const struct in6_addr *internal_client,
+                      const struct in6_addr *remote_host,
+                      uint16_t internal_port,
+                      uint16_t remote_port,
+                      uint8_t protocol,
+                      const char *seen_prefix,
+                      const char *accepted_prefix,
+                      int *logged);
+int ip6tc_delete_pinhole(const struct in6_addr *internal_client,
+                         const struct in6_addr *remote_host,
+                         uint16_t internal_port,
+                         uint16_t remote_port,
+                         uint8_t protocol,
+                         int logged);
+int ip6tc_add_input_rule(uint8_t protocol, uint16_t port);
+
+// called for every pinhole rule with packet counter of the rule
+typedef void (*ip6tc_counter_cb)(const struct in6_addr *internal_client,
+                                 const struct in6_addr *remote_host,
+                                 uint16_t internal_port,
+                                 uint16_t remote_port,
+                                 uint8_t protocol,
+                                 uint64_t packets,
+                                 void *arg);
+
+int ip6tc_read_pinhole_counters(ip6tc_counter_cb callback, void *arg);
+
+void ip6tc_transaction_begin(void);
+int ip6tc_transaction_commit(void);
+void ip6tc_transaction_abort(void);
+
+#endif // _IP6TC_H_
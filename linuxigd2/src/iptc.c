@@ -29,6 +29,7 @@
 #include "globals.h"
 #include "util.h"
 #include "iptc.h"
+#include "xtctransaction.h"
 
 static u_int16_t ipt_parse_port(const char *port);
 static void parse_ports(const char *portstring, u_int16_t *ports);
@@ -39,8 +40,54 @@ static struct ipt_natinfo *append_range(struct ipt_natinfo *info, const struct n
 
 static int matchcmp(const struct ipt_entry_match *match, const char *srcports, const char *destports);
 
+static const struct xtcOps iptc_ops =
+{
+    .name = "libiptc",
+    .init = iptc_init,
+    .commit = iptc_commit,
+    .free = iptc_free,
+    .strerror = iptc_strerror,
+};
+
+// tables opened in current transaction, see xtctransaction.c
+static struct xtcTransaction iptc_transaction = { .ops = &iptc_ops };
+
+/**
+ * Start transaction. Until matching iptc_transaction_commit or
+ * iptc_transaction_abort is called, rules are changed only in local copies
+ * of tables. Transactions may be nested, only outermost one commits. If
+ * nested transaction is aborted, outermost one is aborted too.
+ */
+void iptc_transaction_begin(void)
+{
+    xtct_begin(&iptc_transaction);
+}
+
+/**
+ * End transaction. If this is outermost transaction, every changed table is
+ * committed into kernel with one call per table. If some nested transaction
+ * was aborted, nothing is committed.
+ *
+ * @return 1 if succesfull, 0 if some table failed to commit or nested
+ *         transaction was aborted.
+ */
+int iptc_transaction_commit(void)
+{
+    return xtct_commit(&iptc_transaction);
+}
+
+/**
+ * End transaction without committing anything. If transaction is nested,
+ * outermost transaction is marked failed and it aborts instead of commit.
+ */
+void iptc_transaction_abort(void)
+{
+    xtct_abort(&iptc_transaction);
+}
+
 /**
  * Add new rule into iptables with libiptc.
+ * Inside transaction rule is committed at the end of transaction.
  *
  * @param table Name of table where rule is added.
  * @param chain Name of chain where rule is added.
@@ -106,7 +153,8 @@ int iptc_add_rule(const char *table,
     else
     {
         trace(1, "Unsupported protocol: %s", protocol);
-        return 0;
+        result = 0;
+        goto out;
     }
 
     if (strcmp(target, "") == 0
@@ -140,11 +188,11 @@ int iptc_add_rule(const char *table,
     if (entry_match)
         memcpy(chain_entry->elems, entry_match, match_size);
 
-    handle = iptc_init(table);
+    handle = xtct_get_handle(&iptc_transaction, table);
     if (!handle)
     {
-        trace(1, "libiptc error: Can't initialize table %s, %s", table, iptc_strerror(errno));
-        return 0;
+        result = 0;
+        goto out;
     }
 
     strncpy(labelit, chain, sizeof(ipt_chainlabel));
@@ -152,7 +200,8 @@ int iptc_add_rule(const char *table,
     if (!result)
     {
         trace(1, "libiptc error: Chain %s does not exist!", chain);
-        return 0;
+        xtct_release_handle(&iptc_transaction, handle, 0);
+        goto out;
     }
     if (append)
         result = iptc_append_entry(labelit, chain_entry, handle);
@@ -162,26 +211,24 @@ int iptc_add_rule(const char *table,
     if (!result)
     {
         trace(1, "libiptc error: Can't add, %s", iptc_strerror(errno));
-        return 0;
-    }
-    result = iptc_commit(handle);
-    if (!result)
-    {
-        trace(1, "libiptc error: Commit error, %s", iptc_strerror(errno));
-        return 0;
+        xtct_release_handle(&iptc_transaction, handle, 0);
+        goto out;
     }
-    else
+    result = xtct_release_handle(&iptc_transaction, handle, 1);
+    if (result)
         trace(3, "added new rule to block successfully");
 
+out:
     free(entry_match);
     free(entry_target);
     free(chain_entry);
 
-    return 1;
+    return result ? 1 : 0;
 }
 
 /**
  * Delete rule from iptables with libiptc.
+ * Inside transaction deletion is committed at the end of transaction.
  *
  * @param table Name of table.
  * @param chain Name of chain.
@@ -217,18 +264,16 @@ int iptc_delete_rule(const char *table,
     if (src) s_src = inet_addr(src);
     if (dest) s_dest = inet_addr(dest);
 
-    handle = iptc_init(table);
+    handle = xtct_get_handle(&iptc_transaction, table);
     if (!handle)
-    {
-        trace(1, "libiptc error: Can't initialize table %s, %s", table, iptc_strerror(errno));
         return 0;
-    }
 
     strncpy(labelit, chain, sizeof(ipt_chainlabel));
     result = iptc_is_chain(chain, handle);
     if (!result)
     {
         trace(1, "libiptc error: Chain %s does not exist!", chain);
+        xtct_release_handle(&iptc_transaction, handle, 0);
         return 0;
     }
 
@@ -267,22 +312,22 @@ int iptc_delete_rule(const char *table,
 
         break;
     }
-    if (!e) return 0;
-    result = iptc_delete_num_entry(chain, i, handle);
-    if (!result)
+    if (!e)
     {
-        trace(1, "libiptc error: Delete error, %s", iptc_strerror(errno));
+        xtct_release_handle(&iptc_transaction, handle, 0);
         return 0;
     }
-    result = iptc_commit(handle);
+    result = iptc_delete_num_entry(chain, i, handle);
     if (!result)
     {
-        trace(1, "libiptc error: Commit error, %s", iptc_strerror(errno));
+        trace(1, "libiptc error: Delete error, %s", iptc_strerror(errno));
+        xtct_release_handle(&iptc_transaction, handle, 0);
         return 0;
     }
-    else
-        trace(3, "deleted rule from block successfully");
+    if (!xtct_release_handle(&iptc_transaction, handle, 1))
+        return 0;
 
+    trace(3, "deleted rule from block successfully");
     return 1;
 }
 
@@ -121,4 +121,8 @@ int iptc_delete_rule(const char *table,
                       const char *target,
                       const char *dnat_to);
 
+void iptc_transaction_begin(void);
+int iptc_transaction_commit(void);
+void iptc_transaction_abort(void);
+
 #endif // _IPTC_H_
@@ -0,0 +1,565 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * iptables backend used when daemon is built without libiptc.
+ *
+ * Rules are given in iptables-restore syntax ("-A chain ...") and collected
+ * per table. When outermost transaction is committed, all changed tables are
+ * fed to one "iptables-restore --noflush" child, which applies rules of each
+ * table and commits the table at its COMMIT line. A rule outside transaction
+ * is a transaction of its own. IPv6 rules of pinholes are collected in the
+ * same way and fed to one "ip6tables-restore --noflush" child.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include "globals.h"
+#include "util.h"
+#include "iptrestore.h"
+
+#define IPTRESTORE_MAX_TABLES 6
+#define IPTRESTORE_TABLE_LEN 32
+
+/*
+ * Tables changed in current transaction. rules contains "*table" line
+ * followed by rules of transaction, one per line.
+ */
+static struct
+{
+    int ipv6;       // table is applied with ip6tables-restore
+    char name[IPTRESTORE_TABLE_LEN];
+    char *rules;
+    size_t length;
+    size_t size;
+    int count;      // number of rules
+} iptrestore_tables[IPTRESTORE_MAX_TABLES];
+
+static int iptrestore_transaction_depth = 0;
+static int iptrestore_transaction_failed = 0;  // nested transaction was aborted
+
+/**
+ * Append data into rules of table, growing buffer if needed.
+ *
+ * @param t Index of table in iptrestore_tables.
+ * @param data Data to append.
+ * @param length Length of data.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int iptrestore_append(int t, const char *data, size_t length)
+{
+    size_t size = iptrestore_tables[t].size;
+    char *rules;
+
+    if (iptrestore_tables[t].length + length > size)
+    {
+        if (size == 0)
+            size = 1024;
+        while (iptrestore_tables[t].length + length > size)
+            size *= 2;
+
+        rules = realloc(iptrestore_tables[t].rules, size);
+        if (rules == NULL)
+        {
+            trace(1, "iptables-restore: Out of memory");
+            return 0;
+        }
+        iptrestore_tables[t].rules = rules;
+        iptrestore_tables[t].size = size;
+    }
+
+    memcpy(iptrestore_tables[t].rules + iptrestore_tables[t].length, data, length);
+    iptrestore_tables[t].length += length;
+    return 1;
+}
+
+/**
+ * Get index of table in current transaction, adding table if it is not yet
+ * part of transaction.
+ *
+ * @param ipv6 Is table IPv6 table.
+ * @param table Name of table.
+ * @return Index of table in iptrestore_tables, -1 if error.
+ */
+static int iptrestore_get_table(int ipv6, const char *table)
+{
+    int i, free_slot = -1;
+
+    if (strlen(table) >= IPTRESTORE_TABLE_LEN)
+        return -1;
+
+    for (i = 0; i < IPTRESTORE_MAX_TABLES; i++)
+    {
+        if (iptrestore_tables[i].length == 0)
+        {
+            if (free_slot < 0)
+                free_slot = i;
+        }
+        else if (iptrestore_tables[i].ipv6 == ipv6 && strcmp(iptrestore_tables[i].name, table) == 0)
+            return i;
+    }
+
+    if (free_slot < 0)
+    {
+        trace(1, "iptables-restore: Too many tables in transaction");
+        return -1;
+    }
+
+    strcpy(iptrestore_tables[free_slot].name, table);
+    iptrestore_tables[free_slot].ipv6 = ipv6;
+    iptrestore_tables[free_slot].count = 0;
+    if (!iptrestore_append(free_slot, "*", 1) ||
+        !iptrestore_append(free_slot, table, strlen(table)) ||
+        !iptrestore_append(free_slot, "\n", 1))
+    {
+        iptrestore_tables[free_slot].length = 0;
+        return -1;
+    }
+
+    return free_slot;
+}
+
+/**
+ * Forget rules of all tables in transaction.
+ */
+static void iptrestore_clear(void)
+{
+    int i;
+
+    for (i = 0; i < IPTRESTORE_MAX_TABLES; i++)
+    {
+        free(iptrestore_tables[i].rules);
+        iptrestore_tables[i].rules = NULL;
+        iptrestore_tables[i].length = 0;
+        iptrestore_tables[i].size = 0;
+        iptrestore_tables[i].count = 0;
+    }
+}
+
+/**
+ * Read error output of iptables-restore, logging it and picking number of
+ * the input line which failed.
+ *
+ * @param fd Read end of stderr pipe of child.
+ * @return Number of failed line, 0 if not reported.
+ */
+static unsigned int iptrestore_read_errors(int fd)
+{
+    char buf[1024], *line, *next, *at;
+    size_t length = 0;
+    ssize_t got;
+    unsigned int failed_line = 0, number;
+
+    // failed line is reported first, rest of long output can be dropped
+    while (length < sizeof(buf) - 1)
+    {
+        got = read(fd, buf + length, sizeof(buf) - 1 - length);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        length += got;
+    }
+    buf[length] = '\0';
+
+    for (line = buf; *line; line = next)
+    {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+
+        trace(1, "iptables-restore: %s", line);
+        if (failed_line == 0 &&
+            (((at = strstr(line, "line ")) && sscanf(at, "line %u failed", &number) == 1) ||
+             ((at = strstr(line, "line: ")) && sscanf(at, "line: %u", &number) == 1)))
+            failed_line = number;
+    }
+
+    return failed_line;
+}
+
+/**
+ * Run iptables-restore or ip6tables-restore --noflush with given input.
+ *
+ * @param ipv6 Run ip6tables-restore instead of iptables-restore.
+ * @param input Input in iptables-restore format, each table ending with
+ *              COMMIT, in one or more parts.
+ * @param count Number of parts in input.
+ * @param failed_line Number of input line iptables-restore reported failed,
+ *                    0 if it didn't report any. May be NULL.
+ * @return 1 if iptables-restore succeeded, 0 else.
+ */
+static int iptrestore_run(int ipv6, const struct iovec *input, int count, unsigned int *failed_line)
+{
+    const char *restore = ipv6 ? g_vars.ip6tablesRestore : g_vars.iptablesRestore;
+    int fds[2], errfds[2];
+    int status, result = 1, write_errno = 0, i;
+    unsigned int error_line;
+    const char *data;
+    size_t length;
+    ssize_t written;
+    pid_t pid;
+    sigset_t sigpipe, oldmask;
+    struct timespec no_wait = {0, 0};
+
+    if (failed_line)
+        *failed_line = 0;
+
+    if (pipe(fds) < 0)
+    {
+        trace(1, "iptables-restore: Can't create pipe, %s", strerror(errno));
+        return 0;
+    }
+    if (pipe(errfds) < 0)
+    {
+        trace(1, "iptables-restore: Can't create pipe, %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        return 0;
+    }
+
+    pid = fork();
+    if (pid < 0)
+    {
+        trace(1, "iptables-restore: Can't fork, %s", strerror(errno));
+        close(fds[0]);
+        close(fds[1]);
+        close(errfds[0]);
+        close(errfds[1]);
+        return 0;
+    }
+    if (pid == 0)
+    {
+        dup2(fds[0], STDIN_FILENO);
+        dup2(errfds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        close(errfds[0]);
+        close(errfds[1]);
+        execl(restore, restore, "--noflush", (char *)NULL);
+        _exit(127);
+    }
+    close(fds[0]);
+    close(errfds[1]);
+
+    // iptables-restore exits on first failing rule without reading rest of
+    // input, don't let SIGPIPE kill the daemon in that case
+    sigemptyset(&sigpipe);
+    sigaddset(&sigpipe, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe, &oldmask);
+
+    for (i = 0; i < count && !write_errno; i++)
+    {
+        data = input[i].iov_base;
+        length = input[i].iov_len;
+        while (length > 0)
+        {
+            written = write(fds[1], data, length);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                write_errno = errno;
+                result = 0;
+                break;
+            }
+            data += written;
+            length -= written;
+        }
+    }
+    close(fds[1]);
+
+    if (write_errno == EPIPE)
+        sigtimedwait(&sigpipe, NULL, &no_wait);
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+    // error output is short, child can't block on it before reading input
+    error_line = iptrestore_read_errors(errfds[0]);
+    close(errfds[0]);
+
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+        {
+            trace(1, "iptables-restore: waitpid failed, %s", strerror(errno));
+            return 0;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        result = 0;
+        if (failed_line)
+            *failed_line = error_line;
+    }
+    else if (write_errno)
+        trace(1, "iptables-restore: Write failed, %s", strerror(write_errno));
+
+    return result;
+}
+
+/**
+ * Apply rules of table one by one. Used when the whole table failed, so that
+ * one rule which can't be applied (e.g. deleting rule that doesn't exist
+ * anymore) doesn't prevent the others.
+ *
+ * @param t Index of table in iptrestore_tables.
+ * @return 1 if every rule succeeded, 0 else.
+ */
+static int iptrestore_replay(int t)
+{
+    char input[IPTRESTORE_TABLE_LEN + IPTRESTORE_RULE_LEN + 16];
+    struct iovec part;
+    const char *rule, *end;
+    int result = 1, length;
+
+    // skip "*table" line, rules end with newline
+    rule = memchr(iptrestore_tables[t].rules, '\n', iptrestore_tables[t].length) + 1;
+    while (rule < iptrestore_tables[t].rules + iptrestore_tables[t].length &&
+           strncmp(rule, "COMMIT\n", 7) != 0)
+    {
+        end = strchr(rule, '\n');
+        length = snprintf(input, sizeof(input), "*%s\n%.*s\nCOMMIT\n",
+                          iptrestore_tables[t].name, (int)(end - rule), rule);
+        part.iov_base = input;
+        part.iov_len = length;
+        if (!iptrestore_run(iptrestore_tables[t].ipv6, &part, 1, NULL))
+        {
+            trace(1, "iptables-restore: Rule failed: -t %s %.*s",
+                  iptrestore_tables[t].name, (int)(end - rule), rule);
+            result = 0;
+        }
+        rule = end + 1;
+    }
+
+    return result;
+}
+
+/**
+ * Add rule into table of transaction. Outside of transaction rule is applied
+ * immediately.
+ *
+ * @param ipv6 Is table IPv6 table.
+ * @param table Name of table.
+ * @param rule Rule in iptables-restore format.
+ * @return 1 if succesfull, 0 else.
+ */
+static int iptrestore_add(int ipv6, const char *table, const char *rule)
+{
+    size_t length = strlen(rule);
+    int t;
+
+    // rule must stay on one line of iptables-restore input
+    if (length >= IPTRESTORE_RULE_LEN || strpbrk(rule, "\r\n") != NULL)
+    {
+        trace(1, "iptables-restore: Invalid rule: %s", rule);
+        return 0;
+    }
+
+    trace(3, "%s -t %s %s", ipv6 ? "ip6tables-restore" : "iptables-restore", table, rule);
+
+    iptrestore_transaction_begin();
+    t = iptrestore_get_table(ipv6, table);
+    if (t < 0 || !iptrestore_append(t, rule, length) || !iptrestore_append(t, "\n", 1))
+    {
+        iptrestore_transaction_abort();
+        return 0;
+    }
+    iptrestore_tables[t].count++;
+
+    return iptrestore_transaction_commit();
+}
+
+/**
+ * Add rule into transaction. Outside of transaction rule is applied
+ * immediately.
+ *
+ * @param table Name of table (filter or nat).
+ * @param rule Rule in iptables-restore format, e.g. "-A FORWARD -p tcp -j ACCEPT".
+ * @return 1 if succesfull, 0 else.
+ */
+int iptrestore_rule(const char *table, const char *rule)
+{
+    return iptrestore_add(0, table, rule);
+}
+
+/**
+ * Add IPv6 rule into transaction. Outside of transaction rule is applied
+ * immediately. IPv6 rules of transaction are applied with one
+ * ip6tables-restore call.
+ *
+ * @param table Name of table (filter or raw).
+ * @param rule Rule in ip6tables-restore format, e.g. "-I FORWARD -p tcp -j ACCEPT".
+ * @return 1 if succesfull, 0 else.
+ */
+int iptrestore_rule6(const char *table, const char *rule)
+{
+    return iptrestore_add(1, table, rule);
+}
+
+/**
+ * Start transaction. Until matching iptrestore_transaction_commit or
+ * iptrestore_transaction_abort is called, iptrestore_rule only collects
+ * rules. Transactions may be nested, only outermost one commits. If nested
+ * transaction is aborted, outermost one is aborted too.
+ */
+void iptrestore_transaction_begin(void)
+{
+    iptrestore_transaction_depth++;
+}
+
+/**
+ * Apply rules of one table which weren't committed by combined run. If that
+ * fails, rules of the table are retried one by one.
+ *
+ * @param t Index of table in iptrestore_tables.
+ * @return 1 if succesfull, 0 if some rule failed.
+ */
+static int iptrestore_commit_table(int t)
+{
+    struct iovec part;
+
+    part.iov_base = iptrestore_tables[t].rules;
+    part.iov_len = iptrestore_tables[t].length;
+    if (iptrestore_run(iptrestore_tables[t].ipv6, &part, 1, NULL))
+    {
+        trace(3, "committed table %s, %d rules", iptrestore_tables[t].name, iptrestore_tables[t].count);
+        return 1;
+    }
+    if (iptrestore_tables[t].count == 1 || !iptrestore_replay(t))
+    {
+        trace(1, "iptables-restore: Commit error in table %s", iptrestore_tables[t].name);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Apply changed tables of one family with one iptables-restore or
+ * ip6tables-restore call. Tables are committed at their COMMIT lines, so if
+ * the call fails, tables before the failed line are in place and the rest
+ * are retried table by table, and rules of a failing table one by one.
+ *
+ * @param ipv6 Apply IPv6 tables instead of IPv4 tables.
+ * @return 1 if succesfull, 0 if some rule failed.
+ */
+static int iptrestore_commit_tables(int ipv6)
+{
+    struct iovec parts[IPTRESTORE_MAX_TABLES];
+    int tables[IPTRESTORE_MAX_TABLES];
+    unsigned int failed_line = 0, last_line = 0;
+    int i, count = 0, result = 1;
+
+    for (i = 0; i < IPTRESTORE_MAX_TABLES; i++)
+    {
+        if (iptrestore_tables[i].count == 0 || iptrestore_tables[i].ipv6 != ipv6)
+            continue;
+
+        if (!iptrestore_append(i, "COMMIT\n", 7))
+        {
+            result = 0;
+            continue;
+        }
+        parts[count].iov_base = iptrestore_tables[i].rules;
+        parts[count].iov_len = iptrestore_tables[i].length;
+        tables[count++] = i;
+    }
+
+    if (count == 0)
+        return result;
+
+    if (iptrestore_run(ipv6, parts, count, &failed_line))
+    {
+        for (i = 0; i < count; i++)
+            trace(3, "committed table %s, %d rules", iptrestore_tables[tables[i]].name, iptrestore_tables[tables[i]].count);
+    }
+    else
+    {
+        for (i = 0; i < count; i++)
+        {
+            // "*table" line, rules and COMMIT line
+            last_line += iptrestore_tables[tables[i]].count + 2;
+            if (failed_line > last_line)
+                trace(3, "committed table %s, %d rules", iptrestore_tables[tables[i]].name, iptrestore_tables[tables[i]].count);
+            else if (!iptrestore_commit_table(tables[i]))
+                result = 0;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * End transaction. If this is outermost transaction, rules of every changed
+ * IPv4 table are applied with one iptables-restore call, and rules of every
+ * changed IPv6 table with one ip6tables-restore call.
+ *
+ * @return 1 if succesfull, 0 if some rule failed.
+ */
+int iptrestore_transaction_commit(void)
+{
+    int result;
+
+    if (iptrestore_transaction_depth == 0 || --iptrestore_transaction_depth > 0)
+        return 1;
+
+    if (iptrestore_transaction_failed)
+    {
+        trace(1, "iptables-restore: Nested transaction was aborted, aborting whole transaction");
+        iptrestore_transaction_failed = 0;
+        iptrestore_clear();
+        return 0;
+    }
+
+    result = iptrestore_commit_tables(0);
+    result &= iptrestore_commit_tables(1);
+    iptrestore_clear();
+
+    return result;
+}
+
+/**
+ * End transaction without applying anything. If transaction is nested,
+ * outermost transaction is marked failed and it aborts instead of commit.
+ */
+void iptrestore_transaction_abort(void)
+{
+    if (iptrestore_transaction_depth == 0)
+        return;
+    if (--iptrestore_transaction_depth > 0)
+    {
+        iptrestore_transaction_failed = 1;
+        return;
+    }
+
+    iptrestore_transaction_failed = 0;
+    iptrestore_clear();
+}
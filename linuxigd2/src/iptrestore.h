@@ -0,0 +1,36 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _IPTRESTORE_H_
+#define _IPTRESTORE_H_
+
+// maximum length of one rule given to iptrestore_rule
+#define IPTRESTORE_RULE_LEN 512
+
+int iptrestore_rule(const char *table, const char *rule);
+int iptrestore_rule6(const char *table, const char *rule);
+
+void iptrestore_transaction_begin(void);
+int iptrestore_transaction_commit(void);
+void iptrestore_transaction_abort(void);
+
+#endif // _IPTRESTORE_H_
@@ -28,7 +28,6 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <regex.h>
 #include <stdarg.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -36,6 +35,7 @@
 #include "lanhostconfig.h"
 #include "globals.h"
 #include "util.h"
+#include "validate.h"
 
 /**
  * Settings for lanhostconfig-module.
@@ -229,9 +229,11 @@ int SetDHCPServerConfigurable( struct Upnp_Action_Request *ca_event )
 {
     char *configurable;
     int config;
+    struct soapArg args[] = {
+        { "NewDHCPServerConfigurable", &configurable, 0 }
+    };
 
-    if ( ( configurable = GetFirstDocumentItem( ca_event->ActionRequest, "NewDHCPServerConfigurable" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         config = resolveBoolean( configurable );
 
@@ -246,14 +248,12 @@ int SetDHCPServerConfigurable( struct Upnp_Action_Request *ca_event )
         else
         {
             lanHostConfig.DHCPServerConfigurable = config;
-            ParseResult( ca_event, "" );
+            CreateActionResponse( ca_event );
         }
     }
     else
         InvalidArgs( ca_event );
 
-    free( configurable );
-
     return ca_event->ErrCode;
 }
 
@@ -267,14 +267,7 @@ int SetDHCPServerConfigurable( struct Upnp_Action_Request *ca_event )
  */
 int GetDHCPServerConfigurable( struct Upnp_Action_Request *ca_event )
 {
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetDHCPServerConfigurable invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
-    ParseResult( ca_event, "<NewDHCPServerConfigurable>%d</NewDHCPServerConfigurable>\n", ( lanHostConfig.DHCPServerConfigurable ? 1 : 0 ) );
+    AddActionResponseInt( ca_event, "NewDHCPServerConfigurable", ( lanHostConfig.DHCPServerConfigurable ? 1 : 0 ) );
 
     return ca_event->ErrCode;
 }
@@ -294,9 +287,11 @@ int SetDHCPRelay( struct Upnp_Action_Request *ca_event )
 {
     char *dhcrelay;
     int b_dhcrelay;
+    struct soapArg args[] = {
+        { "NewDHCPRelay", &dhcrelay, 0 }
+    };
 
-    if ( ( dhcrelay = GetFirstDocumentItem( ca_event->ActionRequest, "NewDHCPRelay" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) ) 
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -323,9 +318,7 @@ int SetDHCPRelay( struct Upnp_Action_Request *ca_event )
         InvalidArgs( ca_event );
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
-
-    free( dhcrelay );
+        CreateActionResponse( ca_event );
 
     return ca_event->ErrCode;
 }
@@ -340,14 +333,7 @@ int SetDHCPRelay( struct Upnp_Action_Request *ca_event )
  */
 int GetDHCPRelay( struct Upnp_Action_Request *ca_event )
 {
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetDHCPRelay invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
-    ParseResult( ca_event, "<NewDHCPRelay>%d</NewDHCPRelay>\n", ( lanHostConfig.dhcrelay ? 1 : 0 ) );
+    AddActionResponseInt( ca_event, "NewDHCPRelay", ( lanHostConfig.dhcrelay ? 1 : 0 ) );
 
     return ca_event->ErrCode;
 }
@@ -367,24 +353,22 @@ int SetSubnetMask( struct Upnp_Action_Request *ca_event )
     char *subnet_mask;
     char command[INET6_ADDRSTRLEN];
     char *args[] = { g_vars.uciCmd, "set", NULL, NULL };
-    regex_t reg_ip;
+    struct soapArg soap_args[] = {
+        { "NewSubnetMask", &subnet_mask, 0 }
+    };
 
-    if ( ( subnet_mask = GetFirstDocumentItem( ca_event->ActionRequest, "NewSubnetMask" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, soap_args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
 
         // sanitize input
-        regcomp(&reg_ip, REGEX_IP_LASTBYTE, REG_EXTENDED);
-        if( regexec( &reg_ip, subnet_mask, 0, 0, 0 ) != 0 )
+        if( !ValidateIPv4Address( subnet_mask, NULL, NULL ) )
         {
             trace( 1, "SetDomainName: subnet mask contains invalid characters: '%s'.", subnet_mask );
             InvalidArgs( ca_event );
-            regfree( &reg_ip );
             return ca_event->ErrCode;
         }
-        regfree( &reg_ip );
 
         snprintf( command, INET6_ADDRSTRLEN, "network.lan.netmask=%s", subnet_mask );
         args[2] = command;
@@ -396,7 +380,7 @@ int SetSubnetMask( struct Upnp_Action_Request *ca_event )
         InvalidArgs( ca_event );
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
+        CreateActionResponse( ca_event );
 
     return ca_event->ErrCode;
 }
@@ -415,13 +399,6 @@ int GetSubnetMask( struct Upnp_Action_Request *ca_event )
     FILE *cmd;
     char subnet_mask[INET6_ADDRSTRLEN];
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetSubnetMask invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
     if ( CheckDHCPServerConfigurable( ca_event ) )
         return ca_event->ErrCode;
 
@@ -436,7 +413,7 @@ int GetSubnetMask( struct Upnp_Action_Request *ca_event )
 
     // get result
     if ( fgets( subnet_mask, INET6_ADDRSTRLEN, cmd ) != NULL )
-        ParseResult( ca_event, "<NewSubnetMask>%s</NewSubnetMask>\n", subnet_mask );
+        AddActionResponse( ca_event, "NewSubnetMask", subnet_mask );
     else
     {
         trace( 1, "GetSubnetMask: uci command returned null." );
@@ -463,9 +440,11 @@ int SetIPRouter( struct Upnp_Action_Request *ca_event )
     char addr[LINE_LEN];
     char *new_router;
     int  status;
+    struct soapArg args[] = {
+        { "NewIPRouters", &new_router, 0 }
+    };
 
-    if ( ( new_router = GetFirstDocumentItem( ca_event->ActionRequest, "NewIPRouters" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) ) 
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -478,7 +457,6 @@ int SetIPRouter( struct Upnp_Action_Request *ca_event )
             {
                 addErrorData( ca_event, 701, "ValueAlreadySpecified" );
                 trace( 2, "SetIPRouter: new default gw '%s' is the same as current one '%s'", new_router, addr );
-                free( new_router );
                 return ca_event->ErrCode;
             }
 
@@ -495,7 +473,7 @@ int SetIPRouter( struct Upnp_Action_Request *ca_event )
         status = RunCommand( ROUTE_COMMAND, parmList );
 
         if ( !status )
-            ParseResult( ca_event, "" );
+            CreateActionResponse( ca_event );
         else
         {
             trace( 2, "SetIPRouter: Route command returned error: %d", status );
@@ -506,8 +484,6 @@ int SetIPRouter( struct Upnp_Action_Request *ca_event )
     else
         InvalidArgs( ca_event );
 
-    free( new_router );
-
     return ca_event->ErrCode;
 }
 
@@ -524,9 +500,11 @@ int DeleteIPRouter( struct Upnp_Action_Request *ca_event )
 {
     char *parmList[] = { ROUTE_COMMAND, "del", "default", "gw", NULL, NULL };
     int status;
+    struct soapArg args[] = {
+        { "NewIPRouters", &parmList[4], 0 }
+    };
 
-    if ( ( parmList[4] = GetFirstDocumentItem( ca_event->ActionRequest, "NewIPRouters" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -534,7 +512,7 @@ int DeleteIPRouter( struct Upnp_Action_Request *ca_event )
         // run route del command
         status = RunCommand( ROUTE_COMMAND, parmList );
         if ( !status )
-            ParseResult( ca_event, "" );
+            CreateActionResponse( ca_event );
         else
         {
             trace( 2, "DeleteIPRouter: Route command returned error: %d", status );
@@ -544,8 +522,6 @@ int DeleteIPRouter( struct Upnp_Action_Request *ca_event )
     else
         InvalidArgs( ca_event );
 
-    free( parmList[4] );
-
     return ca_event->ErrCode;
 }
 
@@ -563,17 +539,10 @@ int GetIPRoutersList( struct Upnp_Action_Request *ca_event )
     char addr[LINE_LEN];
     int gw_found = FALSE;
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetIPRoutersLists invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
     gw_found = GetDefaultGateway( addr );
 
     if ( gw_found )
-        ParseResult( ca_event, "<NewIPRouters>%s</NewIPRouters>\n", addr );
+        AddActionResponse( ca_event, "NewIPRouters", addr );
     else
         addErrorData( ca_event, 501, "Invalid Args" );
 
@@ -593,24 +562,22 @@ int SetDomainName( struct Upnp_Action_Request *ca_event )
     FILE *cmd = NULL;
     char *domainName;
     char setdomain_cmd[LINE_LEN];
-    regex_t reg_domain;
+    struct soapArg args[] = {
+        { "NewDomainName", &domainName, 0 }
+    };
 
-    if ( ( domainName = GetFirstDocumentItem( ca_event->ActionRequest, "NewDomainName" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) ) 
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
 
         // sanitize input
-        regcomp(&reg_domain, REGEX_DOMAIN_NAME, REG_EXTENDED);
-        if( regexec( &reg_domain, domainName, 0, 0, 0 ) != 0 )
+        if( !ValidateDomainName( domainName, 0 ) )
         {
             trace( 1, "SetDomainName: Domain Name contains invalid characters: '%s'.", domainName );
             InvalidArgs( ca_event );
-            regfree(&reg_domain);
             return ca_event->ErrCode;
         }
-        regfree(&reg_domain);
 
         snprintf( setdomain_cmd, LINE_LEN, "uci set dhcp.@dnsmasq[0].domain=%s", domainName );
         cmd = popen( setdomain_cmd, "r" );
@@ -624,13 +591,12 @@ int SetDomainName( struct Upnp_Action_Request *ca_event )
         UciCommit();
         NetworkCommand( SERVICE_RESTART );
 
-        ParseResult( ca_event, "" );
+        CreateActionResponse( ca_event );
     }
     else
         InvalidArgs( ca_event );
 
     if ( cmd ) pclose( cmd );
-    free( domainName );
 
     return ca_event->ErrCode;
 }
@@ -646,13 +612,6 @@ int GetDomainName( struct Upnp_Action_Request *ca_event )
     FILE *cmd;
     char domain_name[LINE_LEN];
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetDomainName invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
     if ( CheckDHCPServerConfigurable( ca_event ) )
         return ca_event->ErrCode;
 
@@ -667,7 +626,7 @@ int GetDomainName( struct Upnp_Action_Request *ca_event )
 
     // get result
     if ( fgets( domain_name, LINE_LEN, cmd ) != NULL )
-        ParseResult( ca_event, "<NewDomainName>%s</NewDomainName>\n", domain_name );
+        AddActionResponse( ca_event, "NewDomainName", domain_name );
     else
     {
         trace( 1, "GetDomainName: uci command returned null." );
@@ -683,24 +642,17 @@ int GetDomainName( struct Upnp_Action_Request *ca_event )
  * Parses and returns last part from given ip address
  *
  * @param ip_addr Ip address as char array
- * @param regmatch_t Regular expression submatch array
+ * @param prefix_len Length of the first 3 parts including the last dot is stored here
  * @return -1 on failure
  */
-int ParseIPLastPart( const char *ip_addr, regmatch_t *submatch )
+int ParseIPLastPart( const char *ip_addr, size_t *prefix_len )
 {
-    regex_t ip;
-    char ip_last[MAX_IP_LAST_PART];
-
-    regcomp( &ip, REGEX_IP_LASTBYTE, REG_EXTENDED );
+    int ip_last;
 
     // check that address is an IP address
-    if ( regexec( &ip, ip_addr, SUB_MATCH, submatch, 0 ) == 0 )
-    {
-        // parse last part of the ip address
-        strncpy( ip_last, &ip_addr[submatch[1].rm_so], min( submatch[1].rm_eo-submatch[1].rm_so, MAX_IP_LAST_PART ) );
-        ip_last[min( submatch[1].rm_eo-submatch[1].rm_so, MAX_IP_LAST_PART-1 )] = 0;
-        return atoi( ip_last );
-    }
+    if ( ValidateIPv4Address( ip_addr, &ip_last, prefix_len ) )
+        return ip_last;
+
     // start address not valid
     return -1;
 }
@@ -722,10 +674,10 @@ int ParseAddressRange( struct Upnp_Action_Request *ca_event,
                        const char *last_addr )
 {
     int start_nro, last_nro;
-    regmatch_t submatch[SUB_MATCH];
+    size_t start_prefix, last_prefix;
 
-    start_nro = ParseIPLastPart( start_addr, submatch );
-    last_nro = ParseIPLastPart( last_addr, submatch );
+    start_nro = ParseIPLastPart( start_addr, &start_prefix );
+    last_nro = ParseIPLastPart( last_addr, &last_prefix );
 
     if ( start_nro == -1 || last_nro == -1 )
     {
@@ -754,7 +706,7 @@ int ParseAddressRange( struct Upnp_Action_Request *ca_event,
     snprintf( start, MAX_IP_LAST_PART, "%d", start_nro );
 
     // are 3 parts of the ip address same
-    if ( strncmp( start_addr, last_addr, submatch[1].rm_so ) == 0 )
+    if ( start_prefix == last_prefix && strncmp( start_addr, last_addr, start_prefix ) == 0 )
     {
         // limit is last - start
         if ( last_nro - start_nro > 0 )
@@ -793,12 +745,12 @@ int SetAddressRange( struct Upnp_Action_Request *ca_event )
     char *start_addr, *limit_addr;
     char command[MAX_IP_LAST_PART+15];
     char start[MAX_IP_LAST_PART], limit[MAX_IP_LAST_PART];
+    struct soapArg args[] = {
+        { "NewMinAddress", &start_addr, 0 },
+        { "NewMaxAddress", &limit_addr, 0 }
+    };
 
-    start_addr = GetFirstDocumentItem( ca_event->ActionRequest, "NewMinAddress" );
-    limit_addr = GetFirstDocumentItem( ca_event->ActionRequest, "NewMaxAddress" );
-
-    if ( start_addr && limit_addr &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 2 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 2 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -822,10 +774,7 @@ int SetAddressRange( struct Upnp_Action_Request *ca_event )
         InvalidArgs( ca_event );
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
-
-    free( start_addr );
-    free( limit_addr );
+        CreateActionResponse( ca_event );
 
     return ca_event->ErrCode;
 }
@@ -843,13 +792,6 @@ int GetAddressRange( struct Upnp_Action_Request *ca_event )
     FILE *cmd = NULL, *cmd_2 = NULL;
     char start[INET6_ADDRSTRLEN] = {0}, limit[INET6_ADDRSTRLEN] = {0};
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetAddressRange invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
     if ( CheckDHCPServerConfigurable( ca_event ) )
         return ca_event->ErrCode;
 
@@ -874,7 +816,10 @@ int GetAddressRange( struct Upnp_Action_Request *ca_event )
     }
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "<NewMinAddress>%s</NewMinAddress>\n<NewMaxAddress>%s</NewMaxAddress>\n", start, limit );
+    {
+        AddActionResponse( ca_event, "NewMinAddress", start );
+        AddActionResponse( ca_event, "NewMaxAddress", limit );
+    }
 
     if ( cmd ) pclose( cmd );
     if ( cmd_2 ) pclose( cmd_2 );
@@ -901,9 +846,11 @@ int SetReservedAddress( struct Upnp_Action_Request *ca_event )
     char *set_args[] = { g_vars.uciCmd, "-q", "set", NULL, NULL };
     char *del_args[] = { g_vars.uciCmd, "-q", "delete", "dhcp.@host[0]", NULL };
     int i=0;
+    struct soapArg args[] = {
+        { "NewReservedAddresses", &all_addr, 0 }
+    };
 
-    if ( ( ( all_addr = GetFirstDocumentItem( ca_event->ActionRequest, "NewReservedAddresses" ) ) == NULL ) || 
-            ( GetNbSoapParameters( ca_event->ActionRequest ) != 1 ) )
+    if ( !GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         InvalidArgs( ca_event );
         return ca_event->ErrCode;
@@ -960,9 +907,7 @@ int SetReservedAddress( struct Upnp_Action_Request *ca_event )
     }
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
-
-    free( all_addr );
+        CreateActionResponse( ca_event );
 
     return ca_event->ErrCode;
 }
@@ -984,9 +929,11 @@ int DeleteReservedAddress( struct Upnp_Action_Request *ca_event )
     char line[MAX_CONFIG_LINE];
     int i = 0;
     int deleted = FALSE;
+    struct soapArg args[] = {
+        { "NewReservedAddresses", &del_addr, 0 }
+    };
 
-    if ( ( ( del_addr = GetFirstDocumentItem( ca_event->ActionRequest, "NewReservedAddresses" ) ) == NULL ) || 
-            ( GetNbSoapParameters( ca_event->ActionRequest ) != 1 ) )
+    if ( !GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         InvalidArgs( ca_event );
         return ca_event->ErrCode;
@@ -1052,10 +999,9 @@ int DeleteReservedAddress( struct Upnp_Action_Request *ca_event )
     }
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
+        CreateActionResponse( ca_event );
 
     if ( cmd ) pclose( cmd );
-    free( del_addr );
 
     return ca_event->ErrCode;
 }
@@ -1079,13 +1025,6 @@ int GetReservedAddresses( struct Upnp_Action_Request *ca_event )
 
     addresses[0] = 0;
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetReservedAddresses invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
     if ( CheckDHCPServerConfigurable( ca_event ) )
         return ca_event->ErrCode;
 
@@ -1125,7 +1064,7 @@ int GetReservedAddresses( struct Upnp_Action_Request *ca_event )
     }
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "<NewReservedAddresses>%s</NewReservedAddresses>\n", addresses );
+        AddActionResponse( ca_event, "NewReservedAddresses", addresses );
 
     if ( cmd ) pclose( cmd );
 
@@ -1149,14 +1088,14 @@ int SetDNSServer( struct Upnp_Action_Request *ca_event )
     char line[MAX_CONFIG_LINE];
     char *dns = NULL;
     char *dns_list = NULL;
-    regex_t nameserver;
-    regmatch_t submatch[SUB_MATCH];
+    size_t dns_offset, dns_len;
+    struct soapArg args[] = {
+        { "NewDNSServers", &dns_list, 0 }
+    };
 
-    regcomp( &nameserver, REGEX_NAMESERVER, REG_EXTENDED );
     ca_event->ErrCode = 0;
 
-    if ( ( dns_list = GetFirstDocumentItem( ca_event->ActionRequest, "NewDNSServers" ) ) &&
-            ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -1178,7 +1117,7 @@ int SetDNSServer( struct Upnp_Action_Request *ca_event )
         {
             while ( fgets( line, MAX_CONFIG_LINE, file ) != NULL )
             {
-                if ( regexec( &nameserver, line, SUB_MATCH, submatch, 0 ) == 0 )
+                if ( ParseNameserverLine( line, &dns_offset, &dns_len ) )
                     continue;
 
                 // line isn't a nameserver, adding it to the temp file
@@ -1191,7 +1130,7 @@ int SetDNSServer( struct Upnp_Action_Request *ca_event )
             {
                 sprintf( line, "nameserver %s\n", dns );
                 // check that resulted line syntax is correct
-                if ( regexec( &nameserver, line, SUB_MATCH, submatch, 0 ) == 0 )
+                if ( ParseNameserverLine( line, &dns_offset, &dns_len ) )
                 {
                     fputs( line, new_file );
                 }
@@ -1224,12 +1163,10 @@ int SetDNSServer( struct Upnp_Action_Request *ca_event )
         InvalidArgs( ca_event );
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
+        CreateActionResponse( ca_event );
 
-    regfree( &nameserver );
     if ( file ) fclose( file );
     if ( new_file ) fclose( new_file );
-    free( dns_list );
 
     return ca_event->ErrCode;
 }
@@ -1250,15 +1187,15 @@ int DeleteDNSServer( struct Upnp_Action_Request *ca_event )
     char line[MAX_CONFIG_LINE];
     char dns[INET6_ADDRSTRLEN];
     char *dns_to_delete = NULL;
-    regex_t nameserver;
-    regmatch_t submatch[SUB_MATCH];
+    size_t dns_offset, dns_len;
     int dns_found = 0;
+    struct soapArg args[] = {
+        { "NewDNSServers", &dns_to_delete, 0 }
+    };
 
-    regcomp( &nameserver, REGEX_NAMESERVER, REG_EXTENDED );
     ca_event->ErrCode = 0;
 
-    if ( ( dns_to_delete = GetFirstDocumentItem( ca_event->ActionRequest, "NewDNSServers" ) ) &&
-         ( GetNbSoapParameters( ca_event->ActionRequest ) == 1 ) )
+    if ( GetSoapArguments( ca_event->ActionRequest, args, 1 ) )
     {
         if ( CheckDHCPServerConfigurable( ca_event ) )
             return ca_event->ErrCode;
@@ -1278,11 +1215,11 @@ int DeleteDNSServer( struct Upnp_Action_Request *ca_event )
         {
             while ( fgets( line, MAX_CONFIG_LINE, file ) != NULL )
             {
-                if ( regexec( &nameserver, line, SUB_MATCH, submatch, 0 ) == 0 )
+                if ( ParseNameserverLine( line, &dns_offset, &dns_len ) )
                 {
                     // nameserver found, get it
-                    strncpy( dns, &line[submatch[1].rm_so], min( submatch[1].rm_eo-submatch[1].rm_so, INET6_ADDRSTRLEN ) );
-                    dns[min( submatch[1].rm_eo-submatch[1].rm_so, INET6_ADDRSTRLEN-1 )] = 0;
+                    strncpy( dns, &line[dns_offset], min( dns_len, INET6_ADDRSTRLEN ) );
+                    dns[min( dns_len, INET6_ADDRSTRLEN-1 )] = 0;
 
                     // if this one needs to be deleted, then continue while loop
                     if ( strncmp( dns, dns_to_delete, INET6_ADDRSTRLEN ) == 0 )
@@ -1321,12 +1258,10 @@ int DeleteDNSServer( struct Upnp_Action_Request *ca_event )
         InvalidArgs( ca_event );
 
     if ( ca_event->ErrCode == 0 )
-        ParseResult( ca_event, "" );
+        CreateActionResponse( ca_event );
 
-    regfree( &nameserver );
     if ( file ) fclose( file );
     if ( new_file ) fclose( new_file );
-    free( dns_to_delete );
 
     return ca_event->ErrCode;
 }
@@ -1345,21 +1280,11 @@ int GetDNSServers( struct Upnp_Action_Request *ca_event )
     char dns_servers[RESULT_LEN];
     char line[MAX_CONFIG_LINE];
     char dns[INET6_ADDRSTRLEN];
-    regex_t nameserver;
-    regmatch_t submatch[SUB_MATCH];
+    size_t dns_offset, dns_len;
     int dns_place = 0;
 
     dns_servers[0] = 0;
 
-    if( GetNbSoapParameters( ca_event->ActionRequest ) != 0 )
-    {
-        trace( 1, "GetDNSServers invalid number of parameters" );
-        addErrorData( ca_event, UPNP_SOAP_E_INVALID_ARGS, "Invalid Args" );
-        return ca_event->ErrCode;
-    }
-
-    regcomp( &nameserver, REGEX_NAMESERVER, REG_EXTENDED );
-
     file = fopen( g_vars.resolvConf, "r" );
     if ( file == NULL )
     {
@@ -1370,22 +1295,21 @@ int GetDNSServers( struct Upnp_Action_Request *ca_event )
 
     while ( fgets( line, MAX_CONFIG_LINE, file ) != NULL )
     {
-        if ( regexec( &nameserver, line, SUB_MATCH, submatch, 0 ) == 0 )
+        if ( ParseNameserverLine( line, &dns_offset, &dns_len ) )
         {
             // nameserver found, get it and add to list
             // if this is not the first dns server, add comma
             if ( dns_place > 0 )
                 dns_place += snprintf( &dns_servers[dns_place], RESULT_LEN - dns_place, "," );
 
-            strncpy( dns, &line[submatch[1].rm_so], min( submatch[1].rm_eo-submatch[1].rm_so, INET6_ADDRSTRLEN ) );
-            dns[min( submatch[1].rm_eo-submatch[1].rm_so, INET6_ADDRSTRLEN-1 )] = 0;
+            strncpy( dns, &line[dns_offset], min( dns_len, INET6_ADDRSTRLEN ) );
+            dns[min( dns_len, INET6_ADDRSTRLEN-1 )] = 0;
             dns_place += snprintf( &dns_servers[dns_place], RESULT_LEN - dns_place, "%s", dns );
         }
     }
 
-    ParseResult( ca_event, "<NewDNSServers>%s</NewDNSServers>\n", dns_servers );
+    AddActionResponse( ca_event, "NewDNSServers", dns_servers );
 
-    regfree( &nameserver );
     fclose( file );
 
     return ca_event->ErrCode;
@@ -36,9 +36,6 @@
 // max size of last ip part
 static const int MAX_IP_LAST_PART = 5;
 
-// regex to identify valid nameserver lines in resolv.conf
-static const char REGEX_NAMESERVER[] = "nameserver[[:blank:]]*([[:digit:]]{1,3}[.][[:digit:]]{1,3}[.][[:digit:]]{1,3}[.][[:digit:]]{1,3})";
-
 
 int SetDHCPServerConfigurable(struct Upnp_Action_Request *ca_event);
 int GetDHCPServerConfigurable(struct Upnp_Action_Request *ca_event);
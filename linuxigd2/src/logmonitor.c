@@ -0,0 +1,285 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Listener of packets logged by NFLOG rules.
+ *
+ * Listener binds to a group of nfnetlink_log and its thread sleeps until
+ * kernel sends packets logged to the group. Only metadata is copied, payload
+ * is not needed because rules tell what they are with the log prefix. Kernel sends packets
+ * in batches, and callback gets prefixes of one batch at once in the order
+ * they were logged.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_log.h>
+#include "globals.h"
+#include "util.h"
+#include "netlinkmonitor.h"
+#include "logmonitor.h"
+
+// packets queued in kernel before batch is sent, and longest wait in 1/100 s
+#define LOG_MONITOR_QTHRESH 32
+#define LOG_MONITOR_TIMEOUT 100
+#define LOG_MONITOR_RCVBUF (256 * 1024)
+
+static void logmonitor_Parse(char *buf, int len);
+static void logmonitor_Lost(void);
+
+static union
+{
+    struct nlmsghdr nh;
+    char buf[LOG_MONITOR_RCVBUF / 4];
+} logmonitor_Buf;
+
+static struct netlinkMonitor logmonitor_Monitor =
+{
+    .name = "Log monitor",
+    .buf = logmonitor_Buf.buf,
+    .size = sizeof(logmonitor_Buf),
+    .received = logmonitor_Parse,
+    .lost = logmonitor_Lost,
+    .socket = -1,
+    .pipe = { -1, -1 }
+};
+
+static void (*logmonitor_Logged)(const char **prefixes, int count);
+
+/**
+ * Add attribute to netlink message.
+ *
+ * @param nh Netlink message with room for attribute.
+ * @param type Type of attribute.
+ * @param data Data of attribute.
+ * @param len Length of data.
+ */
+static void logmonitor_AddAttr(struct nlmsghdr *nh, int type, const void *data, int len)
+{
+    struct nlattr *nla = (struct nlattr *)((char *)nh + NLMSG_ALIGN(nh->nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nh->nlmsg_len = NLMSG_ALIGN(nh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/**
+ * Send configuration message of nfnetlink_log and wait for acknowledgement.
+ *
+ * @param family Protocol family of message.
+ * @param group Log group.
+ * @param command Configuration command, 0 if none.
+ * @param mode Set copy mode and batching of group.
+ * @return 1 if kernel accepted message, 0 if not.
+ */
+static int logmonitor_Config(int family, int group, int command, int mode)
+{
+    union
+    {
+        struct nlmsghdr nh;
+        char buf[256];
+    } msg;
+    struct nfgenmsg *nfg;
+    struct nlmsgerr *err;
+    struct sockaddr_nl kernel;
+    static unsigned int seq;
+    int len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    msg.nh.nlmsg_type = (NFNL_SUBSYS_ULOG << 8) | NFULNL_MSG_CONFIG;
+    msg.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    msg.nh.nlmsg_seq = ++seq;
+    nfg = NLMSG_DATA(&msg.nh);
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(group);
+
+    if (command)
+    {
+        struct nfulnl_msg_config_cmd cmd = { command };
+
+        logmonitor_AddAttr(&msg.nh, NFULA_CFG_CMD, &cmd, sizeof(cmd));
+    }
+    if (mode)
+    {
+        struct nfulnl_msg_config_mode copy;
+        uint32_t value;
+
+        memset(&copy, 0, sizeof(copy));
+        copy.copy_mode = NFULNL_COPY_META;
+        logmonitor_AddAttr(&msg.nh, NFULA_CFG_MODE, &copy, sizeof(copy));
+        value = htonl(LOG_MONITOR_QTHRESH);
+        logmonitor_AddAttr(&msg.nh, NFULA_CFG_QTHRESH, &value, sizeof(value));
+        value = htonl(LOG_MONITOR_TIMEOUT);
+        logmonitor_AddAttr(&msg.nh, NFULA_CFG_TIMEOUT, &value, sizeof(value));
+    }
+
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (sendto(logmonitor_Monitor.socket, &msg, msg.nh.nlmsg_len, 0,
+               (struct sockaddr *)&kernel, sizeof(kernel)) < 0)
+        return 0;
+
+    // acknowledgement comes before any packet, group is not bound yet
+    for (;;)
+    {
+        len = recv(logmonitor_Monitor.socket, &msg, sizeof(msg), 0);
+        if (len < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        if (!NLMSG_OK(&msg.nh, len) || msg.nh.nlmsg_type != NLMSG_ERROR)
+            continue;
+        err = NLMSG_DATA(&msg.nh);
+        if (err->error != 0)
+            errno = -err->error;
+        return err->error == 0;
+    }
+}
+
+/**
+ * Get log prefix of logged packet.
+ *
+ * @param nh Netlink message of NFULNL_MSG_PACKET.
+ * @return Prefix, NULL if packet has none.
+ */
+static const char *logmonitor_Prefix(struct nlmsghdr *nh)
+{
+    struct nlattr *nla;
+    int len;
+
+    if (nh->nlmsg_len < NLMSG_LENGTH(sizeof(struct nfgenmsg)))
+        return NULL;
+
+    len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nla = (struct nlattr *)((char *)NLMSG_DATA(nh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)));
+    while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len)
+    {
+        if ((nla->nla_type & NLA_TYPE_MASK) == NFULA_PREFIX && nla->nla_len > NLA_HDRLEN)
+        {
+            // prefix is nul terminated by kernel, check to be sure
+            char *prefix = (char *)nla + NLA_HDRLEN;
+
+            if (prefix[nla->nla_len - NLA_HDRLEN - 1] != '\0')
+                return NULL;
+            return prefix;
+        }
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+    return NULL;
+}
+
+/**
+ * Pass prefixes of all packets of buffer to callback.
+ *
+ * @param buf Netlink messages.
+ * @param len Length of buf.
+ */
+static void logmonitor_Parse(char *buf, int len)
+{
+    const char *prefixes[LOG_MONITOR_BATCH];
+    struct nlmsghdr *nh;
+    int count = 0;
+
+    for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+    {
+        if (nh->nlmsg_type != ((NFNL_SUBSYS_ULOG << 8) | NFULNL_MSG_PACKET))
+            continue;
+        if ((prefixes[count] = logmonitor_Prefix(nh)) == NULL)
+            continue;
+        if (++count == LOG_MONITOR_BATCH)
+        {
+            logmonitor_Logged(prefixes, count);
+            count = 0;
+        }
+    }
+    if (count > 0)
+        logmonitor_Logged(prefixes, count);
+}
+
+/**
+ * Packets were lost, later ones tell the state again.
+ */
+static void logmonitor_Lost(void)
+{
+    trace(2, "Log monitor: logged packets lost");
+}
+
+/**
+ * Start listening packets logged to NFLOG group.
+ *
+ * @param group NFLOG group.
+ * @param logged Called from listener thread with prefixes of logged packets,
+ *               in the order packets were logged.
+ * @return 1 if started, 0 if failed.
+ */
+int LogMonitorStart(int group, void (*logged)(const char **prefixes, int count))
+{
+    if (logmonitor_Monitor.running)
+        return 1;
+
+    if (!NetlinkMonitorOpen(&logmonitor_Monitor, NETLINK_NETFILTER, 0, LOG_MONITOR_RCVBUF))
+        return 0;
+
+    // binding protocol family is needed only by old kernels, failure is fine
+    logmonitor_Config(AF_INET6, 0, NFULNL_CFG_CMD_PF_BIND, 0);
+    if (!logmonitor_Config(AF_UNSPEC, group, NFULNL_CFG_CMD_BIND, 0) ||
+        !logmonitor_Config(AF_UNSPEC, group, 0, 1))
+    {
+        trace(1, "Log monitor: binding to NFLOG group %d failed: %s", group, strerror(errno));
+        NetlinkMonitorStop(&logmonitor_Monitor);
+        return 0;
+    }
+
+    logmonitor_Logged = logged;
+
+    return NetlinkMonitorStart(&logmonitor_Monitor);
+}
+
+/**
+ * Stop listening. Waits until callback running in listener thread returns,
+ * so this must not be called with locks which callback takes. Closing the
+ * socket unbinds the group.
+ */
+void LogMonitorStop(void)
+{
+    NetlinkMonitorStop(&logmonitor_Monitor);
+}
+
+/**
+ * Check if logged packets are listened.
+ *
+ * @return 1 if listener is running, 0 if not.
+ */
+int LogMonitorRunning(void)
+{
+    return NetlinkMonitorRunning(&logmonitor_Monitor);
+}
@@ -0,0 +1,33 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _LOGMONITOR_H_
+#define _LOGMONITOR_H_
+
+// most prefixes passed to callback at once
+#define LOG_MONITOR_BATCH 256
+
+int LogMonitorStart(int group, void (*logged)(const char **prefixes, int count));
+void LogMonitorStop(void);
+int LogMonitorRunning(void);
+
+#endif // _LOGMONITOR_H_
@@ -46,6 +46,8 @@
 #include "pmlist.h"
 #include "lanhostconfig.h"
 #include "wanipv6fw.h"
+#include "actiontable.h"
+#include "ifmonitor.h"
 #include <locale.h>
 
 
@@ -233,6 +235,9 @@ int main (int argc, char** argv)
     }
     trace(2, "Succesfully set the Web Server Root Directory.");
 
+    // action dispatch table and locks of shared state
+    ActionTableInit();
+
     //initialize the timer thread for expiration of mappings
     if (ExpirationTimerThreadInit()!=0)
     {
@@ -241,7 +246,29 @@ int main (int argc, char** argv)
         exit(1);
     }
 
-    InitFirewallv6();
+    // state variable changes are merged and evented by event thread
+    if (!EventThreadInit())
+    {
+        syslog(LOG_ERR,"Event thread start failed, sending events at once");
+    }
+
+    // link and addresses of WAN interface are followed through netlink
+    if (!IfMonitorStart(g_vars.extInterfaceName, WANInterfaceEventing))
+    {
+        syslog(LOG_ERR,"Interface monitor start failed, polling %s every %d seconds",
+               g_vars.extInterfaceName, g_vars.eventUpdateInterval);
+    }
+
+    // firewall rules of portmappings are applied by worker thread
+    if (!pmlist_WorkerStart())
+    {
+        syslog(LOG_ERR,"Firewall worker start failed, applying rules synchronously");
+    }
+
+    if (!InitFirewallv6())
+    {
+        syslog(LOG_ERR,"IPv6 firewall initialization failed, UPnP port may be closed");
+    }
 
     /**
      * IPv4 register
@@ -507,8 +534,12 @@ int main (int argc, char** argv)
 
     // Cleanup UPnP SDK and free memory
     DeleteAllPortMappings();
+    IfMonitorStop();
     ExpirationTimerThreadShutdown();
+    EventThreadShutdown();
+    pmlist_WorkerStop();
     CloseFirewallv6();
+    ActionTableLogStatistics();
 
     // Cleanup lanhostconfig module
     FreeLanHostConfig();
@@ -0,0 +1,218 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Thread, wake pipe and receive loop of netlink listeners.
+ *
+ * Listener thread sleeps in poll until kernel sends something or the monitor
+ * is stopped. Then it reads every datagram queued to the socket, so that
+ * monitor can handle what was sent together at once before sleeping again.
+ * Only datagrams sent by kernel are passed to monitor.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include "globals.h"
+#include "util.h"
+#include "netlinkmonitor.h"
+
+/**
+ * Listener thread.
+ *
+ * @param arg Monitor.
+ */
+static void *netlinkmonitor_Run(void *arg)
+{
+    struct netlinkMonitor *monitor = arg;
+    struct sockaddr_nl from;
+    socklen_t fromlen;
+    struct pollfd fds[2];
+    sigset_t signals;
+    int len;
+
+    // signals are handled by main thread
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    fds[0].fd = monitor->socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = monitor->pipe[0];
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        if (monitor->idle)
+            monitor->idle();
+
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            trace(1, "%s: poll failed: %s", monitor->name, strerror(errno));
+            __sync_lock_test_and_set(&monitor->failed, 1);
+            break;
+        }
+        if (fds[1].revents)
+            break;
+
+        // read everything queued
+        for (;;)
+        {
+            fromlen = sizeof(from);
+            len = recvfrom(monitor->socket, monitor->buf, monitor->size, MSG_DONTWAIT,
+                           (struct sockaddr *)&from, &fromlen);
+            if (len < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                if (errno == ENOBUFS)
+                {
+                    if (monitor->lost)
+                        monitor->lost();
+                    continue;
+                }
+                break;
+            }
+            if (len == 0)
+                break;
+            // only kernel is trusted
+            if (from.nl_pid != 0)
+                continue;
+            monitor->received(monitor->buf, len);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Open netlink socket of monitor and subscribe multicast groups.
+ *
+ * @param monitor Monitor.
+ * @param protocol Netlink protocol, e.g. NETLINK_ROUTE.
+ * @param groups Multicast groups, 0 if none.
+ * @param rcvbuf Size of receive buffer of socket, 0 for default.
+ * @return 1 if succesfull, 0 if failed.
+ */
+int NetlinkMonitorOpen(struct netlinkMonitor *monitor, int protocol, unsigned int groups, int rcvbuf)
+{
+    struct sockaddr_nl addr;
+
+    monitor->running = 0;
+    monitor->pipe[0] = monitor->pipe[1] = -1;
+    monitor->socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol);
+    if (monitor->socket < 0)
+    {
+        trace(1, "%s: netlink socket failed: %s", monitor->name, strerror(errno));
+        return 0;
+    }
+    if (rcvbuf > 0)
+        setsockopt(monitor->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = groups;
+    if (bind(monitor->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        trace(1, "%s: netlink bind failed: %s", monitor->name, strerror(errno));
+        close(monitor->socket);
+        monitor->socket = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Start listener thread of monitor opened with NetlinkMonitorOpen. If this
+ * fails, socket is closed.
+ *
+ * @param monitor Monitor.
+ * @return 1 if started, 0 if failed.
+ */
+int NetlinkMonitorStart(struct netlinkMonitor *monitor)
+{
+    if (pipe2(monitor->pipe, O_CLOEXEC) < 0)
+    {
+        trace(1, "%s: pipe failed: %s", monitor->name, strerror(errno));
+        NetlinkMonitorStop(monitor);
+        return 0;
+    }
+
+    __sync_lock_test_and_set(&monitor->failed, 0);
+    if (ithread_create(&monitor->thread, NULL, netlinkmonitor_Run, monitor) != 0)
+    {
+        trace(1, "%s: thread creation failed", monitor->name);
+        NetlinkMonitorStop(monitor);
+        return 0;
+    }
+    monitor->running = 1;
+
+    return 1;
+}
+
+/**
+ * Stop listener thread and close socket of monitor. Waits until callback
+ * running in listener thread returns, so this must not be called with locks
+ * which callbacks take. Monitor which was opened but not started is closed.
+ *
+ * @param monitor Monitor.
+ */
+void NetlinkMonitorStop(struct netlinkMonitor *monitor)
+{
+    char c = 0;
+
+    if (monitor->running)
+    {
+        while (write(monitor->pipe[1], &c, 1) < 0 && errno == EINTR)
+            ;
+        ithread_join(monitor->thread, NULL);
+        monitor->running = 0;
+    }
+
+    if (monitor->pipe[0] >= 0)
+    {
+        close(monitor->pipe[0]);
+        close(monitor->pipe[1]);
+    }
+    if (monitor->socket >= 0)
+        close(monitor->socket);
+    monitor->socket = monitor->pipe[0] = monitor->pipe[1] = -1;
+}
+
+/**
+ * Check if listener thread of monitor is running.
+ *
+ * @param monitor Monitor.
+ * @return 1 if it is, 0 if monitor is stopped or thread has quit.
+ */
+int NetlinkMonitorRunning(const struct netlinkMonitor *monitor)
+{
+    // thread sets failed when it quits, read it atomically
+    return monitor->running && !__sync_fetch_and_add((int *)&monitor->failed, 0);
+}
@@ -0,0 +1,58 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _NETLINKMONITOR_H_
+#define _NETLINKMONITOR_H_
+
+#include <stddef.h>
+#include <upnp/ithread.h>
+
+/*
+ * Netlink listener shared by monitors. Monitor fills the public fields,
+ * opens socket with NetlinkMonitorOpen, configures it if needed and starts
+ * listener thread with NetlinkMonitorStart. Callbacks are called from
+ * listener thread.
+ */
+struct netlinkMonitor
+{
+    const char *name;                       // used in log messages
+    char *buf;                              // receive buffer, aligned for nlmsghdr
+    size_t size;                            // size of buf
+    void (*received)(char *buf, int len);   // called with messages of each datagram from kernel
+    void (*lost)(void);                     // called when kernel dropped messages, may be NULL
+    void (*idle)(void);                     // called before each wait, when everything queued
+                                            // has been read, may be NULL
+
+    // managed by NetlinkMonitor functions
+    int socket;
+    int pipe[2];                            // written to stop thread
+    ithread_t thread;
+    int running;
+    int failed;                             // thread has quit, accessed atomically
+};
+
+int NetlinkMonitorOpen(struct netlinkMonitor *monitor, int protocol, unsigned int groups, int rcvbuf);
+int NetlinkMonitorStart(struct netlinkMonitor *monitor);
+void NetlinkMonitorStop(struct netlinkMonitor *monitor);
+int NetlinkMonitorRunning(const struct netlinkMonitor *monitor);
+
+#endif // _NETLINKMONITOR_H_
@@ -0,0 +1,913 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * nf_tables backend, used when daemon is built with libnftnl.
+ *
+ * Daemon owns table "ip upnpd", which is recreated on first use:
+ *
+ *   chain <prerouting_chain_name> { type nat hook prerouting priority -100;
+ *       [rules of mappings with remote host or wildcard external port]
+ *       iifname <ext_if> dnat to meta l4proto . th dport map @portmap
+ *   }
+ *   chain <forward_chain_name> { type filter hook forward priority 0;
+ *       [ip saddr <remote host>] ip daddr <client> meta l4proto <proto> th dport <port> accept
+ *   }
+ *
+ * Most mappings are just an element of the portmap map, keyed on protocol
+ * and external port, so adding and deleting one is a single set element
+ * operation in kernel. Other DNAT rules and forward rules are deleted with
+ * the rule handle stored in portMap when rule was added, so no rule needs to
+ * be searched from the ruleset.
+ *
+ * Messages of a transaction are sent to kernel as one nf_tables batch, which
+ * kernel applies atomically.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter_ipv4.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <libmnl/libmnl.h>
+#include <libnftnl/common.h>
+#include <libnftnl/table.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/rule.h>
+#include <libnftnl/expr.h>
+#include <libnftnl/set.h>
+#include <upnp/upnp.h>
+#include "globals.h"
+#include "pmlist.h"
+#include "util.h"
+#include "nftables.h"
+
+// nft data types of the map, informational only but used by "nft list"
+#define NFTABLES_TYPE_BITS 6
+#define NFTABLES_TYPE_IPADDR 7
+#define NFTABLES_TYPE_INET_PROTOCOL 12
+#define NFTABLES_TYPE_INET_SERVICE 13
+#define NFTABLES_MAP_ID 1
+
+// key is protocol . external port, data is internal client . internal port,
+// each field padded to 32 bits
+#define NFTABLES_MAP_KEY_LEN 8
+#define NFTABLES_MAP_DATA_LEN 8
+
+static struct mnl_socket *nftables_nl = NULL;
+static uint32_t nftables_seq = 0;
+static int nftables_ready = 0;      // is table created
+static int nftables_transaction_depth = 0;
+static int nftables_transaction_failed = 0;  // nested transaction was aborted
+
+static int nftables_setup(void);
+
+/*
+ * Batch of current transaction: batch begin message followed by messages of
+ * transaction. Offset of each message is kept for replaying them one by one.
+ */
+static char *nftables_batch = NULL;
+static size_t nftables_batch_length = 0;
+static size_t nftables_batch_size = 0;
+static size_t *nftables_msgs = NULL;
+static int nftables_msg_count = 0;
+static int nftables_msg_capacity = 0;
+
+/*
+ * Rules added in current transaction whose handle is stored into portMap
+ * when kernel echoes the rule back.
+ */
+static struct
+{
+    uint32_t seq;
+    struct portMap *item;
+    uint64_t *handle;
+} *nftables_pending = NULL;
+static int nftables_pending_count = 0;
+static int nftables_pending_capacity = 0;
+
+/**
+ * Forget messages and pending handles of current batch.
+ */
+static void nftables_clear(void)
+{
+    nftables_batch_length = 0;
+    nftables_msg_count = 0;
+    nftables_pending_count = 0;
+}
+
+/**
+ * Handle messages kernel sent as a response for batch. Kernel processes
+ * batch while it is being sent, so responses are already queued in socket
+ * and are read without blocking.
+ *
+ * @return 1 if kernel reported no errors, 0 else.
+ */
+static int nftables_receive(void)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    const struct nlmsghdr *nlh;
+    const struct nlmsgerr *err;
+    struct nftnl_rule *r;
+    int len, i, result = 1;
+
+    while ((len = recv(mnl_socket_get_fd(nftables_nl), buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+    {
+        for (nlh = (struct nlmsghdr *)buf; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len))
+        {
+            if (nlh->nlmsg_type == NLMSG_ERROR)
+            {
+                err = mnl_nlmsg_get_payload(nlh);
+                if (err->error != 0)
+                {
+                    trace(1, "nftables error: Message %u failed, %s", nlh->nlmsg_seq, strerror(-err->error));
+                    result = 0;
+                }
+            }
+            else if (NFNL_SUBSYS_ID(nlh->nlmsg_type) == NFNL_SUBSYS_NFTABLES &&
+                     NFNL_MSG_TYPE(nlh->nlmsg_type) == NFT_MSG_NEWRULE)
+            {
+                for (i = 0; i < nftables_pending_count; i++)
+                {
+                    if (nftables_pending[i].seq != nlh->nlmsg_seq)
+                        continue;
+                    r = nftnl_rule_alloc();
+                    if (r && nftnl_rule_nlmsg_parse(nlh, r) == 0)
+                        *nftables_pending[i].handle = nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE);
+                    if (r)
+                        nftnl_rule_free(r);
+                    break;
+                }
+            }
+        }
+    }
+    if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        trace(1, "nftables error: Can't receive, %s", strerror(errno));
+        result = 0;
+    }
+
+    return result;
+}
+
+/**
+ * Send batch to kernel.
+ *
+ * @param buf Batch including batch begin and end messages.
+ * @param length Length of batch.
+ * @return 1 if kernel applied batch, 0 else.
+ */
+static int nftables_send(const char *buf, size_t length)
+{
+    int size = length;
+
+    if (nftables_nl == NULL)
+    {
+        nftables_nl = mnl_socket_open(NETLINK_NETFILTER);
+        if (nftables_nl == NULL)
+        {
+            trace(1, "nftables error: Can't open netlink socket, %s", strerror(errno));
+            return 0;
+        }
+        if (mnl_socket_bind(nftables_nl, 0, MNL_SOCKET_AUTOPID) < 0)
+        {
+            trace(1, "nftables error: Can't bind netlink socket, %s", strerror(errno));
+            mnl_socket_close(nftables_nl);
+            nftables_nl = NULL;
+            return 0;
+        }
+    }
+
+    // big batches (e.g. deleting all mappings) don't fit default socket buffer
+    if (length > MNL_SOCKET_BUFFER_SIZE &&
+        setsockopt(mnl_socket_get_fd(nftables_nl), SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(mnl_socket_get_fd(nftables_nl), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+    if (mnl_socket_sendto(nftables_nl, buf, length) < 0)
+    {
+        trace(1, "nftables error: Can't send batch, %s", strerror(errno));
+        return 0;
+    }
+
+    return nftables_receive();
+}
+
+/**
+ * Make sure that batch has room for given amount of data.
+ *
+ * @param length Amount of free space needed.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_reserve(size_t length)
+{
+    size_t size = nftables_batch_size;
+    char *batch;
+    size_t *msgs;
+
+    if (nftables_msg_count == nftables_msg_capacity)
+    {
+        msgs = realloc(nftables_msgs, (nftables_msg_capacity ? nftables_msg_capacity * 2 : 64) * sizeof(size_t));
+        if (msgs == NULL)
+            return 0;
+        nftables_msgs = msgs;
+        nftables_msg_capacity = nftables_msg_capacity ? nftables_msg_capacity * 2 : 64;
+    }
+
+    if (nftables_batch_length + length <= size)
+        return 1;
+
+    if (size == 0)
+        size = 4 * MNL_SOCKET_BUFFER_SIZE;
+    while (nftables_batch_length + length > size)
+        size *= 2;
+
+    batch = realloc(nftables_batch, size);
+    if (batch == NULL)
+        return 0;
+    nftables_batch = batch;
+    nftables_batch_size = size;
+    return 1;
+}
+
+/**
+ * Start new message at the end of batch. Message must be completed with
+ * nftables_msg_end before starting another one.
+ *
+ * @param type nf_tables message type (NFT_MSG_...).
+ * @param flags Netlink flags of message.
+ * @return Header of message or NULL if out of memory.
+ */
+static struct nlmsghdr *nftables_msg_begin(uint16_t type, uint16_t flags)
+{
+    struct nlmsghdr *nlh;
+
+    // table is created with batch of its own before first change
+    if (!nftables_ready && !nftables_setup())
+        return NULL;
+
+    if (!nftables_reserve(MNL_SOCKET_BUFFER_SIZE))
+    {
+        trace(1, "nftables error: Out of memory");
+        return NULL;
+    }
+
+    if (nftables_batch_length == 0)
+    {
+        nlh = nftnl_batch_begin(nftables_batch, nftables_seq++);
+        nftables_batch_length = NLMSG_ALIGN(nlh->nlmsg_len);
+    }
+
+    return nftnl_nlmsg_build_hdr(nftables_batch + nftables_batch_length, type, NFPROTO_IPV4, flags, nftables_seq++);
+}
+
+/**
+ * Complete message started with nftables_msg_begin.
+ *
+ * @param nlh Header of message.
+ */
+static void nftables_msg_end(struct nlmsghdr *nlh)
+{
+    nftables_msgs[nftables_msg_count++] = (char *)nlh - nftables_batch;
+    nftables_batch_length += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/**
+ * Send messages of batch one by one. Used when the whole batch failed, so
+ * that one message which can't be applied (e.g. deleting rule which has been
+ * flushed) doesn't prevent the others.
+ *
+ * @return 1 if every message succeeded, 0 else.
+ */
+static int nftables_replay(void)
+{
+    char *buf;
+    struct nlmsghdr *nlh, *msg;
+    size_t length;
+    int i, result = 1;
+
+    buf = malloc(3 * MNL_SOCKET_BUFFER_SIZE);
+    if (buf == NULL)
+        return 0;
+
+    for (i = 0; i < nftables_msg_count; i++)
+    {
+        msg = (struct nlmsghdr *)(nftables_batch + nftables_msgs[i]);
+
+        nlh = nftnl_batch_begin(buf, nftables_seq++);
+        length = NLMSG_ALIGN(nlh->nlmsg_len);
+        memcpy(buf + length, msg, msg->nlmsg_len);
+        length += NLMSG_ALIGN(msg->nlmsg_len);
+        nlh = nftnl_batch_end(buf + length, nftables_seq++);
+        length += NLMSG_ALIGN(nlh->nlmsg_len);
+
+        if (!nftables_send(buf, length))
+            result = 0;
+    }
+    free(buf);
+
+    return result;
+}
+
+/**
+ * Send messages collected into batch and empty it.
+ *
+ * @return 1 if succesfull, 0 if some message failed.
+ */
+static int nftables_flush(void)
+{
+    struct nlmsghdr *nlh;
+    int result;
+
+    if (nftables_msg_count == 0)
+    {
+        nftables_clear();
+        return 1;
+    }
+
+    nlh = nftnl_batch_end(nftables_batch + nftables_batch_length, nftables_seq++);
+    result = nftables_send(nftables_batch, nftables_batch_length + NLMSG_ALIGN(nlh->nlmsg_len));
+    if (!result && nftables_msg_count > 1)
+    {
+        trace(1, "nftables error: Batch of %d messages failed, sending them one by one", nftables_msg_count);
+        result = nftables_replay();
+    }
+    nftables_clear();
+
+    return result;
+}
+
+/**
+ * Add new rule message into batch.
+ *
+ * @param r Rule.
+ * @param type NFT_MSG_NEWRULE or NFT_MSG_DELRULE.
+ * @param flags Netlink flags of message.
+ * @param item Portmapping whose handle is stored when rule is added, or NULL.
+ * @param handle Where handle of added rule is stored.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_rule_msg(struct nftnl_rule *r, uint16_t type, uint16_t flags,
+                             struct portMap *item, uint64_t *handle)
+{
+    struct nlmsghdr *nlh;
+    void *pending;
+
+    if (item && nftables_pending_count == nftables_pending_capacity)
+    {
+        pending = realloc(nftables_pending, (nftables_pending_capacity ? nftables_pending_capacity * 2 : 16) * sizeof(*nftables_pending));
+        if (pending == NULL)
+            return 0;
+        nftables_pending = pending;
+        nftables_pending_capacity = nftables_pending_capacity ? nftables_pending_capacity * 2 : 16;
+    }
+
+    nlh = nftables_msg_begin(type, flags);
+    if (nlh == NULL)
+        return 0;
+    nftnl_rule_nlmsg_build_payload(nlh, r);
+
+    if (item)
+    {
+        nftables_pending[nftables_pending_count].seq = nlh->nlmsg_seq;
+        nftables_pending[nftables_pending_count].item = item;
+        nftables_pending[nftables_pending_count].handle = handle;
+        nftables_pending_count++;
+    }
+    nftables_msg_end(nlh);
+
+    return 1;
+}
+
+/**
+ * Allocate rule of daemon table.
+ *
+ * @param chain Name of chain.
+ * @return New rule or NULL if out of memory.
+ */
+static struct nftnl_rule *nftables_rule_alloc(const char *chain)
+{
+    struct nftnl_rule *r = nftnl_rule_alloc();
+
+    if (r == NULL)
+        return NULL;
+    nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
+    nftnl_rule_set_str(r, NFTNL_RULE_TABLE, NFTABLES_TABLE_NAME);
+    nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+    return r;
+}
+
+/**
+ * Add expression of given type and attributes into rule.
+ * Attributes are given as (attribute, 32 bit value) pairs ending with -1.
+ *
+ * @param r Rule.
+ * @param name Expression type, e.g. "meta" or "payload".
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_expr(struct nftnl_rule *r, const char *name, ...)
+{
+    struct nftnl_expr *e = nftnl_expr_alloc(name);
+    va_list ap;
+    int attr;
+
+    if (e == NULL)
+        return 0;
+
+    va_start(ap, name);
+    while ((attr = va_arg(ap, int)) >= 0)
+        nftnl_expr_set_u32(e, attr, va_arg(ap, uint32_t));
+    va_end(ap);
+
+    nftnl_rule_add_expr(r, e);
+    return 1;
+}
+
+/**
+ * Add expression with data attribute (cmp or immediate) into rule.
+ *
+ * @param r Rule.
+ * @param name "cmp" or "immediate".
+ * @param reg Register compared or loaded.
+ * @param data Data to compare or load.
+ * @param length Length of data.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_expr_data(struct nftnl_rule *r, const char *name, uint32_t reg, const void *data, uint32_t length)
+{
+    struct nftnl_expr *e = nftnl_expr_alloc(name);
+
+    if (e == NULL)
+        return 0;
+
+    if (strcmp(name, "cmp") == 0)
+    {
+        nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG, reg);
+        nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP, NFT_CMP_EQ);
+        nftnl_expr_set(e, NFTNL_EXPR_CMP_DATA, data, length);
+    }
+    else
+    {
+        nftnl_expr_set_u32(e, NFTNL_EXPR_IMM_DREG, reg);
+        nftnl_expr_set(e, NFTNL_EXPR_IMM_DATA, data, length);
+    }
+
+    nftnl_rule_add_expr(r, e);
+    return 1;
+}
+
+/**
+ * Add "iifname <external interface>" match into rule.
+ */
+static int nftables_match_iifname(struct nftnl_rule *r)
+{
+    return nftables_expr(r, "meta", NFTNL_EXPR_META_KEY, NFT_META_IIFNAME, NFTNL_EXPR_META_DREG, NFT_REG_1, -1) &&
+           nftables_expr_data(r, "cmp", NFT_REG_1, g_vars.extInterfaceName, strlen(g_vars.extInterfaceName) + 1);
+}
+
+/**
+ * Add "ip saddr/daddr <address>" match into rule.
+ */
+static int nftables_match_addr(struct nftnl_rule *r, uint32_t offset, const struct in_addr *addr)
+{
+    return nftables_expr(r, "payload", NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER, NFTNL_EXPR_PAYLOAD_OFFSET, offset,
+                         NFTNL_EXPR_PAYLOAD_LEN, 4, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1, -1) &&
+           nftables_expr_data(r, "cmp", NFT_REG_1, addr, sizeof(*addr));
+}
+
+/**
+ * Add "meta l4proto <protocol> th dport <port>" match into rule. Port 0 is
+ * wildcard and matches any port.
+ */
+static int nftables_match_port(struct nftnl_rule *r, uint8_t protocol, uint16_t port)
+{
+    uint16_t nport = htons(port);
+
+    if (!nftables_expr(r, "meta", NFTNL_EXPR_META_KEY, NFT_META_L4PROTO, NFTNL_EXPR_META_DREG, NFT_REG_1, -1) ||
+        !nftables_expr_data(r, "cmp", NFT_REG_1, &protocol, sizeof(protocol)))
+        return 0;
+    if (port == 0)
+        return 1;
+    return nftables_expr(r, "payload", NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER, NFTNL_EXPR_PAYLOAD_OFFSET, 2,
+                         NFTNL_EXPR_PAYLOAD_LEN, 2, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG_1, -1) &&
+           nftables_expr_data(r, "cmp", NFT_REG_1, &nport, sizeof(nport));
+}
+
+/**
+ * Build messages creating daemon table into batch.
+ *
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_setup_batch(void)
+{
+    struct nftnl_table *t;
+    struct nftnl_chain *c;
+    struct nftnl_set *s;
+    struct nftnl_rule *r;
+    struct nlmsghdr *nlh;
+    int i, ok;
+
+    t = nftnl_table_alloc();
+    if (t == NULL)
+        return 0;
+    nftnl_table_set_u32(t, NFTNL_TABLE_FAMILY, NFPROTO_IPV4);
+    nftnl_table_set_str(t, NFTNL_TABLE_NAME, NFTABLES_TABLE_NAME);
+
+    // add table (so that delete doesn't fail), delete it and add again
+    for (i = 0; i < 3; i++)
+    {
+        nlh = nftables_msg_begin(i == 1 ? NFT_MSG_DELTABLE : NFT_MSG_NEWTABLE, i == 1 ? 0 : NLM_F_CREATE);
+        if (nlh == NULL)
+        {
+            nftnl_table_free(t);
+            return 0;
+        }
+        nftnl_table_nlmsg_build_payload(nlh, t);
+        nftables_msg_end(nlh);
+    }
+    nftnl_table_free(t);
+
+    for (i = 0; i < 2; i++)
+    {
+        if (i == 1 && !g_vars.createForwardRules)
+            break;
+        c = nftnl_chain_alloc();
+        if (c == NULL)
+            return 0;
+        nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, NFTABLES_TABLE_NAME);
+        nftnl_chain_set_u32(c, NFTNL_CHAIN_FAMILY, NFPROTO_IPV4);
+        if (i == 0)
+        {
+            nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, g_vars.preroutingChainName);
+            nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "nat");
+            nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, NF_INET_PRE_ROUTING);
+            nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, NF_IP_PRI_NAT_DST);
+        }
+        else
+        {
+            // accept here doesn't override drop of forward chains of other
+            // tables, admin must accept DNATed packets there, see upnpd.conf
+            nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, g_vars.forwardChainName);
+            nftnl_chain_set_str(c, NFTNL_CHAIN_TYPE, "filter");
+            nftnl_chain_set_u32(c, NFTNL_CHAIN_HOOKNUM, NF_INET_FORWARD);
+            nftnl_chain_set_s32(c, NFTNL_CHAIN_PRIO, NF_IP_PRI_FILTER);
+        }
+        nlh = nftables_msg_begin(NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+        if (nlh)
+        {
+            nftnl_chain_nlmsg_build_payload(nlh, c);
+            nftables_msg_end(nlh);
+        }
+        nftnl_chain_free(c);
+        if (nlh == NULL)
+            return 0;
+    }
+
+    s = nftnl_set_alloc();
+    if (s == NULL)
+        return 0;
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, NFTABLES_TABLE_NAME);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, NFTABLES_MAP_NAME);
+    nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+    nftnl_set_set_u32(s, NFTNL_SET_ID, NFTABLES_MAP_ID);
+    nftnl_set_set_u32(s, NFTNL_SET_FLAGS, NFT_SET_MAP);
+    nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, NFTABLES_TYPE_INET_PROTOCOL << NFTABLES_TYPE_BITS | NFTABLES_TYPE_INET_SERVICE);
+    nftnl_set_set_u32(s, NFTNL_SET_KEY_LEN, NFTABLES_MAP_KEY_LEN);
+    nftnl_set_set_u32(s, NFTNL_SET_DATA_TYPE, NFTABLES_TYPE_IPADDR << NFTABLES_TYPE_BITS | NFTABLES_TYPE_INET_SERVICE);
+    nftnl_set_set_u32(s, NFTNL_SET_DATA_LEN, NFTABLES_MAP_DATA_LEN);
+    nlh = nftables_msg_begin(NFT_MSG_NEWSET, NLM_F_CREATE);
+    if (nlh)
+    {
+        nftnl_set_nlmsg_build_payload(nlh, s);
+        nftables_msg_end(nlh);
+    }
+    nftnl_set_free(s);
+    if (nlh == NULL)
+        return 0;
+
+    // iifname <ext_if> dnat to meta l4proto . th dport map @portmap
+    r = nftables_rule_alloc(g_vars.preroutingChainName);
+    if (r == NULL)
+        return 0;
+    ok = nftables_match_iifname(r) &&
+         nftables_expr(r, "meta", NFTNL_EXPR_META_KEY, NFT_META_L4PROTO, NFTNL_EXPR_META_DREG, NFT_REG32_00, -1) &&
+         nftables_expr(r, "payload", NFTNL_EXPR_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER, NFTNL_EXPR_PAYLOAD_OFFSET, 2,
+                       NFTNL_EXPR_PAYLOAD_LEN, 2, NFTNL_EXPR_PAYLOAD_DREG, NFT_REG32_01, -1);
+    if (ok)
+    {
+        struct nftnl_expr *e = nftnl_expr_alloc("lookup");
+        ok = (e != NULL);
+        if (ok)
+        {
+            nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SREG, NFT_REG32_00);
+            nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_DREG, NFT_REG32_00);
+            nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET, NFTABLES_MAP_NAME);
+            nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SET_ID, NFTABLES_MAP_ID);
+            nftnl_rule_add_expr(r, e);
+        }
+    }
+    ok = ok && nftables_expr(r, "nat", NFTNL_EXPR_NAT_TYPE, NFT_NAT_DNAT, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4,
+                             NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG32_00, NFTNL_EXPR_NAT_REG_PROTO_MIN, NFT_REG32_01, -1) &&
+         nftables_rule_msg(r, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND, NULL, NULL);
+    nftnl_rule_free(r);
+
+    return ok;
+}
+
+/**
+ * Create daemon table, dropping everything left from previous run.
+ *
+ * @return 1 if succesfull, 0 else.
+ */
+static int nftables_setup(void)
+{
+    // messages of setup are built with nftables_msg_begin too
+    nftables_ready = 1;
+    if (!nftables_setup_batch() || !nftables_flush())
+    {
+        trace(1, "nftables error: Can't create table %s", NFTABLES_TABLE_NAME);
+        nftables_clear();
+        nftables_ready = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Add or delete element of portmap map.
+ *
+ * @param item Portmapping.
+ * @param type NFT_MSG_NEWSETELEM or NFT_MSG_DELSETELEM.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_map_msg(const struct portMap *item, uint16_t type)
+{
+    unsigned char key[NFTABLES_MAP_KEY_LEN] = { 0 };
+    unsigned char data[NFTABLES_MAP_DATA_LEN] = { 0 };
+    uint16_t port;
+    struct nftnl_set *s;
+    struct nftnl_set_elem *e;
+    struct nlmsghdr *nlh;
+
+    key[0] = item->m_PortMappingProtocol;
+    port = htons(item->m_ExternalPort);
+    memcpy(key + 4, &port, sizeof(port));
+    memcpy(data, &item->m_InternalClient.v4, sizeof(struct in_addr));
+    port = htons(item->m_InternalPort);
+    memcpy(data + 4, &port, sizeof(port));
+
+    s = nftnl_set_alloc();
+    if (s == NULL)
+        return 0;
+    e = nftnl_set_elem_alloc();
+    if (e == NULL)
+    {
+        nftnl_set_free(s);
+        return 0;
+    }
+    nftnl_set_set_str(s, NFTNL_SET_TABLE, NFTABLES_TABLE_NAME);
+    nftnl_set_set_str(s, NFTNL_SET_NAME, NFTABLES_MAP_NAME);
+    nftnl_set_set_u32(s, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+    nftnl_set_elem_set(e, NFTNL_SET_ELEM_KEY, key, sizeof(key));
+    if (type == NFT_MSG_NEWSETELEM)
+        nftnl_set_elem_set(e, NFTNL_SET_ELEM_DATA, data, sizeof(data));
+    nftnl_set_elem_add(s, e);
+
+    nlh = nftables_msg_begin(type, type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE | NLM_F_EXCL : 0);
+    if (nlh)
+    {
+        nftnl_set_elems_nlmsg_build_payload(nlh, s);
+        nftables_msg_end(nlh);
+    }
+    nftnl_set_free(s);
+
+    return nlh != NULL;
+}
+
+/**
+ * Delete rule by its handle.
+ *
+ * @param chain Name of chain.
+ * @param handle Handle of rule.
+ * @return 1 if succesfull, 0 if out of memory.
+ */
+static int nftables_delete_rule(const char *chain, uint64_t handle)
+{
+    struct nftnl_rule *r = nftables_rule_alloc(chain);
+    int ok;
+
+    if (r == NULL)
+        return 0;
+    nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, handle);
+    ok = nftables_rule_msg(r, NFT_MSG_DELRULE, 0, NULL, NULL);
+    nftnl_rule_free(r);
+
+    return ok;
+}
+
+/**
+ * Check if DNAT of portmapping is handled by portmap map. Mappings with
+ * remote host or wildcard external port need rule of their own.
+ *
+ * @param item Portmapping.
+ * @return 1 if mapping is in map, 0 else.
+ */
+static int nftables_in_map(const struct portMap *item)
+{
+    return item->m_RemoteHostFamily == AF_UNSPEC && item->m_ExternalPort != 0;
+}
+
+/**
+ * Add DNAT and forward rules of portmapping. Only IPv4 addresses are
+ * supported, remote host and internal client can't be domain names.
+ * Handles of added rules are stored into portMap, inside transaction when
+ * transaction is committed.
+ *
+ * @param item Portmapping.
+ * @return 1 if succesfull, 0 else.
+ */
+int nftables_add_mapping(struct portMap *item)
+{
+    struct nftnl_rule *r;
+    struct in_addr addr;
+    uint16_t port;
+    int ok = 1;
+
+    if (!item->m_PortMappingEnabled)
+        return 1;
+
+    if (item->m_InternalClientFamily != AF_INET ||
+        (item->m_RemoteHostFamily != AF_UNSPEC && item->m_RemoteHostFamily != AF_INET))
+    {
+        trace(1, "nftables error: Only IPv4 addresses are supported in portmappings");
+        return 0;
+    }
+
+    nftables_transaction_begin();
+
+    if (g_vars.createForwardRules)
+    {
+        r = nftables_rule_alloc(g_vars.forwardChainName);
+        ok = r &&
+             (item->m_RemoteHostFamily == AF_UNSPEC ||
+              nftables_match_addr(r, offsetof(struct iphdr, saddr), &item->m_RemoteHost.v4)) &&
+             nftables_match_addr(r, offsetof(struct iphdr, daddr), &item->m_InternalClient.v4) &&
+             nftables_match_port(r, item->m_PortMappingProtocol, item->m_InternalPort) &&
+             nftables_expr(r, "immediate", NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT, NFTNL_EXPR_IMM_VERDICT, NF_ACCEPT, -1) &&
+             nftables_rule_msg(r, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_ECHO | (g_vars.forwardRulesAppend ? NLM_F_APPEND : 0),
+                               item, &item->m_ForwardHandle);
+        if (r)
+            nftnl_rule_free(r);
+    }
+
+    if (ok && nftables_in_map(item))
+    {
+        ok = nftables_map_msg(item, NFT_MSG_NEWSETELEM);
+    }
+    else if (ok)
+    {
+        // inserted at start of chain, so that rule is matched before map
+        addr = item->m_InternalClient.v4;
+        port = htons(item->m_InternalPort);
+        r = nftables_rule_alloc(g_vars.preroutingChainName);
+        ok = r &&
+             nftables_match_iifname(r) &&
+             (item->m_RemoteHostFamily == AF_UNSPEC ||
+              nftables_match_addr(r, offsetof(struct iphdr, saddr), &item->m_RemoteHost.v4)) &&
+             nftables_match_port(r, item->m_PortMappingProtocol, item->m_ExternalPort) &&
+             nftables_expr_data(r, "immediate", NFT_REG_1, &addr, sizeof(addr)) &&
+             nftables_expr_data(r, "immediate", NFT_REG_2, &port, sizeof(port)) &&
+             nftables_expr(r, "nat", NFTNL_EXPR_NAT_TYPE, NFT_NAT_DNAT, NFTNL_EXPR_NAT_FAMILY, NFPROTO_IPV4,
+                           NFTNL_EXPR_NAT_REG_ADDR_MIN, NFT_REG_1, NFTNL_EXPR_NAT_REG_PROTO_MIN, NFT_REG_2, -1) &&
+             nftables_rule_msg(r, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_ECHO, item, &item->m_NatHandle);
+        if (r)
+            nftnl_rule_free(r);
+    }
+
+    if (!ok)
+    {
+        trace(1, "nftables error: Can't build rules of portmapping");
+        nftables_transaction_abort();
+        return 0;
+    }
+
+    return nftables_transaction_commit();
+}
+
+/**
+ * Delete DNAT and forward rules of portmapping.
+ *
+ * @param item Portmapping.
+ * @return 1 if succesfull, 0 else.
+ */
+int nftables_delete_mapping(struct portMap *item)
+{
+    int i, status = 1;
+
+    if (!item->m_PortMappingEnabled)
+        return 1;
+
+    // rules of mapping added in this same transaction must be applied first
+    // to know their handles
+    for (i = 0; i < nftables_pending_count; i++)
+    {
+        if (nftables_pending[i].item == item)
+        {
+            nftables_flush();
+            break;
+        }
+    }
+
+    nftables_transaction_begin();
+
+    if (nftables_in_map(item))
+        status = nftables_map_msg(item, NFT_MSG_DELSETELEM);
+    else if (item->m_NatHandle)
+        status = nftables_delete_rule(g_vars.preroutingChainName, item->m_NatHandle);
+    else
+        status = 0;
+
+    if (item->m_ForwardHandle && !nftables_delete_rule(g_vars.forwardChainName, item->m_ForwardHandle))
+        status = 0;
+
+    if (!nftables_transaction_commit() || status == 0)
+        return 0;
+    return 1;
+}
+
+/**
+ * Start transaction. Until matching nftables_transaction_commit or
+ * nftables_transaction_abort is called, changes are only collected into
+ * batch. Transactions may be nested, only outermost one commits. If nested
+ * transaction is aborted, outermost one is aborted too.
+ */
+void nftables_transaction_begin(void)
+{
+    nftables_transaction_depth++;
+}
+
+/**
+ * End transaction. If this is outermost transaction, batch is sent to
+ * kernel. If batch fails, its messages are retried one by one.
+ *
+ * @return 1 if succesfull, 0 if some change failed.
+ */
+int nftables_transaction_commit(void)
+{
+    if (nftables_transaction_depth == 0 || --nftables_transaction_depth > 0)
+        return 1;
+
+    if (nftables_transaction_failed)
+    {
+        trace(1, "nftables: Nested transaction was aborted, aborting whole transaction");
+        nftables_transaction_failed = 0;
+        nftables_clear();
+        return 0;
+    }
+
+    return nftables_flush();
+}
+
+/**
+ * End transaction without applying anything. If transaction is nested,
+ * outermost transaction is marked failed and it aborts instead of commit.
+ */
+void nftables_transaction_abort(void)
+{
+    if (nftables_transaction_depth == 0)
+        return;
+    if (--nftables_transaction_depth > 0)
+    {
+        nftables_transaction_failed = 1;
+        return;
+    }
+
+    nftables_transaction_failed = 0;
+    nftables_clear();
+}
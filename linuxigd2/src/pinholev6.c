@@ -30,138 +30,808 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <upnp/TimerThread.h>
 #include <upnp/upnpconfig.h>
-#include <regex.h>
+#include <upnp/ithread.h>
 #include <sys/types.h>
 #include <time.h>
+#include <limits.h>
 
 #include "util.h"
 #include "globals.h"
 #include "gatedevice.h"
 #include "pinholev6.h"
+#include "actiontable.h"
+#include "logmonitor.h"
 
-static const char * add_rule_str = "ip6tables -I %s " //upnp forward chain
-        "-i %s "        //input interface
-        "-o %s "        //output interface
-        "-s %s "        //source address
-        "-d %s "        //destionation address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j ACCEPT";
-
-static const char * add_rule_raw_str = "ip6tables -t raw -I PREROUTING "
-        "-i %s "        //input interface
-        "-s %s "        //source address
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j TRACE";
-
-//no remote -> no source address in the rule
-static const char * add_rule_no_remote_str = "ip6tables "
-        "-I %s "        //upnp forward chain
-        "-i %s "        //input interface
-        "-o %s "        //output interface
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j ACCEPT";
-
-static const char * add_rule_raw_no_remote_str = "ip6tables -t raw "
-        "-I PREROUTING "
-        "-i %s "        //input interface
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j TRACE";
-
-
-static const char * del_rule_str = "ip6tables -D %s " //upnp forward chain
-        "-i %s "        //input interface
-        "-o %s "        //output interface
-        "-s %s "        //source address
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j ACCEPT";
-
-static const char * del_rule_raw_str = "ip6tables -t raw -D PREROUTING "
-        "-i %s "        //input interface
-        "-s %s "        //source address
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j TRACE";
-
-static const char * del_rule_no_remote_str = "ip6tables "
-        "-D %s "        //upnp forward chain
-        "-i %s "        //input interface
-        "-o %s "        //output interface
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j ACCEPT";
-
-static const char * del_rule_raw_no_remote_str = "ip6tables -t raw "
-        "-D PREROUTING "
-        "-i %s "        //input interface
-        "-d %s "        //destination address
-        "-p %i "        //protocol
-        "--sport %i "   //source port
-        "--dport %i "   //destination port
-        "-j TRACE";
+#if HAVE_LIBIPTC
+#include "ip6tc.h"
+#else
+#include "iptrestore.h"
+#endif
+
+// log prefixes of pinhole rules, followed by UniqueID of pinhole
+#define PHV6_LOG_SEEN "upnp6 seen "
+#define PHV6_LOG_ACCEPTED "upnp6 accepted "
+#define PHV6_LOG_PREFIX_LEN 64
+
+// how long ago traffic must have been seen by CheckPinholeWorking
+#define PHV6_WORKING_PERIOD 60
+
+// how many seconds packet counters read for all pinholes are reused
+#define PHV6_COUNTERS_MAX_AGE 1
+
+#if !HAVE_LIBIPTC
+// ip6tables-restore rules of pinhole: interface, addresses and ports of
+// match, chain, output interface, NFLOG options and fixed words of rule
+#define PHV6_MATCH_LEN (IFNAMSIZ + 2 * INET6_ADDRSTRLEN + 64)
+#define PHV6_RULE_LEN (OPTION_LEN + PHV6_MATCH_LEN + IFNAMSIZ + PHV6_LOG_PREFIX_LEN + 128)
+
+// rules of pinhole: ACCEPT rule, then its best effort NFLOG rules
+#define PHV6_RULE_ACCEPT 0
+#define PHV6_RULE_LOG_FIRST 1
+#define PHV6_RULE_LOG_LAST 2
+#endif
 
 /**
  * PRIVATE FUNCTIONS
  */
 
-extern ithread_mutex_t DevMutex;
+// expiration of pinholes, protected by pinhole lock
+static struct timerWheel phv6_wheel;
 
 int phv6_scheduleExpiration(struct pinholev6 *pinhole);
 
 int phv6_cancelExpiration(struct pinholev6 *pinhole);
 
+/*
+ * Hash indexes of pinhole list, one keyed on UniqueID and one on the
+ * 5-tuple of the pinhole. Open addressing tables with linear probing as the
+ * portmapping index. Deleted slots are refilled by shifting the rest of the
+ * run back, so no tombstones are needed. Protected by pinhole lock.
+ */
+#define PHV6_INDEX_MIN_SIZE 64
+
+struct phv6_index
+{
+    struct pinholev6 **slots;
+    unsigned int size;      // number of slots, always power of two
+    unsigned int count;     // number of used slots
+    unsigned int (*hash)(const struct pinholev6 *pinhole);
+};
+
+/*
+ * UniqueIDs in use, one bit per ID. UniqueID is ui2, so there are at most
+ * 65536 pinholes. Second level has one bit per word of the first level
+ * telling if that word is full. IDs are handed out from an increasing
+ * counter, so an ID just released is not given to next pinhole.
+ */
+#define PHV6_UNIQUE_IDS 65536
+#define PHV6_ID_WORDS (PHV6_UNIQUE_IDS / 64)
+#define PHV6_ID_SUMMARY_WORDS (PHV6_ID_WORDS / 64)
+
+static uint64_t phv6_idsInUse[PHV6_ID_WORDS];
+static uint64_t phv6_idWordsFull[PHV6_ID_SUMMARY_WORDS];
+static unsigned int phv6_idCount = 0;
+static uint32_t phv6_nextId = 0;
+
+/**
+ * Calculate hash of pinhole UniqueID.
+ *
+ * @param id The pinhole's unique id
+ * @return Hash value.
+ */
+static unsigned int phv6_hashId(uint32_t id)
+{
+    // multiplicative hashing, upper bits are the well mixed ones
+    id *= 2654435761u;
+    return id ^ (id >> 16);
+}
+
+/**
+ * Calculate hash of pinhole 5-tuple.
+ *
+ * @param internal_client The internal client address
+ * @param remote_host The remote host address, NULL if wildcarded
+ * @param internal_port The internal port
+ * @param remote_port The remote port
+ * @param protocol The protocol
+ * @return Hash value.
+ */
+static unsigned int phv6_hashTuple(const struct in6_addr *internal_client,
+        const struct in6_addr *remote_host,
+        uint16_t internal_port,
+        uint16_t remote_port,
+        uint8_t protocol)
+{
+    unsigned int key = ((unsigned int)protocol << 16) ^ internal_port ^ ((unsigned int)remote_port << 8);
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        key = (key ^ internal_client->s6_addr32[i]) * 2654435761u;
+        if (remote_host)
+            key = (key ^ remote_host->s6_addr32[i]) * 2654435761u;
+    }
+    return key ^ (key >> 16);
+}
+
+static unsigned int phv6_pinholeHashId(const struct pinholev6 *pinhole)
+{
+    return phv6_hashId(pinhole->unique_id);
+}
+
+static unsigned int phv6_pinholeHashTuple(const struct pinholev6 *pinhole)
+{
+    return phv6_hashTuple(pinhole->internal_client, pinhole->remote_host,
+            pinhole->internal_port, pinhole->remote_port, pinhole->protocol);
+}
+
+static struct phv6_index phv6_idIndex = { NULL, 0, 0, phv6_pinholeHashId };
+static struct phv6_index phv6_tupleIndex = { NULL, 0, 0, phv6_pinholeHashTuple };
+
+/**
+ * Insert pinhole into hash index. Index must have free slot.
+ *
+ * @param index The hash index
+ * @param pinhole The pinhole to add
+ */
+static void phv6_indexPut(struct phv6_index *index, struct pinholev6 *pinhole)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i = index->hash(pinhole) & mask;
+
+    while (index->slots[i] != NULL)
+        i = (i + 1) & mask;
+
+    index->slots[i] = pinhole;
+    index->count++;
+}
+
+/**
+ * Make sure that hash index has room for one more pinhole.
+ * Index is kept at most half full, it is doubled and rehashed when needed.
+ *
+ * @param index The hash index
+ * @return 1 if there is room, 0 if memory allocation failed.
+ */
+static int phv6_indexReserve(struct phv6_index *index)
+{
+    struct pinholev6 **old = index->slots;
+    unsigned int oldSize = index->size;
+    unsigned int newSize, i;
+
+    if ((index->count + 1) * 2 <= index->size)
+        return 1;
+
+    newSize = oldSize ? oldSize * 2 : PHV6_INDEX_MIN_SIZE;
+    index->slots = (struct pinholev6 **) calloc(newSize, sizeof(struct pinholev6 *));
+    if (index->slots == NULL)
+    {
+        trace(1, "Failed to allocate pinhole index of %u entries", newSize);
+        index->slots = old;
+        return 0;
+    }
+    index->size = newSize;
+    index->count = 0;
+
+    for (i = 0; i < oldSize; i++)
+    {
+        if (old[i])
+            phv6_indexPut(index, old[i]);
+    }
+    free(old);
+
+    return 1;
+}
+
+/**
+ * Remove pinhole from hash index. Following entries of the same probe
+ * run are moved back so that lookups never meet a hole inside a run.
+ *
+ * @param index The hash index
+ * @param pinhole The pinhole to remove
+ */
+static void phv6_indexRemove(struct phv6_index *index, struct pinholev6 *pinhole)
+{
+    unsigned int mask = index->size - 1;
+    unsigned int i, j, home;
+
+    if (index->slots == NULL)
+        return;
+
+    i = index->hash(pinhole) & mask;
+    while (index->slots[i] != pinhole)
+    {
+        if (index->slots[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    index->slots[i] = NULL;
+    index->count--;
+
+    // shift back entries which would not be found anymore
+    j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (index->slots[j] == NULL)
+            break;
+        home = index->hash(index->slots[j]) & mask;
+        // move entry from j to i if its home slot is not cyclically in (i, j]
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            index->slots[i] = index->slots[j];
+            index->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/**
+ * Drop everything from hash index.
+ *
+ * @param index The hash index
+ */
+static void phv6_indexClear(struct phv6_index *index)
+{
+    free(index->slots);
+    index->slots = NULL;
+    index->size = 0;
+    index->count = 0;
+}
+
+/**
+ * Mark UniqueID used or free.
+ *
+ * @param id The pinhole's unique id
+ * @param used 1 if id is taken into use, 0 if it is released
+ */
+static void phv6_markId(uint32_t id, int used)
+{
+    unsigned int word = id / 64;
+
+    if (used)
+    {
+        phv6_idsInUse[word] |= 1ULL << (id % 64);
+        if (phv6_idsInUse[word] == ~0ULL)
+            phv6_idWordsFull[word / 64] |= 1ULL << (word % 64);
+        phv6_idCount++;
+    }
+    else
+    {
+        phv6_idsInUse[word] &= ~(1ULL << (id % 64));
+        phv6_idWordsFull[word / 64] &= ~(1ULL << (word % 64));
+        phv6_idCount--;
+    }
+}
 
 /**
- * this functions seeks an available id in the pinhole list
+ * this functions seeks an available id for a new pinhole. The first free id
+ * following the previously given one is chosen.
  *
  * @param pointer to the newly found unique id.
  * @return 1 if ok, 0 otherwise
  */
 int findUniqueID(uint32_t * uniqueId)
 {
-    struct pinholev6 *pinhole;
-    uint32_t candidate_id;
+    unsigned int word, start, summary, n;
+    uint64_t bits;
+
+    if (phv6_idCount >= PHV6_UNIQUE_IDS)
+    {
+        //no Unique ID available
+        return 0;
+    }
+
+    word = phv6_nextId / 64;
+    bits = ~phv6_idsInUse[word] & (~0ULL << (phv6_nextId % 64));
+    if (bits == 0)
+    {
+        // first word with free id after this one, wrapping around to this one
+        start = (word + 1) % PHV6_ID_WORDS;
+        for (n = 0; n <= PHV6_ID_SUMMARY_WORDS; n++)
+        {
+            summary = (start / 64 + n) % PHV6_ID_SUMMARY_WORDS;
+            bits = ~phv6_idWordsFull[summary];
+            if (n == 0)
+                bits &= ~0ULL << (start % 64);
+            if (bits)
+                break;
+        }
+        word = summary * 64 + __builtin_ctzll(bits);
+        bits = ~phv6_idsInUse[word];
+    }
+
+    *uniqueId = word * 64 + __builtin_ctzll(bits);
+    phv6_nextId = (*uniqueId + 1) % PHV6_UNIQUE_IDS;
+
+    return 1;
+}
+
+/**
+ * Find pinhole by its 5-tuple.
+ *
+ * @param internal_client The internal client address
+ * @param remote_host The remote host address, NULL if wildcarded
+ * @param internal_port The internal port
+ * @param remote_port The remote port
+ * @param protocol The protocol
+ * @return The pinhole, NULL if there is no such pinhole
+ */
+static struct pinholev6 *phv6_lookupTuple(const struct in6_addr *internal_client,
+        const struct in6_addr *remote_host,
+        uint16_t internal_port,
+        uint16_t remote_port,
+        uint8_t protocol)
+{
+    struct pinholev6 *p;
+    unsigned int mask = phv6_tupleIndex.size - 1;
+    unsigned int i;
+
+    if(phv6_tupleIndex.count == 0) return NULL;
+
+    i = phv6_hashTuple(internal_client, remote_host, internal_port, remote_port, protocol) & mask;
+    for(; (p = phv6_tupleIndex.slots[i]) != NULL; i = (i + 1) & mask)
+    {
+        if((memcmp(p->internal_client, internal_client, 16) == 0)
+                && (p->internal_port == internal_port)
+                && (p->remote_port == remote_port)
+                && (p->protocol == protocol)
+                && ((p->remote_host == NULL && remote_host == NULL)
+                    || (p->remote_host != NULL && remote_host != NULL
+                        && memcmp(p->remote_host, remote_host, 16) == 0)))
+            return p;
+    }
+
+    return NULL;
+}
+
+/*
+ * Packet counters of pinhole rules. All rules are read at once and their
+ * counters are summed to entries of array sorted by UniqueID. Pinholes are
+ * only read, so counters may be read under read lock of pinholes.
+ */
+struct phv6_counterSnapshot
+{
+    struct phv6_packets *counters;
+    int count;
+};
+
+/**
+ * Compare counters by UniqueID, for qsort and bsearch.
+ */
+static int phv6_compareCounters(const void *a, const void *b)
+{
+    uint32_t id_a = ((const struct phv6_packets *)a)->unique_id;
+    uint32_t id_b = ((const struct phv6_packets *)b)->unique_id;
+
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+/**
+ * Add packet counter of firewall rule to counter of its pinhole.
+ * Rules which are not in the snapshot are skipped.
+ *
+ * @param arg The counter snapshot
+ */
+static void phv6_addCounter(const struct in6_addr *internal_client,
+        const struct in6_addr *remote_host,
+        uint16_t internal_port,
+        uint16_t remote_port,
+        uint8_t protocol,
+        uint64_t packets,
+        void *arg)
+{
+    struct phv6_counterSnapshot *snapshot = arg;
+    struct phv6_packets key, *counter;
+    struct pinholev6 *p;
 
-    pinhole = ph_first;
-    candidate_id = 0;
+    p = phv6_lookupTuple(internal_client, remote_host,
+            internal_port, remote_port, protocol);
+    if(p == NULL) return;
 
+    key.unique_id = p->unique_id;
+    counter = bsearch(&key, snapshot->counters, snapshot->count,
+            sizeof(*snapshot->counters), phv6_compareCounters);
+    if(counter != NULL) counter->packets += packets;
+}
 
-    while(pinhole != NULL)
+/*
+ * Counters of all pinholes from the last read of firewall rules, sorted by
+ * UniqueID. Without libiptc every read runs ip6tables-save, so successive
+ * GetPinholePackets calls share one read for PHV6_COUNTERS_MAX_AGE seconds.
+ * Callers hold read lock of pinholes, so the cache has its own mutex.
+ * Adding or deleting a pinhole empties it.
+ */
+static struct phv6_packets *phv6_cachedCounters = NULL;
+static int phv6_cachedCount = 0;
+static time_t phv6_cachedTime = 0;
+static int phv6_cacheValid = 0;
+static ithread_mutex_t phv6_cacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if !HAVE_LIBIPTC
+/**
+ * Parse rule of ip6tables-save -c output and add its packet counter to the
+ * snapshot, if it is ACCEPT rule of pinhole in the IPv6 forward chain.
+ * The rule looks like:
+ * [12:3456] -A FORWARD -s 2001:db8::5/128 -d 2001:db8::1/128 -i eth0 -o br0
+ *     -p tcp -m tcp --sport 1234 --dport 80 -j ACCEPT
+ *
+ * @param line Line of output, modified by parsing
+ * @param snapshot The counter snapshot
+ */
+static void phv6_parseSaveLine(char *line, struct phv6_counterSnapshot *snapshot)
+{
+    struct in6_addr internal_client, remote_host;
+    unsigned long long packets, bytes;
+    char *token, *value, *prefix, *saveptr;
+    int chain = 0, accept = 0, in = 0, out = 0;
+    int has_client = 0, has_remote = 0, has_sport = 0, has_dport = 0;
+    uint16_t internal_port = 0, remote_port = 0;
+    uint8_t protocol = 0;
+
+    if(sscanf(line, "[%llu:%llu]", &packets, &bytes) != 2) return;
+
+    strtok_r(line, " \t\n", &saveptr);
+    while((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL)
     {
-        if(pinhole->unique_id == candidate_id) {
-            candidate_id++;
-            if (candidate_id == 0) {
-                //integer overflow, no Unique ID available
-                return 0;
+        // negated matches are never pinhole rules
+        if(strcmp(token, "!") == 0) return;
+        if(token[0] != '-') continue;
+        if((value = strtok_r(NULL, " \t\n", &saveptr)) == NULL) break;
+        if(strcmp(value, "!") == 0) return;
+
+        if(strcmp(token, "-A") == 0)
+            chain = strcmp(value, g_vars.ipv6forwardChain) == 0;
+        else if(strcmp(token, "-j") == 0)
+            accept = strcmp(value, "ACCEPT") == 0;
+        else if(strcmp(token, "-i") == 0)
+            in = strcmp(value, g_vars.extInterfaceName) == 0;
+        else if(strcmp(token, "-o") == 0)
+            out = strcmp(value, g_vars.intInterfaceName) == 0;
+        else if(strcmp(token, "-s") == 0 || strcmp(token, "-d") == 0)
+        {
+            // only host addresses
+            if((prefix = strchr(value, '/')) != NULL)
+            {
+                if(strcmp(prefix, "/128") != 0) return;
+                *prefix = '\0';
             }
-            pinhole = ph_first;
+            if(token[1] == 's')
+                has_remote = inet_pton(AF_INET6, value, &remote_host) == 1;
+            else
+                has_client = inet_pton(AF_INET6, value, &internal_client) == 1;
         }
-        else pinhole = pinhole->next;
+        else if(strcmp(token, "-p") == 0)
+        {
+            if(strcmp(value, "tcp") == 0) protocol = IPPROTO_TCP;
+            else if(strcmp(value, "udp") == 0) protocol = IPPROTO_UDP;
+            else if(strcmp(value, "udplite") == 0) protocol = 136;
+            else protocol = atoi(value);
+        }
+        else if(strcmp(token, "--sport") == 0)
+        {
+            if(!isStringInteger(value)) return;
+            remote_port = atoi(value);
+            has_sport = 1;
+        }
+        else if(strcmp(token, "--dport") == 0)
+        {
+            if(!isStringInteger(value)) return;
+            internal_port = atoi(value);
+            has_dport = 1;
+        }
+    }
+
+    if(chain && accept && in && out && has_client && has_sport && has_dport)
+        phv6_addCounter(&internal_client, has_remote ? &remote_host : NULL,
+                internal_port, remote_port, protocol, packets, snapshot);
+}
+
+/**
+ * Read packet counters of pinhole rules from output of ip6tables-save.
+ * The whole filter table is read with one command.
+ *
+ * @param snapshot The counter snapshot
+ * @return 1 if Ok, 0 if command failed
+ */
+static int phv6_readSaveCounters(struct phv6_counterSnapshot *snapshot)
+{
+    char line[512];
+    FILE *pipe;
+
+    if((pipe = popen("ip6tables-save -c -t filter", "r")) == NULL)
+    {
+        trace(1, "Can't run ip6tables-save");
+        return 0;
+    }
+    while(fgets(line, sizeof(line), pipe) != NULL)
+    {
+        if(line[0] == '[')
+            phv6_parseSaveLine(line, snapshot);
+    }
+
+    return pclose(pipe) == 0;
+}
+#endif
+
+/**
+ * Read packet counters of the pinholes given in array. Firewall rules are
+ * read once for all of them.
+ *
+ * @param counters Counters with UniqueID set, sorted by UniqueID
+ * @param count Number of counters
+ * @return 1 if Ok, 0 if firewall rules could not be read
+ */
+static int phv6_readCounters(struct phv6_packets *counters, int count)
+{
+    struct phv6_counterSnapshot snapshot;
+    int i;
+
+    for(i = 0; i < count; i++)
+        counters[i].packets = 0;
+    snapshot.counters = counters;
+    snapshot.count = count;
+
+#if HAVE_LIBIPTC
+    return ip6tc_read_pinhole_counters(phv6_addCounter, &snapshot);
+#else
+    return phv6_readSaveCounters(&snapshot);
+#endif
+}
+
+/**
+ * Forget cached packet counters, when pinholes are added or deleted.
+ */
+static void phv6_dropCounters(void)
+{
+    ithread_mutex_lock(&phv6_cacheMutex);
+    free(phv6_cachedCounters);
+    phv6_cachedCounters = NULL;
+    phv6_cachedCount = 0;
+    phv6_cacheValid = 0;
+    ithread_mutex_unlock(&phv6_cacheMutex);
+}
+
+/**
+ * Make sure cached packet counters of all pinholes are fresh, reading them
+ * again with one read of firewall rules if they are too old.
+ * phv6_cacheMutex must be held.
+ *
+ * @return 1 if Ok, 0 if out of memory or firewall rules could not be read
+ */
+static int phv6_refreshCounters(void)
+{
+    struct phv6_packets *counters = NULL;
+    struct pinholev6 *p;
+    time_t now = time(NULL);
+    int n = 0;
+
+    if(phv6_cacheValid && now - phv6_cachedTime < PHV6_COUNTERS_MAX_AGE
+            && now >= phv6_cachedTime)
+        return 1;
+
+    if(phv6_idIndex.count > 0)
+    {
+        counters = malloc(phv6_idIndex.count * sizeof(*counters));
+        if(counters == NULL) return 0;
+
+        for(p = ph_first; p != NULL; p = p->next)
+            counters[n++].unique_id = p->unique_id;
+        qsort(counters, n, sizeof(*counters), phv6_compareCounters);
+    }
+
+    if(n > 0 && !phv6_readCounters(counters, n))
+    {
+        free(counters);
+        return 0;
     }
 
-    *uniqueId = candidate_id;
+    free(phv6_cachedCounters);
+    phv6_cachedCounters = counters;
+    phv6_cachedCount = n;
+    phv6_cachedTime = now;
+    phv6_cacheValid = 1;
 
     return 1;
+}
+
+#if !HAVE_LIBIPTC
+/**
+ * Insert or delete rules of pinhole: ACCEPT rule in the forward chain, NFLOG
+ * rule of accepted packets before it and NFLOG rule of arriving packets in
+ * raw PREROUTING. Rules are applied with one ip6tables-restore call, or with
+ * the batch if phv6_firewallBegin was called.
+ *
+ * @param command_flag "-I" to insert rules, "-D" to delete them
+ * @param first First rule to apply, PHV6_RULE_ACCEPT or PHV6_RULE_LOG_FIRST
+ * @param last Last rule to apply, PHV6_RULE_ACCEPT or PHV6_RULE_LOG_LAST
+ * @param internal_client The internal client address
+ * @param remote_host The remote host address, NULL if wildcarded
+ * @param internal_port The internal port
+ * @param remote_port The remote port
+ * @param protocol The protocol
+ * @param unique_id The unique id of the pinhole
+ * @return 1 if every rule was applied, 0 otherwise
+ */
+static int phv6_ip6tablesRules(const char *command_flag,
+        int first,
+        int last,
+        struct in6_addr *internal_client,
+        struct in6_addr *remote_host,
+        uint16_t internal_port,
+        uint16_t remote_port,
+        uint16_t protocol,
+        uint32_t unique_id)
+{
+    static const char *tables[3] = { "filter", "filter", "raw" };
+    char rules[3][PHV6_RULE_LEN];
+    char match[PHV6_MATCH_LEN];
+    char internal_client_str[INET6_ADDRSTRLEN];
+    char remote_host_str[INET6_ADDRSTRLEN];
+    char source[INET6_ADDRSTRLEN + 4] = "";
+    int lengths[3];
+    int length, i;
+
+    inet_ntop(AF_INET6, internal_client,
+            internal_client_str, INET6_ADDRSTRLEN);
+    //no remote -> no source address in the rule
+    if (remote_host)
+    {
+        inet_ntop(AF_INET6, remote_host,
+                remote_host_str, INET6_ADDRSTRLEN);
+        snprintf(source, sizeof(source), "-s %s ", remote_host_str);
+    }
+
+    length = snprintf(match, sizeof(match), "-i %s %s-d %s -p %i --sport %i --dport %i",
+            g_vars.extInterfaceName,
+            source,
+            internal_client_str,
+            protocol,
+            remote_port,
+            internal_port);
+    if (length < 0 || length >= (int)sizeof(match))
+    {
+        trace(1, "phv6_ip6tablesRules: match of pinhole %u too long", unique_id);
+        return 0;
+    }
+
+    //inserted first, so the log rule ends up before it
+    lengths[0] = snprintf(rules[0], sizeof(rules[0]), "%s %s %s -o %s -j ACCEPT",
+            command_flag, g_vars.ipv6forwardChain, match, g_vars.intInterfaceName);
+    lengths[1] = snprintf(rules[1], sizeof(rules[1]), "%s %s %s -o %s "
+            "-j NFLOG --nflog-group %i --nflog-prefix \"" PHV6_LOG_ACCEPTED "%u\"",
+            command_flag, g_vars.ipv6forwardChain, match, g_vars.intInterfaceName,
+            g_vars.ipv6nflogGroup, unique_id);
+    lengths[2] = snprintf(rules[2], sizeof(rules[2]), "%s PREROUTING %s "
+            "-j NFLOG --nflog-group %i --nflog-prefix \"" PHV6_LOG_SEEN "%u\"",
+            command_flag, match, g_vars.ipv6nflogGroup, unique_id);
+
+    //apply nothing unless every rule is complete
+    for (i = 0; i < 3; i++)
+    {
+        if (lengths[i] < 0 || lengths[i] >= (int)sizeof(rules[i]))
+        {
+            trace(1, "phv6_ip6tablesRules: rule of pinhole %u too long", unique_id);
+            return 0;
+        }
+    }
 
+    iptrestore_transaction_begin();
+    for (i = first; i <= last; i++)
+    {
+        if (!iptrestore_rule6(tables[i], rules[i]))
+        {
+            iptrestore_transaction_abort();
+            return 0;
+        }
+    }
+
+    return iptrestore_transaction_commit();
+}
+#endif
+
+/**
+ * Record packets logged by the NFLOG rules of pinholes. Packet is logged
+ * first when it arrives and again if it reaches ACCEPT rule of the pinhole,
+ * so after each packet the pinhole tells whether its last packet was
+ * accepted by it. Called from log monitor thread, pinholes are only read
+ * and the times are stored atomically, so read lock is enough.
+ *
+ * @param prefixes Log prefixes of packets in the order they were logged
+ * @param count Number of prefixes
+ */
+static void phv6_packetsLogged(const char **prefixes, int count)
+{
+    struct pinholev6 *p;
+    uint32_t now = (uint32_t)time(NULL);
+    const char *id;
+    int accepted, i;
+
+    ActionLockRead(ACTION_LOCK_PINHOLE);
+    for (i = 0; i < count; i++)
+    {
+        if (strncmp(prefixes[i], PHV6_LOG_SEEN, strlen(PHV6_LOG_SEEN)) == 0)
+        {
+            id = prefixes[i] + strlen(PHV6_LOG_SEEN);
+            accepted = 0;
+        }
+        else if (strncmp(prefixes[i], PHV6_LOG_ACCEPTED, strlen(PHV6_LOG_ACCEPTED)) == 0)
+        {
+            id = prefixes[i] + strlen(PHV6_LOG_ACCEPTED);
+            accepted = 1;
+        }
+        else
+            continue;
+
+        if (!phv6_findPinhole(strtoul(id, NULL, 10), &p))
+            continue;
+        if (!accepted)
+            __atomic_store_n(&p->last_seen, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&p->last_accepted, accepted, __ATOMIC_RELAXED);
+    }
+    ActionUnlock(ACTION_LOCK_PINHOLE);
+}
+
+/**
+ * Start batch of firewall rule changes. The changes are committed with one
+ * call per table with libip6tc, or with one ip6tables-restore call, in
+ * phv6_firewallCommit.
+ */
+static void phv6_firewallBegin(void)
+{
+#if HAVE_LIBIPTC
+    ip6tc_transaction_begin();
+#else
+    iptrestore_transaction_begin();
+#endif
+}
+
+/**
+ * Commit batch of firewall rule changes started with phv6_firewallBegin.
+ *
+ * @return 1 if changes were committed, 0 if failed.
+ */
+static int phv6_firewallCommit(void)
+{
+#if HAVE_LIBIPTC
+    return ip6tc_transaction_commit();
+#else
+    return iptrestore_transaction_commit();
+#endif
+}
+
+/**
+ * Remove pinhole from pinhole list, hash indexes and expiration, delete its
+ * firewall rules and free it.
+ *
+ * @param pinhole The pinhole to delete
+ */
+static void phv6_freePinhole(struct pinholev6 *pinhole)
+{
+    if (pinhole->prev)
+        pinhole->prev->next = pinhole->next;
+    else
+        ph_first = pinhole->next;
+    if (pinhole->next)
+        pinhole->next->prev = pinhole->prev;
+
+    phv6_indexRemove(&phv6_idIndex, pinhole);
+    phv6_indexRemove(&phv6_tupleIndex, pinhole);
+    phv6_markId(pinhole->unique_id, 0);
+    phv6_cancelExpiration(pinhole);
+    phv6_dropCounters();
+
+    phv6_ip6table_deleteRule(pinhole->internal_client,
+            pinhole->remote_host,
+            pinhole->internal_port,
+            pinhole->remote_port,
+            pinhole->protocol,
+            pinhole->unique_id,
+            pinhole->logged);
+    free(pinhole->internal_client);
+    if(pinhole->remote_host != NULL) free(pinhole->remote_host);
+    free(pinhole);
 }
 
 /**
@@ -173,32 +843,54 @@ int findUniqueID(uint32_t * uniqueId)
 /**
  * This functions initializes ip6tables and the pinhole list
  *
- * @return 1 if ok
+ * @return 1 if ok, 0 if rules of INPUT chain could not be added
  */
 int phv6_init(void)
 {
     //pinhole list initialization
     ph_first = NULL;
-#ifdef UPNP_ENABLE_IPV6
-    int rc;
-    //string used for system commands
-    char command[250];
 
+    //packets logged by the pinhole rules tell if pinholes are working
+    if (!LogMonitorStart(g_vars.ipv6nflogGroup, phv6_packetsLogged))
+        trace(1, "Log monitor start failed, CheckPinholeWorking detects no traffic");
+#ifdef UPNP_ENABLE_IPV6
     //the nf_conntrack module gives the outbound pinhole timeout information
     trace(3, "loading nf_conntrack module");
-    rc = system("/sbin/modprobe nf_conntrack");
-
-    //the ip6t_LOG module enables the "raw" table for ip6tables
-    //this is useful for the checkpinholeworking action
-    trace(3, "loading ip6t_LOG module");
-    rc = system("/sbin/modprobe ip6t_LOG");
+    if (system("/sbin/modprobe nf_conntrack") != 0)
+        trace(2, "modprobe nf_conntrack failed, module may be built in");
 
     trace(3, "ip6tables initialization");
 
-    snprintf(command, 250, "ip6tables -I INPUT -p tcp --dport %i -j ACCEPT", UpnpGetServerPort6());
-    rc = system(command);
-    snprintf(command, 250, "ip6tables -I INPUT -p udp --dport %i -j ACCEPT", UpnpGetServerPort6());
-    rc = system(command);
+#if HAVE_LIBIPTC
+    phv6_firewallBegin();
+    if (!ip6tc_add_input_rule(IPPROTO_TCP, UpnpGetServerPort6()) ||
+        !ip6tc_add_input_rule(IPPROTO_UDP, UpnpGetServerPort6()))
+    {
+        ip6tc_transaction_abort();
+        return 0;
+    }
+    if (!phv6_firewallCommit())
+        return 0;
+#else
+    //rule used for ip6tables-restore
+    char rule[64];
+
+    phv6_firewallBegin();
+    snprintf(rule, sizeof(rule), "-I INPUT -p tcp --dport %i -j ACCEPT", UpnpGetServerPort6());
+    if (!iptrestore_rule6("filter", rule))
+    {
+        iptrestore_transaction_abort();
+        return 0;
+    }
+    snprintf(rule, sizeof(rule), "-I INPUT -p udp --dport %i -j ACCEPT", UpnpGetServerPort6());
+    if (!iptrestore_rule6("filter", rule))
+    {
+        iptrestore_transaction_abort();
+        return 0;
+    }
+    if (!phv6_firewallCommit())
+        return 0;
+#endif
 #endif
 
     return 1;
@@ -213,25 +905,17 @@ int phv6_init(void)
  */
 int phv6_close(void)
 {
+    //log monitor takes pinhole lock, stop it before anything is freed
+    LogMonitorStop();
+
     //pinhole list deletion
-    struct pinholev6 * pinhole;
-    struct pinholev6 * p_delete = ph_first;
-    //int rc;
+    phv6_firewallBegin();
+    while(ph_first != NULL)
+        phv6_freePinhole(ph_first);
+    phv6_firewallCommit();
 
-    while(p_delete!=NULL)
-    {
-        pinhole = p_delete->next;
-        phv6_cancelExpiration(p_delete);
-        phv6_ip6table_deleteRule(p_delete->internal_client,
-                p_delete->remote_host,
-                p_delete->internal_port,
-                p_delete->remote_port,
-                p_delete->protocol);
-        free(p_delete->internal_client);
-        if(p_delete->remote_host != NULL) free(p_delete->remote_host);
-        free(p_delete);
-        p_delete = pinhole;
-    }
+    phv6_indexClear(&phv6_idIndex);
+    phv6_indexClear(&phv6_tupleIndex);
 
     trace(3, "ip6tables reset");
 
@@ -239,70 +923,76 @@ int phv6_close(void)
 }
 
 /**
- * This function gives the rule number associated with the
- * given pinhole id in the ip6tables policies
+ * This function gives the number of packets that went through
+ * the given pinhole, read from the counter of its firewall rule.
+ * Counters of all pinholes are read at once and reused for
+ * PHV6_COUNTERS_MAX_AGE seconds.
  *
  * @param id the pinhole's unique id
- * @param lineNumber a pointer to an int that stores the line number
- * @return 1 if the pinhole is found, 0 otherwise
+ * @param packets a pointer to an int that stores the result
+ * @return 1 if the pinhole has been found and its counter read, 0 otherwise
  */
-int phv6_findLineNumber(uint32_t id, int * lineNumber)
+int phv6_getPinholePackets(uint32_t id, int * packets)
 {
+    struct phv6_packets key, *counter = NULL;
     struct pinholev6 *p;
-    //the rule number begins at 1
-    int index = 1;
 
-    p = ph_first;
+    *packets = 0;
+    if(!phv6_findPinhole(id, &p)) return 0;
 
-    //as the newest pinhole are inserted at the beginning of queue
-    //the index is the depth of the pinhole in the queue
-    while( p != NULL )
+    key.unique_id = id;
+    ithread_mutex_lock(&phv6_cacheMutex);
+    if(phv6_refreshCounters())
     {
-        if( p->unique_id == id )
-        {
-            *lineNumber = index;
-            return 1;
-        }
-        else
-        {
-            p = p->next;
-        }
-        index++;
+        counter = bsearch(&key, phv6_cachedCounters, phv6_cachedCount,
+                sizeof(*phv6_cachedCounters), phv6_compareCounters);
+        //PinholePackets is ui4 but the response is an int
+        if(counter != NULL)
+            *packets = counter->packets > INT_MAX ? INT_MAX : (int)counter->packets;
     }
+    ithread_mutex_unlock(&phv6_cacheMutex);
 
-    return 0;
+    return counter != NULL;
 }
 
 /**
  * This function gives the number of packets that went through
- * the given pinhole
+ * every pinhole with one read of firewall rules, or from counters
+ * read less than PHV6_COUNTERS_MAX_AGE seconds ago
  *
- * @param id the pinhole's unique id
- * @param packets a pointer to an int that stores the result
- * @return 1 if the pinhole has been found, 0 otherwise
+ * @param counters a pointer to an array allocated with malloc, sorted by
+ * unique id. The caller frees it. NULL if there are no pinholes
+ * @param count a pointer to an int that stores the number of pinholes
+ * @return 1 if Ok, 0 otherwise
+ *
+ * NB : pinholes must be locked for reading, as for GetPinholePackets.
  */
-int phv6_getPinholePackets(uint32_t id, int * packets)
+int phv6_getAllPinholePackets(struct phv6_packets **counters, int *count)
 {
-    int lineNumber;
-    FILE * pipe;
-    char command[100];
-    char garbage[100];
-    int rc;
+    int result = 0;
 
-    if(phv6_findLineNumber(id, &lineNumber))
-    {
-        trace(1, "line number : %i", lineNumber);
-        snprintf(command, 100, "ip6tables -L %s %i -v -n -x",
-                g_vars.ipv6forwardChain,
-                lineNumber);
-        pipe = popen(command, "r");
-        rc = fscanf(pipe, "%i %s", packets, garbage);
-        pclose(pipe);
+    *counters = NULL;
+    *count = 0;
 
-        return 1;
+    ithread_mutex_lock(&phv6_cacheMutex);
+    if(phv6_refreshCounters())
+    {
+        result = 1;
+        if(phv6_cachedCount > 0)
+        {
+            *counters = malloc(phv6_cachedCount * sizeof(**counters));
+            if(*counters != NULL)
+            {
+                memcpy(*counters, phv6_cachedCounters, phv6_cachedCount * sizeof(**counters));
+                *count = phv6_cachedCount;
+            }
+            else
+                result = 0;
+        }
     }
+    ithread_mutex_unlock(&phv6_cacheMutex);
 
-    return 0;
+    return result;
 }
 
 /**
@@ -316,21 +1006,18 @@ int phv6_getPinholePackets(uint32_t id, int * packets)
  */
 int phv6_findPinhole(uint32_t id, struct pinholev6 ** pinhole)
 {
-    struct pinholev6 *p;
+    unsigned int mask = phv6_idIndex.size - 1;
+    unsigned int i;
 
-    p = ph_first;
+    if(phv6_idIndex.count == 0) return 0;
 
-    while( p != NULL )
+    for(i = phv6_hashId(id) & mask; phv6_idIndex.slots[i] != NULL; i = (i + 1) & mask)
     {
-        if( p->unique_id == id )
+        if(phv6_idIndex.slots[i]->unique_id == id)
         {
-            *pinhole = p;
+            *pinhole = phv6_idIndex.slots[i];
             return 1;
         }
-        else
-        {
-            p = p->next;
-        }
     }
 
     return 0;
@@ -355,42 +1042,28 @@ int phv6_existingPinhole(char *_internal_client,
         char *_protocol,
         uint32_t *uniqueID)
 {
-    struct pinholev6 *p = ph_first;
+    struct pinholev6 *p;
     struct in6_addr internal_client;
     struct in6_addr remote_host;
-    uint16_t internal_port;
-    uint16_t remote_port;
-    uint16_t protocol;
+    struct in6_addr *remote = NULL;
 
+    memset(&internal_client, 0, sizeof(internal_client));
     inet_pton(AF_INET6, _internal_client, &internal_client);
-    inet_pton(AF_INET6, _remote_host, &remote_host);
-    internal_port = atoi(_internal_port);
-    remote_port = atoi(_remote_port);
-    protocol = atoi(_protocol);
+    //wildcard case
+    if(strcmp(_remote_host, "") != 0) {
+        memset(&remote_host, 0, sizeof(remote_host));
+        inet_pton(AF_INET6, _remote_host, &remote_host);
+        remote = &remote_host;
+    }
 
-    while(p != NULL)
+    p = phv6_lookupTuple(&internal_client, remote,
+            atoi(_internal_port), atoi(_remote_port), atoi(_protocol));
+    if(p != NULL)
     {
-        if((memcmp(p->internal_client, &internal_client, 16) == 0)
-                && (p->internal_port == internal_port)
-                && (p->remote_port == remote_port)
-                && (p->protocol == protocol))
-        {
-            if(p->remote_host != NULL) {
-                if(memcmp(p->remote_host, &remote_host, 16) == 0) {
-                    *uniqueID = p->unique_id;
-                    return 1;
-                }
-            }
-            //wildcard case
-            else if(strcmp(_remote_host, "") == 0) {
-                *uniqueID = p->unique_id;
-                return 1;
-            }
-
-
-        }
-        p = p->next;
+        *uniqueID = p->unique_id;
+        return 1;
     }
+
     return 0;
 }
 
@@ -404,7 +1077,9 @@ int phv6_existingPinhole(char *_internal_client,
  * @param protocol A string representing the protocol
  * @param lease_time A unsigned integer giving the desired lease_time
  * @param uniqueId An int pointer giving the uniqueid of the existing pinhole
- * @return 1 if Ok, 0 otherwise. The new unique_id is given in the pointer
+ * @return 1 if Ok, 0 if firewall rules could not be added, -1 if there is no
+ * room for more pinholes, -2 if out of memory. The new unique_id is given in
+ * the pointer
  */
 int phv6_addPinhole(char *internal_client,
         char *remote_host,
@@ -415,17 +1090,24 @@ int phv6_addPinhole(char *internal_client,
         uint32_t *uniqueId)
 {
     struct pinholev6 *p_new;
+    uint32_t unique_id;
+
+    //no room for more pinholes
+    if(!findUniqueID(&unique_id)) return -1;
+    if(!phv6_indexReserve(&phv6_idIndex) || !phv6_indexReserve(&phv6_tupleIndex))
+        return -2;
 
     //allocate the pinhole memory
     p_new = (struct pinholev6 *)malloc(sizeof(struct pinholev6));
-    if(p_new == NULL) return -1;
+    if(p_new == NULL) return -2;
 
     //copy the internal client address
     p_new->internal_client = (struct in6_addr *)malloc(sizeof(struct in6_addr));
     if(p_new->internal_client == NULL) {
         free(p_new);
-        return -1;
+        return -2;
     }
+    memset(p_new->internal_client, 0, sizeof(struct in6_addr));
     inet_pton(AF_INET6, internal_client, p_new->internal_client);
 
     //copy the remote host address (if not wildcarded)
@@ -434,9 +1116,10 @@ int phv6_addPinhole(char *internal_client,
         if(p_new->remote_host == NULL) {
             free(p_new->internal_client);
             free(p_new);
-            return -1;
+            return -2;
         }
 
+        memset(p_new->remote_host, 0, sizeof(struct in6_addr));
         inet_pton(AF_INET6, remote_host, p_new->remote_host);
     }
     else p_new->remote_host = NULL;
@@ -445,29 +1128,39 @@ int phv6_addPinhole(char *internal_client,
     p_new->remote_port = atoi(remote_port);
     p_new->protocol = atoi(protocol);
     p_new->lease_time = lease_time;
-    p_new->next = NULL;
-
-    findUniqueID(&p_new->unique_id);
-    *uniqueId = p_new->unique_id;
+    p_new->last_seen = 0;
+    p_new->last_accepted = 0;
+    TimerNodeInit(&p_new->expiration);
 
-    if(ph_first == NULL)
-    {
-        ph_first = p_new;
-    }
-    else
-    {
-        //adding the new pinhole at the top of the queue
-        p_new->next = ph_first;
-        ph_first = p_new;
-    }
-
-    phv6_scheduleExpiration(p_new);
-    phv6_ip6table_addRule(p_new->internal_client,
+    if(!phv6_ip6table_addRule(p_new->internal_client,
             p_new->remote_host,
             p_new->internal_port,
             p_new->remote_port,
-            p_new->protocol);
+            p_new->protocol,
+            unique_id,
+            &p_new->logged))
+    {
+        free(p_new->internal_client);
+        if(p_new->remote_host != NULL) free(p_new->remote_host);
+        free(p_new);
+        return 0;
+    }
+
+    p_new->unique_id = unique_id;
+    phv6_markId(unique_id, 1);
+    *uniqueId = p_new->unique_id;
+
+    //adding the new pinhole at the top of the queue
+    p_new->prev = NULL;
+    p_new->next = ph_first;
+    if(ph_first != NULL) ph_first->prev = p_new;
+    ph_first = p_new;
 
+    phv6_indexPut(&phv6_idIndex, p_new);
+    phv6_indexPut(&phv6_tupleIndex, p_new);
+    phv6_dropCounters();
+
+    phv6_scheduleExpiration(p_new);
 
     return 1;
 }
@@ -481,72 +1174,13 @@ int phv6_addPinhole(char *internal_client,
 int phv6_deletePinhole(uint32_t id)
 {
     struct pinholev6 *p;
-    struct pinholev6 *p_delete;
 
-    if(ph_first == NULL) return 0;
-
-    //this case is when the first pinhole of the list is the targeted one
-    if(ph_first->unique_id == id)
+    if(phv6_findPinhole(id, &p))
     {
-        if(ph_first->event_id >= 0)
-            phv6_cancelExpiration(ph_first);
-
-        if(ph_first->next!= NULL)
-        {
-            p = ph_first->next;
-            phv6_ip6table_deleteRule(ph_first->internal_client,
-                    ph_first->remote_host,
-                    ph_first->internal_port,
-                    ph_first->remote_port,
-                    ph_first->protocol);
-            free(ph_first->internal_client);
-            if(ph_first->remote_host != NULL) free(ph_first->remote_host);
-            free(ph_first);
-            ph_first = p;
-        }
-        else
-        {
-            phv6_ip6table_deleteRule(ph_first->internal_client,
-                    ph_first->remote_host,
-                    ph_first->internal_port,
-                    ph_first->remote_port,
-                    ph_first->protocol);
-
-            free(ph_first->internal_client);
-            if(ph_first->remote_host != NULL) free(ph_first->remote_host);
-            free(ph_first);
-            ph_first = NULL;
-        }
-
+        phv6_freePinhole(p);
         return 1;
     }
 
-    p = ph_first;
-
-    while(p->next != NULL)
-    {
-        if(p->next->unique_id == id)
-        {
-            //the pinhole has been found
-            p_delete = p->next;
-            p->next = p_delete->next;
-
-            if(p_delete->event_id >= 0)
-                phv6_cancelExpiration(p_delete);
-
-            phv6_ip6table_deleteRule(p_delete->internal_client,
-                    p_delete->remote_host,
-                    p_delete->internal_port,
-                    p_delete->remote_port,
-                    p_delete->protocol);
-            free(p_delete->internal_client);
-            if(p_delete->remote_host != NULL) free(p_delete->remote_host);
-            free(p_delete);
-            return 1;
-        }
-        p = p->next;
-    }
-
     return 0;
 }
 
@@ -564,7 +1198,6 @@ int phv6_updatePinhole(uint32_t id, uint32_t lease_time)
     if(phv6_findPinhole(id, &pinhole))
     {
         pinhole->lease_time = lease_time;
-        phv6_cancelExpiration(pinhole);
         phv6_scheduleExpiration(pinhole);
         return 1;
     }
@@ -580,90 +1213,45 @@ int phv6_updatePinhole(uint32_t id, uint32_t lease_time)
  * @param internal_port A string representing the internal port
  * @param remote_port A string representing the remote port
  * @param protocol A string representing the protocol
- * @return 1 if Ok
+ * @param unique_id The unique id of the pinhole, used in log prefixes
+ * @param logged Set to 1 if log rules of the pinhole were added, 0 else
+ * @return 1 if Ok, 0 if rules could not be added
  */
 int phv6_ip6table_addRule(struct in6_addr *internal_client,
         struct in6_addr *remote_host,
         uint16_t internal_port,
         uint16_t remote_port,
-        uint16_t protocol)
+        uint16_t protocol,
+        uint32_t unique_id,
+        int *logged)
 {
+#if HAVE_LIBIPTC
+    char seen_prefix[PHV6_LOG_PREFIX_LEN];
+    char accepted_prefix[PHV6_LOG_PREFIX_LEN];
+
+    snprintf(seen_prefix, PHV6_LOG_PREFIX_LEN, PHV6_LOG_SEEN "%u", unique_id);
+    snprintf(accepted_prefix, PHV6_LOG_PREFIX_LEN, PHV6_LOG_ACCEPTED "%u", unique_id);
+
+    return ip6tc_add_pinhole(internal_client, remote_host,
+            internal_port, remote_port, (uint8_t)protocol,
+            seen_prefix, accepted_prefix, logged);
+#else
+    if (!phv6_ip6tablesRules("-I", PHV6_RULE_ACCEPT, PHV6_RULE_ACCEPT,
+            internal_client, remote_host, internal_port, remote_port, protocol, unique_id))
+        return 0;
 
-    //string used to pass ip6tables commands
-    char command[250];
-    int rc;
-
-    //pinhole parameters. The remote host is tested
-    //to see if it is wildcarded
-    char internal_client_str[INET6_ADDRSTRLEN];
-    char remote_host_str[INET6_ADDRSTRLEN];
-
-    inet_ntop(AF_INET6, internal_client,
-            internal_client_str, INET6_ADDRSTRLEN);
-
-    //not wildcard
-    if (remote_host)
-    {
-        //add the firewall rule
-        inet_ntop(AF_INET6, remote_host,
-                remote_host_str, INET6_ADDRSTRLEN);
-
-        snprintf(command, 250, add_rule_str,
-                g_vars.ipv6forwardChain,
-                g_vars.extInterfaceName,
-                g_vars.intInterfaceName,
-                remote_host_str,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-
-        trace(3, command);
-
-        //add the trace rule
-        snprintf(command, 250, add_rule_raw_str,
-                g_vars.extInterfaceName,
-                remote_host_str,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-
-        trace(3, command);
-
-    }
-    //remote host wildcarded
-    else
+    //log rules are only needed by CheckPinholeWorking, pinhole works without
+    *logged = phv6_ip6tablesRules("-I", PHV6_RULE_LOG_FIRST, PHV6_RULE_LOG_LAST,
+            internal_client, remote_host, internal_port, remote_port, protocol, unique_id);
+    if (!*logged)
     {
-        snprintf(command, 250, add_rule_no_remote_str,
-                g_vars.ipv6forwardChain,
-                g_vars.extInterfaceName,
-                g_vars.intInterfaceName,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
-        snprintf(command, 250, add_rule_raw_no_remote_str,
-                g_vars.extInterfaceName,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
+        trace(1, "Log rules of pinhole %u could not be added, its traffic is not checked", unique_id);
+        phv6_ip6tablesRules("-D", PHV6_RULE_LOG_FIRST, PHV6_RULE_LOG_LAST,
+                internal_client, remote_host, internal_port, remote_port, protocol, unique_id);
     }
 
     return 1;
+#endif
 }
 
 /**
@@ -674,151 +1262,70 @@ int phv6_ip6table_addRule(struct in6_addr *internal_client,
  * @param internal_port A string representing the internal port
  * @param remote_port A string representing the remote port
  * @param protocol A string representing the protocol
- * @return 1 if Ok
+ * @param unique_id The unique id of the pinhole, used in log prefixes
+ * @param logged Were log rules of the pinhole added
+ * @return 1 if Ok, 0 if some rule could not be deleted
  */
 int phv6_ip6table_deleteRule(struct in6_addr *internal_client,
         struct in6_addr *remote_host,
         uint16_t internal_port,
         uint16_t remote_port,
-        uint16_t protocol)
-{
-
-
-    char command[250];
-    char internal_client_str[INET6_ADDRSTRLEN];
-    char remote_host_str[INET6_ADDRSTRLEN];
-    int rc;
-
-    inet_ntop(AF_INET6, internal_client,
-            internal_client_str, INET6_ADDRSTRLEN);
-
-    if (remote_host)
-    {
-        inet_ntop(AF_INET6, remote_host,
-                remote_host_str, INET6_ADDRSTRLEN);
-
-        snprintf(command, 250, del_rule_str,
-                g_vars.ipv6forwardChain,
-                g_vars.extInterfaceName,
-                g_vars.intInterfaceName,
-                remote_host_str,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
-        snprintf(command, 250, del_rule_raw_str,
-                g_vars.extInterfaceName,
-                remote_host_str,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
-    }
-    else
-    {
-        snprintf(command, 250, del_rule_no_remote_str,
-                g_vars.ipv6forwardChain,
-                g_vars.extInterfaceName,
-                g_vars.intInterfaceName,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
-        snprintf(command, 250, del_rule_raw_no_remote_str,
-                g_vars.extInterfaceName,
-                internal_client_str,
-                protocol,
-                remote_port,
-                internal_port);
-
-        rc = system(command);
-        trace(3, command);
-
-    }
-
-    return 1;
-}
-
-/**
- * Set expiration event free.
- *
- * @param event Expiration event.
- */
-void phv6_freeEvent(struct phv6_expirationEvent *event)
+        uint16_t protocol,
+        uint32_t unique_id,
+        int logged)
 {
-    if (event != NULL && event->pinhole !=NULL)
-        event->pinhole->event_id = -1;
-    free(event);
+#if HAVE_LIBIPTC
+    return ip6tc_delete_pinhole(internal_client, remote_host,
+            internal_port, remote_port, (uint8_t)protocol, logged);
+#else
+    //missing log rule fails its table, which is then retried rule by rule
+    return phv6_ip6tablesRules("-D", PHV6_RULE_ACCEPT,
+            logged ? PHV6_RULE_LOG_LAST : PHV6_RULE_ACCEPT,
+            internal_client, remote_host, internal_port, remote_port, protocol, unique_id);
+#endif
 }
 
 /**
- * This function makes a pinhole expires as its lease time is reached
+ * This function makes the pinholes expire whose lease time is reached.
+ * All of them are deleted under one acquisition of the pinhole lock.
  *
- * @param data Expiration event.
+ * @param now Current time.
  */
-void phv6_expiration(void *data)
+void phv6_expire(time_t now)
 {
-    struct phv6_expirationEvent *event = ( struct phv6_expirationEvent * ) data;
+    struct timerNode *due, *node;
+    struct pinholev6 *pinhole;
 
-    ithread_mutex_lock(&DevMutex);
+    ActionLockWrite(ACTION_LOCK_PINHOLE);
 
-    event->pinhole->event_id = -1;
-    phv6_deletePinhole(event->pinhole->unique_id);
-    phv6_freeEvent(event);
+    if(TimerWheelCollect(&phv6_wheel, now, &due) > 0)
+    {
+        phv6_firewallBegin();
+        while((node = TimerWheelPop(&due)) != NULL)
+        {
+            pinhole = TIMER_NODE_ENTRY(node, struct pinholev6, expiration);
+            trace(2, "Pinhole %u expired", pinhole->unique_id);
+            phv6_freePinhole(pinhole);
+        }
+        phv6_firewallCommit();
+    }
 
-    ithread_mutex_unlock(&DevMutex);
+    ActionUnlock(ACTION_LOCK_PINHOLE);
 }
 
 /**
- * This function schedules the expiration when this pinhole is created or updated
+ * This function schedules the expiration when this pinhole is created or updated.
+ * Expiration scheduled earlier is replaced.
  *
  * @param pinhole The pinhole to expire
- * @return the event_id created
+ * @return 1 if Ok
  */
 int phv6_scheduleExpiration(struct pinholev6 *pinhole)
 {
-    ThreadPoolJob job;
-    struct phv6_expirationEvent *event;
-
-    event = (struct phv6_expirationEvent *)malloc(
-            sizeof(struct phv6_expirationEvent));
-    if(event == NULL)
-    {
-        return 0;
-    }
-
-    event->pinhole = pinhole;
-
-    TPJobInit( &job, ( start_routine ) phv6_expiration, event );
-    TPJobSetFreeFunction( &job, ( free_routine ) phv6_freeEvent );
-
-    if( TimerThreadSchedule(&gExpirationTimerThread,
-            pinhole->lease_time,
-            REL_SEC,
-            &job,
-            SHORT_TERM,
-            &(event->event_id))
-            != UPNP_E_SUCCESS )
-    {
-        free( event );
-        return 0;
-    }
+    TimerWheelSchedule(&phv6_wheel, &pinhole->expiration,
+            time(NULL) + pinhole->lease_time);
 
-    pinhole->event_id = event->event_id;
-
-    return event->event_id;
+    return 1;
 }
 
 /**
@@ -829,19 +1336,10 @@ int phv6_scheduleExpiration(struct pinholev6 *pinhole)
  */
 int phv6_cancelExpiration(struct pinholev6 * pinhole)
 {
-    ThreadPoolJob job;
+    if(TimerNodePending(&pinhole->expiration))
+        trace(3,"Canceling expiration for pinhole : %i",pinhole->unique_id);
 
-    trace(1,"Canceling expiration for pinhole : %i",pinhole->unique_id);
-
-    if( TimerThreadRemove(&gExpirationTimerThread,pinhole->event_id, &job)==0 )
-    {
-        phv6_freeEvent((struct phv6_expirationEvent *)job.arg);
-    }
-    else
-    {
-        trace(1,"  TimerThreadRemove failed!");
-        return 0;
-    }
+    TimerWheelCancel(&pinhole->expiration);
     return 1;
 }
 
@@ -849,201 +1347,40 @@ int phv6_cancelExpiration(struct pinholev6 * pinhole)
  * This function checks if a pinhole really manages the packets that have to be
  * treated by the pinhole given in parameter
  *
- * NB : this function does not literraly checks if the pinhole is working. This
- * function verifies if some traffic matching the pinhole parameters is
- * received by checking the data stored in /var/log/kern.log. Those data are generated
- * by the ip6t_LOG module. If some traffic is received, it checks that the last packet
- * matching the pinhole parameters passed through this pinhole. It the packets did so,
- * the function returns 1. If the packet passed through another rule, it will return 0.
- * If no traffic is detected, it returns -1.
+ * NB : this function does not literraly checks if the pinhole is working. The
+ * rules of the pinhole log packets matching the pinhole parameters when they
+ * are received and when they pass through the pinhole, and the log monitor
+ * records the last ones. If some traffic was received during the last minute,
+ * it tells whether the last packet passed through this pinhole. It the packet
+ * did so, the function returns 1. If the packet passed through another rule,
+ * it will return 0. If no traffic is detected, or the log rules of the
+ * pinhole could not be added, it returns -1.
  *
  * @param pinhole The pinhole to inspect
- * @return -1 No traffic detected
+ * @return -1 No traffic detected or traffic is not logged
  * @return 0 Packet treated by another rule
  * @return 1 The Pinhole manages the packets
  */
 int phv6_checkPinholeWorking(int pinhole_id)
 {
-    regex_t re_packet;
-    regex_t re_rule;
-
-    char regex_packet[512];
-    char regex_rule[256];
-
-    regmatch_t pmatch[4];
-    time_t current_time = time(NULL);
-    time_t old_time = current_time - 60;
-    //60 sec before the action is called, traffic is detected
-    //within 1 minute
-
-
-    struct tm * cur_time_tm = malloc(sizeof(struct tm));
-    struct tm * old_time_tm = malloc(sizeof(struct tm));
-
-    char cur_time_str[100];
-    char old_time_str[100];
-
-    //this string is used to store the last occurence
-    //of a matching packet
-    char packet_line[1024];
-
-    //the pinhole to check
-    struct pinholev6 * pinhole = NULL;
-
-    int rule = 0;
-
-    char * protocol = "";
-
-    char internal_client_str[INET6_ADDRSTRLEN];
-    char remote_host_str[INET6_ADDRSTRLEN];
-
-    struct in6_addr internal_client;
-    struct in6_addr remote_host;
-
-    FILE * log_file;
-
-    phv6_findPinhole(pinhole_id, &pinhole);
-    phv6_findLineNumber(pinhole_id, &rule);
-
-    //processing the current time, and the curren_time - 60 sec
-    localtime_r(&current_time,cur_time_tm);
-    localtime_r(&old_time,old_time_tm);
-
-    //building the regex for those times.
-    strftime(cur_time_str, 100, "%b[[:blank:]]+%d[[:blank:]]+%H:%M", cur_time_tm);
-    strftime(old_time_str, 100, "%b[[:blank:]]+%d[[:blank:]]+%H:%M", old_time_tm);
-
-    if(pinhole->protocol == 6 ) protocol = "TCP";
-    else if(pinhole->protocol == 17) protocol = "UDP";
-    else if(pinhole->protocol == 136) protocol = "UDP_LITE";
-
-
-    // The trace is as following :
-    //Jul  2 16:31:38 r-lnx-bang000 kernel: [27793.027210]
-    //TRACE: filter:FORWARD_upnp:rule:4 IN=eth0 OUT=eth1
-    //SRC=3ffe:0000:0000:0000:0000:0000:0000:0004
-    //DST=2032:0000:0000:0000:0000:0000:0000:0002
-    //LEN=72 TC=0 HOPLIMIT=63 FLOWLBL=0 PROTO=TCP SPT=1234 DPT=5678
-    //SEQ=3186301092 ACK=1756907998 WINDOW=90 RES=0x00 ACK FIN URGP=0 OPT (0101080A001FA3A4006866CD)
-
-    //Building the regex matching the above trace
-    snprintf(regex_packet, 512,
-            "(%s|%s):[[:print:]]+filter:%s:[[:print:]]+"
-            "SRC=([[:graph:]]+)[[:blank:]]DST=([[:graph:]]+)[[:blank:]]"
-            "[[:print:]]+"
-            "PROTO=%s[[:blank:]]"
-            "SPT=%i[[:blank:]]"
-            "DPT=%i[[:blank:]][[:print:]]+",
-            cur_time_str,
-            old_time_str,
-            g_vars.ipv6forwardChain,
-            protocol,
-            pinhole->remote_port,
-            pinhole->internal_port);
-
-    //Building the regex to find the rule number in ip6tables
-    snprintf(regex_rule, 256, "filter:%s:rule:([[:digit:]]+)",g_vars.ipv6forwardChain);
-
-    regcomp(&re_packet,regex_packet, REG_EXTENDED);
-    regcomp(&re_rule, regex_rule, REG_EXTENDED);
-
-    //all the acket traces are store in kern.log (kernel module)
-    if ((log_file=fopen("/var/log/kern.log","r")) == NULL) return -1;
-    else {
-        char line[1024];
-        int found = 0;
-        // Walk through the file line by line
-        while (fgets(line,1024,log_file) != NULL)
-        {
-            // Search the last line where the packet is traced
-            if ( regexec(&re_packet,line,4,pmatch,0) == 0 )
-            {
-
-                //find the remote_host
-                strncpy (remote_host_str,
-                        &line[pmatch[2].rm_so],
-                        pmatch[2].rm_eo-pmatch[2].rm_so);
-                remote_host_str[pmatch[2].rm_eo-pmatch[2].rm_so] = '\0';
-
-                //find the internal_client
-                strncpy (internal_client_str,
-                        &line[pmatch[3].rm_so],
-                        pmatch[3].rm_eo-pmatch[3].rm_so);
-                internal_client_str[pmatch[3].rm_eo-pmatch[3].rm_so] = '\0';
-
-                inet_pton(AF_INET6, internal_client_str, &internal_client);
-                inet_pton(AF_INET6, remote_host_str, &remote_host);
-
-                //testing the addresses
-                if(IN6_ARE_ADDR_EQUAL(&internal_client,
-                        pinhole->internal_client) )
-
-                {
-                    //if remote_host is wildcarded
-                    if (pinhole->remote_host != NULL) {
-                        if (IN6_ARE_ADDR_EQUAL(&remote_host,
-                                pinhole->remote_host))
-                        {
-                            found = 1;
-                            strncpy(packet_line,line, 1024);
-                        }
-                    }
-                    else {
-                        //traffic found
-                        found = 1;
-                        strncpy(packet_line,line, 1024);
-                    }
-
-                }
-            }
-        }
+    struct pinholev6 *pinhole;
+    uint32_t last_seen;
 
-        fclose(log_file);
-        regfree(&re_packet);
-        free(cur_time_tm);
-        free(old_time_tm);
+    if (!phv6_findPinhole(pinhole_id, &pinhole))
+        return -1;
 
-        if(found == 0)
-        {
-            //no match found for this pinhole, no traffic error
-            regfree(&re_rule);
-            return -1;
+    if (!LogMonitorRunning())
+        trace(1, "CheckPinholeWorking: logged packets are not listened");
 
-        } else {
+    //without log rules traffic of the pinhole is unknown
+    if (!pinhole->logged)
+        return -1;
 
-            //traffic has been found, check if this is the good pinhole
-            if(regexec(&re_rule,packet_line,2,pmatch,0) == 0 )
-            {
-                char * rule_str;
-                int start = pmatch[1].rm_so;
-                int end = pmatch[1].rm_eo;
-                size_t size = end - start;
-
-                rule_str = malloc (sizeof (char) * (size + 1));
-                if (rule_str)
-                {
-                    strncpy (rule_str, &packet_line[start], size);
-                    rule_str[size] = '\0';
-                    trace(1,"check ip6tables rule : %i", rule);
-                    if(rule == atoi(rule_str))
-                    {
-                        //the pinhole manages the packets
-                        regfree(&re_rule);
-                        free (rule_str);
-                        return 1;
-                    }
-                    else {
-                        //this is not managed by the good rule
-                        regfree(&re_rule);
-                        free (rule_str);
-                        return 0;
-                    }
-                }
-            }
-        }
-    }
+    last_seen = __atomic_load_n(&pinhole->last_seen, __ATOMIC_RELAXED);
+    if (last_seen == 0 || (uint32_t)time(NULL) - last_seen > PHV6_WORKING_PERIOD)
+        return -1;
 
-    return -1;
+    return __atomic_load_n(&pinhole->last_accepted, __ATOMIC_RELAXED);
 }
 
 
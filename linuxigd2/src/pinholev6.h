@@ -24,6 +24,7 @@
 #define PINHOLEV6_H_
 
 #include <netinet/in.h>
+#include "timerwheel.h"
 
 struct pinholev6 {
     struct in6_addr * internal_client;
@@ -33,16 +34,20 @@ struct pinholev6 {
     uint8_t protocol;
     uint32_t lease_time;
     uint32_t unique_id;
-    int event_id;
+    struct timerNode expiration;   // end of lease
+    uint32_t last_seen;            // when last packet arrived, 0 if never
+    int last_accepted;             // was last packet accepted by this pinhole
+    int logged;                    // are packets of pinhole logged
 
     struct pinholev6 *next;
+    struct pinholev6 *prev;
 
 } *ph_first;
 
-struct phv6_expirationEvent
-{
-    int event_id;
-    struct pinholev6 *pinhole;
+// packet counter of pinhole
+struct phv6_packets {
+    uint32_t unique_id;
+    uint64_t packets;
 };
 
 int phv6_init(void);
@@ -70,17 +75,26 @@ int phv6_deletePinhole(uint32_t id);
 
 int phv6_updatePinhole(uint32_t id, uint32_t lease_time);
 
+void phv6_expire(time_t now);
+
+int phv6_getAllPinholePackets(struct phv6_packets **counters, int *count);
+
+
 int phv6_ip6table_addRule(struct in6_addr * internal_client,
         struct in6_addr * remote_host,
         uint16_t internal_port,
         uint16_t remote_port,
-        uint16_t protocol);
+        uint16_t protocol,
+        uint32_t unique_id,
+        int *logged);
 
 int phv6_ip6table_deleteRule(struct in6_addr * internal_client,
         struct in6_addr * remote_host,
         uint16_t internal_port,
         uint16_t remote_port,
-        uint16_t protocol);
+        uint16_t protocol,
+        uint32_t unique_id,
+        int logged);
 
 
 
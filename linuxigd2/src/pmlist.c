@@ -28,22 +28,428 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/wait.h>
+#include <errno.h>
+#include <signal.h>
+#include <semaphore.h>
+#include <time.h>
 #include <unistd.h>
 #include <upnp/upnp.h>
+#include <upnp/ithread.h>
 #include "globals.h"
 #include "config.h"
 #include "pmlist.h"
 #include "gatedevice.h"
+#include "actiontable.h"
 #include "util.h"
 
-#if HAVE_LIBIPTC
+#if HAVE_LIBNFTNL
+#include "nftables.h"
+#elif HAVE_LIBIPTC
 #include "iptc.h"
+#else
+#include "iptrestore.h"
 #endif
 
+/*
+ * Hash index of portmapping list.
+ *
+ * Open addressing table with linear probing. Entries are keyed on
+ * (protocol, external port, remote host), but the slot is chosen from
+ * protocol and external port only. That way all mappings sharing the same
+ * external port and protocol sit in one probe run, and lookups which do not
+ * care about remote host (pmlist_FindBy_extPort_proto...) are served from
+ * the same index. Deleted slots are refilled by shifting the rest of the run
+ * back, so no tombstones are needed.
+ */
+#define PMLIST_INDEX_MIN_SIZE 64
+
+static struct portMap **pmlist_Index = NULL;
+static unsigned int pmlist_IndexSize = 0;  // number of slots, always power of two
+static unsigned int pmlist_IndexCount = 0; // number of used slots
+
+/*
+ * External ports in use, one bit per port for TCP and UDP. Kept in sync with
+ * hash index and used by pmlist_FindNextFreePort.
+ * Second level has one bit per word of the first level telling if any port of
+ * that word is in use. Together they are port ordered index of portmappings,
+ * used by pmlist_FindRangeAfter.
+ */
+#define PMLIST_PORT_WORDS (65536 / 64)
+#define PMLIST_FIRST_FREE_PORT 1024
+
+static uint64_t pmlist_PortsInUse[2][PMLIST_PORT_WORDS];
+static uint64_t pmlist_PortWordsInUse[2][PMLIST_PORT_WORDS / 64];
+
+#define PMLIST_PORTS(proto) pmlist_PortsInUse[(proto) == IPPROTO_UDP ? 1 : 0]
+#define PMLIST_PORT_WORDS_USED(proto) pmlist_PortWordsInUse[(proto) == IPPROTO_UDP ? 1 : 0]
+
+/**
+ * Calculate hash of protocol and external port.
+ *
+ * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
+ * @param proto Portmapping protocol, IPPROTO_TCP or IPPROTO_UDP.
+ * @return Hash value.
+ */
+static unsigned int pmlist_Hash(uint16_t externalPort, uint8_t proto)
+{
+    unsigned int key = ((unsigned int)proto << 16) | externalPort;
+
+    // multiplicative hashing, upper bits are the well mixed ones
+    key *= 2654435761u;
+    return key ^ (key >> 16);
+}
+
+/**
+ * Insert portmapping into hash index. Index must have free slot.
+ *
+ * @param item Portmapping struct which is added into index.
+ */
+static void pmlist_IndexPut(struct portMap *item)
+{
+    unsigned int mask = pmlist_IndexSize - 1;
+    unsigned int i = pmlist_Hash(item->m_ExternalPort, item->m_PortMappingProtocol) & mask;
+
+    while (pmlist_Index[i] != NULL)
+        i = (i + 1) & mask;
+
+    pmlist_Index[i] = item;
+    pmlist_IndexCount++;
+
+    PMLIST_PORTS(item->m_PortMappingProtocol)[item->m_ExternalPort / 64] |= 1ULL << (item->m_ExternalPort % 64);
+    PMLIST_PORT_WORDS_USED(item->m_PortMappingProtocol)[item->m_ExternalPort / 4096] |= 1ULL << (item->m_ExternalPort / 64 % 64);
+}
+
+/**
+ * Make sure that hash index has room for one more portmapping.
+ * Index is kept at most half full, it is doubled and rehashed when needed.
+ *
+ * @return 1 if there is room, 0 if memory allocation failed.
+ */
+static int pmlist_IndexReserve(void)
+{
+    struct portMap **old = pmlist_Index;
+    unsigned int oldSize = pmlist_IndexSize;
+    unsigned int newSize, i;
+
+    if ((pmlist_IndexCount + 1) * 2 <= pmlist_IndexSize)
+        return 1;
+
+    newSize = oldSize ? oldSize * 2 : PMLIST_INDEX_MIN_SIZE;
+    pmlist_Index = (struct portMap **) calloc(newSize, sizeof(struct portMap *));
+    if (pmlist_Index == NULL)
+    {
+        trace(1, "Failed to allocate portmapping index of %u entries", newSize);
+        pmlist_Index = old;
+        return 0;
+    }
+    pmlist_IndexSize = newSize;
+    pmlist_IndexCount = 0;
+
+    for (i = 0; i < oldSize; i++)
+    {
+        if (old[i])
+            pmlist_IndexPut(old[i]);
+    }
+    free(old);
+
+    return 1;
+}
+
+/**
+ * Remove portmapping from hash index. Following entries of the same probe
+ * run are moved back so that lookups never meet a hole inside a run.
+ *
+ * @param item Portmapping struct which is removed from index.
+ */
+static void pmlist_IndexRemove(struct portMap *item)
+{
+    unsigned int mask = pmlist_IndexSize - 1;
+    unsigned int i, j, home;
+
+    if (pmlist_Index == NULL)
+        return;
+
+    i = pmlist_Hash(item->m_ExternalPort, item->m_PortMappingProtocol) & mask;
+    while (pmlist_Index[i] != item)
+    {
+        if (pmlist_Index[i] == NULL)
+            return;
+        i = (i + 1) & mask;
+    }
+    pmlist_Index[i] = NULL;
+    pmlist_IndexCount--;
+
+    // shift back entries which would not be found anymore
+    j = i;
+    for (;;)
+    {
+        j = (j + 1) & mask;
+        if (pmlist_Index[j] == NULL)
+            break;
+        home = pmlist_Hash(pmlist_Index[j]->m_ExternalPort, pmlist_Index[j]->m_PortMappingProtocol) & mask;
+        // move entry from j to i if its home slot is not cyclically in (i, j]
+        if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j))
+        {
+            pmlist_Index[i] = pmlist_Index[j];
+            pmlist_Index[j] = NULL;
+            i = j;
+        }
+    }
+
+    // port is free if it was the last mapping using it (all of them are in one run)
+    i = pmlist_Hash(item->m_ExternalPort, item->m_PortMappingProtocol) & mask;
+    for (; pmlist_Index[i] != NULL; i = (i + 1) & mask)
+    {
+        if (pmlist_Index[i]->m_ExternalPort == item->m_ExternalPort &&
+            pmlist_Index[i]->m_PortMappingProtocol == item->m_PortMappingProtocol)
+            return;
+    }
+    PMLIST_PORTS(item->m_PortMappingProtocol)[item->m_ExternalPort / 64] &= ~(1ULL << (item->m_ExternalPort % 64));
+    if (PMLIST_PORTS(item->m_PortMappingProtocol)[item->m_ExternalPort / 64] == 0)
+        PMLIST_PORT_WORDS_USED(item->m_PortMappingProtocol)[item->m_ExternalPort / 4096] &= ~(1ULL << (item->m_ExternalPort / 64 % 64));
+}
+
+/**
+ * Drop everything from hash index.
+ */
+static void pmlist_IndexClear(void)
+{
+    free(pmlist_Index);
+    pmlist_Index = NULL;
+    pmlist_IndexSize = 0;
+    pmlist_IndexCount = 0;
+    memset(pmlist_PortsInUse, 0, sizeof(pmlist_PortsInUse));
+    memset(pmlist_PortWordsInUse, 0, sizeof(pmlist_PortWordsInUse));
+}
+
+/**
+ * Get first slot of probe run where portmappings with given external port
+ * and protocol are stored.
+ *
+ * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
+ * @param proto Portmapping protocol, IPPROTO_TCP or IPPROTO_UDP.
+ * @return Slot number, or -1 if index is empty.
+ */
+static int pmlist_IndexFirst(uint16_t externalPort, uint8_t proto)
+{
+    if (pmlist_Index == NULL || pmlist_IndexCount == 0)
+        return -1;
+    return pmlist_Hash(externalPort, proto) & (pmlist_IndexSize - 1);
+}
+
+/*
+ * Portmappings in list order, for pmlist_FindByIndex. Deleted portmappings
+ * leave holes which are compacted away only when index lookup is needed, so
+ * deleting many portmappings does not move the rest of the vector each time.
+ */
+static struct portMap **pmlist_Order = NULL;
+static int pmlist_OrderCapacity = 0;
+static int pmlist_OrderLength = 0;  // used slots including holes
+static int pmlist_OrderHoles = 0;
+// lookups by index run under read lock of portmapping list, but they compact
+// the order vector, so compaction is serialized with this
+static ithread_mutex_t pmlist_OrderMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Remove holes left by deleted portmappings from order vector.
+ */
+static void pmlist_OrderCompact(void)
+{
+    int i, j = 0;
+
+    for (i = 0; i < pmlist_OrderLength; i++)
+    {
+        if (pmlist_Order[i] != NULL)
+        {
+            pmlist_Order[j] = pmlist_Order[i];
+            pmlist_Order[j]->m_OrderPosition = j;
+            j++;
+        }
+    }
+    pmlist_OrderLength = j;
+    // lookups reading holes without pmlist_OrderMutex must see compacted vector
+    __atomic_store_n(&pmlist_OrderHoles, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Make sure that order vector has room for one more portmapping.
+ *
+ * @return 1 if there is room, 0 if memory allocation failed.
+ */
+static int pmlist_OrderReserve(void)
+{
+    struct portMap **temp;
+    int newCapacity;
+
+    if (pmlist_OrderLength < pmlist_OrderCapacity)
+        return 1;
+
+    if (pmlist_OrderHoles > 0)
+    {
+        pmlist_OrderCompact();
+        return 1;
+    }
+
+    newCapacity = pmlist_OrderCapacity ? pmlist_OrderCapacity * 2 : PMLIST_INDEX_MIN_SIZE;
+    temp = (struct portMap **) realloc(pmlist_Order, newCapacity * sizeof(struct portMap *));
+    if (temp == NULL)
+    {
+        trace(1, "Failed to allocate portmapping order vector of %d entries", newCapacity);
+        return 0;
+    }
+    pmlist_Order = temp;
+    pmlist_OrderCapacity = newCapacity;
+
+    return 1;
+}
+
+/**
+ * Drop everything from order vector.
+ */
+static void pmlist_OrderClear(void)
+{
+    free(pmlist_Order);
+    pmlist_Order = NULL;
+    pmlist_OrderCapacity = 0;
+    pmlist_OrderLength = 0;
+    pmlist_OrderHoles = 0;
+}
+
+/**
+ * Convert protocol string to protocol number.
+ *
+ * @param protocol Portmapping protocol, either "TCP" or "UDP".
+ * @return IPPROTO_TCP, IPPROTO_UDP or 0 if protocol is unknown.
+ */
+int pmlist_ProtocolFromStr(const char *protocol)
+{
+    if (strcmp(protocol, "TCP") == 0)
+        return IPPROTO_TCP;
+    else if (strcmp(protocol, "UDP") == 0)
+        return IPPROTO_UDP;
+    return 0;
+}
+
+/**
+ * Convert protocol number to protocol string.
+ *
+ * @param protocol IPPROTO_TCP or IPPROTO_UDP.
+ * @return "TCP", "UDP" or empty string if protocol is unknown.
+ */
+const char* pmlist_ProtocolToStr(int protocol)
+{
+    if (protocol == IPPROTO_TCP)
+        return "TCP";
+    else if (protocol == IPPROTO_UDP)
+        return "UDP";
+    return "";
+}
+
+/**
+ * Convert port string to port number.
+ *
+ * @param port Port number as string.
+ * @return Port number, or -1 if string is not valid port number.
+ */
+static int pmlist_ParsePort(const char *port)
+{
+    char *end;
+    long value;
+
+    if (port == NULL || *port == '\0')
+        return 0;
+
+    value = strtol(port, &end, 10);
+    if (*end != '\0' || value < 0 || value > 65535)
+        return -1;
+    return (int)value;
+}
+
+/**
+ * Convert address string to binary form. Empty string is wildcarded address.
+ * If string is not numeric IPv4 or IPv6 address, it is taken as domain name.
+ * Domain name is not copied, addr points to given string.
+ *
+ * @param str IP address or domain name.
+ * @param family Address family is stored here, AF_UNSPEC, AF_INET, AF_INET6 or PM_AF_NAME.
+ * @param addr Binary address is stored here.
+ * @return 1 if conversion succeeded, 0 if string is too long.
+ */
+static int pmlist_ParseAddr(const char *str, uint8_t *family, union pmAddr *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+
+    if (str == NULL || *str == '\0')
+        *family = AF_UNSPEC;
+    else if (inet_pton(AF_INET, str, &addr->v4) == 1)
+        *family = AF_INET;
+    else if (inet_pton(AF_INET6, str, &addr->v6) == 1)
+        *family = AF_INET6;
+    else if (strlen(str) < INET6_ADDRSTRLEN)
+    {
+        *family = PM_AF_NAME;
+        addr->name = (char *)str;
+    }
+    else
+    {
+        *family = AF_UNSPEC;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Compare two binary addresses.
+ *
+ * @return 1 if addresses are same, 0 if not.
+ */
+static int pmlist_AddrEquals(uint8_t family1, const union pmAddr *addr1, uint8_t family2, const union pmAddr *addr2)
+{
+    if (family1 != family2)
+        return 0;
+
+    switch (family1)
+    {
+        case AF_INET:
+            return addr1->v4.s_addr == addr2->v4.s_addr;
+        case AF_INET6:
+            return memcmp(&addr1->v6, &addr2->v6, sizeof(struct in6_addr)) == 0;
+        case PM_AF_NAME:
+            return strcmp(addr1->name, addr2->name) == 0;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * Convert binary address to string.
+ *
+ * @param family Address family.
+ * @param addr Binary address.
+ * @param str Buffer of at least INET6_ADDRSTRLEN bytes.
+ */
+static void pmlist_AddrToStr(uint8_t family, const union pmAddr *addr, char *str)
+{
+    switch (family)
+    {
+        case AF_INET:
+            inet_ntop(AF_INET, &addr->v4, str, INET6_ADDRSTRLEN);
+            break;
+        case AF_INET6:
+            inet_ntop(AF_INET6, &addr->v6, str, INET6_ADDRSTRLEN);
+            break;
+        case PM_AF_NAME:
+            strcpy(str, addr->name);
+            break;
+        default:
+            str[0] = '\0';
+    }
+}
+
 /**
  * Create new portMap struct of rule to add iptables. 
  * portMap-struct is internal presentation of iptables rule in IGD. 
+ * Values are stored in binary form, pmlist_ToText converts them back to strings.
  *
  * @param enabled Is rule enabled.
  * @param duration How long portmapping should exist.
@@ -53,40 +459,89 @@
  * @param protocol Portmapping protocol, either TCP or UDP.
  * @param internalClient The local IP address of the client.
  * @param desc Textual description of portmapping.
- * @return Pointer to newly created portMap-struct.
+ * @return Pointer to newly created portMap-struct or NULL if memory allocation failed.
  */
 struct portMap* pmlist_NewNode(int enabled, long int duration, char *remoteHost,
                                char *externalPort, char *internalPort,
                                char *protocol, char *internalClient, char *desc, int isStatic)
 {
-    struct portMap* temp = (struct portMap*) malloc(sizeof(struct portMap));
-
-    temp->m_PortMappingEnabled = enabled;
-
-    if (remoteHost && strlen(remoteHost) < sizeof(temp->m_RemoteHost)) strcpy(temp->m_RemoteHost, remoteHost);
-    else strcpy(temp->m_RemoteHost, "");
-    if (strlen(externalPort) < sizeof(temp->m_ExternalPort)) strcpy(temp->m_ExternalPort, externalPort);
-    else strcpy(temp->m_ExternalPort, "");
-    if (strlen(internalPort) < sizeof(temp->m_InternalPort)) strcpy(temp->m_InternalPort, internalPort);
-    else strcpy(temp->m_InternalPort, "");
-    if (strlen(protocol) < sizeof(temp->m_PortMappingProtocol)) strcpy(temp->m_PortMappingProtocol, protocol);
-    else strcpy(temp->m_PortMappingProtocol, "");
-    if (strlen(internalClient) < sizeof(temp->m_InternalClient)) strcpy(temp->m_InternalClient, internalClient);
-    else strcpy(temp->m_InternalClient, "");
-    if (strlen(desc) < sizeof(temp->m_PortMappingDescription)) strcpy(temp->m_PortMappingDescription, desc);
-    else strcpy(temp->m_PortMappingDescription, "");
+    struct portMap* temp = (struct portMap*) calloc(1, sizeof(struct portMap));
+    int port;
+
+    if (temp == NULL)
+        return NULL;
+
+    temp->m_PortMappingEnabled = enabled ? 1 : 0;
+
+    pmlist_ParseAddr(remoteHost, &temp->m_RemoteHostFamily, &temp->m_RemoteHost);
+    pmlist_ParseAddr(internalClient, &temp->m_InternalClientFamily, &temp->m_InternalClient);
+    // domain names point to caller's strings, take own copies
+    if (temp->m_RemoteHostFamily == PM_AF_NAME)
+        temp->m_RemoteHost.name = strdup(temp->m_RemoteHost.name);
+    if (temp->m_InternalClientFamily == PM_AF_NAME)
+        temp->m_InternalClient.name = strdup(temp->m_InternalClient.name);
+
+    if ((port = pmlist_ParsePort(externalPort)) > 0)
+        temp->m_ExternalPort = port;
+    if ((port = pmlist_ParsePort(internalPort)) > 0)
+        temp->m_InternalPort = port;
+    temp->m_PortMappingProtocol = pmlist_ProtocolFromStr(protocol);
+    if (desc && *desc != '\0' && strlen(desc) < PM_DESC_LEN)
+        temp->m_PortMappingDescription = strdup(desc);
     temp->m_PortMappingLeaseDuration = duration;
-    temp->m_IsStatic = isStatic;
+    temp->m_IsStatic = isStatic ? 1 : 0;
 
     temp->next = NULL;
     temp->prev = NULL;
 
+    if ((temp->m_RemoteHostFamily == PM_AF_NAME && temp->m_RemoteHost.name == NULL) ||
+        (temp->m_InternalClientFamily == PM_AF_NAME && temp->m_InternalClient.name == NULL))
+    {
+        pmlist_FreeNode(temp);
+        return NULL;
+    }
+
     return temp;
 }
 
+/**
+ * Free portMap struct and strings allocated for it.
+ *
+ * @param item Portmapping struct to free. Must not be in portmapping list.
+ */
+void pmlist_FreeNode(struct portMap* item)
+{
+    if (item == NULL)
+        return;
+
+    if (item->m_RemoteHostFamily == PM_AF_NAME)
+        free(item->m_RemoteHost.name);
+    if (item->m_InternalClientFamily == PM_AF_NAME)
+        free(item->m_InternalClient.name);
+    free(item->m_PortMappingDescription);
+    free(item);
+}
+
+/**
+ * Convert values of portMap struct to strings.
+ *
+ * @param item Portmapping struct.
+ * @param text Strings are written here. protocol and description point to
+ *             static or portmapping owned strings.
+ */
+void pmlist_ToText(const struct portMap* item, struct portMapText *text)
+{
+    pmlist_AddrToStr(item->m_RemoteHostFamily, &item->m_RemoteHost, text->remoteHost);
+    pmlist_AddrToStr(item->m_InternalClientFamily, &item->m_InternalClient, text->internalClient);
+    snprintf(text->externalPort, sizeof(text->externalPort), "%u", item->m_ExternalPort);
+    snprintf(text->internalPort, sizeof(text->internalPort), "%u", item->m_InternalPort);
+    text->protocol = pmlist_ProtocolToStr(item->m_PortMappingProtocol);
+    text->description = item->m_PortMappingDescription ? item->m_PortMappingDescription : "";
+}
+
 /**
  * Search if portmapping with given parameters exist in IGD's portmapping list. 
- * Starts searching from the beginning of list. 
+ * Lookup is done from hash index of the list.
  *
  * @param remoteHost WAN IP address (destination) of connections initiated by a client in the local network. If empty string, then it is assumed as wildcarded address and matches all addresses.
  * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
@@ -97,21 +552,28 @@ struct portMap* pmlist_NewNode(int enabled, long int duration, char *remoteHost,
 struct portMap* pmlist_Find(char * remoteHost, char *externalPort, char *proto, char *internalClient)
 {
     struct portMap* temp;
+    union pmAddr rh, ic;
+    uint8_t rhFamily, icFamily;
+    int port = pmlist_ParsePort(externalPort);
+    int protocol = pmlist_ProtocolFromStr(proto);
+    int i;
 
-    temp = pmlist_Head;
-    if (temp == NULL)
+    if (port < 0 || !pmlist_ParseAddr(remoteHost, &rhFamily, &rh) || !pmlist_ParseAddr(internalClient, &icFamily, &ic))
         return NULL;
-    do
+
+    if ((i = pmlist_IndexFirst(port, protocol)) < 0)
+        return NULL;
+
+    while ((temp = pmlist_Index[i]) != NULL)
     {
-        if ( (strcmp(temp->m_RemoteHost, remoteHost) == 0) &&
-                (strcmp(temp->m_ExternalPort, externalPort) == 0) &&
-                (strcmp(temp->m_PortMappingProtocol, proto) == 0) &&
-                (strcmp(temp->m_InternalClient, internalClient) == 0) )
+        if ( (temp->m_ExternalPort == port) &&
+                (temp->m_PortMappingProtocol == protocol) &&
+                pmlist_AddrEquals(temp->m_RemoteHostFamily, &temp->m_RemoteHost, rhFamily, &rh) &&
+                pmlist_AddrEquals(temp->m_InternalClientFamily, &temp->m_InternalClient, icFamily, &ic) )
             return temp; // We found a match, return pointer to it
-        else
-            temp = temp->next;
+
+        i = (i + 1) & (pmlist_IndexSize - 1);
     }
-    while (temp != NULL);
 
     // If we made it here, we didn't find it, so return NULL
     return NULL;
@@ -119,7 +581,7 @@ struct portMap* pmlist_Find(char * remoteHost, char *externalPort, char *proto,
 
 /**
  * Search if portmapping with given parameters exist in IGD's portmapping list. 
- * Starts searching from the beginning of list. 
+ * Lookup is done from hash index of the list.
  *
  * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
  * @param proto Portmapping protocol, either TCP or UDP.
@@ -129,248 +591,851 @@ struct portMap* pmlist_Find(char * remoteHost, char *externalPort, char *proto,
 struct portMap* pmlist_FindBy_extPort_proto_intClient(char *externalPort, char *proto, char *internalClient)
 {
     struct portMap* temp;
+    union pmAddr ic;
+    uint8_t icFamily;
+    int port = pmlist_ParsePort(externalPort);
+    int protocol = pmlist_ProtocolFromStr(proto);
+    int i;
 
-    temp = pmlist_Head;
+    if (port < 0 || !pmlist_ParseAddr(internalClient, &icFamily, &ic))
+        return NULL;
+
+    if ((i = pmlist_IndexFirst(port, protocol)) < 0)
+        return NULL;
+
+    while ((temp = pmlist_Index[i]) != NULL)
+    {
+        if  (  (temp->m_ExternalPort == port) &&
+               (temp->m_PortMappingProtocol == protocol) &&
+               pmlist_AddrEquals(temp->m_InternalClientFamily, &temp->m_InternalClient, icFamily, &ic) )
+            return temp; // We found a match, return pointer to it
+
+        i = (i + 1) & (pmlist_IndexSize - 1);
+    }
+
+    // If we made it here, we didn't find it, so return NULL
+    return NULL;
+}
+
+/**
+ * Search if portmapping with given parameters exist in IGD's portmapping list. 
+ * Lookup is done from hash index of the list.
+ *
+ * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
+ * @param proto Portmapping protocol, either TCP or UDP.
+ * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ */
+struct portMap* pmlist_FindBy_extPort_proto(char *externalPort, char *proto)
+{
+    struct portMap* temp;
+    int port = pmlist_ParsePort(externalPort);
+    int protocol = pmlist_ProtocolFromStr(proto);
+    int i;
+
+    if (port < 0 || (i = pmlist_IndexFirst(port, protocol)) < 0)
+        return NULL;
+
+    while ((temp = pmlist_Index[i]) != NULL)
+    {
+        if  (  (temp->m_ExternalPort == port) &&
+               (temp->m_PortMappingProtocol == protocol) )
+            return temp; // We found a match, return pointer to it
+
+        i = (i + 1) & (pmlist_IndexSize - 1);
+    }
+
+    // If we made it here, we didn't find it, so return NULL
+    return NULL;
+}
+
+/**
+ * Fetch portmapping from given index in portmapping list. 
+ *
+ * @param index Index of searched portmapping. 0 is first.
+ * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ */
+struct portMap* pmlist_FindByIndex(int index)
+{
+    // holes appear only under write lock, when there are no lookups. First
+    // lookup after that compacts and the others wait for it.
+    if (__atomic_load_n(&pmlist_OrderHoles, __ATOMIC_ACQUIRE) > 0)
+    {
+        ithread_mutex_lock(&pmlist_OrderMutex);
+        if (pmlist_OrderHoles > 0)
+            pmlist_OrderCompact();
+        ithread_mutex_unlock(&pmlist_OrderMutex);
+    }
+
+    if (index < 0 || index >= pmlist_OrderLength)
+        return NULL;
+
+    return pmlist_Order[index];
+}
+
+/**
+ * Search if portmapping matching given parameters exist in IGD's portmapping list. 
+ * Lookup is done from hash index of the list.
+ *
+ * @param remoteHost WAN IP address (destination) of connections initiated by a client in the local network. If empty string, then it is assumed as wildcarded address and matches all addresses.
+ * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
+ * @param protocol Portmapping protocol, either TCP or UDP.
+ * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ */
+struct portMap* pmlist_FindSpecific(char * remoteHost, char *externalPort, char *protocol)
+{
+    struct portMap* temp;
+    union pmAddr rh;
+    uint8_t rhFamily;
+    int port = pmlist_ParsePort(externalPort);
+    int proto = pmlist_ProtocolFromStr(protocol);
+    int i;
+
+    if (port < 0 || !pmlist_ParseAddr(remoteHost, &rhFamily, &rh))
+        return NULL;
+
+    if ((i = pmlist_IndexFirst(port, proto)) < 0)
+        return NULL;
+
+    while ((temp = pmlist_Index[i]) != NULL)
+    {
+        if ( (temp->m_ExternalPort == port) &&
+                (temp->m_PortMappingProtocol == proto) &&
+                pmlist_AddrEquals(temp->m_RemoteHostFamily, &temp->m_RemoteHost, rhFamily, &rh))
+            return temp;
+
+        i = (i + 1) & (pmlist_IndexSize - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * Search if portmapping matching given parameters exist in IGD's portmapping list. 
+ * Starts searching from the given index of list. 
+ *
+ * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
+ * @param protocol Portmapping protocol, either TCP or UDP.
+ * @param index Index of portmapping list where searching is started from.
+ * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ */
+struct portMap* pmlist_FindBy_extPort_proto_afterIndex(char *externalPort, char *protocol, int index)
+{
+    struct portMap* temp;
+    int port = pmlist_ParsePort(externalPort);
+    int proto = pmlist_ProtocolFromStr(protocol);
+
+    if ((index >= pmlist_Size()) || (index < 0) || port < 0)
+        return NULL;
+
+    temp = pmlist_FindByIndex(index);
     if (temp == NULL)
         return NULL;
+
     do
     {
-        if  (  (strcmp(temp->m_ExternalPort, externalPort) == 0) &&
-               (strcmp(temp->m_PortMappingProtocol, proto) == 0) &&
-               (strcmp(temp->m_InternalClient, internalClient) == 0) )
-            return temp; // We found a match, return pointer to it
+        if ( (temp->m_ExternalPort == port) &&
+                (temp->m_PortMappingProtocol == proto))
+            return temp;
         else
             temp = temp->next;
     }
     while (temp != NULL);
 
-    // If we made it here, we didn't find it, so return NULL
     return NULL;
 }
 
 /**
- * Search if portmapping with given parameters exist in IGD's portmapping list. 
- * Starts searching from the beginning of list. 
+ * Find first free port from port bitmap. Bitmap is scanned a word at a time.
+ *
+ * @param ports Port bitmap of one protocol.
+ * @param from First port to check.
+ * @param to Last port to check.
+ * @return First free port between from and to, or -1 if all are in use.
+ */
+static int pmlist_FindFreeBit(const uint64_t *ports, int from, int to)
+{
+    int word = from / 64;
+    uint64_t free_bits;
+
+    if (from > to)
+        return -1;
+
+    // ignore ports below from in the first word
+    free_bits = ~ports[word] & (~0ULL << (from % 64));
+    for (;;)
+    {
+        if (free_bits)
+        {
+            int port = word * 64 + __builtin_ctzll(free_bits);
+            return port <= to ? port : -1;
+        }
+        if (++word > to / 64)
+            return -1;
+        free_bits = ~ports[word];
+    }
+}
+
+/**
+ * Search for next free external_port between ports 1024 and 65535.
+ * Where searching starts depends on port_allocation option of config file:
+ * sequential starts from 1024, random from random port and near from given port.
+ * Search wraps around at 65535.
+ * 
+ * @param protocol Next free portnumber of which protocol is searched.
+ * @param port Port requested by control point, used by near policy.
+ * @return Next free portnumber of given protocol or -1 if no ports are free.
+ */
+int pmlist_FindNextFreePort(char *protocol, int port)
+{
+    static int seeded = 0;
+    const uint64_t *ports = PMLIST_PORTS(pmlist_ProtocolFromStr(protocol));
+    int start = PMLIST_FIRST_FREE_PORT;
+    int freePort;
+
+    switch (g_vars.portAllocation)
+    {
+        case PORT_ALLOCATION_RANDOM:
+            if (!seeded)
+            {
+                srandom(time(NULL) ^ getpid());
+                seeded = 1;
+            }
+            start = PMLIST_FIRST_FREE_PORT + random() % (65536 - PMLIST_FIRST_FREE_PORT);
+            break;
+        case PORT_ALLOCATION_NEAR:
+            if (port > PMLIST_FIRST_FREE_PORT && port <= 65535)
+                start = port;
+            break;
+        default:
+            break;
+    }
+
+    freePort = pmlist_FindFreeBit(ports, start, 65535);
+    if (freePort < 0)
+        freePort = pmlist_FindFreeBit(ports, PMLIST_FIRST_FREE_PORT, start - 1);
+
+    return freePort;
+}
+
+/**
+ * Find first external port in use from port bitmap.
+ *
+ * @param proto Protocol, IPPROTO_TCP or IPPROTO_UDP.
+ * @param from First port to check.
+ * @param to Last port to check.
+ * @return First port between from and to which has portmapping, or -1 if none.
+ */
+static int pmlist_FindUsedPort(int proto, int from, int to)
+{
+    const uint64_t *ports = PMLIST_PORTS(proto);
+    const uint64_t *words = PMLIST_PORT_WORDS_USED(proto);
+    int word, summary, port;
+    uint64_t bits;
+
+    if (from < 0)
+        from = 0;
+    if (to > 65535)
+        to = 65535;
+    if (from > to)
+        return -1;
+
+    word = from / 64;
+    bits = ports[word] & (~0ULL << (from % 64));
+    if (bits == 0)
+    {
+        // look up next word with used ports from second level
+        if (++word >= PMLIST_PORT_WORDS)
+            return -1;
+        summary = word / 64;
+        bits = words[summary] & (~0ULL << (word % 64));
+        while (bits == 0)
+        {
+            if (++summary >= PMLIST_PORT_WORDS / 64)
+                return -1;
+            bits = words[summary];
+        }
+        word = summary * 64 + __builtin_ctzll(bits);
+        bits = ports[word];
+    }
+
+    port = word * 64 + __builtin_ctzll(bits);
+    return port <= to ? port : -1;
+}
+
+/**
+ *  Find next port mapping in port range. If internal_client value is empty string, then it is treated as wildcard
+ *  and all internal client values matches.
+ *  Portmappings are returned in order of external port, so the whole range is
+ *  gone through without looking at portmappings outside of it.
+ * 
+ * @param start_port Lower limit for port value in portmappings included in search.
+ * @param end_port Upper limit for port value in portmappings included in search.
+ * @param protocol Protocol of portmapping searched.
+ * @param internal_client Internal client IP value.
+ * @param pm Portmapping returned by previous call, or NULL to start from start_port.
+ * @return Portmapping matching parameters or NULL if none found.
+ */
+struct portMap* pmlist_FindRangeAfter(int start_port, int end_port, char *protocol, char *internal_client, struct portMap *pm)
+{
+    union pmAddr ic;
+    uint8_t icFamily;
+    struct portMap *temp;
+    int proto = pmlist_ProtocolFromStr(protocol);
+    int port, i;
+
+    if (!pmlist_ParseAddr(internal_client, &icFamily, &ic))
+        return NULL;
+
+    // continue after pm in its probe run, otherwise start from first used port
+    if (pm != NULL)
+    {
+        port = pm->m_ExternalPort;
+        if ((i = pmlist_IndexFirst(port, proto)) < 0)
+            return NULL;
+        while (pmlist_Index[i] != NULL && pmlist_Index[i] != pm)
+            i = (i + 1) & (pmlist_IndexSize - 1);
+        if (pmlist_Index[i] != NULL)
+            i = (i + 1) & (pmlist_IndexSize - 1);
+    }
+    else
+    {
+        port = pmlist_FindUsedPort(proto, start_port, end_port);
+        if (port < 0 || (i = pmlist_IndexFirst(port, proto)) < 0)
+            return NULL;
+    }
+
+    while (port >= 0)
+    {
+        while ((temp = pmlist_Index[i]) != NULL)
+        {
+            if (temp->m_ExternalPort == port && temp->m_PortMappingProtocol == proto &&
+                (icFamily == AF_UNSPEC || pmlist_AddrEquals(temp->m_InternalClientFamily, &temp->m_InternalClient, icFamily, &ic)))
+                return temp;
+
+            i = (i + 1) & (pmlist_IndexSize - 1);
+        }
+
+        port = pmlist_FindUsedPort(proto, port + 1, end_port);
+        if (port >= 0)
+            i = pmlist_IndexFirst(port, proto);
+    }
+
+    return NULL;
+}
+
+/**
+ * Check if portmapping list is empty.
+ * 
+ * @return 0 if not empty, 1 if is empty.
+ */
+int pmlist_IsEmtpy(void)
+{
+    if (pmlist_Head)
+        return 0;
+    else
+        return 1;
+}
+
+/**
+ * Count how many portmappings there is in IGD's portmapping list.
+ * 
+ * @return Size of portmapping list.
+ */
+int pmlist_Size(void)
+{
+    // every node in list is also in hash index
+    return pmlist_IndexCount;
+}
+
+/**
+ * Start transaction in the firewall backend daemon was built with.
+ */
+static void pmlist_BackendBegin(void)
+{
+#if HAVE_LIBNFTNL
+    nftables_transaction_begin();
+#elif HAVE_LIBIPTC
+    iptc_transaction_begin();
+#else
+    iptrestore_transaction_begin();
+#endif
+}
+
+/**
+ * Commit transaction started with pmlist_BackendBegin.
+ *
+ * @return 1 if changes were committed, 0 if failed.
+ */
+static int pmlist_BackendCommit(void)
+{
+#if HAVE_LIBNFTNL
+    return nftables_transaction_commit();
+#elif HAVE_LIBIPTC
+    return iptc_transaction_commit();
+#else
+    return iptrestore_transaction_commit();
+#endif
+}
+
+/**
+ * Abort transaction started with pmlist_BackendBegin.
+ */
+static void pmlist_BackendAbort(void)
+{
+#if HAVE_LIBNFTNL
+    nftables_transaction_abort();
+#elif HAVE_LIBIPTC
+    iptc_transaction_abort();
+#else
+    iptrestore_transaction_abort();
+#endif
+}
+
+/**
+ * Add firewall rules of portmapping with the backend daemon was built with.
+ *
+ * @param item Portmapping.
+ * @return 1 if addition succeeded, 0 if failed.
+ */
+static int pmlist_AddRules(struct portMap *item)
+{
+#if HAVE_LIBNFTNL
+    return nftables_add_mapping(item);
+#else
+    struct portMapText text;
+
+    pmlist_ToText(item, &text);
+    return pmlist_AddPortMapping(item->m_PortMappingEnabled, (char *)text.protocol, text.remoteHost,
+                                 text.externalPort, text.internalClient, text.internalPort);
+#endif
+}
+
+/**
+ * Delete firewall rules of portmapping with the backend daemon was built with.
+ *
+ * @param item Portmapping.
+ * @return 1 if deletion succeeded, 0 if failed.
+ */
+static int pmlist_DeleteRules(struct portMap *item)
+{
+#if HAVE_LIBNFTNL
+    return nftables_delete_mapping(item);
+#else
+    struct portMapText text;
+
+    pmlist_ToText(item, &text);
+    return pmlist_DeletePortMapping(item->m_PortMappingEnabled, text.remoteHost, (char *)text.protocol,
+                                    text.externalPort, text.internalClient, text.internalPort);
+#endif
+}
+
+/*
+ * Firewall worker.
+ *
+ * While worker is running, pmlist functions only change the in-memory list
+ * and push firewall operations into a lock-free queue, so actions don't wait
+ * for kernel while holding portmapping lock. Worker takes all queued operations at
+ * once and applies them in order, committing consecutive deletions together
+ * and consecutive additions together. Portmapping whose rules can't be added
+ * is removed from list afterwards (rolled back) and the change is evented,
+ * unless the action waiting for it did that itself.
+ *
+ * Operations are pushed on top of a stack with compare-and-swap and worker
+ * takes the whole stack with one swap, so producers never block each other
+ * and there is no ABA problem.
+ */
+#define PMLIST_FW_ADD 0
+#define PMLIST_FW_DELETE 1
+#define PMLIST_FW_STOP 2
+
+struct pmlist_FwOp
+{
+    struct pmlist_FwOp *next;
+    struct portMap *item;   // deleted item is owned by operation
+    int type;
+    int refs;               // worker and waiting action, protected by pmlist_FwMutex
+    int done;               // protected by pmlist_FwMutex
+    int result;
+    int claimed;            // waiting action rolled failed addition back itself
+};
+
+static struct pmlist_FwOp *pmlist_FwQueue = NULL;  // newest first
+static struct pmlist_FwOp pmlist_FwStopOp;
+static sem_t pmlist_FwSem;
+static ithread_t pmlist_FwThread;
+static int pmlist_FwRunning = 0;
+static ithread_mutex_t pmlist_FwMutex = PTHREAD_MUTEX_INITIALIZER;
+static ithread_cond_t pmlist_FwCond = PTHREAD_COND_INITIALIZER;
+// held while worker is inside backend transaction
+static ithread_mutex_t pmlist_FwBackendMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void pmlist_Detach(struct portMap *item);
+
+/**
+ * Push operation into firewall queue.
+ *
+ * @param op Operation.
+ */
+static void pmlist_FwPush(struct pmlist_FwOp *op)
+{
+    do
+    {
+        op->next = pmlist_FwQueue;
+    }
+    while (!__sync_bool_compare_and_swap(&pmlist_FwQueue, op->next, op));
+
+    sem_post(&pmlist_FwSem);
+}
+
+/**
+ * Create and queue new firewall operation.
+ *
+ * @param type PMLIST_FW_ADD or PMLIST_FW_DELETE.
+ * @param item Portmapping.
+ * @param refs 2 if caller waits for operation, else 1.
+ * @return Operation or NULL if out of memory.
+ */
+static struct pmlist_FwOp *pmlist_FwQueueOp(int type, struct portMap *item, int refs)
+{
+    struct pmlist_FwOp *op = calloc(1, sizeof(struct pmlist_FwOp));
+
+    if (op == NULL)
+    {
+        trace(1, "pmlist: Out of memory, can't queue firewall operation");
+        return NULL;
+    }
+    op->type = type;
+    op->item = item;
+    op->refs = refs;
+    pmlist_FwPush(op);
+
+    return op;
+}
+
+/**
+ * Drop reference to operation, freeing it when it was the last one.
+ *
+ * @param op Operation.
+ */
+static void pmlist_FwRelease(struct pmlist_FwOp *op)
+{
+    int refs;
+
+    ithread_mutex_lock(&pmlist_FwMutex);
+    refs = --op->refs;
+    ithread_mutex_unlock(&pmlist_FwMutex);
+
+    if (refs == 0)
+        free(op);
+}
+
+/**
+ * Queue addition of rules for portmapping which is already in list.
+ * Depending on firewall_commit_wait, wait for the commit.
+ * Must be called with portmapping lock held for writing.
+ *
+ * @param item Portmapping.
+ * @return 1 if rules were added or are still being added, 0 if failed. If
+ *         0 is returned, caller must remove portmapping from list.
+ */
+static int pmlist_FwAdd(struct portMap *item)
+{
+    struct pmlist_FwOp *op;
+    struct timespec deadline;
+    int result = 1;
+
+    op = pmlist_FwQueueOp(PMLIST_FW_ADD, item, g_vars.firewallCommitWait > 0 ? 2 : 1);
+    if (op == NULL)
+        return 0;
+    if (g_vars.firewallCommitWait <= 0)
+        return 1;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += g_vars.firewallCommitWait / 1000;
+    deadline.tv_nsec += (g_vars.firewallCommitWait % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    ithread_mutex_lock(&pmlist_FwMutex);
+    while (!op->done)
+    {
+        if (ithread_cond_timedwait(&pmlist_FwCond, &pmlist_FwMutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (!op->done)
+        trace(2, "pmlist: Firewall commit didn't finish in %d ms, responding anyway", g_vars.firewallCommitWait);
+    else if (!op->result)
+    {
+        // worker leaves rollback to us
+        op->claimed = 1;
+        result = 0;
+    }
+    ithread_mutex_unlock(&pmlist_FwMutex);
+    pmlist_FwRelease(op);
+
+    return result;
+}
+
+/**
+ * Queue deletion of rules for portmapping which has been detached from list.
+ * Portmapping is freed by worker after rules are deleted.
+ *
+ * @param item Portmapping.
+ * @return 1 if deletion was queued, 0 if out of memory.
+ */
+static int pmlist_FwDelete(struct portMap *item)
+{
+    // worker may free item as soon as operation is queued
+    item->m_Unlinked = 1;
+    return pmlist_FwQueueOp(PMLIST_FW_DELETE, item, 1) != NULL;
+}
+
+/**
+ * Delete rules of portmapping which couldn't be queued for worker. Worker
+ * and this share transaction state of backend, so rules are deleted in own
+ * transaction while worker is kept out of backend.
  *
- * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
- * @param proto Portmapping protocol, either TCP or UDP.
- * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ * @param item Portmapping.
+ * @return 1 if deleting rules succeeded, 0 if failed.
  */
-struct portMap* pmlist_FindBy_extPort_proto(char *externalPort, char *proto)
+static int pmlist_FwDeleteNow(struct portMap *item)
 {
-    struct portMap* temp;
+    int result;
 
-    temp = pmlist_Head;
-    if (temp == NULL)
-        return NULL;
-    do
-    {
-        if  (  (strcmp(temp->m_ExternalPort, externalPort) == 0) &&
-               (strcmp(temp->m_PortMappingProtocol, proto) == 0) )
-            return temp; // We found a match, return pointer to it
-        else
-            temp = temp->next;
-    }
-    while (temp != NULL);
+    ithread_mutex_lock(&pmlist_FwBackendMutex);
+    pmlist_BackendBegin();
+    result = pmlist_DeleteRules(item);
+    if (!pmlist_BackendCommit())
+        result = 0;
+    ithread_mutex_unlock(&pmlist_FwBackendMutex);
 
-    // If we made it here, we didn't find it, so return NULL
-    return NULL;
+    return result;
 }
 
 /**
- * Fetch portmapping from given index in portmapping list. 
+ * Add rules of consecutive addition operations with one commit. If some
+ * addition fails, nothing is committed and additions are replayed one by
+ * one in own transactions to know which one failed. If the commit itself
+ * fails, backend may have applied part of the rules, so rules of the whole
+ * run are deleted before the replay.
  *
- * @param index Index of searched portmapping. 0 is first.
- * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ * @param ops First addition operation.
+ * @param end Operation following the last addition, NULL if none.
+ * @return Number of additions which failed.
  */
-struct portMap* pmlist_FindByIndex(int index)
+static int pmlist_FwAddRun(struct pmlist_FwOp *ops, struct pmlist_FwOp *end)
 {
-    int i=0;
-    struct portMap* temp;
+    struct pmlist_FwOp *op;
+    int ok = 1, failed = 0;
 
-    temp = pmlist_Head;
-    if (temp == NULL)
-        return NULL;
-    do
+    if (ops->next != end)
     {
-        if (i == index)
-            return temp;
+        pmlist_BackendBegin();
+        for (op = ops; op != end; op = op->next)
+        {
+            if (!(op->result = pmlist_AddRules(op->item)))
+                ok = 0;
+        }
+        if (!ok)
+            pmlist_BackendAbort();
+        else if (pmlist_BackendCommit())
+            return 0;
         else
         {
-            temp = temp->next;
-            i++;
+            trace(1, "pmlist: Committing addition of portmappings failed, retrying one by one");
+            pmlist_BackendBegin();
+            for (op = ops; op != end; op = op->next)
+                pmlist_DeleteRules(op->item);
+            pmlist_BackendCommit();
         }
     }
-    while (temp != NULL);
 
-    return NULL;
+    for (op = ops; op != end; op = op->next)
+    {
+        op->result = pmlist_AddRules(op->item);
+        if (!op->result)
+            failed++;
+    }
+
+    return failed;
 }
 
 /**
- * Search if portmapping matching given parameters exist in IGD's portmapping list. 
- * Starts searching from the beginning of list. 
+ * Apply firewall operations in queue order.
  *
- * @param remoteHost WAN IP address (destination) of connections initiated by a client in the local network. If empty string, then it is assumed as wildcarded address and matches all addresses.
- * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
- * @param protocol Portmapping protocol, either TCP or UDP.
- * @return Pointer to found portmapping. If portmapping is not found, return NULL.
+ * @param ops Operations in queue order.
+ * @return 1 if stop operation was found, else 0.
  */
-struct portMap* pmlist_FindSpecific(char * remoteHost, char *externalPort, char *protocol)
+static int pmlist_FwApply(struct pmlist_FwOp *ops)
 {
-    struct portMap* temp;
-
-    temp = pmlist_Head;
-    if (temp == NULL)
-        return NULL;
+    struct pmlist_FwOp *op, *next;
+    int in_batch = 0, failed = 0, removed = 0, stop = 0;
 
-    do
+    ithread_mutex_lock(&pmlist_FwBackendMutex);
+    for (op = ops; op; op = next)
     {
-        if ( (strcmp(temp->m_RemoteHost, remoteHost) == 0) &&
-                (strcmp(temp->m_ExternalPort, externalPort) == 0) &&
-                (strcmp(temp->m_PortMappingProtocol, protocol) == 0))
-            return temp;
-        else
-            temp = temp->next;
-    }
-    while (temp != NULL);
+        next = op->next;
+        if (op->type == PMLIST_FW_DELETE)
+        {
+            if (!in_batch)
+                pmlist_BackendBegin();
+            in_batch = 1;
+            op->result = pmlist_DeleteRules(op->item);
+            continue;
+        }
 
-    return NULL;
-}
+        if (in_batch && !pmlist_BackendCommit())
+            trace(1, "pmlist: Committing deletion of portmappings failed");
+        in_batch = 0;
 
-/**
- * Search if portmapping matching given parameters exist in IGD's portmapping list. 
- * Starts searching from the given index of list. 
- *
- * @param externalPort TCP or UDP port number of the Client as seen by the remote host.
- * @param protocol Portmapping protocol, either TCP or UDP.
- * @param index Index of portmapping list where searching is started from.
- * @return Pointer to found portmapping. If portmapping is not found, return NULL.
- */
-struct portMap* pmlist_FindBy_extPort_proto_afterIndex(char *externalPort, char *protocol, int index)
-{
-    struct portMap* temp;
+        if (op->type == PMLIST_FW_ADD)
+        {
+            while (next && next->type == PMLIST_FW_ADD)
+                next = next->next;
+            failed += pmlist_FwAddRun(op, next);
+        }
+        else
+            stop = 1;
+    }
+    if (in_batch && !pmlist_BackendCommit())
+        trace(1, "pmlist: Committing deletion of portmappings failed");
+    ithread_mutex_unlock(&pmlist_FwBackendMutex);
 
-    if ((index >= pmlist_Size()) || (index < 0))
-        return NULL;
+    ithread_mutex_lock(&pmlist_FwMutex);
+    for (op = ops; op; op = op->next)
+        op->done = 1;
+    ithread_cond_broadcast(&pmlist_FwCond);
+    ithread_mutex_unlock(&pmlist_FwMutex);
 
-    temp = pmlist_FindByIndex(index);
-    if (temp == NULL)
-        return NULL;
+    if (failed)
+    {
+        ActionLockWrite(ACTION_LOCK_PORTMAP);
+        for (op = ops; op; op = op->next)
+        {
+            if (op->type != PMLIST_FW_ADD || op->result || op->claimed || op->item->m_Unlinked)
+                continue;
+            trace(1, "pmlist: Adding rules of portmapping failed, removing it");
+            CancelMappingExpiration(op->item);
+            pmlist_Detach(op->item);
+            pmlist_FreeNode(op->item);
+            removed++;
+        }
+        if (removed)
+            NotifyPortMappingsRemoved();
+        ActionUnlock(ACTION_LOCK_PORTMAP);
+    }
 
-    do
+    for (op = ops; op; op = next)
     {
-        if ( (strcmp(temp->m_ExternalPort, externalPort) == 0) &&
-                (strcmp(temp->m_PortMappingProtocol, protocol) == 0))
-            return temp;
-        else
-            temp = temp->next;
+        next = op->next;
+        if (op->type == PMLIST_FW_DELETE)
+            pmlist_FreeNode(op->item);
+        if (op->type != PMLIST_FW_STOP)
+            pmlist_FwRelease(op);
     }
-    while (temp != NULL);
 
-    return NULL;
+    return stop;
 }
 
 /**
- * Search for next free external_port between ports 1024 and 9999.
- * 
- * @param protocol Next free portnumber of which protocol is searched.
- * @return Next free portnumber of given protocol or -1 if no ports are free.
+ * Firewall worker thread.
  */
-int pmlist_FindNextFreePort(char *protocol)
+static void *pmlist_FwWorker(void *arg)
 {
-    // Iteratively search for free port...
-    // lousy implementation....
-    // TODO: improve this. Are we sure that we can really use the found port?
-    int i;
-    int freePort = -1;
-    char portBuf[5];
+    struct pmlist_FwOp *ops, *op, *next;
+    sigset_t signals;
+    int stop = 0;
 
-    struct portMap* temp;
+    // signals are handled by main thread
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
 
-    for (i = 1024; i < 9999; i++)
+    while (!stop)
     {
-        sprintf(portBuf, "%d", i);
-        temp = pmlist_FindBy_extPort_proto(portBuf, protocol);
-        if (temp == NULL) 
+        while (sem_wait(&pmlist_FwSem) < 0 && errno == EINTR)
+            ;
+
+        // take whole queue and reverse it into queue order
+        ops = __sync_lock_test_and_set(&pmlist_FwQueue, NULL);
+        for (op = ops, ops = NULL; op; op = next)
         {
-            freePort = i;
-            break;
+            next = op->next;
+            op->next = ops;
+            ops = op;
         }
+
+        if (ops)
+            stop = pmlist_FwApply(ops);
     }
 
-    return freePort;
+    return NULL;
 }
 
 /**
- *  Find next port mapping in port range. If internal_client value is empty string, then it is treated as wildcard
- *  and all internal client values matches.
- * 
- * @param start_port Lower limit for port value in portmappings included in search.
- * @param end_port Upper limit for port value in portmappings included in search.
- * @param protocol Protocol of portmapping searched.
- * @param internal_client Internal client IP value.
- * @param pm Portmapping from where searching is started in list.
- * @return Portmapping matching parameters or NULL if none found.
+ * Start firewall worker. After this firewall rules of portmappings are
+ * added and deleted by worker thread.
+ *
+ * @return 1 if succesfull, 0 if failed.
  */
-struct portMap* pmlist_FindRangeAfter(int start_port, int end_port, char *protocol, char *internal_client, struct portMap *pm)
+int pmlist_WorkerStart(void)
 {
-    if (pmlist_Head == NULL)
-        return NULL;
-
-    // start from head if pm is null, otherwise start from next
-    if (pm == NULL)
-        pm = pmlist_Head;
-    else
-        pm = pm->next;
+    if (pmlist_FwRunning)
+        return 1;
 
-    while( pm != NULL )
+    if (sem_init(&pmlist_FwSem, 0, 0) < 0)
+        return 0;
+    if (ithread_create(&pmlist_FwThread, NULL, pmlist_FwWorker, NULL) != 0)
     {
-        if ( ((strcmp(pm->m_InternalClient, internal_client) == 0) || (strcmp(internal_client, "") == 0)) &&
-             (strcmp(pm->m_PortMappingProtocol, protocol) == 0) &&
-               atoi(pm->m_ExternalPort) >= start_port &&
-               atoi(pm->m_ExternalPort) <= end_port)
-            return pm;
-
-        pm = pm->next;
+        sem_destroy(&pmlist_FwSem);
+        return 0;
     }
+    pmlist_FwRunning = 1;
 
-    return NULL;
+    return 1;
 }
 
 /**
- * Check if portmapping list is empty.
- * 
- * @return 0 if not empty, 1 if is empty.
+ * Stop firewall worker after operations queued so far have been applied.
+ * Must be called without portmapping lock held.
  */
-int pmlist_IsEmtpy(void)
+void pmlist_WorkerStop(void)
 {
-    if (pmlist_Head)
-        return 0;
-    else
-        return 1;
+    if (!pmlist_FwRunning)
+        return;
+
+    pmlist_FwStopOp.type = PMLIST_FW_STOP;
+    pmlist_FwPush(&pmlist_FwStopOp);
+    ithread_join(pmlist_FwThread, NULL);
+    sem_destroy(&pmlist_FwSem);
+    pmlist_FwRunning = 0;
 }
 
 /**
- * Count how many portmappings there is in IGD's portmapping list.
- * 
- * @return Size of portmapping list.
+ * Start batch of iptables changes. Rules added and deleted until
+ * pmlist_EndBatch are committed together, instead of committing whole table
+ * (or running iptables-restore) for each rule. Batches may be nested.
+ * When firewall worker is running, it batches changes by itself and this
+ * does nothing.
  */
-int pmlist_Size(void)
+void pmlist_BeginBatch(void)
 {
-    struct portMap* temp;
-    int size = 0;
-
-    temp = pmlist_Head;
-    if (temp == NULL)
-        return 0;
+    if (!pmlist_FwRunning)
+        pmlist_BackendBegin();
+}
 
-    while (temp->next)
-    {
-        size++;
-        temp = temp->next;
-    }
-    size++;
-    return size;
+/**
+ * End batch of iptables changes started with pmlist_BeginBatch.
+ *
+ * @return 1 if changes were committed, 0 if failed.
+ */
+int pmlist_EndBatch(void)
+{
+    if (pmlist_FwRunning)
+        return 1;
+    return pmlist_BackendCommit();
 }
 
 /**
@@ -383,26 +1448,36 @@ int pmlist_FreeList(void)
     int action_succeeded = 1, ret;
     struct portMap *temp, *next;
 
+    pmlist_BeginBatch();
     temp = pmlist_Head;
     while (temp)
     {
-        CancelMappingExpiration(temp->expirationEventId);
-        ret = pmlist_DeletePortMapping(temp->m_PortMappingEnabled, temp->m_RemoteHost, temp->m_PortMappingProtocol,
-                                 temp->m_ExternalPort, temp->m_InternalClient, temp->m_InternalPort);
+        CancelMappingExpiration(temp);
+        next = temp->next;
+        if (pmlist_FwRunning && pmlist_FwDelete(temp))
+        {
+            temp = next;
+            continue;
+        }
+
+        ret = pmlist_FwRunning ? pmlist_FwDeleteNow(temp) : pmlist_DeleteRules(temp);
         if (ret == 0)
             action_succeeded = 0;
-
-        next = temp->next;
-        free(temp);
+        pmlist_FreeNode(temp);
         temp = next;
     }
+    if (!pmlist_EndBatch())
+        action_succeeded = 0;
     pmlist_Head = pmlist_Tail = NULL;
+    pmlist_IndexClear();
+    pmlist_OrderClear();
     return action_succeeded;
 }
 
 /**
  * Append new portmapping node at the end of portmapping list and
- * add portmaping into iptables with pmlist_AddPortMapping.
+ * add portmaping into iptables with pmlist_AddPortMapping, or queue that
+ * for firewall worker.
  * 
  * @param item Portmapping struct which is added into list.
  * @return 1 if addition succeeded, 0 if failed.
@@ -410,12 +1485,24 @@ int pmlist_FreeList(void)
 int pmlist_PushBack(struct portMap* item)
 {
     int action_succeeded = 0;
+    struct portMapText text;
+
+    if (item == NULL || !pmlist_IndexReserve() || !pmlist_OrderReserve())
+        return 0;
 
-    action_succeeded = pmlist_AddPortMapping(item->m_PortMappingEnabled, item->m_PortMappingProtocol, item->m_RemoteHost,
-                      item->m_ExternalPort, item->m_InternalClient, item->m_InternalPort);
+    pmlist_ToText(item, &text);
+    // firewall worker adds rules after portmapping is in list
+    if (pmlist_FwRunning)
+        action_succeeded = 1;
+    else
+        action_succeeded = pmlist_AddRules(item);
 
     if (action_succeeded == 1)
     {
+        pmlist_IndexPut(item);
+        item->m_OrderPosition = pmlist_OrderLength;
+        pmlist_Order[pmlist_OrderLength++] = item;
+
         if (pmlist_Tail) // We have a list, place on the end
         {
             pmlist_Tail->next = item;
@@ -431,8 +1518,14 @@ int pmlist_PushBack(struct portMap* item)
             item->next = NULL;
             action_succeeded = 1;
             trace(3, "appended %d %s %s %s %s %s %ld", item->m_PortMappingEnabled,
-                  item->m_PortMappingProtocol, item->m_RemoteHost, item->m_ExternalPort, item->m_InternalClient,
-                  item->m_InternalPort, item->m_PortMappingLeaseDuration);
+                  text.protocol, text.remoteHost, text.externalPort, text.internalClient,
+                  text.internalPort, item->m_PortMappingLeaseDuration);
+        }
+
+        if (pmlist_FwRunning && !pmlist_FwAdd(item))
+        {
+            pmlist_Detach(item);
+            action_succeeded = 0;
         }
     }
 
@@ -442,6 +1535,64 @@ int pmlist_PushBack(struct portMap* item)
         return 0;
 }
 
+/**
+ * Remove portmapping node from portmapping list, hash index and list order.
+ * Firewall rules and expiration of portmapping are left untouched.
+ * 
+ * @param temp Portmapping struct which is in list.
+ */
+static void pmlist_Detach(struct portMap *temp)
+{
+    pmlist_IndexRemove(temp);
+    pmlist_Order[temp->m_OrderPosition] = NULL;
+    pmlist_OrderHoles++;
+    if (temp == pmlist_Head) // We are the head of the list
+    {
+        if (temp->next == NULL) // We're the only node in the list
+        {
+            pmlist_Head = pmlist_Tail = pmlist_Current = NULL;
+        }
+        else // we have a next, so change head to point to it
+        {
+            pmlist_Head = temp->next;
+            pmlist_Head->prev = NULL;
+        }
+    }
+    else if (temp == pmlist_Tail) // We are the Tail, but not the Head so we have prev
+    {
+        pmlist_Tail = pmlist_Tail->prev;
+        pmlist_Tail->next = NULL;
+    }
+    else // We exist and we are between two nodes
+    {
+        temp->prev->next = temp->next;
+        temp->next->prev = temp->prev;
+        pmlist_Current = temp->next; // We put current to the right after a extraction
+    }
+}
+
+/**
+ * Remove portmapping node from portmapping list and from iptables, and free it.
+ * With firewall worker rules are deleted and node is freed by worker.
+ * 
+ * @param temp Portmapping struct which is in list.
+ * @return 1 if deleting from iptables succeeded, 0 if failed.
+ */
+static int pmlist_Unlink(struct portMap *temp)
+{
+    int action_succeeded;
+
+    CancelMappingExpiration(temp);
+    pmlist_Detach(temp);
+    if (pmlist_FwRunning && pmlist_FwDelete(temp))
+        return 1;
+
+    action_succeeded = pmlist_FwRunning ? pmlist_FwDeleteNow(temp) : pmlist_DeleteRules(temp);
+    pmlist_FreeNode(temp);
+
+    return action_succeeded;
+}
+
 /**
  * Delete portmapping node from portmapping list.
  * 
@@ -451,46 +1602,26 @@ int pmlist_PushBack(struct portMap* item)
 int pmlist_Delete(struct portMap* item)
 {
     struct portMap *temp;
-    int action_succeeded = 0;
+    int i;
 
-    temp = pmlist_Find(item->m_RemoteHost, item->m_ExternalPort, item->m_PortMappingProtocol, item->m_InternalClient);
-    if (temp) // We found the item to delete
+    // item is normally node of the list, but make sure of it
+    if ((i = pmlist_IndexFirst(item->m_ExternalPort, item->m_PortMappingProtocol)) < 0)
+        return 0;
+
+    while ((temp = pmlist_Index[i]) != NULL)
     {
-        CancelMappingExpiration(temp->expirationEventId);
-        action_succeeded = pmlist_DeletePortMapping(item->m_PortMappingEnabled, item->m_RemoteHost, item->m_PortMappingProtocol,
-                                 item->m_ExternalPort, item->m_InternalClient, item->m_InternalPort);
-        if (temp == pmlist_Head) // We are the head of the list
-        {
-            if (temp->next == NULL) // We're the only node in the list
-            {
-                pmlist_Head = pmlist_Tail = pmlist_Current = NULL;
-                free (temp);
-            }
-            else // we have a next, so change head to point to it
-            {
-                pmlist_Head = temp->next;
-                pmlist_Head->prev = NULL;
-                free (temp);
-            }
-        }
-        else if (temp == pmlist_Tail) // We are the Tail, but not the Head so we have prev
-        {
-            pmlist_Tail = pmlist_Tail->prev;
-            free (pmlist_Tail->next);
-            pmlist_Tail->next = NULL;
-        }
-        else // We exist and we are between two nodes
-        {
-            temp->prev->next = temp->next;
-            temp->next->prev = temp->prev;
-            pmlist_Current = temp->next; // We put current to the right after a extraction
-            free (temp);
-        }
+        if (temp == item ||
+            (temp->m_ExternalPort == item->m_ExternalPort &&
+             temp->m_PortMappingProtocol == item->m_PortMappingProtocol &&
+             pmlist_AddrEquals(temp->m_RemoteHostFamily, &temp->m_RemoteHost, item->m_RemoteHostFamily, &item->m_RemoteHost) &&
+             pmlist_AddrEquals(temp->m_InternalClientFamily, &temp->m_InternalClient, item->m_InternalClientFamily, &item->m_InternalClient)))
+            return pmlist_Unlink(temp); // We found the item to delete
+
+        i = (i + 1) & (pmlist_IndexSize - 1);
     }
-    else  // We're deleting something that's not there, so return 0
-        action_succeeded = 0;
 
-    return action_succeeded;
+    // We're deleting something that's not there, so return 0
+    return 0;
 }
 
 /**
@@ -502,51 +1633,19 @@ int pmlist_Delete(struct portMap* item)
 int pmlist_DeleteIndex(int index)
 {
     struct portMap *temp;
-    int action_succeeded = 0;
 
     temp = pmlist_FindByIndex(index);
     if (temp) // We found the item to delete
-    {
-        CancelMappingExpiration(temp->expirationEventId);
-        action_succeeded = pmlist_DeletePortMapping(temp->m_PortMappingEnabled, temp->m_RemoteHost, temp->m_PortMappingProtocol,
-                                 temp->m_ExternalPort, temp->m_InternalClient, temp->m_InternalPort);
-        if (temp == pmlist_Head) // We are the head of the list
-        {
-            if (temp->next == NULL) // We're the only node in the list
-            {
-                pmlist_Head = pmlist_Tail = pmlist_Current = NULL;
-                free (temp);
-            }
-            else // we have a next, so change head to point to it
-            {
-                pmlist_Head = temp->next;
-                pmlist_Head->prev = NULL;
-                free (temp);
-            }
-        }
-        else if (temp == pmlist_Tail) // We are the Tail, but not the Head so we have prev
-        {
-            pmlist_Tail = pmlist_Tail->prev;
-            free (pmlist_Tail->next);
-            pmlist_Tail->next = NULL;
-        }
-        else // We exist and we are between two nodes
-        {
-            temp->prev->next = temp->next;
-            temp->next->prev = temp->prev;
-            pmlist_Current = temp->next; // We put current to the right after a extraction
-            free (temp);
-        }
-    }
-    else  // We're deleting something that's not there, so return 0
-        action_succeeded = 0;
+        return pmlist_Unlink(temp);
 
-    return action_succeeded;
+    // We're deleting something that's not there, so return 0
+    return 0;
 }
 
+#if !HAVE_LIBNFTNL
 /**
  * Add new portmapping rule in iptables.
- * Use either libiptc or iptables commandline command for adding.
+ * Use either libiptc or iptables-restore for adding.
  * 
  * If value of remoteHost is empty string, then it is interpreted as wildcard value and it is not
  * added for port map.
@@ -578,6 +1677,9 @@ int pmlist_AddPortMapping (int enabled, char *protocol, char *remoteHost, char *
         snprintf(dest, DEST_LEN, "%s:%s", internalClient, internalPort);
 
 #if HAVE_LIBIPTC
+        // both rules are committed together, or neither if one fails
+        iptc_transaction_begin();
+        status = 1;
         if (g_vars.createForwardRules)
         {
             trace(3, "iptc_add_rule %s %s %s %s %s %s %s %s",
@@ -586,145 +1688,52 @@ int pmlist_AddPortMapping (int enabled, char *protocol, char *remoteHost, char *
             status = iptc_add_rule("filter", g_vars.forwardChainName, protocol, NULL, NULL, tmp_remoteHost, internalClient, NULL, internalPort, "ACCEPT", NULL, g_vars.forwardRulesAppend ? TRUE : FALSE);
         }
         if (status == 0)
+        {
+            iptc_transaction_abort();
             return 0;
+        }
 
         trace(3, "iptc_add_rule %s %s %s %s %s %s %s %s %s",
               "nat", g_vars.preroutingChainName, protocol, g_vars.extInterfaceName, tmp_remoteHost, tmp_externalPort, "DNAT", dest, "APPEND");
         status = iptc_add_rule("nat", g_vars.preroutingChainName, protocol, g_vars.extInterfaceName, NULL, tmp_remoteHost, NULL, NULL, tmp_externalPort, "DNAT", dest, TRUE);
         if (status == 0)
+        {
+            iptc_transaction_abort();
+            return 0;
+        }
+        if (!iptc_transaction_commit())
             return 0;
 #else
-        char *args[18];
+        char rule[IPTRESTORE_RULE_LEN];
 
+        // both rules are applied with one iptables-restore call
+        iptrestore_transaction_begin();
+        status = 1;
         if (g_vars.createForwardRules)
         {
-            if (tmp_remoteHost) {
-                args[0] = g_vars.iptables;
-                args[1] = g_vars.forwardRulesAppend ? "-A" : "-I";
-                args[2] = g_vars.forwardChainName;
-                args[3] = "-s";
-                args[4] = tmp_remoteHost;
-                args[5] = "-p";
-                args[6] = protocol;
-                args[7] = "-d";
-                args[8] = internalClient;
-                args[9] = "--dport";
-                args[10] = internalPort;
-                args[11] = "-j";
-                args[12] = "ACCEPT";
-                args[13] =  NULL;
-
-                trace(3, "%s %s %s -s %s -p %s -d %s --dport %s -j ACCEPT",
-                      g_vars.iptables,g_vars.forwardRulesAppend ? "-A" : "-I",g_vars.forwardChainName, tmp_remoteHost, protocol, internalClient, internalPort);
-
-            }
-            else {
-                args[0] = g_vars.iptables;
-                args[1] = g_vars.forwardRulesAppend ? "-A" : "-I";
-                args[2] = g_vars.forwardChainName;
-                args[3] = "-p";
-                args[4] = protocol;
-                args[5] = "-d";
-                args[6] = internalClient;
-                args[7] = "--dport";
-                args[8] = internalPort;
-                args[9] = "-j";
-                args[10] = "ACCEPT";
-                args[11] =  NULL;
-
-                trace(3, "%s %s %s -p %s -d %s --dport %s -j ACCEPT",
-                      g_vars.iptables,g_vars.forwardRulesAppend ? "-A" : "-I",g_vars.forwardChainName, protocol, internalClient, internalPort);
-            }
-
-            if (!fork())
-            {
-                int rc = execv(g_vars.iptables, args);
-                exit(rc);
-            }
-            else
-            {
-                wait(&status);
-                if (status != 0)
-                    return 0;
-            }
-        }
-
-        // Pre routing
-        if (tmp_remoteHost && tmp_externalPort) {
-            args[0] = g_vars.iptables;
-            args[1] = "-t";
-            args[2] = "nat";
-            args[3] = "-A";
-            args[4] = g_vars.preroutingChainName;
-            args[5] = "-i";
-            args[6] = g_vars.extInterfaceName;
-            args[7] = "-s";
-            args[8] = tmp_remoteHost;
-            args[9] = "-p";
-            args[10] = protocol;
-            args[11] = "--dport";
-            args[12] = tmp_externalPort;
-            args[13] = "-j";
-            args[14] = "DNAT";
-            args[15] = "--to";
-            args[16] = dest;
-            args[17] = NULL;
-
-            trace(3, "%s -t nat -A %s -i %s -s %s -p %s --dport %s -j DNAT --to %s",
-                  g_vars.iptables, g_vars.preroutingChainName, g_vars.extInterfaceName, tmp_remoteHost, protocol, tmp_externalPort, dest);
-        }
-        else if (tmp_externalPort) {
-            args[0] = g_vars.iptables;
-            args[1] = "-t";
-            args[2] = "nat";
-            args[3] = "-A";
-            args[4] = g_vars.preroutingChainName;
-            args[5] = "-i";
-            args[6] = g_vars.extInterfaceName;
-            args[7] = "-p";
-            args[8] = protocol;
-            args[9] = "--dport";
-            args[10] = tmp_externalPort;
-            args[11] = "-j";
-            args[12] = "DNAT";
-            args[13] = "--to";
-            args[14] = dest;
-            args[15] = NULL;
-
-            trace(3, "%s -t nat -A %s -i %s -p %s --dport %s -j DNAT --to %s",
-                  g_vars.iptables, g_vars.preroutingChainName, g_vars.extInterfaceName, protocol, tmp_externalPort, dest);
+            snprintf(rule, sizeof(rule), "%s %s%s%s -p %s -d %s --dport %s -j ACCEPT",
+                     g_vars.forwardRulesAppend ? "-A" : "-I", g_vars.forwardChainName,
+                     tmp_remoteHost ? " -s " : "", tmp_remoteHost ? tmp_remoteHost : "",
+                     protocol, internalClient, internalPort);
+            status = iptrestore_rule("filter", rule);
         }
-        else {
-            args[0] = g_vars.iptables;
-            args[1] = "-t";
-            args[2] = "nat";
-            args[3] = "-A";
-            args[4] = g_vars.preroutingChainName;
-            args[5] = "-i";
-            args[6] = g_vars.extInterfaceName;
-            args[7] = "-p";
-            args[8] = protocol;
-            args[9] = "-j";
-            args[10] = "DNAT";
-            args[11] = "--to";
-            args[12] = dest;
-            args[13] = NULL;
-
-            trace(3, "%s -t nat -A %s -i %s -p %s -j DNAT --to %s",
-                  g_vars.iptables, g_vars.preroutingChainName, g_vars.extInterfaceName, protocol, dest);
-        }
-
-        if (!fork())
+        if (status)
         {
-            int rc = execv(g_vars.iptables, args);
-            exit(rc);
+            // Pre routing
+            snprintf(rule, sizeof(rule), "-A %s -i %s%s%s -p %s%s%s -j DNAT --to %s",
+                     g_vars.preroutingChainName, g_vars.extInterfaceName,
+                     tmp_remoteHost ? " -s " : "", tmp_remoteHost ? tmp_remoteHost : "",
+                     protocol, tmp_externalPort ? " --dport " : "", tmp_externalPort ? tmp_externalPort : "",
+                     dest);
+            status = iptrestore_rule("nat", rule);
         }
-        else
+        if (status == 0)
         {
-            wait(&status);
-            if (status != 0)
-                return 0;
+            iptrestore_transaction_abort();
+            return 0;
         }
+        if (!iptrestore_transaction_commit())
+            return 0;
 #endif
     }
     return 1;
@@ -732,7 +1741,7 @@ int pmlist_AddPortMapping (int enabled, char *protocol, char *remoteHost, char *
 
 /**
  * Add new portmapping rule in iptables.
- * Use either libiptc or iptables commandline command for adding.
+ * Use either libiptc or iptables-restore for deleting.
  * 
  * @param enabled Is rule enabled. Rule is deleted only if it is enabled (1).
  * @param remoteHost WAN IP address (destination) of connections initiated by a client in the local network.
@@ -754,132 +1763,42 @@ int pmlist_DeletePortMapping(int enabled, char *remoteHost, char *protocol, char
         snprintf(dest, DEST_LEN, "%s:%s", internalClient, internalPort);
 
 #if HAVE_LIBIPTC
+        // rules which could be deleted are committed even if the other fails
+        iptc_transaction_begin();
         trace(3, "iptc_delete_rule %s %s %s %s %s %s %s %s",
               "nat", g_vars.preroutingChainName, protocol, g_vars.extInterfaceName, remoteHost, externalPort, "DNAT", dest);
         status = iptc_delete_rule("nat", g_vars.preroutingChainName, protocol, g_vars.extInterfaceName, NULL, remoteHost, NULL, NULL, externalPort, "DNAT", dest);
-        if (status == 0)
-            return 0;
 
-        if (g_vars.createForwardRules)
+        if (status && g_vars.createForwardRules)
         {
             trace(3, "iptc_delete_rule %s %s %s %s %s %s %s",
                   "filter", g_vars.forwardChainName, protocol, remoteHost, internalClient, internalPort, "ACCEPT");
             status = iptc_delete_rule("filter", g_vars.forwardChainName, protocol, NULL, NULL, remoteHost, internalClient, NULL, internalPort, "ACCEPT", NULL);
-            if (status == 0)
-                return 0;
         }
+        if (!iptc_transaction_commit() || status == 0)
+            return 0;
 #else
-        char *args[18];
-
-        if (remoteHost) {
-            args[0] = g_vars.iptables;
-            args[1] = "-t";
-            args[2] = "nat";
-            args[3] = "-D";
-            args[4] = g_vars.preroutingChainName;
-            args[5] = "-i";
-            args[6] = g_vars.extInterfaceName;
-            args[7] = "-s";
-            args[8] = remoteHost;
-            args[9] = "-p";
-            args[10] = protocol;
-            args[11] = "--dport";
-            args[12] = externalPort;
-            args[13] = "-j";
-            args[14] = "DNAT";
-            args[15] = "--to";
-            args[16] = dest;
-            args[17] = NULL;
-
-            trace(3, "%s -t nat -D %s -i %s -s %s -p %s --dport %s -j DNAT --to %s",
-                  g_vars.iptables, g_vars.preroutingChainName, g_vars.extInterfaceName, remoteHost, protocol, externalPort, dest);
-        }
-        else {
-            args[0] = g_vars.iptables;
-            args[1] = "-t";
-            args[2] = "nat";
-            args[3] = "-D";
-            args[4] = g_vars.preroutingChainName;
-            args[5] = "-i";
-            args[6] = g_vars.extInterfaceName;
-            args[7] = "-p";
-            args[8] = protocol;
-            args[9] = "--dport";
-            args[10] = externalPort;
-            args[11] = "-j";
-            args[12] = "DNAT";
-            args[13] = "--to";
-            args[14] = dest;
-            args[15] = NULL;
-
-            trace(3, "%s -t nat -D %s -i %s -p %s --dport %s -j DNAT --to %s",
-                  g_vars.iptables, g_vars.preroutingChainName, g_vars.extInterfaceName, protocol, externalPort, dest);
-        }
+        char rule[IPTRESTORE_RULE_LEN];
 
-        if (!fork())
-        {
-            int rc = execv(g_vars.iptables, args);
-            exit(rc);
-        }
-        else
-        {
-            wait(&status);
-            if (status != 0)
-                return 0;
-        }
+        iptrestore_transaction_begin();
+        snprintf(rule, sizeof(rule), "-D %s -i %s%s%s -p %s --dport %s -j DNAT --to %s",
+                 g_vars.preroutingChainName, g_vars.extInterfaceName,
+                 remoteHost ? " -s " : "", remoteHost ? remoteHost : "",
+                 protocol, externalPort, dest);
+        status = iptrestore_rule("nat", rule);
 
-        if (g_vars.createForwardRules)
+        if (status && g_vars.createForwardRules)
         {
-            if (remoteHost) {
-                args[0] = g_vars.iptables;
-                args[1] = "-D";
-                args[2] = g_vars.forwardChainName;
-                args[3] = "-s";
-                args[4] = remoteHost;
-                args[5] = "-p";
-                args[6] = protocol;
-                args[7] = "-d";
-                args[8] = internalClient;
-                args[9] = "--dport";
-                args[10] = internalPort;
-                args[11] = "-j";
-                args[12] = "ACCEPT";
-                args[13] =  NULL;
-
-                trace(3, "%s -D %s -s %s -p %s -d %s --dport %s -j ACCEPT",
-                          g_vars.iptables, g_vars.forwardChainName, remoteHost, protocol, internalClient, internalPort);
-             }
-             else {
-                args[0] = g_vars.iptables;
-                args[1] = "-D";
-                args[2] = g_vars.forwardChainName;
-                args[3] = "-p";
-                args[4] = protocol;
-                args[5] = "-d";
-                args[6] = internalClient;
-                args[7] = "--dport";
-                args[8] = internalPort;
-                args[9] = "-j";
-                args[10] = "ACCEPT";
-                args[11] =  NULL;
-
-                trace(3, "%s -D %s -p %s -d %s --dport %s -j ACCEPT",
-                          g_vars.iptables, g_vars.forwardChainName, protocol, internalClient, internalPort);
-             }
-
-            if (!fork())
-            {
-                int rc = execv(g_vars.iptables, args);
-                exit(rc);
-            }
-            else
-            {
-                wait(&status);
-                if (status != 0)
-                    return 0;
-            }
+            snprintf(rule, sizeof(rule), "-D %s%s%s -p %s -d %s --dport %s -j ACCEPT",
+                     g_vars.forwardChainName,
+                     remoteHost ? " -s " : "", remoteHost ? remoteHost : "",
+                     protocol, internalClient, internalPort);
+            status = iptrestore_rule("filter", rule);
         }
+        if (!iptrestore_transaction_commit() || status == 0)
+            return 0;
 #endif
     }
     return 1;
 }
+#endif
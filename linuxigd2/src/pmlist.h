@@ -27,42 +27,71 @@
  
 #ifndef _PMLIST_H_
 #define _PMLIST_H_
+#include <stdint.h>
 #include <arpa/inet.h>
+#include "timerwheel.h"
 
 #define DEST_LEN 100
+#define PM_DESC_LEN 50
 
+// address family of remote host or internal client given as domain name
+#define PM_AF_NAME 0xff
 
-typedef struct ExpirationEvent
+
+/* remote host or internal client in binary form, see m_..Family for type */
+union pmAddr
 {
-    int eventId;
-    char DevUDN[NAME_SIZE];
-    char ServiceID[NAME_SIZE];
-    struct portMap *mapping;
-} expiration_event;
+    struct in_addr v4;      // AF_INET
+    struct in6_addr v6;     // AF_INET6
+    char *name;             // PM_AF_NAME, allocated with portmapping
+};
 
 struct portMap
 {
-    int m_PortMappingEnabled;
-    long int m_PortMappingLeaseDuration;
-    int m_IsStatic;
-    char m_RemoteHost[INET6_ADDRSTRLEN];      // updated IPv6 addrss length 16 -> 46
-    char m_ExternalPort[6];
-    char m_InternalPort[6];
-    char m_PortMappingProtocol[4];
-    char m_InternalClient[INET6_ADDRSTRLEN];  // updated IPv6 addrss length 16 -> 46
-    char m_PortMappingDescription[50];
+    struct portMap* next;
+    struct portMap* prev;
 
-    int expirationEventId;
+    long int m_PortMappingLeaseDuration;
     long int expirationTime;
+    char *m_PortMappingDescription;         // NULL if empty
 
-    struct portMap* next;
-    struct portMap* prev;
+    union pmAddr m_RemoteHost;
+    union pmAddr m_InternalClient;
+    struct timerNode expirationTimer;       // expiration of lease, see ScheduleMappingExpiration
+    int m_OrderPosition;                    // index in list order, see pmlist_FindByIndex
+    uint16_t m_ExternalPort;
+    uint16_t m_InternalPort;
+    uint8_t m_PortMappingProtocol;          // IPPROTO_TCP or IPPROTO_UDP
+    uint8_t m_RemoteHostFamily;             // AF_UNSPEC if remote host is wildcarded
+    uint8_t m_InternalClientFamily;
+    uint8_t m_PortMappingEnabled;
+    uint8_t m_IsStatic;
+    uint8_t m_Unlinked;                     // removed from list, firewall worker deletes rules and frees it
+#if HAVE_LIBNFTNL
+    uint64_t m_ForwardHandle;               // nftables handle of forward rule, 0 if none
+    uint64_t m_NatHandle;                   // nftables handle of DNAT rule, 0 if mapping is in DNAT map
+#endif
 } *pmlist_Head, *pmlist_Tail, *pmlist_Current;
 
+/* portMap values as strings, used for SOAP messages and iptables rules */
+struct portMapText
+{
+    char remoteHost[INET6_ADDRSTRLEN];
+    char externalPort[6];
+    char internalPort[6];
+    char internalClient[INET6_ADDRSTRLEN];
+    const char *protocol;
+    const char *description;
+};
+
 //struct portMap* pmlist_NewNode(void);
 struct portMap* pmlist_NewNode(int enabled, long int duration, char *remoteHost,
                                char *externalPort, char *internalPort,
                                char *protocol, char *internalClient, char *desc, int isStatic);
+void pmlist_FreeNode(struct portMap* item);
+void pmlist_ToText(const struct portMap* item, struct portMapText *text);
+int pmlist_ProtocolFromStr(const char *protocol);
+const char* pmlist_ProtocolToStr(int protocol);
 
 struct portMap* pmlist_Find(char * remoteHost, char *externalPort, char *proto, char *internalClient);
 struct portMap* pmlist_FindBy_extPort_proto_intClient(char *externalPort, char *proto, char *internalClient);
@@ -71,16 +100,22 @@ struct portMap* pmlist_FindByIndex(int index);
 struct portMap* pmlist_FindRangeAfter(int, int, char *, char *, struct portMap*);
 struct portMap* pmlist_FindSpecific(char * remoteHost, char *externalPort, char *protocol);
 struct portMap* pmlist_FindBy_extPort_proto_afterIndex(char *externalPort, char *protocol, int index);
-int pmlist_FindNextFreePort(char *protocol);
+int pmlist_FindNextFreePort(char *protocol, int port);
 int pmlist_IsEmtpy(void);
 int pmlist_Size(void);
 int pmlist_FreeList(void);
+void pmlist_BeginBatch(void);
+int pmlist_EndBatch(void);
+int pmlist_WorkerStart(void);
+void pmlist_WorkerStop(void);
 int pmlist_PushBack(struct portMap* item);
 int pmlist_Delete(struct portMap* item);
 int pmlist_DeleteIndex(int index);
+#if !HAVE_LIBNFTNL
 int pmlist_AddPortMapping (int enabled, char *protocol, char *remoteHost,
                            char *externalPort, char *internalClient, char *internalPort);
 int pmlist_DeletePortMapping(int enabled, char *remoteHost, char *protocol,
                              char *externalPort, char *internalClient, char *internalPort);
+#endif
 
 #endif // _PMLIST_H_
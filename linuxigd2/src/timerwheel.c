@@ -0,0 +1,250 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Hierarchical timing wheel for expiration of portmappings and pinholes.
+ *
+ * Timers are nodes embedded in the expiring objects, so scheduling and
+ * cancelling don't allocate and take constant time. Level 0 has one slot per
+ * second. Timers further away wait in higher levels and are moved down
+ * (cascaded) when the lower level wraps around, so each timer is moved at most
+ * once per level. Collecting advances the wheel second by second up to current
+ * time and returns everything due as one list.
+ */
+
+#include "timerwheel.h"
+
+/**
+ * Initialize timer node as not scheduled.
+ *
+ * @param node Timer node.
+ */
+void TimerNodeInit(struct timerNode *node)
+{
+    node->next = NULL;
+    node->pprev = NULL;
+    node->expires = 0;
+}
+
+/**
+ * Check if timer node is scheduled.
+ *
+ * @param node Timer node.
+ * @return 1 if node is in wheel or in list of due timers, 0 if not.
+ */
+int TimerNodePending(const struct timerNode *node)
+{
+    return node->pprev != NULL;
+}
+
+/**
+ * Link timer node first in list.
+ *
+ * @param list First node of list.
+ * @param node Timer node which is not linked.
+ */
+static void timerLink(struct timerNode **list, struct timerNode *node)
+{
+    node->next = *list;
+    if (node->next)
+        node->next->pprev = &node->next;
+    *list = node;
+    node->pprev = list;
+}
+
+/**
+ * Put timer node to slot matching its expiration time.
+ *
+ * @param wheel Timer wheel.
+ * @param node Timer node which is not linked.
+ */
+static void timerWheelInsert(struct timerWheel *wheel, struct timerNode *node)
+{
+    time_t expires = node->expires;
+    time_t delta;
+    int level;
+
+    // timers already due go to slot expired next
+    if (expires < wheel->current)
+        expires = wheel->current;
+    delta = expires - wheel->current;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < ((time_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+            break;
+    }
+    // timers beyond the range wait in last slot and are put back when cascaded
+    if (delta >= TIMER_WHEEL_RANGE)
+        expires = wheel->current + TIMER_WHEEL_RANGE - 1;
+
+    timerLink(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], node);
+}
+
+/**
+ * Move timers of higher level slot to lower levels.
+ *
+ * @param wheel Timer wheel.
+ * @param level Level of slot.
+ * @param index Index of slot.
+ */
+static void timerWheelCascade(struct timerWheel *wheel, int level, int index)
+{
+    struct timerNode *node;
+
+    while ((node = TimerWheelPop(&wheel->slots[level][index])) != NULL)
+        timerWheelInsert(wheel, node);
+}
+
+/**
+ * Synchronize wheel to clock which has jumped or to wheel which has not been
+ * used yet. Every timer is visited, timers due are moved to list of due timers
+ * and the others are placed again relative to current time.
+ *
+ * @param wheel Timer wheel.
+ * @param now Current time.
+ * @param due List where timers due are added.
+ * @return Number of timers due.
+ */
+static int timerWheelRebase(struct timerWheel *wheel, time_t now, struct timerNode **due)
+{
+    struct timerNode *pending = NULL, *node;
+    int level, index, count = 0;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (index = 0; index < TIMER_WHEEL_SLOTS; index++)
+        {
+            while ((node = TimerWheelPop(&wheel->slots[level][index])) != NULL)
+            {
+                if (node->expires <= now)
+                {
+                    timerLink(due, node);
+                    count++;
+                }
+                else
+                    timerLink(&pending, node);
+            }
+        }
+    }
+
+    wheel->current = now + 1;
+    while ((node = TimerWheelPop(&pending)) != NULL)
+        timerWheelInsert(wheel, node);
+
+    return count;
+}
+
+/**
+ * Schedule timer to expire at given time. If timer is already scheduled, it
+ * is moved to new time.
+ *
+ * @param wheel Timer wheel.
+ * @param node Timer node.
+ * @param expires Absolute expiration time.
+ */
+void TimerWheelSchedule(struct timerWheel *wheel, struct timerNode *node, time_t expires)
+{
+    TimerWheelCancel(node);
+    node->expires = expires;
+    timerWheelInsert(wheel, node);
+}
+
+/**
+ * Cancel timer. Timer which is not scheduled is left as it is.
+ *
+ * @param node Timer node.
+ */
+void TimerWheelCancel(struct timerNode *node)
+{
+    if (!node->pprev)
+        return;
+
+    *node->pprev = node->next;
+    if (node->next)
+        node->next->pprev = node->pprev;
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+/**
+ * Advance wheel to given time and collect all timers due.
+ * Timers stay pending in list of due timers until they are popped or
+ * cancelled, so owner may cancel any of them while handling the others.
+ *
+ * @param wheel Timer wheel.
+ * @param now Current time.
+ * @param due List of timers due, empty if none.
+ * @return Number of timers due.
+ */
+int TimerWheelCollect(struct timerWheel *wheel, time_t now, struct timerNode **due)
+{
+    struct timerNode *node;
+    int level, index, count = 0;
+
+    *due = NULL;
+
+    // clock was set backwards or wheel lags behind more than it can step
+    if (now + 1 < wheel->current || now - wheel->current >= TIMER_WHEEL_RANGE)
+        return timerWheelRebase(wheel, now, due);
+
+    while (wheel->current <= now)
+    {
+        index = wheel->current & TIMER_WHEEL_MASK;
+        if (index == 0)
+        {
+            // lower level wrapped around, cascade next slot of higher levels
+            for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+            {
+                index = (wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+                timerWheelCascade(wheel, level, index);
+                if (index != 0)
+                    break;
+            }
+            index = 0;
+        }
+
+        while ((node = TimerWheelPop(&wheel->slots[0][index])) != NULL)
+        {
+            timerLink(due, node);
+            count++;
+        }
+        wheel->current++;
+    }
+
+    return count;
+}
+
+/**
+ * Take first timer from list of timers.
+ *
+ * @param due List of timers.
+ * @return Timer node which is not scheduled anymore, NULL if list is empty.
+ */
+struct timerNode *TimerWheelPop(struct timerNode **due)
+{
+    struct timerNode *node = *due;
+
+    if (node)
+        TimerWheelCancel(node);
+    return node;
+}
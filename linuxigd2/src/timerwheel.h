@@ -0,0 +1,65 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#include <stddef.h>
+#include <time.h>
+
+// Wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots. Slot of
+// level 0 is one second, slot of each next level covers a whole lower level.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+// seconds covered by the wheel, a bit over 194 days
+#define TIMER_WHEEL_RANGE ((time_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+// Timer embedded in the object which expires. Zeroed node is not scheduled.
+struct timerNode
+{
+    struct timerNode *next;
+    struct timerNode **pprev;   // link pointing to this node, NULL if not scheduled
+    time_t expires;             // absolute expiration time
+};
+
+// Zeroed wheel is empty and valid, it is synchronized to clock on first collect.
+// Wheel has no lock of its own, owner of the timed objects serializes access.
+struct timerWheel
+{
+    time_t current;             // next second to expire
+    struct timerNode *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// get object containing timer node
+#define TIMER_NODE_ENTRY(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+void TimerNodeInit(struct timerNode *node);
+int TimerNodePending(const struct timerNode *node);
+void TimerWheelSchedule(struct timerWheel *wheel, struct timerNode *node, time_t expires);
+void TimerWheelCancel(struct timerNode *node);
+int TimerWheelCollect(struct timerWheel *wheel, time_t now, struct timerNode **due);
+struct timerNode *TimerWheelPop(struct timerNode **due);
+
+#endif // _TIMERWHEEL_H_
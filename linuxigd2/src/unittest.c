@@ -27,12 +27,16 @@
 #include <upnp/ixml.h>
 #include <upnp/TimerThread.h>
 #include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <regex.h>
 
 #include "gatedevice.h"
 #include "pmlist.h"
 #include "globals.h"
 #include "util.h"
 #include "unittest.h"
+#include "validate.h"
 #include "util.h"
 #include <arpa/inet.h>
 
@@ -43,11 +47,11 @@ int InitTestSuite(void)
 {
     struct portMap *pm;
 
-    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "21", "21", "TCP", "192.168.0.20", "FTP");
+    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "21", "21", "TCP", "192.168.0.20", "FTP", 0);
     pmlist_PushBack(pm);
-    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "22", "22", "TCP", "192.168.0.20", "SSH");
+    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "22", "22", "TCP", "192.168.0.20", "SSH", 0);
     pmlist_PushBack(pm);
-    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "80", "80", "TCP", "192.168.0.20", "Http");
+    pm = pmlist_NewNode(1, 604800, "130.234.180.200", "80", "80", "TCP", "192.168.0.20", "Http", 0);
     pmlist_PushBack(pm);
 
     ExpirationTimerThreadInit();
@@ -262,6 +266,9 @@ void Test_ControlPointIP_equals_InternalClientIP(void)
 void Test_GetEthernetLinkStatus(void)
 {
     struct Upnp_Action_Request event;
+    char *status = NULL;
+
+    memset(&event, 0, sizeof(event));
     strcpy(event.DevUDN,"uuid:75802409-bccb-40e7-8e6c-fa095ecce13e");
     strcpy(event.ServiceID,"urn:upnp-org:serviceId:WANEthLinkC1");
     strcpy(event.ActionName,"GetEthernetLinkStatus");
@@ -271,23 +278,375 @@ void Test_GetEthernetLinkStatus(void)
     // Up
     strcpy(g_vars.extInterfaceName,"eth0");
     CU_ASSERT(GetEthernetLinkStatus(&event) == 0);
-    CU_ASSERT(strcmp(EthernetLinkStatus,"Up") == 0);
+    status = GetFirstDocumentItem(event.ActionResult, "NewEthernetLinkStatus");
+    CU_ASSERT(status != NULL && strcmp(status,"Up") == 0);
+    free(status);
+    ixmlDocument_free(event.ActionResult);
+    event.ActionResult = NULL;
 
     // Down
     strcpy(g_vars.extInterfaceName,"eth7");
     CU_ASSERT(GetEthernetLinkStatus(&event) == 0);
-    CU_ASSERT(strcmp(EthernetLinkStatus,"Down") == 0);
+    status = GetFirstDocumentItem(event.ActionResult, "NewEthernetLinkStatus");
+    CU_ASSERT(status != NULL && strcmp(status,"Down") == 0);
+    free(status);
+    ixmlDocument_free(event.ActionResult);
+
+    ixmlDocument_free(event.ActionRequest);
+}
+
+/*
+ * Previous escaping implementations, which reallocated output for every
+ * escaped character. Used as reference for results and speed.
+ */
+static char *escapeXMLStringReference(char *xml)
+{
+    const char *entity;
+    char *escXML, *new_buf;
+    size_t size = strlen(xml), alloc = size + 1;
+    int i, j;
+
+    if ((escXML = malloc(alloc)) == NULL)
+        return NULL;
+
+    for (i = 0, j = 0; i < size; i++)
+    {
+        switch (xml[i])
+        {
+            case '<': entity = "&lt;"; break;
+            case '>': entity = "&gt;"; break;
+            case '"': entity = "&quot;"; break;
+            case '\'': entity = "&apos;"; break;
+            case '&': entity = "&amp;"; break;
+            default: escXML[j++] = xml[i]; continue;
+        }
+        alloc += strlen(entity);
+        if ((new_buf = realloc(escXML, alloc)) == NULL)
+        {
+            free(escXML);
+            return NULL;
+        }
+        escXML = new_buf;
+        strcpy(escXML + j, entity);
+        j += strlen(entity);
+    }
+    escXML[j] = '\0';
+    return escXML;
+}
+
+static char *unescapeXMLStringReference(char *escXML)
+{
+    const char *entities[] = { "&lt;", "&gt;", "&quot;", "&apos;", "&amp;" };
+    const char chars[] = { '<', '>', '"', '\'', '&' };
+    size_t size = strlen(escXML);
+    char *xml = malloc(size + 1);
+    int i, j, e;
+
+    if (xml == NULL)
+        return NULL;
+
+    for (i = 0, j = 0; j < size; i++)
+    {
+        for (e = 0; e < 5; e++)
+        {
+            if (strncmp(escXML + j, entities[e], strlen(entities[e])) == 0)
+                break;
+        }
+        if (e < 5)
+        {
+            xml[i] = chars[e];
+            j += strlen(entities[e]);
+        }
+        else
+            xml[i] = escXML[j++];
+    }
+    xml[i] = '\0';
+    return xml;
+}
+
+/*
+ * Make test string of given length, every period:th character is one to escape.
+ */
+static char *makeEscapeTestString(size_t len, int period)
+{
+    const char special[] = "<>\"'&";
+    char *str = malloc(len + 1);
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (period && i % period == period - 1)
+            str[i] = special[i % 5];
+        else
+            str[i] = 'a' + i % 26;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+void Test_EscapeXMLString(void)
+{
+    char buf[128];
+    char *str, *esc, *ref, *unesc;
+    size_t len;
+    int period;
+
+    strcpy(buf, "  <a href=\"x\">Tom & Jerry's</a>  ");
+    esc = escapeXMLString(buf);
+    CU_ASSERT(strcmp(esc, "&lt;a href=&quot;x&quot;&gt;Tom &amp; Jerry&apos;s&lt;/a&gt;") == 0);
+    unesc = unescapeXMLString(esc);
+    CU_ASSERT(strcmp(unesc, "<a href=\"x\">Tom & Jerry's</a>") == 0);
+    free(esc);
+    free(unesc);
+
+    // empty and unknown entity
+    strcpy(buf, "");
+    esc = escapeXMLString(buf);
+    CU_ASSERT(strcmp(esc, "") == 0);
+    free(esc);
+    strcpy(buf, "&unknown; &amp");
+    unesc = unescapeXMLString(buf);
+    CU_ASSERT(strcmp(unesc, "&unknown; &amp") == 0);
+    free(unesc);
+
+    // special characters at every position around 16 byte blocks
+    for (len = 1; len < 70; len++)
+    {
+        for (period = 0; period < 20; period++)
+        {
+            str = makeEscapeTestString(len, period);
+            esc = escapeXMLString(str);
+            ref = escapeXMLStringReference(str);
+            CU_ASSERT(strcmp(esc, ref) == 0);
+            unesc = unescapeXMLString(esc);
+            CU_ASSERT(strcmp(unesc, str) == 0);
+            free(str);
+            free(esc);
+            free(ref);
+            free(unesc);
+        }
+    }
+}
+
+static double elapsedMs(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+void Test_EscapeXMLStringBenchmark(void)
+{
+    const size_t sizes[] = { 64, 4096, 65536 };
+    const int periods[] = { 0, 40, 4 };
+    struct timespec start;
+    double refEsc, newEsc, refUnesc, newUnesc;
+    char *str, *esc, *unesc;
+    int s, p, i, rounds;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        for (p = 0; p < sizeof(periods) / sizeof(periods[0]); p++)
+        {
+            str = makeEscapeTestString(sizes[s], periods[p]);
+            esc = escapeXMLString(str);
+            rounds = 4 * 1024 * 1024 / sizes[s];
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < rounds; i++)
+                free(escapeXMLStringReference(str));
+            refEsc = elapsedMs(&start);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < rounds; i++)
+                free(escapeXMLString(str));
+            newEsc = elapsedMs(&start);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < rounds; i++)
+                free(unescapeXMLStringReference(esc));
+            refUnesc = elapsedMs(&start);
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            for (i = 0; i < rounds; i++)
+            {
+                unesc = unescapeXMLString(esc);
+                free(unesc);
+            }
+            newUnesc = elapsedMs(&start);
+
+            printf("\n  escape %6zu bytes, 1/%-2d special: %8.2f ms -> %8.2f ms, unescape %8.2f ms -> %8.2f ms",
+                   sizes[s], periods[p], refEsc, newEsc, refUnesc, newUnesc);
+
+            free(str);
+            free(esc);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * Regular expressions used for validation before the hand-written validators.
+ * Used as reference for results and speed.
+ */
+static const char REGEX_IP_LASTBYTE[] = "^(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9])\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9]|0)\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9]|0)\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[0-9])$";
+static const char REGEX_DOMAIN_NAME[] = "^([a-z0-9]([a-z0-9\\-]{0,61}[a-z0-9])?\\.)+[a-z]{2,6}$";
+static const char REGEX_NAMESERVER[] = "nameserver[[:blank:]]*([[:digit:]]{1,3}[.][[:digit:]]{1,3}[.][[:digit:]]{1,3}[.][[:digit:]]{1,3})";
+
+static const char *validatorTestStrings[] = {
+    "", ".", "...", "1.2.3.4", "0.1.2.3", "1.0.0.0", "01.2.3.4", "001.2.3.4", "1.2.3.00",
+    "1.2.3.000", "255.255.255.255", "256.1.1.1", "1.1.1.256", "249.250.251.259", "199.099.09.9",
+    "1.2.3", "1.2.3.4.", "1.2.3.4.5", "1.2.3.4 ", " 1.2.3.4", "1..2.3", "1.2.3.1234", "a.b.c.d",
+    "example.com", "EXAMPLE.COM", "Example.Com", "www.example.co.uk", "example", "example.c",
+    "example.museum", "example.abcdefg", "example.c0m", "-a.com", "a-.com", "a-b.com", "a--b.com",
+    "a\\b.com", "\\a.com", "a.b.c.d.ef", ".com", "a..com", "a.com.", "a_b.com", "1.2.3.com",
+    "xn--bcher-kva.example", "localhost", "123.example.net",
+    "nameserver 1.2.3.4", "nameserver\t10.0.0.1\n", "nameserver1.2.3.4", "nameserver  1.2.3",
+    "  nameserver 1.2.3.4567", "# nameserver 1.2.3.4", "nameserver 1234.2.3.4", "nameserver 1.2.3.",
+    "nameserver nameserver 9.9.9.9", "nameservernameserver 9.9.9.9", "nameserver ::1",
+    "search example.com", "nameserver 1.2.3.4 nameserver 5.6.7.8", "Nameserver 1.2.3.4",
+};
+
+/*
+ * Check that validators accept the same strings as the reference regular
+ * expressions, and return the same part of string as submatches.
+ */
+static void checkValidators(const char *str, regex_t *ip, regex_t *domain, regex_t *domainNoCase, regex_t *nameserver)
+{
+    regmatch_t submatch[5];
+    size_t offset, length;
+    int lastPart, valid;
+
+    valid = ValidateIPv4Address(str, &lastPart, &offset);
+    CU_ASSERT(valid == (regexec(ip, str, 5, submatch, 0) == 0));
+    if (valid)
+    {
+        CU_ASSERT(offset == submatch[4].rm_so);
+        CU_ASSERT(lastPart == atoi(str + submatch[4].rm_so));
+    }
+
+    CU_ASSERT(ValidateDomainName(str, 0) == (regexec(domain, str, 0, NULL, 0) == 0));
+    CU_ASSERT(ValidateDomainName(str, 1) == (regexec(domainNoCase, str, 0, NULL, 0) == 0));
+
+    valid = ParseNameserverLine(str, &offset, &length);
+    CU_ASSERT(valid == (regexec(nameserver, str, 2, submatch, 0) == 0));
+    if (valid)
+    {
+        CU_ASSERT(offset == submatch[1].rm_so);
+        CU_ASSERT(length == submatch[1].rm_eo - submatch[1].rm_so);
+    }
+}
+
+void Test_Validators(void)
+{
+    const char chars[] = "nameserv 0123456789.-\\aZ";
+    regex_t ip, domain, domainNoCase, nameserver;
+    char str[80];
+    int i, j, len;
+
+    regcomp(&ip, REGEX_IP_LASTBYTE, REG_EXTENDED);
+    regcomp(&domain, REGEX_DOMAIN_NAME, REG_EXTENDED|REG_NOSUB);
+    regcomp(&domainNoCase, REGEX_DOMAIN_NAME, REG_EXTENDED|REG_NOSUB|REG_ICASE);
+    regcomp(&nameserver, REGEX_NAMESERVER, REG_EXTENDED);
+
+    CU_ASSERT(ValidateIPv4Address("192.168.0.1", NULL, NULL) == 1);
+    CU_ASSERT(ValidateIPv4Address("0.168.0.1", NULL, NULL) == 0);
+    CU_ASSERT(ValidateDomainName("Example.Com", 0) == 0);
+    CU_ASSERT(ValidateDomainName("Example.Com", 1) == 1);
+
+    for (i = 0; i < sizeof(validatorTestStrings) / sizeof(validatorTestStrings[0]); i++)
+        checkValidators(validatorTestStrings[i], &ip, &domain, &domainNoCase, &nameserver);
+
+    // every octet value in every part of address
+    for (i = 0; i < 1000; i++)
+    {
+        for (j = 0; j < 4; j++)
+        {
+            snprintf(str, sizeof(str), "%d.%d.%d.%d", j == 0 ? i : 10, j == 1 ? i : 10, j == 2 ? i : 10, j == 3 ? i : 10);
+            checkValidators(str, &ip, &domain, &domainNoCase, &nameserver);
+            snprintf(str, sizeof(str), "%03d.%02d.%03d.%d", j == 0 ? i : 10, j == 1 ? i : 10, j == 2 ? i : 10, j == 3 ? i : 10);
+            checkValidators(str, &ip, &domain, &domainNoCase, &nameserver);
+        }
+    }
+
+    // labels around maximum length
+    for (len = 1; len < 70; len++)
+    {
+        memset(str, 'a', len);
+        strcpy(str + len, ".com");
+        checkValidators(str, &ip, &domain, &domainNoCase, &nameserver);
+        str[len - 1] = '-';
+        checkValidators(str, &ip, &domain, &domainNoCase, &nameserver);
+    }
+
+    // random strings built of characters meaningful to the expressions
+    srand(1);
+    for (i = 0; i < 100000; i++)
+    {
+        len = rand() % 24;
+        for (j = 0; j < len; j++)
+            str[j] = chars[rand() % (sizeof(chars) - 1)];
+        str[len] = '\0';
+        checkValidators(str, &ip, &domain, &domainNoCase, &nameserver);
+    }
+
+    regfree(&ip);
+    regfree(&domain);
+    regfree(&domainNoCase);
+    regfree(&nameserver);
+}
+
+void Test_ValidatorsBenchmark(void)
+{
+    const char *strings[] = { "192.168.100.200", "www.example.com", "nameserver 10.0.0.1\n" };
+    const int rounds = 10000;
+    struct timespec start;
+    double refMs, newMs;
+    regex_t re;
+    size_t offset, length;
+    int s, i;
+
+    for (s = 0; s < 3; s++)
+    {
+        // regular expression compiled on every call, as it used to be
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < rounds; i++)
+        {
+            regcomp(&re, s == 0 ? REGEX_IP_LASTBYTE : s == 1 ? REGEX_DOMAIN_NAME : REGEX_NAMESERVER, REG_EXTENDED);
+            regexec(&re, strings[s], 0, NULL, 0);
+            regfree(&re);
+        }
+        refMs = elapsedMs(&start);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (i = 0; i < rounds; i++)
+        {
+            if (s == 0)
+                ValidateIPv4Address(strings[s], NULL, NULL);
+            else if (s == 1)
+                ValidateDomainName(strings[s], 1);
+            else
+                ParseNameserverLine(strings[s], &offset, &length);
+        }
+        newMs = elapsedMs(&start);
+
+        printf("\n  validate %-22s x %d: %8.2f ms -> %8.2f ms", s == 2 ? "nameserver line" : strings[s], rounds, refMs, newMs);
+    }
+    printf("\n");
 }
 
 int main(int argc, char** argv)
 {
     CU_pSuite pSuite = NULL;
-    int xml = 0, i;
+    int xml = 0, benchmark = 0, i;
 
     for(i=1; i < argc; i++)
     {
         if (strcmp(argv[i], "--xml") == 0 || strcmp(argv[i], "-x") == 0)
             xml = 1;
+        else if (strcmp(argv[i], "--benchmark") == 0 || strcmp(argv[i], "-b") == 0)
+            benchmark = 1;
     }
 
     /* initialize the CUnit test registry */
@@ -316,6 +675,14 @@ int main(int argc, char** argv)
         return CU_get_error();
     }
 
+    // util tests
+    if ((NULL == CU_add_test(pSuite, "test of escapeXMLString()", Test_EscapeXMLString)) ||
+        (NULL == CU_add_test(pSuite, "test of validators", Test_Validators)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
     // WANEthLinkC1 tests
     if ((NULL == CU_add_test(pSuite, "test of GetEthernetLinkStatus()", Test_GetEthernetLinkStatus)))
     {
@@ -323,6 +690,19 @@ int main(int argc, char** argv)
         return CU_get_error();
     }
 
+    // benchmarks only print timings, they are run only when asked for
+    if (benchmark)
+    {
+        pSuite = CU_add_suite("Benchmarks", NULL, NULL);
+        if ((NULL == pSuite) ||
+            (NULL == CU_add_test(pSuite, "benchmark of escapeXMLString()", Test_EscapeXMLStringBenchmark)) ||
+            (NULL == CU_add_test(pSuite, "benchmark of validators", Test_ValidatorsBenchmark)))
+        {
+            CU_cleanup_registry();
+            return CU_get_error();
+        }
+    }
+
     if (xml)
     {
         CU_automated_run_tests();
@@ -26,8 +26,11 @@
  */
 
 #include <stddef.h>
-#include <regex.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <string.h>
@@ -43,10 +46,18 @@
 #include <wchar.h>
 #include <wctype.h>
 #include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #include <upnp/upnp.h>
 #include <upnp/ixml.h>
+#include <upnp/ithread.h>
 #include "globals.h"
 #include "util.h"
+#include "validate.h"
+#include "ifmonitor.h"
 
 
 /**
@@ -57,14 +68,18 @@
 static int get_sockfd(void)
 {
     static int sockfd = -1;
+    int fd;
 
     if (sockfd == -1)
     {
-        if ((sockfd = socket(PF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
+        if ((fd = socket(PF_INET, SOCK_RAW, IPPROTO_RAW)) == -1)
         {
             perror("user: socket creating failed");
             return (-1);
         }
+        // read-only actions may get here concurrently, keep only one socket
+        if (!__sync_bool_compare_and_swap(&sockfd, -1, fd))
+            close(fd);
     }
     return sockfd;
 }
@@ -117,14 +132,82 @@ char* createUnion(const char *str1, const char *str2)
     return unionStr;
 }
 
+// Statistics files of external interface in order of stats_t. Files are kept
+// open and read with pread, values are cached for STATS_CACHE_TIME ms.
+static const char *statsFiles[STATS_LIMIT] = { "tx_bytes", "rx_bytes", "tx_packets", "rx_packets" };
+static int statsFds[STATS_LIMIT] = { -1, -1, -1, -1 };
+static uint64_t statsCache[STATS_LIMIT];
+static long long statsCacheTime = -1;       // monotonic ms of cached values, -1 if none
+static ithread_mutex_t statsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Close statistics files of external interface.
+ */
+static void closeStatsFiles(void)
+{
+    int i;
+
+    for (i = 0; i < STATS_LIMIT; i++)
+    {
+        if (statsFds[i] >= 0)
+            close(statsFds[i]);
+        statsFds[i] = -1;
+    }
+}
+
+/**
+ * Open statistics files of external interface from /sys/class/net.
+ *
+ * @return 1 if all were opened, 0 if not.
+ */
+static int openStatsFiles(void)
+{
+    char path[64 + IFNAMSIZ];
+    int i;
+
+    for (i = 0; i < STATS_LIMIT; i++)
+    {
+        snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", g_vars.extInterfaceName, statsFiles[i]);
+        if ((statsFds[i] = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        {
+            closeStatsFiles();
+            return 0;
+        }
+    }
+    return 1;
+}
+
 /**
- * Get values for send bytes and packets and received bytes and packets for 
- * external interface from /proc/net/dev
+ * Read values of opened statistics files.
  *
- * @param stats Unsigned long array with size of STATS_LIMIT
+ * @param stats Array with size of STATS_LIMIT.
+ * @return 1 if all were read, 0 if not. Files of removed interface can't be read.
+ */
+static int readStatsFiles(uint64_t stats[STATS_LIMIT])
+{
+    char buf[24];
+    ssize_t len;
+    int i;
+
+    for (i = 0; i < STATS_LIMIT; i++)
+    {
+        len = pread(statsFds[i], buf, sizeof(buf) - 1, 0);
+        if (len <= 0)
+            return 0;
+        buf[len] = '\0';
+        stats[i] = strtoull(buf, NULL, 10);
+    }
+    return 1;
+}
+
+/**
+ * Get values for send bytes and packets and received bytes and packets for
+ * external interface from /proc/net/dev. Used if sysfs is not available.
+ *
+ * @param stats Array with size of STATS_LIMIT
  * @return 0 if fails to open file, 1 if succeed to get values.
  */
-int readStats(unsigned long stats[STATS_LIMIT])
+static int readProcStats(uint64_t stats[STATS_LIMIT])
 {
     char dev[IFNAMSIZ];
     FILE *proc;
@@ -142,7 +225,7 @@ int readStats(unsigned long stats[STATS_LIMIT])
 
     /* parse stats */
     do
-        read = fscanf(proc, "%[^:]:%lu %lu %*u %*u %*u %*u %*u %*u %lu %lu %*u %*u %*u %*u %*u %*u\n", dev, &stats[STATS_RX_BYTES], &stats[STATS_RX_PACKETS], &stats[STATS_TX_BYTES], &stats[STATS_TX_PACKETS]);
+        read = fscanf(proc, "%[^:]:%" SCNu64 " %" SCNu64 " %*u %*u %*u %*u %*u %*u %" SCNu64 " %" SCNu64 " %*u %*u %*u %*u %*u %*u\n", dev, &stats[STATS_RX_BYTES], &stats[STATS_RX_PACKETS], &stats[STATS_TX_BYTES], &stats[STATS_TX_PACKETS]);
     while (read != EOF && (read == 5 && strncmp(dev, g_vars.extInterfaceName, IFNAMSIZ) != 0));
 
     fclose(proc);
@@ -150,6 +233,53 @@ int readStats(unsigned long stats[STATS_LIMIT])
     return 1;
 }
 
+/**
+ * Get values for send bytes and packets and received bytes and packets for
+ * external interface. Counters are 64 bits wide, callers reporting ui4 state
+ * variables must let them wrap around at 2^32.
+ *
+ * Values are read from /sys/class/net/<interface>/statistics, whose files are
+ * kept open, and cached for STATS_CACHE_TIME milliseconds. So polling control
+ * points cost neither allocation nor parsing of /proc/net/dev.
+ *
+ * @param stats Array with size of STATS_LIMIT
+ * @return 0 if reading fails, 1 if succeed to get values.
+ */
+int readStats(uint64_t stats[STATS_LIMIT])
+{
+    struct timespec ts;
+    long long now;
+    int i, result = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    ithread_mutex_lock(&statsMutex);
+    if (statsCacheTime >= 0 && now - statsCacheTime < STATS_CACHE_TIME)
+        result = 1;
+    else
+    {
+        // interface may have been recreated after files were opened, then open again
+        for (i = 0; i < 2 && !result; i++)
+        {
+            if (statsFds[0] < 0 && !openStatsFiles())
+                break;
+            if (readStatsFiles(statsCache))
+                result = 1;
+            else
+                closeStatsFiles();
+        }
+        if (!result && statsFds[0] < 0)
+            result = readProcStats(statsCache);
+        statsCacheTime = result ? now : -1;
+    }
+    if (result)
+        memcpy(stats, statsCache, sizeof(statsCache));
+    ithread_mutex_unlock(&statsMutex);
+
+    return result;
+}
+
 /**
  * Trims leading and trailing white spaces from a string.
  *
@@ -175,6 +305,144 @@ char *trimString(char *str)
     return str;
 }
 
+// Characters which are escaped in XML and their entities
+static const struct
+{
+    char c;
+    const char *entity;
+    size_t len;
+} xmlEntities[] =
+{
+    { '<',  "&lt;",   4 },
+    { '>',  "&gt;",   4 },
+    { '"',  "&quot;", 6 },
+    { '\'', "&apos;", 6 },
+    { '&',  "&amp;",  5 },
+};
+
+#define XML_ENTITY_COUNT (int)(sizeof(xmlEntities) / sizeof(xmlEntities[0]))
+
+/**
+ * Get index of character in xmlEntities.
+ *
+ * @param c Character.
+ * @return Index or -1 if character is not escaped.
+ */
+static inline int xmlEntityIndex(char c)
+{
+    switch (c)
+    {
+        case '<':  return 0;
+        case '>':  return 1;
+        case '"':  return 2;
+        case '\'': return 3;
+        case '&':  return 4;
+        default:   return -1;
+    }
+}
+
+/**
+ * Get length of run at the start of string which needs no escaping.
+ * With SSE2 or NEON 16 characters are checked at a time.
+ *
+ * @param str String to scan.
+ * @param len Length of string.
+ * @return Number of characters before first character to escape, len if none.
+ */
+static size_t xmlEscapeSpan(const char *str, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+    const __m128i quot = _mm_set1_epi8('"'), apos = _mm_set1_epi8('\'');
+    __m128i v, m;
+    int mask;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)(str + i));
+        m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, lt), _mm_cmpeq_epi8(v, gt)),
+                         _mm_or_si128(_mm_cmpeq_epi8(v, amp),
+                                      _mm_or_si128(_mm_cmpeq_epi8(v, quot), _mm_cmpeq_epi8(v, apos))));
+        if ((mask = _mm_movemask_epi8(m)) != 0)
+            return i + __builtin_ctz(mask);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t lt = vdupq_n_u8('<'), gt = vdupq_n_u8('>'), amp = vdupq_n_u8('&');
+    const uint8x16_t quot = vdupq_n_u8('"'), apos = vdupq_n_u8('\'');
+    uint8x16_t v, m;
+    uint64x2_t m64;
+
+    for (; i + 16 <= len; i += 16)
+    {
+        v = vld1q_u8((const uint8_t *)(str + i));
+        m = vorrq_u8(vorrq_u8(vceqq_u8(v, lt), vceqq_u8(v, gt)),
+                     vorrq_u8(vceqq_u8(v, amp), vorrq_u8(vceqq_u8(v, quot), vceqq_u8(v, apos))));
+        m64 = vreinterpretq_u64_u8(m);
+        // block has a character to escape, scalar loop below finds it
+        if (vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1))
+            break;
+    }
+#endif
+
+    while (i < len && xmlEntityIndex(str[i]) < 0)
+        i++;
+    return i;
+}
+
+/**
+ * Count length of string after XML escaping.
+ *
+ * @param str String to escape.
+ * @param len Length of string.
+ * @return Length of escaped string, not including terminating null.
+ */
+static size_t xmlEscapedLength(const char *str, size_t len)
+{
+    size_t i = 0, out = 0, run;
+
+    while (i < len)
+    {
+        run = xmlEscapeSpan(str + i, len - i);
+        out += run;
+        i += run;
+        if (i < len)
+            out += xmlEntities[xmlEntityIndex(str[i++])].len;
+    }
+    return out;
+}
+
+/**
+ * Write XML escaped string. Output must have room for
+ * xmlEscapedLength(str, len) characters.
+ *
+ * @param out Output.
+ * @param str String to escape.
+ * @param len Length of string.
+ * @return Pointer to end of written output. Output is not null terminated.
+ */
+static char *xmlEscapeFill(char *out, const char *str, size_t len)
+{
+    size_t i = 0, run;
+    int e;
+
+    while (i < len)
+    {
+        run = xmlEscapeSpan(str + i, len - i);
+        memcpy(out, str + i, run);
+        out += run;
+        i += run;
+        if (i < len)
+        {
+            e = xmlEntityIndex(str[i++]);
+            memcpy(out, xmlEntities[e].entity, xmlEntities[e].len);
+            out += xmlEntities[e].len;
+        }
+    }
+    return out;
+}
+
 /**
  * THIS FUNCTION IS NOT ACTUALLY NEEDED, if you use UpnpMakeActionResponse and such
  * functions for creating responses. libupnp then takes care of escaping xmls. 
@@ -188,6 +456,7 @@ char *trimString(char *str)
  *  '''  -->  "&apos;"
  *  '&'  -->  "&amp;"
  * 
+ * Length of result is counted first, so it is allocated only once.
  * User should free returned pointer.
  *
  * @param xml String to turn escaped xml.
@@ -195,104 +464,19 @@ char *trimString(char *str)
  */
 char* escapeXMLString(char *xml)
 {
+    char *escXML;
+    size_t size;
+
     xml = trimString(xml);
     if (xml == NULL)
         return NULL;
 
-    char *escXML = NULL;
-    size_t size = strlen(xml);
-    size_t alloc = size +1;
-
-    escXML = realloc(NULL, alloc);
+    size = strlen(xml);
+    escXML = malloc(xmlEscapedLength(xml, size) + 1);
     if (!escXML)
         return NULL;
 
-    int i,j; // i goes through original xml and j through escaped escXML
-    for (i=0,j=0; i < size; i++)
-    {
-        switch (xml[i])
-        {
-            case '<' :
-            {
-                char *new_buf;
-                alloc += strlen("&lt;");
-                new_buf = realloc (escXML, alloc);
-                if (!new_buf) {
-                    return NULL;
-                }
-                escXML = new_buf;
-
-                strcpy(escXML+j, "&lt;");
-                j += strlen("&lt;");
-                break;
-            }
-            case '>' :
-            {
-                char *new_buf;
-                alloc += strlen("&gt;");
-                new_buf = realloc (escXML, alloc);
-                if (!new_buf) {
-                    return NULL;
-                }
-                escXML = new_buf;
-
-                strcpy(escXML+j, "&gt;");
-                j += strlen("&gt;");
-                break;
-            }
-            case '"' :
-            {
-                char *new_buf;
-                alloc += strlen("&quot;");
-                new_buf = realloc (escXML, alloc);
-                if (!new_buf) {
-                    return NULL;
-                }
-                escXML = new_buf;
-
-                strcpy(escXML+j, "&quot;");
-                j += strlen("&quot;");
-                break;
-            }
-            case '\'' :
-            {
-                char *new_buf;
-                alloc += strlen("&apos;");
-                new_buf = realloc (escXML, alloc);
-                if (!new_buf) {
-                    return NULL;
-                }
-                escXML = new_buf;
-
-                strcpy(escXML+j, "&apos;");
-                j += strlen("&apos;");
-                break;
-            }
-            case '&' :
-            {
-                char *new_buf;
-                alloc += strlen("&amp;");
-                new_buf = realloc (escXML, alloc);
-                if (!new_buf) {
-                    return NULL;
-                }
-                escXML = new_buf;
-
-                strcpy(escXML+j, "&amp;");
-                j += strlen("&amp;");
-                break;
-            }
-            default :
-            {
-                escXML[j++] = xml[i];
-                break;
-            }
-        }
-    }
-
-    if (j > 0)
-        escXML[j] = '\0';
-
+    *xmlEscapeFill(escXML, xml, size) = '\0';
     return escXML;
 }
 
@@ -305,6 +489,8 @@ char* escapeXMLString(char *xml)
  *  "&apos;"  -->  '''
  *  "&amp;"   -->  '&'
  * 
+ * Result is never longer than escaped string, so it is allocated once.
+ * Runs without '&' are found with memchr, which libc vectorizes.
  * User should free returned pointer.
  *
  * @param escXML String to turn unescaped xml.
@@ -312,60 +498,49 @@ char* escapeXMLString(char *xml)
  */
 char* unescapeXMLString(char *escXML)
 {
+    char *xml, *out;
+    const char *amp;
+    size_t size, i = 0, run;
+    int e;
+
     escXML = trimString(escXML);
     if (escXML == NULL)
         return NULL;
 
-    char *xml = NULL;
-    size_t size = strlen(escXML);
-
-    xml = (char *)malloc(size);
+    size = strlen(escXML);
+    xml = malloc(size + 1);
     if (!xml)
         return NULL;
 
-    memset(xml, '\0', size);
-
-    int i,j; // i goes through unescaped xml and j through escaped escXML
-    for (i=0,j=0; i < size && j < size; i++)
+    out = xml;
+    while (i < size)
     {
-        if (strncmp(escXML+j, "&lt;", strlen("&lt;")) == 0)
-        {
-            xml[i] = '<';
-            j += strlen("&lt;");
-        }
-        else if (strncmp(escXML+j, "&gt;", strlen("&gt;")) == 0)
+        amp = memchr(escXML + i, '&', size - i);
+        run = amp ? (size_t)(amp - (escXML + i)) : size - i;
+        memcpy(out, escXML + i, run);
+        out += run;
+        i += run;
+        if (i == size)
+            break;
+
+        for (e = 0; e < XML_ENTITY_COUNT; e++)
         {
-            xml[i] = '>';
-            j += strlen("&gt;");
-        }
-        else if (strncmp(escXML+j, "&quot;", strlen("&quot;")) == 0)
-        {
-            xml[i] = '"';
-            j += strlen("&quot;");
-        }
-        else if (strncmp(escXML+j, "&apos;", strlen("&apos;")) == 0)
-        {
-            xml[i] = '\'';
-            j += strlen("&apos;");
+            if (strncmp(escXML + i, xmlEntities[e].entity, xmlEntities[e].len) == 0)
+                break;
         }
-        else if (strncmp(escXML+j, "&amp;", strlen("&amp;")) == 0)
+        if (e < XML_ENTITY_COUNT)
         {
-            xml[i] = '&';
-            j += strlen("&amp;");
+            *out++ = xmlEntities[e].c;
+            i += xmlEntities[e].len;
         }
         else
-        {
-            xml[i] = escXML[j];
-            j++;
-        }
+            *out++ = escXML[i++];
     }
-
-    xml[i] = '\0';
+    *out = '\0';
 
     return xml;
 }
 
-
 /**
  * Change given string in uppercase. Converts given string first as wide-character string
  * and then transliterate that to upper case. Finally convert upper case wide-character string
@@ -527,27 +702,7 @@ int GetConnectionStatus(char *conStatus, char *ifname)
  */
 int IsIpOrDomain(char *address)
 {
-    int result;
-
-    // is it IP
-    regex_t re_IP;
-    regcomp(&re_IP, REGEX_IP_LASTBYTE, REG_EXTENDED|REG_NOSUB);
-    result = regexec(&re_IP, address, (size_t) 0, NULL, 0);
-    regfree(&re_IP);
-    if (result == 0) {
-        return 1;
-    }
-
-    // is it domain name
-    regex_t re_host;
-    regcomp(&re_host, REGEX_DOMAIN_NAME, REG_EXTENDED|REG_NOSUB|REG_ICASE);
-    result = regexec(&re_host, address, (size_t) 0, NULL, 0);
-    regfree(&re_host);
-    if (result == 0) {
-        return 1;
-    }
-
-    return 0;
+    return ValidateIPv4Address(address, NULL, NULL) || ValidateDomainName(address, 1);
 }
 
 /**
@@ -649,50 +804,318 @@ int resolveBoolean(char *value)
     return 0;
 }
 
-void ParseXMLResponse(struct Upnp_Action_Request *ca_event, const char *result_str)
+/**
+ * Drop partially built action response and fail the action.
+ *
+ * @param ca_event Upnp action struct.
+ */
+static void ActionResponseFailed(struct Upnp_Action_Request *ca_event)
+{
+    trace(1, "Failed to create response to %s", ca_event->ActionName);
+    if (ca_event->ActionResult)
+        ixmlDocument_free(ca_event->ActionResult);
+    addErrorData(ca_event, 501, "Action Failed");
+}
+
+/**
+ * Get response element of action result, create result document if
+ * action has none yet. Response element is named after the action and uses
+ * the same namespace prefix and URI as the request. Failed action gets no
+ * result, so that a response built after the failure can't replace error.
+ *
+ * @param ca_event Upnp action struct.
+ * @return Response element or NULL if action has failed or result could not
+ *         be created.
+ */
+static IXML_Node *GetActionResponse(struct Upnp_Action_Request *ca_event)
 {
-    IXML_Document *result = NULL;
+    IXML_Document *doc = NULL;
+    IXML_Element *response = NULL;
+    IXML_Node *request = NULL;
+    const char *prefix = NULL;
+    const char *namespace = NULL;
+    char name[NAME_SIZE + 32];
+    char xmlns[64];
+
+    if (ca_event->ErrCode != UPNP_E_SUCCESS)
+        return NULL;
+    if (ca_event->ActionResult)
+        return ca_event->ActionResult->n.firstChild;
+
+    if (ca_event->ActionRequest)
+        request = ca_event->ActionRequest->n.firstChild;
+    if (request)
+    {
+        prefix = ixmlNode_getPrefix(request);
+        namespace = ixmlNode_getNamespaceURI(request);
+    }
 
-    if ((result = ixmlParseBuffer(result_str)) != NULL)
+    if (prefix)
     {
-        ca_event->ActionResult = result;
-        ca_event->ErrCode = UPNP_E_SUCCESS;
+        snprintf(name, sizeof(name), "%s:%sResponse", prefix, ca_event->ActionName);
+        snprintf(xmlns, sizeof(xmlns), "xmlns:%s", prefix);
     }
     else
     {
-        trace(1, "Error parsing response to %s: %s", ca_event->ActionName, result_str);
-        ca_event->ActionResult = NULL;
-        ca_event->ErrCode = UPNP_SOAP_E_INVALID_ARGS;
+        snprintf(name, sizeof(name), "%sResponse", ca_event->ActionName);
+        strcpy(xmlns, "xmlns");
     }
+
+    if (ixmlDocument_createDocumentEx(&doc) != IXML_SUCCESS)
+        goto failed;
+    ca_event->ActionResult = doc;
+
+    if (namespace)
+    {
+        if (ixmlDocument_createElementNSEx(doc, (char *)namespace, name, &response) != IXML_SUCCESS)
+            goto failed;
+    }
+    else if (ixmlDocument_createElementEx(doc, name, &response) != IXML_SUCCESS)
+        goto failed;
+    if (ixmlNode_appendChild(&doc->n, &response->n) != IXML_SUCCESS)
+    {
+        ixmlNode_free(&response->n);
+        goto failed;
+    }
+    if (namespace && ixmlElement_setAttribute(response, xmlns, (char *)namespace) != IXML_SUCCESS)
+        goto failed;
+
+    return &response->n;
+
+failed:
+    ActionResponseFailed(ca_event);
+    return NULL;
 }
 
 /**
- * Form and parse upnp action result xml.
+ * Create successful result of action without out arguments. Arguments can
+ * be added to it with AddActionResponse functions. Does nothing if action
+ * has already failed.
  *
  * @param ca_event Upnp action struct.
- * @param str Format string for extra parameters.
- * @param ... Extra parameters
  */
-void ParseResult( struct Upnp_Action_Request *ca_event, const char *str, ... )
+void CreateActionResponse(struct Upnp_Action_Request *ca_event)
+{
+    GetActionResponse(ca_event);
+}
+
+/**
+ * Add out argument to result of action. Result is created if this is the
+ * first argument. Value is stored as text node, so it must not be escaped.
+ * Does nothing if action has already failed, also when adding earlier
+ * argument failed.
+ *
+ * @param ca_event Upnp action struct.
+ * @param name Name of argument.
+ * @param value Value of argument.
+ */
+void AddActionResponse(struct Upnp_Action_Request *ca_event, const char *name, const char *value)
+{
+    IXML_Node *response;
+    IXML_Element *arg = NULL;
+    IXML_Node *text = NULL;
+
+    if ((response = GetActionResponse(ca_event)) == NULL)
+        return;
+
+    if (ixmlDocument_createElementEx(ca_event->ActionResult, (char *)name, &arg) != IXML_SUCCESS)
+        goto failed;
+    if (ixmlNode_appendChild(response, &arg->n) != IXML_SUCCESS)
+    {
+        ixmlNode_free(&arg->n);
+        goto failed;
+    }
+
+    // empty value is element without text node, like parser would create
+    if (value == NULL || *value == '\0')
+        return;
+
+    if (ixmlDocument_createTextNodeEx(ca_event->ActionResult, (char *)value, &text) != IXML_SUCCESS)
+        goto failed;
+    if (ixmlNode_appendChild(&arg->n, text) != IXML_SUCCESS)
+    {
+        ixmlNode_free(text);
+        goto failed;
+    }
+    return;
+
+failed:
+    ActionResponseFailed(ca_event);
+}
+
+/**
+ * Add signed integer out argument to result of action.
+ *
+ * @param ca_event Upnp action struct.
+ * @param name Name of argument.
+ * @param value Value of argument.
+ */
+void AddActionResponseInt(struct Upnp_Action_Request *ca_event, const char *name, long value)
+{
+    char tmp[24];
+
+    snprintf(tmp, sizeof(tmp), "%ld", value);
+    AddActionResponse(ca_event, name, tmp);
+}
+
+/**
+ * Add unsigned integer out argument to result of action.
+ *
+ * @param ca_event Upnp action struct.
+ * @param name Name of argument.
+ * @param value Value of argument.
+ */
+void AddActionResponseUInt(struct Upnp_Action_Request *ca_event, const char *name, unsigned long value)
+{
+    char tmp[24];
+
+    snprintf(tmp, sizeof(tmp), "%lu", value);
+    AddActionResponse(ca_event, name, tmp);
+}
+
+/**
+ * Initialize empty output buffer. Memory is allocated on first append.
+ *
+ * @param buf Buffer to initialize.
+ * @param max Maximum size of buffer in bytes including terminating null, 0 - unlimited.
+ */
+void XmlBufferInit(struct xmlBuffer *buf, size_t max)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->size = 0;
+    buf->max = max;
+}
+
+/**
+ * Release memory of output buffer.
+ *
+ * @param buf Buffer to free.
+ */
+void XmlBufferFree(struct xmlBuffer *buf)
+{
+    free(buf->data);
+    XmlBufferInit(buf, buf->max);
+}
+
+/**
+ * Make room for given number of characters after current content. Size is
+ * doubled so that appending n characters costs O(n) in total.
+ *
+ * @param buf Output buffer.
+ * @param count Number of characters to append, not including terminating null.
+ * @return 1 if there is room, 0 if allocation failed or maximum size would be exceeded.
+ */
+static int XmlBufferReserve(struct xmlBuffer *buf, size_t count)
+{
+    size_t need = buf->len + count + 1;
+    size_t size = buf->size ? buf->size : XML_BUFFER_INITIAL_SIZE;
+    char *data;
+
+    if (need <= buf->size)
+        return 1;
+    if (buf->max && need > buf->max)
+        return 0;
+
+    while (size < need)
+        size *= 2;
+    if (buf->max && size > buf->max)
+        size = buf->max;
+
+    if ((data = realloc(buf->data, size)) == NULL)
+        return 0;
+    buf->data = data;
+    buf->size = size;
+    return 1;
+}
+
+/**
+ * Append string to output buffer as is.
+ *
+ * @param buf Output buffer.
+ * @param str String to append.
+ * @return 1 on success, 0 if buffer is full. Content is unchanged on failure.
+ */
+int XmlBufferAppend(struct xmlBuffer *buf, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (!XmlBufferReserve(buf, len))
+        return 0;
+    memcpy(buf->data + buf->len, str, len + 1);
+    buf->len += len;
+    return 1;
+}
+
+/**
+ * Append string to output buffer, escaping characters which are not allowed
+ * in XML text and attribute values. Escaped length is counted first, so the
+ * string is written with one reservation.
+ *
+ * @param buf Output buffer.
+ * @param str String to escape and append.
+ * @return 1 on success, 0 if buffer is full. Content is unchanged on failure.
+ */
+int XmlBufferAppendEscaped(struct xmlBuffer *buf, const char *str)
+{
+    size_t size = strlen(str);
+    size_t len = xmlEscapedLength(str, size);
+
+    if (!XmlBufferReserve(buf, len))
+        return 0;
+
+    *xmlEscapeFill(buf->data + buf->len, str, size) = '\0';
+    buf->len += len;
+    return 1;
+}
+
+/**
+ * Append formatted string to output buffer.
+ *
+ * @param buf Output buffer.
+ * @param format Format string.
+ * @return 1 on success, 0 if buffer is full. Content is unchanged on failure.
+ */
+int XmlBufferPrintf(struct xmlBuffer *buf, const char *format, ...)
 {
-    char result[RESULT_LEN];
-    char parameters[RESULT_LEN];
     va_list arg;
+    size_t room = buf->size ? buf->size - buf->len : 0;
+    int len;
 
-    // write all parameters into one string
-    va_start( arg, str );
-    vsnprintf( parameters, RESULT_LEN, str, arg );
-    va_end( arg );
+    va_start(arg, format);
+    len = vsnprintf(room ? buf->data + buf->len : NULL, room, format, arg);
+    va_end(arg);
+    if (len < 0)
+        return 0;
 
-    // and form final xml
-    snprintf( result, RESULT_LEN, "<%sResponse xmlns:%s=\"%s\">\n%s\n</%sResponse>",
-        ixmlNode_getNodeName( ca_event->ActionRequest->n.firstChild ),
-        ixmlNode_getPrefix( ca_event->ActionRequest->n.firstChild ),
-        ixmlNode_getNamespaceURI( ca_event->ActionRequest->n.firstChild ),
-        parameters,
-        ixmlNode_getNodeName( ca_event->ActionRequest->n.firstChild ) );
+    if ((size_t)len >= room)
+    {
+        // didn't fit, grow and format again
+        if (!XmlBufferReserve(buf, len))
+        {
+            if (buf->data)
+                buf->data[buf->len] = '\0';
+            return 0;
+        }
+        va_start(arg, format);
+        vsnprintf(buf->data + buf->len, len + 1, format, arg);
+        va_end(arg);
+    }
+    buf->len += len;
+    return 1;
+}
 
-    ParseXMLResponse( ca_event, result );
+/**
+ * Cut output buffer back to given length, e.g. to drop partially written entry.
+ *
+ * @param buf Output buffer.
+ * @param len New length, not greater than current length.
+ */
+void XmlBufferTruncate(struct xmlBuffer *buf, size_t len)
+{
+    buf->len = len;
+    if (buf->data)
+        buf->data[len] = '\0';
 }
 
 /**
@@ -704,36 +1127,75 @@ void ParseResult( struct Upnp_Action_Request *ca_event, const char *str, ... )
  */
 int GetNbSoapParameters( IN IXML_Document * doc)
 {
-    IXML_NodeList *nodeList = NULL;
-    IXML_Node* tmpNode = NULL;
-    IXML_Node* childNode = NULL;
+    IXML_Node *node;
     int nbchild = 0;
 
-    if(doc == NULL) return 0;
+    if (doc == NULL || doc->n.firstChild == NULL)
+        return 0;
 
-    nodeList = ixmlDocument_getElementsByTagName( doc, 
-        ixmlNode_getNodeName( doc->n.firstChild ) );
+    // first child of document is action element, its children are parameters
+    for (node = ixmlNode_getFirstChild(doc->n.firstChild); node != NULL;
+         node = ixmlNode_getNextSibling(node))
+        nbchild++;
 
-    if ( nodeList )
+    return nbchild;
+}
+
+/**
+ * Get parameters of SOAP action with one walk over children of action
+ * element. Values are not copied, they point into doc and are valid as long
+ * as doc is. Parameter which exists but has no text gets value "".
+ *
+ * Parameters may come in any order, but every expected parameter must be
+ * present, integer parameters must contain only digits and there must be no
+ * other parameters.
+ *
+ * @param doc XML document of action request.
+ * @param args Expected parameters. Value of each is set, NULL if it is missing.
+ * @param count Number of expected parameters.
+ * @return 1 if parameters are valid, 0 if not.
+ */
+int GetSoapArguments(IXML_Document *doc, struct soapArg *args, int count)
+{
+    static char empty[] = "";
+    IXML_Node *node, *textNode;
+    const char *name;
+    char *value;
+    int i, found = 0, nbchild = 0;
+
+    for (i = 0; i < count; i++)
+        *args[i].value = NULL;
+
+    if (doc == NULL || doc->n.firstChild == NULL)
+        return count == 0;
+
+    for (node = ixmlNode_getFirstChild(doc->n.firstChild); node != NULL;
+         node = ixmlNode_getNextSibling(node))
     {
-        if ( ( tmpNode = ixmlNodeList_item( nodeList, 0 ) ) )
+        nbchild++;
+        if (ixmlNode_getNodeType(node) != eELEMENT_NODE ||
+            (name = ixmlNode_getNodeName(node)) == NULL)
+            continue;
+
+        for (i = 0; i < count; i++)
         {
-            ixmlNodeList_free( nodeList );
-            nodeList = ixmlNode_getChildNodes(tmpNode);
-            nbchild = ixmlNodeList_length(nodeList);
-            if(nbchild > 0){
-                childNode = ixmlNode_getFirstChild(tmpNode);
-                if(childNode == NULL) return 0;
-            }
-            return nbchild;
+            if (*args[i].value == NULL && strcmp(args[i].name, name) == 0)
+                break;
         }
-    }
+        if (i == count)
+            continue;
 
-    if ( nodeList )
-        ixmlNodeList_free( nodeList );
+        // if node exists, but has no text node, value of node is ""
+        textNode = ixmlNode_getFirstChild(node);
+        value = textNode ? ixmlNode_getNodeValue(textNode) : NULL;
+        *args[i].value = value ? value : empty;
+        found++;
 
-    return 0;
+        if (args[i].integer && !isStringInteger(*args[i].value))
+            return 0;
+    }
 
+    return found == count && nbchild == count;
 }
 
 /**
@@ -754,7 +1216,8 @@ int isStringInteger(char * string)
 
 /**
  * Resolve up/down status of given network interface and insert it into given string.
- * Status is up if interface is listed in /proc/net/dev_mcast -file, else down.
+ * If interface is monitored, status is the link state reported by interface monitor.
+ * Otherwise status is up if interface is listed in /proc/net/dev_mcast -file, else down.
  * 
  * @param ethLinkStatus Pointer to string where status is wrote.
  * @param iface Network interface name.
@@ -764,6 +1227,13 @@ int setEthernetLinkStatus(char *ethLinkStatus, char *iface)
 {
     FILE *fp;
     char str[60];
+    int link;
+
+    if ((link = IfMonitorLinkState()) >= 0)
+    {
+        strcpy(ethLinkStatus, link ? "Up" : "Down");
+        return !link;
+    }
 
     // check from dev_mcast if interface is up (up if listed in file)
     // This could be done "finer" with reading registers from socket. Check from ifconfig.c or mii-tool.c. Do if nothing better to do.
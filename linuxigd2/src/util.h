@@ -28,11 +28,10 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stddef.h>
+#include <stdint.h>
 #include <upnp/upnp.h>
 
-static const char REGEX_IP_LASTBYTE[] = "^(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9])\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9]|0)\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[1-9]|0)\\.(25[0-5]|2[0-4][0-9]|[0-1]{1}[0-9]{2}|[1-9]{1}[0-9]{1}|[0-9])$";
-static const char REGEX_DOMAIN_NAME[] = "^([a-z0-9]([a-z0-9\\-]{0,61}[a-z0-9])?\\.)+[a-z]{2,6}$";
-
 /* interface statistics */
 typedef enum
 {
@@ -43,6 +42,9 @@ typedef enum
     STATS_LIMIT
 } stats_t;
 
+// How long interface statistics are cached, in milliseconds
+#define STATS_CACHE_TIME 500
+
 // ACL error codes
 typedef enum {
     ACL_SUCCESS           = 0,
@@ -52,8 +54,27 @@ typedef enum {
     ACL_ROLE_ERROR        = -3,  //role either exist if it shouldn't or doesn't exist even if should
 } ACL_ERRORCODE;
 
+// Expected parameter of SOAP action, see GetSoapArguments
+struct soapArg
+{
+    const char *name;
+    char **value;   // set to point into action request document
+    int integer;    // value must be non-negative integer
+};
+
+// Growable output buffer for building XML documents, see XmlBuffer functions
+struct xmlBuffer
+{
+    char *data;     // null terminated content, NULL until first append
+    size_t len;     // length of content
+    size_t size;    // allocated size
+    size_t max;     // maximum size, 0 - unlimited
+};
+
+#define XML_BUFFER_INITIAL_SIZE 4096
+
 char* createUnion(const char *str1, const char *str2);
-int readStats(unsigned long stats[STATS_LIMIT]);
+int readStats(uint64_t stats[STATS_LIMIT]);
 char* escapeXMLString(char *xml);
 char* unescapeXMLString(char *escXML);
 char *toUpperCase(const char * str);
@@ -76,9 +97,19 @@ int readIntFromFile(char *file);
 char* GetFirstDocumentItem( IN IXML_Document * doc, const char *item );
 char* GetDocumentItem(IXML_Document * doc, const char *item, int index);
 int GetNbSoapParameters(IN IXML_Document * doc);
+int GetSoapArguments(IXML_Document *doc, struct soapArg *args, int count);
 int isStringInteger(char * string);
 
-void ParseXMLResponse(struct Upnp_Action_Request *ca_event, const char *result);
-void ParseResult( struct Upnp_Action_Request *ca_event, const char *str, ... );
+void CreateActionResponse(struct Upnp_Action_Request *ca_event);
+void AddActionResponse(struct Upnp_Action_Request *ca_event, const char *name, const char *value);
+void AddActionResponseInt(struct Upnp_Action_Request *ca_event, const char *name, long value);
+void AddActionResponseUInt(struct Upnp_Action_Request *ca_event, const char *name, unsigned long value);
+
+void XmlBufferInit(struct xmlBuffer *buf, size_t max);
+void XmlBufferFree(struct xmlBuffer *buf);
+int XmlBufferAppend(struct xmlBuffer *buf, const char *str);
+int XmlBufferAppendEscaped(struct xmlBuffer *buf, const char *str);
+int XmlBufferPrintf(struct xmlBuffer *buf, const char *format, ...);
+void XmlBufferTruncate(struct xmlBuffer *buf, size_t len);
 
 #endif //_UTIL_H_
@@ -0,0 +1,214 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+
+/*
+ * Validators for addresses and names received in SOAP requests and read from
+ * resolv.conf.
+ *
+ * These are small hand-written parsers accepting exactly the same strings as
+ * the extended regular expressions used earlier (see unittest.c), so that
+ * nothing needs to be compiled or allocated per call. Character classes are
+ * those of the C locale.
+ */
+
+#include "validate.h"
+
+#define IS_DIGIT(c) ((c) >= '0' && (c) <= '9')
+#define IS_LOWER(c) ((c) >= 'a' && (c) <= 'z')
+#define IS_UPPER(c) ((c) >= 'A' && (c) <= 'Z')
+
+// longest label of domain name
+#define DOMAIN_LABEL_MAX 63
+// shortest and longest top level domain
+#define DOMAIN_TLD_MIN 2
+#define DOMAIN_TLD_MAX 6
+
+/**
+ * Check one part of IPv4 address.
+ * Parts of one or two digits must not start with zero, except single zero
+ * which is allowed in other than first part. Parts of three digits may start
+ * with zero and must not be over 255.
+ *
+ * @param part First digit of the part.
+ * @param length Number of digits.
+ * @param first 1 if this is the first part of address.
+ * @return Value of part, -1 if it isn't valid.
+ */
+static int ipv4Part(const char *part, size_t length, int first)
+{
+    switch (length)
+    {
+    case 1:
+        if (first && part[0] == '0')
+            return -1;
+        return part[0] - '0';
+    case 2:
+        if (part[0] == '0')
+            return -1;
+        return (part[0] - '0') * 10 + (part[1] - '0');
+    case 3:
+        if (part[0] > '2')
+            return -1;
+        if (part[0] == '2' && (part[1] > '5' || (part[1] == '5' && part[2] > '5')))
+            return -1;
+        return (part[0] - '0') * 100 + (part[1] - '0') * 10 + (part[2] - '0');
+    default:
+        return -1;
+    }
+}
+
+/**
+ * Check that string is IPv4 address in dotted decimal form, e.g. 192.168.0.1.
+ * Zero is not allowed as first part.
+ *
+ * @param address String to check.
+ * @param lastPart Value of the last part of address is stored here, may be NULL.
+ * @param lastOffset Offset of the last part in address is stored here, may be NULL.
+ * @return 1 if address is valid, 0 else.
+ */
+int ValidateIPv4Address(const char *address, int *lastPart, size_t *lastOffset)
+{
+    const char *part = address, *p;
+    int i, value = -1;
+
+    for (i = 0; i < 4; i++)
+    {
+        for (p = part; IS_DIGIT(*p); p++)
+            ;
+        if ((value = ipv4Part(part, p - part, i == 0)) < 0)
+            return 0;
+        if (i < 3)
+        {
+            if (*p != '.')
+                return 0;
+            part = p + 1;
+        }
+        else if (*p != '\0')
+            return 0;
+    }
+
+    if (lastPart)
+        *lastPart = value;
+    if (lastOffset)
+        *lastOffset = part - address;
+    return 1;
+}
+
+/**
+ * Check that string is domain name, e.g. www.example.com.
+ * Name has one or more labels followed by top level domain of 2 to 6 letters.
+ * Label is 1 to 63 characters long, it begins and ends with letter or digit
+ * and may contain also '-' and '\' in between.
+ *
+ * @param name String to check.
+ * @param ignoreCase 1 if upper case letters are accepted, 0 if only lower case.
+ * @return 1 if name is valid, 0 else.
+ */
+int ValidateDomainName(const char *name, int ignoreCase)
+{
+    const char *label = name, *p;
+    int labels = 0;
+    char c;
+
+    for (;;)
+    {
+        // label or top level domain ends at next dot or at the end
+        for (p = label; (c = *p) != '\0' && c != '.'; p++)
+        {
+            if (!IS_LOWER(c) && !IS_DIGIT(c) && c != '-' && c != '\\' &&
+                !(ignoreCase && IS_UPPER(c)))
+                return 0;
+        }
+        if (c == '\0')
+            break;
+
+        if (p == label || p - label > DOMAIN_LABEL_MAX)
+            return 0;
+        if (!IS_LOWER(label[0]) && !IS_DIGIT(label[0]) && !(ignoreCase && IS_UPPER(label[0])))
+            return 0;
+        if (!IS_LOWER(p[-1]) && !IS_DIGIT(p[-1]) && !(ignoreCase && IS_UPPER(p[-1])))
+            return 0;
+        labels++;
+        label = p + 1;
+    }
+
+    if (labels == 0 || p - label < DOMAIN_TLD_MIN || p - label > DOMAIN_TLD_MAX)
+        return 0;
+    for (p = label; *p; p++)
+    {
+        if (!IS_LOWER(*p) && !(ignoreCase && IS_UPPER(*p)))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Find nameserver entry from line of resolv.conf, e.g. "nameserver 10.0.0.1".
+ * Keyword may appear anywhere on the line and be followed by blanks and
+ * address of four dot separated parts of 1 to 3 digits. If there are more
+ * digits after the address, only the first three of the last part belong to it.
+ *
+ * @param line Line to search.
+ * @param offset Offset of address in line is stored here.
+ * @param length Length of address is stored here.
+ * @return 1 if nameserver was found, 0 else.
+ */
+int ParseNameserverLine(const char *line, size_t *offset, size_t *length)
+{
+    static const char keyword[] = "nameserver";
+    const char *start, *part, *p;
+    size_t i;
+    int n;
+
+    for (start = line; *start; start++)
+    {
+        for (i = 0; keyword[i] && start[i] == keyword[i]; i++)
+            ;
+        if (keyword[i])
+            continue;
+
+        for (part = start + i; *part == ' ' || *part == '\t'; part++)
+            ;
+        p = part;
+        for (n = 0; n < 4; n++)
+        {
+            for (i = 0; IS_DIGIT(p[i]); i++)
+                ;
+            if (i == 0)
+                break;
+            if (n == 3)
+                p += i < 3 ? i : 3;
+            else if (i <= 3 && p[i] == '.')
+                p += i + 1;
+            else
+                break;
+        }
+        if (n == 4)
+        {
+            *offset = part - line;
+            *length = p - part;
+            return 1;
+        }
+    }
+    return 0;
+}
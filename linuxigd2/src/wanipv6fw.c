@@ -219,7 +219,7 @@ void errorManagement(int error, struct Upnp_Action_Request *ca_event)
 /**
  * InitFirewallv6
  *
- * @return 1 if ok.
+ * @return 1 if ok, 0 if firewall rules could not be added.
  */
 int InitFirewallv6(void)
 {
@@ -246,18 +246,10 @@ int CloseFirewallv6(void)
  */
 int upnp_wanipv6_getFirewallStatus(struct Upnp_Action_Request *ca_event)
 {
-    if(GetNbSoapParameters(ca_event->ActionRequest) == 0) {
-
-        ParseResult( ca_event, "<FirewallEnabled>%i</FirewallEnabled>\n"
-                "<InboundPinholeAllowed>%i</InboundPinholeAllowed>\n", 
-                g_vars.ipv6firewallEnabled,
-                g_vars.ipv6inboundPinholeAllowed );
-    }
-
-    else {
-        trace(1, "GetFirewallStatus invalid number of parameters");
-        errorManagement(UPNP_SOAP_E_INVALID_ARGS, ca_event);
-    }
+    AddActionResponseInt( ca_event, "FirewallEnabled",
+            g_vars.ipv6firewallEnabled );
+    AddActionResponseInt( ca_event, "InboundPinholeAllowed",
+            g_vars.ipv6inboundPinholeAllowed );
 
     return(ca_event->ErrCode);
 
@@ -277,18 +269,15 @@ int upnp_wanipv6_getOutboundPinholeTimeOut(struct Upnp_Action_Request *ca_event)
     char *internal_port=NULL;
     char *protocol=NULL;
     int error = 0;
-
-    if ( (remote_host = GetFirstDocumentItem(
-            ca_event->ActionRequest, "RemoteHost") )
-            && (remote_port = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "RemotePort") )
-            && (internal_client = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "InternalClient") )
-            && (internal_port = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "InternalPort") )
-            && (protocol = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "Protocol") )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 5 ) )
+    struct soapArg args[] = {
+        { "RemoteHost", &remote_host, 0 },
+        { "RemotePort", &remote_port, 0 },
+        { "InternalClient", &internal_client, 0 },
+        { "InternalPort", &internal_port, 0 },
+        { "Protocol", &protocol, 0 }
+    };
+
+    if (GetSoapArguments(ca_event->ActionRequest, args, 5))
     {
 
         if(!(checkForWildCard(internal_client))
@@ -382,8 +371,7 @@ int upnp_wanipv6_getOutboundPinholeTimeOut(struct Upnp_Action_Request *ca_event)
                 }
             }
 
-            ParseResult( ca_event,
-                "<OutboundPinholeTimeout>%i</OutboundPinholeTimeout>\n", 
+            AddActionResponseInt( ca_event, "OutboundPinholeTimeout",
                 timeout );
         }
 
@@ -400,12 +388,6 @@ int upnp_wanipv6_getOutboundPinholeTimeOut(struct Upnp_Action_Request *ca_event)
         return UPNP_SOAP_E_INVALID_ARGS;
     }
 
-    free(remote_host);
-    free(remote_port);
-    free(internal_client);
-    free(internal_port);
-    free(protocol);
-
     return(ca_event->ErrCode);
 }
 
@@ -426,20 +408,17 @@ int upnp_wanipv6_addPinhole(struct Upnp_Action_Request *ca_event)
     char *lease_time=NULL;
     uint32_t UniqueId;
     int error = 0;
-
-    if ( (remote_host = GetFirstDocumentItem(
-            ca_event->ActionRequest, "RemoteHost") )
-            && (remote_port = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "RemotePort") )
-            && (internal_client = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "InternalClient") )
-            && (internal_port = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "InternalPort") )
-            && (protocol = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "Protocol") )
-            && (lease_time = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "LeaseTime") )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 6 ) )
+    int result;
+    struct soapArg args[] = {
+        { "RemoteHost", &remote_host, 0 },
+        { "RemotePort", &remote_port, 0 },
+        { "InternalClient", &internal_client, 0 },
+        { "InternalPort", &internal_port, 0 },
+        { "Protocol", &protocol, 0 },
+        { "LeaseTime", &lease_time, 0 }
+    };
+
+    if (GetSoapArguments(ca_event->ActionRequest, args, 6))
     {
         if(!g_vars.ipv6firewallEnabled)
         {
@@ -569,23 +548,39 @@ int upnp_wanipv6_addPinhole(struct Upnp_Action_Request *ca_event)
             phv6_updatePinhole(UniqueId,(uint32_t)atoi(lease_time));
         }
         //else add the pinhole int the list
-        else if(phv6_addPinhole(internal_client,
-                remote_host,
-                internal_port,
-                remote_port,
-                protocol,
-                (uint32_t)atoi(lease_time),
-                &UniqueId) < 0)
+        else
         {
-            trace(1, "AddPinhole out of memory");
-            errorManagement(ERR_PINHOLE_SPACE_EXHAUSTED, ca_event);
-            error = ERR_PINHOLE_SPACE_EXHAUSTED;
+            result = phv6_addPinhole(internal_client,
+                    remote_host,
+                    internal_port,
+                    remote_port,
+                    protocol,
+                    (uint32_t)atoi(lease_time),
+                    &UniqueId);
+            if(result == -1)
+            {
+                trace(1, "AddPinhole: no room for more pinholes");
+                errorManagement(ERR_PINHOLE_SPACE_EXHAUSTED, ca_event);
+                error = ERR_PINHOLE_SPACE_EXHAUSTED;
+            }
+            else if(result < 0)
+            {
+                trace(1, "AddPinhole out of memory");
+                addErrorData(ca_event, 501, "Action Failed");
+                error = 501;
+            }
+            else if(result == 0)
+            {
+                trace(1, "AddPinhole: firewall rules could not be added");
+                addErrorData(ca_event, 501, "Action Failed");
+                error = 501;
+            }
         }
 
 
         if(error == 0)
         {
-            ParseResult( ca_event, "<UniqueID>%i</UniqueID>\n", UniqueId );
+            AddActionResponseUInt( ca_event, "UniqueID", UniqueId );
         }
 
     }
@@ -600,15 +595,6 @@ int upnp_wanipv6_addPinhole(struct Upnp_Action_Request *ca_event)
         errorManagement(UPNP_SOAP_E_INVALID_ARGS, ca_event);
     }
 
-
-    free(remote_host);
-    free(remote_port);
-    free(internal_client);
-    free(internal_port);
-    free(protocol);
-    free(lease_time);
-
-
     return(ca_event->ErrCode);
 
 }
@@ -626,14 +612,12 @@ int upnp_wanipv6_updatePinhole(struct Upnp_Action_Request *ca_event)
     char *unique_id=NULL;
     int error = 0;
     struct pinholev6 * pinhole;
+    struct soapArg args[] = {
+        { "UniqueID", &unique_id, 1 },
+        { "NewLeaseTime", &lease_time, 1 }
+    };
 
-    if ( (unique_id = GetFirstDocumentItem(
-            ca_event->ActionRequest, "UniqueID") )
-            && (isStringInteger(unique_id) )
-            && (lease_time = GetFirstDocumentItem(
-                    ca_event->ActionRequest, "NewLeaseTime") )
-            && (isStringInteger(lease_time) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 2 ) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 2))
     {
         if(!g_vars.ipv6firewallEnabled)
         {
@@ -682,7 +666,7 @@ int upnp_wanipv6_updatePinhole(struct Upnp_Action_Request *ca_event)
                 phv6_updatePinhole((uint32_t)atoi(unique_id),
                         (uint32_t)atoi(lease_time));
 
-                ParseResult( ca_event, "" );
+                CreateActionResponse( ca_event );
             }
         }
         else
@@ -698,9 +682,6 @@ int upnp_wanipv6_updatePinhole(struct Upnp_Action_Request *ca_event)
         errorManagement(UPNP_SOAP_E_INVALID_ARGS, ca_event);
     }
 
-    free(lease_time);
-    free(unique_id);
-
     return(ca_event->ErrCode);
 }
 
@@ -716,11 +697,11 @@ int upnp_wanipv6_deletePinhole(struct Upnp_Action_Request *ca_event)
     char *unique_id = NULL;
     struct pinholev6 * pinhole;
     int error = 0;
+    struct soapArg args[] = {
+        { "UniqueID", &unique_id, 1 }
+    };
 
-    if ( (unique_id = GetFirstDocumentItem(
-            ca_event->ActionRequest, "UniqueID"))
-            && (isStringInteger(unique_id) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 1 ) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         if(!g_vars.ipv6firewallEnabled)
         {
@@ -756,7 +737,7 @@ int upnp_wanipv6_deletePinhole(struct Upnp_Action_Request *ca_event)
 
                 phv6_deletePinhole((uint32_t)atoi(unique_id));
 
-                ParseResult( ca_event, "" );
+                CreateActionResponse( ca_event );
             }
 
         }
@@ -774,8 +755,6 @@ int upnp_wanipv6_deletePinhole(struct Upnp_Action_Request *ca_event)
 
     }
 
-    free(unique_id);
-
     return(ca_event->ErrCode);
 
 }
@@ -793,11 +772,11 @@ int upnp_wanipv6_getPinholePackets(struct Upnp_Action_Request *ca_event)
     struct pinholev6 * pinhole;
     int error = 0;
     int packets = 0;
+    struct soapArg args[] = {
+        { "UniqueID", &unique_id, 1 }
+    };
 
-    if ( (unique_id = GetFirstDocumentItem(
-            ca_event->ActionRequest, "UniqueID"))
-            && (isStringInteger(unique_id) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 1 ) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         if(!g_vars.ipv6firewallEnabled)
         {
@@ -831,10 +810,16 @@ int upnp_wanipv6_getPinholePackets(struct Upnp_Action_Request *ca_event)
 
             if(error == 0) {
 
-                phv6_getPinholePackets((uint32_t)atoi(unique_id), &packets);
-
-                ParseResult( ca_event, "<PinholePackets>%i</PinholePackets>\n",
-                        packets );
+                if(phv6_getPinholePackets((uint32_t)atoi(unique_id), &packets))
+                {
+                    AddActionResponseInt( ca_event, "PinholePackets",
+                            packets );
+                }
+                else
+                {
+                    trace(1, "GetPinholePackets: packet counter could not be read");
+                    addErrorData(ca_event, 501, "Action Failed");
+                }
             }
 
         }
@@ -852,8 +837,6 @@ int upnp_wanipv6_getPinholePackets(struct Upnp_Action_Request *ca_event)
 
     }
 
-    free(unique_id);
-
     return(ca_event->ErrCode);
 }
 
@@ -869,11 +852,11 @@ int upnp_wanipv6_checkPinholeWorking(struct Upnp_Action_Request *ca_event)
     char *unique_id = NULL;
     struct pinholev6 * pinhole;
     int error = 0;
+    struct soapArg args[] = {
+        { "UniqueID", &unique_id, 1 }
+    };
 
-    if ( (unique_id = GetFirstDocumentItem(
-            ca_event->ActionRequest, "UniqueID") )
-            && (isStringInteger(unique_id) )
-            && (GetNbSoapParameters(ca_event->ActionRequest) == 1 ) )
+    if (GetSoapArguments(ca_event->ActionRequest, args, 1))
     {
         if(!g_vars.ipv6firewallEnabled)
         {
@@ -921,7 +904,7 @@ int upnp_wanipv6_checkPinholeWorking(struct Upnp_Action_Request *ca_event)
                 }
 
                 else {
-                    ParseResult( ca_event, "<IsWorking>%i</IsWorking>\n",
+                    AddActionResponseInt( ca_event, "IsWorking",
                         isWorking );
                 }
             }
@@ -941,8 +924,6 @@ int upnp_wanipv6_checkPinholeWorking(struct Upnp_Action_Request *ca_event)
 
     }
 
-    free(unique_id);
-
     return(ca_event->ErrCode);
 
 }
@@ -0,0 +1,212 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+/*
+ * Transactions of libiptc and libip6tc tables. Both libraries use the same
+ * struct xtc_handle, so iptc.c and ip6tc.c share this code and only give
+ * their own functions to init, commit and free a handle.
+ */
+
+#if HAVE_LIBIPTC
+#include <string.h>
+#include <errno.h>
+#include "util.h"
+#include "xtctransaction.h"
+
+/**
+ * Get handle of table. Outside of transaction new handle is initialized,
+ * inside transaction handle of the transaction is used.
+ *
+ * @param transaction Transaction state of library.
+ * @param table Name of table.
+ * @return Table handle or NULL if error.
+ */
+struct xtc_handle *xtct_get_handle(struct xtcTransaction *transaction, const char *table)
+{
+    const struct xtcOps *ops = transaction->ops;
+    struct xtc_handle *handle;
+    int i, free_slot = -1;
+
+    if (transaction->depth > 0)
+    {
+        for (i = 0; i < XTCT_MAX_TABLES; i++)
+        {
+            if (transaction->tables[i].handle == NULL)
+            {
+                if (free_slot < 0)
+                    free_slot = i;
+            }
+            else if (strcmp(transaction->tables[i].name, table) == 0)
+                return transaction->tables[i].handle;
+        }
+    }
+
+    handle = ops->init(table);
+    if (!handle)
+    {
+        trace(1, "%s error: Can't initialize table %s, %s", ops->name, table, ops->strerror(errno));
+        return NULL;
+    }
+
+    if (transaction->depth > 0)
+    {
+        if (free_slot < 0)
+        {
+            trace(1, "%s error: Too many tables in transaction", ops->name);
+            ops->free(handle);
+            return NULL;
+        }
+        strncpy(transaction->tables[free_slot].name, table, XT_TABLE_MAXNAMELEN - 1);
+        transaction->tables[free_slot].name[XT_TABLE_MAXNAMELEN - 1] = '\0';
+        transaction->tables[free_slot].handle = handle;
+        transaction->tables[free_slot].changed = 0;
+    }
+
+    return handle;
+}
+
+/**
+ * Release handle got from xtct_get_handle. Outside of transaction changes
+ * are committed and handle is freed. Inside transaction changes wait for
+ * xtct_commit.
+ *
+ * @param transaction Transaction state of library.
+ * @param handle Table handle.
+ * @param changed Was table changed.
+ * @return 1 if succesfull, 0 if commit failed.
+ */
+int xtct_release_handle(struct xtcTransaction *transaction, struct xtc_handle *handle, int changed)
+{
+    const struct xtcOps *ops = transaction->ops;
+    int i, result = 1;
+
+    if (transaction->depth > 0)
+    {
+        for (i = 0; i < XTCT_MAX_TABLES; i++)
+        {
+            if (transaction->tables[i].handle == handle)
+                transaction->tables[i].changed |= changed;
+        }
+        return 1;
+    }
+
+    if (changed && !ops->commit(handle))
+    {
+        trace(1, "%s error: Commit error, %s", ops->name, ops->strerror(errno));
+        result = 0;
+    }
+    ops->free(handle);
+
+    return result;
+}
+
+/**
+ * Start transaction. Until matching xtct_commit or xtct_abort is called,
+ * rules are changed only in local copies of tables. Transactions may be
+ * nested, only outermost one commits. If nested transaction is aborted,
+ * outermost one is aborted too.
+ *
+ * @param transaction Transaction state of library.
+ */
+void xtct_begin(struct xtcTransaction *transaction)
+{
+    transaction->depth++;
+}
+
+/**
+ * End transaction. If this is outermost transaction, every changed table is
+ * committed into kernel with one call per table. If some nested transaction
+ * was aborted, nothing is committed.
+ *
+ * @param transaction Transaction state of library.
+ * @return 1 if succesfull, 0 if some table failed to commit or nested
+ *         transaction was aborted.
+ */
+int xtct_commit(struct xtcTransaction *transaction)
+{
+    const struct xtcOps *ops = transaction->ops;
+    int i, result = 1;
+
+    if (transaction->depth == 0 || --transaction->depth > 0)
+        return 1;
+
+    if (transaction->failed)
+    {
+        trace(1, "%s: Nested transaction was aborted, aborting whole transaction", ops->name);
+        transaction->depth++;
+        xtct_abort(transaction);
+        return 0;
+    }
+
+    for (i = 0; i < XTCT_MAX_TABLES; i++)
+    {
+        if (transaction->tables[i].handle == NULL)
+            continue;
+
+        if (transaction->tables[i].changed)
+        {
+            if (!ops->commit(transaction->tables[i].handle))
+            {
+                trace(1, "%s error: Commit error in table %s, %s", ops->name, transaction->tables[i].name, ops->strerror(errno));
+                result = 0;
+            }
+            else
+                trace(3, "%s: committed table %s", ops->name, transaction->tables[i].name);
+        }
+        ops->free(transaction->tables[i].handle);
+        transaction->tables[i].handle = NULL;
+    }
+
+    return result;
+}
+
+/**
+ * End transaction without committing anything. If transaction is nested,
+ * outermost transaction is marked failed and it aborts instead of commit,
+ * because changes of nested transaction can't be separated from the rest.
+ *
+ * @param transaction Transaction state of library.
+ */
+void xtct_abort(struct xtcTransaction *transaction)
+{
+    int i;
+
+    if (transaction->depth == 0)
+        return;
+    if (--transaction->depth > 0)
+    {
+        transaction->failed = 1;
+        return;
+    }
+
+    transaction->failed = 0;
+
+    for (i = 0; i < XTCT_MAX_TABLES; i++)
+    {
+        if (transaction->tables[i].handle != NULL)
+        {
+            transaction->ops->free(transaction->tables[i].handle);
+            transaction->tables[i].handle = NULL;
+        }
+    }
+}
+#endif
@@ -0,0 +1,68 @@
+/**
+ * This file is part of igd2-for-linux project
+ * Copyright © 2011-2016 France Telecom / Orange.
+ * Contact: fabrice.fontaine@orange.com
+ * Developer(s): fabrice.fontaine@orange.com, rmenard.ext@orange-ftgroup.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program, see the /doc directory of this program. If
+ * not, see http://www.gnu.org/licenses/.
+ *
+ */
+
+#ifndef _XTCTRANSACTION_H_
+#define _XTCTRANSACTION_H_
+
+#include <linux/netfilter/x_tables.h>
+
+struct xtc_handle;
+
+// maximum number of tables changed in one transaction
+#define XTCT_MAX_TABLES 4
+
+// libiptc or libip6tc functions used by transaction
+struct xtcOps
+{
+    const char *name;   // library name used in messages
+    struct xtc_handle *(*init)(const char *table);
+    int (*commit)(struct xtc_handle *handle);
+    void (*free)(struct xtc_handle *handle);
+    const char *(*strerror)(int err);
+};
+
+/*
+ * Tables opened in current transaction. Inside transaction rules are added to
+ * and deleted from these handles, and each table is committed only once when
+ * outermost transaction is committed.
+ */
+struct xtcTransaction
+{
+    const struct xtcOps *ops;
+    struct
+    {
+        char name[XT_TABLE_MAXNAMELEN];
+        struct xtc_handle *handle;
+        int changed;
+    } tables[XTCT_MAX_TABLES];
+    int depth;
+    int failed;     // nested transaction was aborted
+};
+
+struct xtc_handle *xtct_get_handle(struct xtcTransaction *transaction, const char *table);
+int xtct_release_handle(struct xtcTransaction *transaction, struct xtc_handle *handle, int changed);
+
+void xtct_begin(struct xtcTransaction *transaction);
+int xtct_commit(struct xtcTransaction *transaction);
+void xtct_abort(struct xtcTransaction *transaction);
+
+#endif // _XTCTRANSACTION_H_